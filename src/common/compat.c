@@ -2780,6 +2780,36 @@ tor_gettimeofday(struct timeval *timeval)
   return;
 }
 
+/** Set *<b>timeval</b> to the current time on a clock that never jumps
+ * backwards or forwards when the system time is changed, if we have one;
+ * otherwise, to the current time of day.  Only the difference between two
+ * such times is meaningful. */
+void
+tor_gettimeofday_monotonic(struct timeval *timeval)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+    timeval->tv_sec = ts.tv_sec;
+    timeval->tv_usec = ts.tv_nsec / 1000;
+    return;
+  }
+#elif defined(_WIN32)
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER count;
+  if ((freq.QuadPart || QueryPerformanceFrequency(&freq)) &&
+      QueryPerformanceCounter(&count)) {
+    uint64_t ticks = (uint64_t)count.QuadPart;
+    uint64_t ticks_per_sec = (uint64_t)freq.QuadPart;
+    timeval->tv_sec = (long) (ticks / ticks_per_sec);
+    timeval->tv_usec = (long) ((ticks % ticks_per_sec) * 1000000 /
+                               ticks_per_sec);
+    return;
+  }
+#endif
+  tor_gettimeofday(timeval);
+}
+
 #if !defined(_WIN32)
 /** Defined iff we need to add locks when defining fake versions of reentrant
  * versions of time-related functions. */
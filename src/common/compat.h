@@ -343,6 +343,7 @@ struct timeval {
 #endif
 
 void tor_gettimeofday(struct timeval *timeval);
+void tor_gettimeofday_monotonic(struct timeval *timeval);
 
 struct tm *tor_localtime_r(const time_t *timep, struct tm *result);
 struct tm *tor_gmtime_r(const time_t *timep, struct tm *result);
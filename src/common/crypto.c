@@ -92,6 +92,14 @@ struct crypto_cipher_t
   char iv[CIPHER_IV_LEN]; /**< The initial IV. */
   aes_cnt_cipher_t *cipher; /**< The key in format usable for counter-mode AES
                              * encryption */
+  /** Buffer for keystream generated ahead of time by
+   * crypto_cipher_prefetch_keystream(), or NULL if we have none pending.
+   * We free it as soon as it's used up, so that idle circuits don't hold
+   * on to a batch-sized buffer. */
+  uint8_t *ks_buf;
+  size_t ks_cap; /**< Number of bytes allocated for ks_buf. */
+  size_t ks_off; /**< Offset of the first unused byte in ks_buf. */
+  size_t ks_len; /**< Number of unused bytes in ks_buf, starting at ks_off. */
 };
 
 /** A structure to hold the first half (x, g^x) of a Diffie-Hellman handshake
@@ -540,6 +548,10 @@ crypto_cipher_free(crypto_cipher_t *env)
 
   tor_assert(env->cipher);
   aes_cipher_free(env->cipher);
+  if (env->ks_buf) {
+    memwipe(env->ks_buf, 0, env->ks_cap);
+    tor_free(env->ks_buf);
+  }
   memwipe(env, 0, sizeof(crypto_cipher_t));
   tor_free(env);
 }
@@ -1061,6 +1073,161 @@ crypto_pk_public_checksig_digest(crypto_pk_t *env, const char *data,
   return 0;
 }
 
+/** How many threads may crypto_pk_checksig_batch() use at once? */
+static int checksig_batch_n_threads = 1;
+
+/** Don't bother handing a thread fewer than this many signatures to check:
+ * starting a thread costs about as much as an RSA verification. */
+#define CHECKSIG_BATCH_MIN_PER_THREAD 4
+
+/** Shared state for one call to crypto_pk_checksig_batch() that is spread
+ * over several threads. */
+typedef struct checksig_batch_t {
+  /** Protects <b>next_idx</b> and <b>n_running</b>. */
+  tor_mutex_t lock;
+  /** Signalled when the last helper thread is done. */
+  tor_cond_t done_cond;
+  /** The signatures to check, and where to put the results. */
+  const crypto_pk_checkable_t *checkable;
+  int *okay;
+  int n_checkable;
+  /** The index of the first signature that nobody has claimed yet. */
+  int next_idx;
+  /** How many helper threads have not yet finished? */
+  int n_running;
+} checksig_batch_t;
+
+/** Return true iff <b>ch</b> holds a correct signature. */
+static int
+crypto_pk_checkable_is_ok(const crypto_pk_checkable_t *ch)
+{
+  char *buf;
+  size_t buflen;
+  int r, ok;
+
+  tor_assert(ch->pk);
+  tor_assert(ch->digest);
+  tor_assert(ch->sig);
+
+  buflen = crypto_pk_keysize(ch->pk);
+  buf = tor_malloc(buflen);
+  r = crypto_pk_public_checksig(ch->pk, buf, buflen, ch->sig, ch->sig_len);
+  ok = r >= 0 && (size_t)r >= ch->digest_len &&
+    tor_memeq(buf, ch->digest, ch->digest_len);
+  tor_free(buf);
+  return ok;
+}
+
+/** Claim signatures from <b>batch</b> a few at a time and check them until
+ * none are left. */
+static void
+checksig_batch_run(checksig_batch_t *batch)
+{
+  int idx, end;
+  for (;;) {
+    tor_mutex_acquire(&batch->lock);
+    idx = batch->next_idx;
+    end = MIN(idx + CHECKSIG_BATCH_MIN_PER_THREAD, batch->n_checkable);
+    batch->next_idx = end;
+    tor_mutex_release(&batch->lock);
+    if (idx >= end)
+      break;
+    for ( ; idx < end; ++idx)
+      batch->okay[idx] = crypto_pk_checkable_is_ok(&batch->checkable[idx]);
+  }
+}
+
+/** Main function for a helper thread launched by crypto_pk_checksig_batch().
+ */
+static void
+checksig_batch_threadfn(void *arg)
+{
+  checksig_batch_t *batch = arg;
+  checksig_batch_run(batch);
+  crypto_thread_cleanup();
+
+  tor_mutex_acquire(&batch->lock);
+  if (--batch->n_running == 0)
+    tor_cond_signal_one(&batch->done_cond);
+  tor_mutex_release(&batch->lock);
+}
+
+/** Check every signature in the <b>n_checkable</b>-element array
+ * <b>checkable</b>, using up to the number of threads set with
+ * crypto_pk_checksig_batch_set_threads().  If <b>okay_out</b> is provided,
+ * set its <b>i</b>th element to 1 if the <b>i</b>th signature was good and
+ * 0 if it was bad.  Return 0 if every signature was good, and otherwise
+ * return the negative number of bad signatures. */
+int
+crypto_pk_checksig_batch(int *okay_out,
+                         const crypto_pk_checkable_t *checkable,
+                         int n_checkable)
+{
+  int i, res = 0, n_threads;
+  int *oks;
+
+  tor_assert(n_checkable >= 0);
+  if (n_checkable == 0)
+    return 0;
+  tor_assert(checkable);
+
+  oks = okay_out ? okay_out : tor_calloc(n_checkable, sizeof(int));
+
+  n_threads = MIN(checksig_batch_n_threads,
+                  n_checkable / CHECKSIG_BATCH_MIN_PER_THREAD);
+  if (n_threads <= 1) {
+    for (i = 0; i < n_checkable; ++i)
+      oks[i] = crypto_pk_checkable_is_ok(&checkable[i]);
+  } else {
+    checksig_batch_t batch;
+    memset(&batch, 0, sizeof(batch));
+    tor_mutex_init_for_cond(&batch.lock);
+    tor_cond_init(&batch.done_cond);
+    batch.checkable = checkable;
+    batch.okay = oks;
+    batch.n_checkable = n_checkable;
+
+    /* This thread does its share of the work too, so launch one helper
+     * fewer than the number of threads we want. */
+    tor_mutex_acquire(&batch.lock);
+    for (i = 1; i < n_threads; ++i) {
+      if (spawn_func(checksig_batch_threadfn, &batch) < 0) {
+        log_info(LD_CRYPTO, "Couldn't launch a signature-checking thread; "
+                 "checking the rest of the batch with fewer threads.");
+        break;
+      }
+      ++batch.n_running;
+    }
+    tor_mutex_release(&batch.lock);
+
+    checksig_batch_run(&batch);
+
+    tor_mutex_acquire(&batch.lock);
+    while (batch.n_running > 0)
+      tor_cond_wait(&batch.done_cond, &batch.lock, NULL);
+    tor_mutex_release(&batch.lock);
+
+    tor_cond_uninit(&batch.done_cond);
+    tor_mutex_uninit(&batch.lock);
+  }
+
+  for (i = 0; i < n_checkable; ++i) {
+    if (!oks[i])
+      --res;
+  }
+  if (oks != okay_out)
+    tor_free(oks);
+  return res;
+}
+
+/** Allow crypto_pk_checksig_batch() to spread its work over as many as
+ * <b>n_threads</b> threads. */
+void
+crypto_pk_checksig_batch_set_threads(int n_threads)
+{
+  checksig_batch_n_threads = n_threads >= 1 ? n_threads : 1;
+}
+
 /** Sign <b>fromlen</b> bytes of data from <b>from</b> with the private key in
  * <b>env</b>, using PKCS1 padding.  On success, write the signature to
  * <b>to</b>, and return the number of bytes written.  On failure, return
@@ -1481,6 +1648,93 @@ crypto_cipher_get_key(crypto_cipher_t *env)
   return env->key;
 }
 
+/** Xor up to <b>len</b> bytes of keystream that we generated earlier with
+ * crypto_cipher_prefetch_keystream() into <b>buf</b>.  Return the number of
+ * bytes handled this way; the caller must run the rest through the cipher
+ * itself. */
+static size_t
+crypto_cipher_use_prefetched_keystream(crypto_cipher_t *env, char *buf,
+                                       size_t len)
+{
+  const uint8_t *ks;
+  size_t i = 0, n;
+
+  if (!env->ks_len)
+    return 0;
+
+  n = MIN(len, env->ks_len);
+  ks = env->ks_buf + env->ks_off;
+  /* Neither buf nor ks need be aligned, so get_uint64() and set_uint64()
+   * do the loads and stores. */
+  for ( ; i + 8 <= n; i += 8)
+    set_uint64(buf + i, get_uint64(buf + i) ^ get_uint64(ks + i));
+  for ( ; i < n; ++i)
+    buf[i] ^= ks[i];
+
+  env->ks_off += n;
+  env->ks_len -= n;
+  if (env->ks_len == 0) {
+    memwipe(env->ks_buf, 0, env->ks_cap);
+    tor_free(env->ks_buf);
+    env->ks_cap = env->ks_off = 0;
+  }
+  return n;
+}
+
+/** Generate the next <b>len</b> bytes of keystream for <b>env</b> in a
+ * single call to the underlying cipher, and hold on to them until the next
+ * encryption or decryption with <b>env</b>.  Because we're using a stream
+ * cipher, doing this has no effect on the output: it only lets callers that
+ * know a burst of data is coming pay the per-call cipher overhead once.
+ */
+void
+crypto_cipher_prefetch_keystream(crypto_cipher_t *env, size_t len)
+{
+  uint8_t *ks;
+
+  tor_assert(env);
+  tor_assert(env->cipher);
+  tor_assert(len < SIZE_T_CEILING);
+  tor_assert(env->ks_len < SIZE_T_CEILING);
+  if (len == 0)
+    return;
+
+  if (env->ks_off + env->ks_len + len > env->ks_cap) {
+    if (env->ks_len + len <= env->ks_cap) {
+      /* There's room if we move the unused keystream to the front. */
+      memmove(env->ks_buf, env->ks_buf + env->ks_off, env->ks_len);
+      memwipe(env->ks_buf + env->ks_len, 0, env->ks_off);
+    } else {
+      /* We need a new buffer, or a bigger one. */
+      size_t cap = env->ks_len + len;
+      uint8_t *buf = tor_malloc_zero(cap);
+      if (env->ks_buf) {
+        memcpy(buf, env->ks_buf + env->ks_off, env->ks_len);
+        memwipe(env->ks_buf, 0, env->ks_cap);
+        tor_free(env->ks_buf);
+      }
+      env->ks_buf = buf;
+      env->ks_cap = cap;
+    }
+    env->ks_off = 0;
+  }
+
+  /* Counter mode: encrypting zeros yields the keystream.  Everything past
+   * the unused keystream is already zero. */
+  ks = env->ks_buf + env->ks_off + env->ks_len;
+  aes_crypt_inplace(env->cipher, (char*)ks, len);
+  env->ks_len += len;
+}
+
+/** Return the number of bytes of keystream that we have generated for
+ * <b>env</b> but not yet used. */
+size_t
+crypto_cipher_get_prefetched_len(const crypto_cipher_t *env)
+{
+  tor_assert(env);
+  return env->ks_len;
+}
+
 /** Encrypt <b>fromlen</b> bytes from <b>from</b> using the cipher
  * <b>env</b>; on success, store the result to <b>to</b> and return 0.
  * Does not check for failure.
@@ -1496,6 +1750,10 @@ crypto_cipher_encrypt(crypto_cipher_t *env, char *to,
   tor_assert(to);
   tor_assert(fromlen < SIZE_T_CEILING);
 
+  if (env->ks_len) {
+    memmove(to, from, fromlen);
+    return crypto_cipher_crypt_inplace(env, to, fromlen);
+  }
   aes_crypt(env->cipher, from, fromlen, to);
   return 0;
 }
@@ -1513,6 +1771,10 @@ crypto_cipher_decrypt(crypto_cipher_t *env, char *to,
   tor_assert(to);
   tor_assert(fromlen < SIZE_T_CEILING);
 
+  if (env->ks_len) {
+    memmove(to, from, fromlen);
+    return crypto_cipher_crypt_inplace(env, to, fromlen);
+  }
   aes_crypt(env->cipher, from, fromlen, to);
   return 0;
 }
@@ -1523,8 +1785,11 @@ crypto_cipher_decrypt(crypto_cipher_t *env, char *to,
 int
 crypto_cipher_crypt_inplace(crypto_cipher_t *env, char *buf, size_t len)
 {
+  size_t n;
   tor_assert(len < SIZE_T_CEILING);
-  aes_crypt_inplace(env->cipher, buf, len);
+  n = crypto_cipher_use_prefetched_keystream(env, buf, len);
+  if (n < len)
+    aes_crypt_inplace(env->cipher, buf + n, len - n);
   return 0;
 }
 
@@ -1916,6 +2181,93 @@ crypto_hmac_sha256(char *hmac_out,
   tor_assert(rv);
 }
 
+/** Length of a SHA256 input block. */
+#define SHA256_BLOCK_LEN 64
+
+/** An HMAC-SHA256 key, with its inner and outer padded blocks already
+ * hashed, so that we don't need to hash them again for every message. */
+struct crypto_hmac_sha256_key_t {
+  SHA256_CTX inner;
+  SHA256_CTX outer;
+};
+
+/** Set up <b>hkey</b> to compute HMAC-SHA256 with the <b>key_len</b>-byte
+ * key at <b>key</b>. */
+static void
+crypto_hmac_sha256_key_init(crypto_hmac_sha256_key_t *hkey,
+                            const char *key, size_t key_len)
+{
+  uint8_t block[SHA256_BLOCK_LEN];
+  uint8_t key_digest[DIGEST256_LEN];
+  size_t i;
+
+  if (key_len > SHA256_BLOCK_LEN) {
+    SHA256((const unsigned char*)key, key_len, key_digest);
+    key = (const char*)key_digest;
+    key_len = DIGEST256_LEN;
+  }
+
+  memset(block, 0x36, sizeof(block));
+  for (i = 0; i < key_len; ++i)
+    block[i] ^= (uint8_t)key[i];
+  SHA256_Init(&hkey->inner);
+  SHA256_Update(&hkey->inner, block, sizeof(block));
+
+  memset(block, 0x5c, sizeof(block));
+  for (i = 0; i < key_len; ++i)
+    block[i] ^= (uint8_t)key[i];
+  SHA256_Init(&hkey->outer);
+  SHA256_Update(&hkey->outer, block, sizeof(block));
+
+  memwipe(block, 0, sizeof(block));
+  memwipe(key_digest, 0, sizeof(key_digest));
+}
+
+/** Return a new HMAC-SHA256 key object for the <b>key_len</b>-byte key at
+ * <b>key</b>, for use with crypto_hmac_sha256_with_key().  This is faster
+ * than crypto_hmac_sha256() when we have many messages to authenticate with
+ * the same key. */
+crypto_hmac_sha256_key_t *
+crypto_hmac_sha256_key_new(const char *key, size_t key_len)
+{
+  crypto_hmac_sha256_key_t *hkey = tor_malloc(sizeof(*hkey));
+  crypto_hmac_sha256_key_init(hkey, key, key_len);
+  return hkey;
+}
+
+/** Wipe and free an HMAC-SHA256 key object. */
+void
+crypto_hmac_sha256_key_free(crypto_hmac_sha256_key_t *hkey)
+{
+  if (!hkey)
+    return;
+  memwipe(hkey, 0, sizeof(*hkey));
+  tor_free(hkey);
+}
+
+/** As crypto_hmac_sha256(), but use the key in <b>hkey</b>. */
+void
+crypto_hmac_sha256_with_key(char *hmac_out,
+                            const crypto_hmac_sha256_key_t *hkey,
+                            const char *msg, size_t msg_len)
+{
+  SHA256_CTX ctx;
+  uint8_t inner_digest[DIGEST256_LEN];
+
+  tor_assert(hmac_out);
+
+  memcpy(&ctx, &hkey->inner, sizeof(ctx));
+  SHA256_Update(&ctx, msg, msg_len);
+  SHA256_Final(inner_digest, &ctx);
+
+  memcpy(&ctx, &hkey->outer, sizeof(ctx));
+  SHA256_Update(&ctx, inner_digest, sizeof(inner_digest));
+  SHA256_Final((unsigned char*)hmac_out, &ctx);
+
+  memwipe(&ctx, 0, sizeof(ctx));
+  memwipe(inner_digest, 0, sizeof(inner_digest));
+}
+
 /* DH */
 
 /** Our DH 'g' parameter */
@@ -2268,17 +2620,40 @@ crypto_expand_key_material_rfc5869_sha256(
                                     const uint8_t *salt_in, size_t salt_in_len,
                                     const uint8_t *info_in, size_t info_in_len,
                                     uint8_t *key_out, size_t key_out_len)
+{
+  crypto_hmac_sha256_key_t salt;
+  int r;
+
+  crypto_hmac_sha256_key_init(&salt, (const char*)salt_in, salt_in_len);
+  r = crypto_expand_key_material_rfc5869_sha256_with_salt_key(
+                                    key_in, key_in_len, &salt,
+                                    info_in, info_in_len,
+                                    key_out, key_out_len);
+  memwipe(&salt, 0, sizeof(salt));
+  return r;
+}
+
+/** As crypto_expand_key_material_rfc5869_sha256(), but take the "salt"
+ * parameter as an HMAC-SHA256 key object, so that callers who use the same
+ * salt many times don't have to hash it every time. */
+int
+crypto_expand_key_material_rfc5869_sha256_with_salt_key(
+                                    const uint8_t *key_in, size_t key_in_len,
+                                    const crypto_hmac_sha256_key_t *salt,
+                                    const uint8_t *info_in, size_t info_in_len,
+                                    uint8_t *key_out, size_t key_out_len)
 {
   uint8_t prk[DIGEST256_LEN];
+  crypto_hmac_sha256_key_t prk_key;
   uint8_t tmp[DIGEST256_LEN + 128 + 1];
   uint8_t mac[DIGEST256_LEN];
   int i;
   uint8_t *outp;
   size_t tmp_len;
 
-  crypto_hmac_sha256((char*)prk,
-                     (const char*)salt_in, salt_in_len,
-                     (const char*)key_in, key_in_len);
+  crypto_hmac_sha256_with_key((char*)prk, salt,
+                              (const char*)key_in, key_in_len);
+  crypto_hmac_sha256_key_init(&prk_key, (const char*)prk, sizeof(prk));
 
   /* If we try to get more than this amount of key data, we'll repeat blocks.*/
   tor_assert(key_out_len <= DIGEST256_LEN * 256);
@@ -2299,9 +2674,8 @@ crypto_expand_key_material_rfc5869_sha256(
       tmp[info_in_len] = i;
       tmp_len = info_in_len + 1;
     }
-    crypto_hmac_sha256((char*)mac,
-                       (const char*)prk, DIGEST256_LEN,
-                       (const char*)tmp, tmp_len);
+    crypto_hmac_sha256_with_key((char*)mac, &prk_key,
+                                (const char*)tmp, tmp_len);
     n = key_out_len < DIGEST256_LEN ? key_out_len : DIGEST256_LEN;
     memcpy(outp, mac, n);
     key_out_len -= n;
@@ -2311,6 +2685,8 @@ crypto_expand_key_material_rfc5869_sha256(
 
   memwipe(tmp, 0, sizeof(tmp));
   memwipe(mac, 0, sizeof(mac));
+  memwipe(prk, 0, sizeof(prk));
+  memwipe(&prk_key, 0, sizeof(prk_key));
   return 0;
 }
 
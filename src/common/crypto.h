@@ -115,8 +115,24 @@ typedef struct {
 typedef struct crypto_pk_t crypto_pk_t;
 typedef struct crypto_cipher_t crypto_cipher_t;
 typedef struct crypto_digest_t crypto_digest_t;
+typedef struct crypto_hmac_sha256_key_t crypto_hmac_sha256_key_t;
 typedef struct crypto_dh_t crypto_dh_t;
 
+/** One RSA signature to check with crypto_pk_checksig_batch(): the
+ * signature is good if it was made with <b>pk</b> on <b>digest</b>. */
+typedef struct crypto_pk_checkable_t {
+  /** The public key that should have made the signature. */
+  crypto_pk_t *pk;
+  /** The digest that should have been signed. */
+  const char *digest;
+  /** The length of <b>digest</b>. */
+  size_t digest_len;
+  /** The signature itself. */
+  const char *sig;
+  /** The length of <b>sig</b>. */
+  size_t sig_len;
+} crypto_pk_checkable_t;
+
 /* global state */
 const char * crypto_openssl_get_version_str(void);
 const char * crypto_openssl_get_header_version_str(void);
@@ -173,6 +189,10 @@ int crypto_pk_public_checksig(const crypto_pk_t *env, char *to, size_t tolen,
                               const char *from, size_t fromlen);
 int crypto_pk_public_checksig_digest(crypto_pk_t *env, const char *data,
                                size_t datalen, const char *sig, size_t siglen);
+int crypto_pk_checksig_batch(int *okay_out,
+                             const crypto_pk_checkable_t *checkable,
+                             int n_checkable);
+void crypto_pk_checksig_batch_set_threads(int n_threads);
 int crypto_pk_private_sign(const crypto_pk_t *env, char *to, size_t tolen,
                            const char *from, size_t fromlen);
 int crypto_pk_private_sign_digest(crypto_pk_t *env, char *to, size_t tolen,
@@ -204,6 +224,8 @@ int crypto_cipher_encrypt(crypto_cipher_t *env, char *to,
 int crypto_cipher_decrypt(crypto_cipher_t *env, char *to,
                           const char *from, size_t fromlen);
 int crypto_cipher_crypt_inplace(crypto_cipher_t *env, char *d, size_t len);
+void crypto_cipher_prefetch_keystream(crypto_cipher_t *env, size_t len);
+size_t crypto_cipher_get_prefetched_len(const crypto_cipher_t *env);
 
 int crypto_cipher_encrypt_with_iv(const char *key,
                                   char *to, size_t tolen,
@@ -244,6 +266,12 @@ void crypto_digest_assign(crypto_digest_t *into,
 void crypto_hmac_sha256(char *hmac_out,
                         const char *key, size_t key_len,
                         const char *msg, size_t msg_len);
+crypto_hmac_sha256_key_t *crypto_hmac_sha256_key_new(const char *key,
+                                                     size_t key_len);
+void crypto_hmac_sha256_key_free(crypto_hmac_sha256_key_t *hkey);
+void crypto_hmac_sha256_with_key(char *hmac_out,
+                                 const crypto_hmac_sha256_key_t *hkey,
+                                 const char *msg, size_t msg_len);
 
 /* Key negotiation */
 #define DH_TYPE_CIRCUIT 1
@@ -268,6 +296,11 @@ int crypto_expand_key_material_rfc5869_sha256(
                                     const uint8_t *salt_in, size_t salt_in_len,
                                     const uint8_t *info_in, size_t info_in_len,
                                     uint8_t *key_out, size_t key_out_len);
+int crypto_expand_key_material_rfc5869_sha256_with_salt_key(
+                                    const uint8_t *key_in, size_t key_in_len,
+                                    const crypto_hmac_sha256_key_t *salt,
+                                    const uint8_t *info_in, size_t info_in_len,
+                                    uint8_t *key_out, size_t key_out_len);
 
 /* random numbers */
 int crypto_seed_rng(void) ATTR_WUR;
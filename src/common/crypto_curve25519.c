@@ -24,6 +24,9 @@
 #ifdef USE_CURVE25519_DONNA
 int curve25519_donna(uint8_t *mypublic,
                      const uint8_t *secret, const uint8_t *basepoint);
+int curve25519_donna_batch(int n, uint8_t *const *mypublic,
+                           const uint8_t *const *secret,
+                           const uint8_t *const *basepoint);
 #endif
 #ifdef USE_CURVE25519_NACL
 #ifdef HAVE_CRYPTO_SCALARMULT_CURVE25519_H
@@ -57,6 +60,40 @@ curve25519_impl(uint8_t *output, const uint8_t *secret,
   return r;
 }
 
+/** Compute curve25519_impl() for each of the <b>n</b> (<b>secrets</b>[i],
+ * <b>basepoints</b>[i]) pairs, writing the results to <b>outputs</b>[i].
+ * <b>n</b> must be no more than CURVE25519_BATCH_MAX.  If our backend can do
+ * them together more cheaply than one at a time, it does. */
+STATIC int
+curve25519_impl_batch(int n, uint8_t *const *outputs,
+                      const uint8_t *const *secrets,
+                      const uint8_t *const *basepoints)
+{
+  int i, r = 0;
+#ifdef USE_CURVE25519_DONNA
+  uint8_t bp[CURVE25519_BATCH_MAX][CURVE25519_PUBKEY_LEN];
+  const uint8_t *bpp[CURVE25519_BATCH_MAX];
+  tor_assert(n >= 0 && n <= CURVE25519_BATCH_MAX);
+  if (n == 0)
+    return 0;
+  for (i = 0; i < n; ++i) {
+    memcpy(bp[i], basepoints[i], CURVE25519_PUBKEY_LEN);
+    /* Clear the high bit, in case our backend foolishly looks at it. */
+    bp[i][31] &= 0x7f;
+    bpp[i] = bp[i];
+  }
+  r = curve25519_donna_batch(n, outputs, secrets, bpp);
+  memwipe(bp, 0, sizeof(bp));
+#else
+  tor_assert(n >= 0 && n <= CURVE25519_BATCH_MAX);
+  for (i = 0; i < n; ++i) {
+    if (curve25519_impl(outputs[i], secrets[i], basepoints[i]) < 0)
+      r = -1;
+  }
+#endif
+  return r;
+}
+
 STATIC int
 curve25519_basepoint_impl(uint8_t *output, const uint8_t *secret)
 {
@@ -226,6 +263,28 @@ curve25519_handshake(uint8_t *output,
   curve25519_impl(output, skey->secret_key, pkey->public_key);
 }
 
+/** Perform <b>n</b> curve25519 ECDH handshakes at once, as if by calling
+ * curve25519_handshake(<b>outputs</b>[i], <b>skeys</b>[i], <b>pkeys</b>[i])
+ * for each i.  This is faster than doing them one at a time. */
+void
+curve25519_handshake_batch(int n, uint8_t *const *outputs,
+                           const curve25519_secret_key_t *const *skeys,
+                           const curve25519_public_key_t *const *pkeys)
+{
+  const uint8_t *secrets[CURVE25519_BATCH_MAX];
+  const uint8_t *basepoints[CURVE25519_BATCH_MAX];
+  int i, done;
+
+  for (done = 0; done < n; done += CURVE25519_BATCH_MAX) {
+    int n_this = MIN(n - done, CURVE25519_BATCH_MAX);
+    for (i = 0; i < n_this; ++i) {
+      secrets[i] = skeys[done+i]->secret_key;
+      basepoints[i] = pkeys[done+i]->public_key;
+    }
+    curve25519_impl_batch(n_this, outputs+done, secrets, basepoints);
+  }
+}
+
 /** Check whether the ed25519-based curve25519 basepoint optimization seems to
  * be working. If so, return 0; otherwise return -1. */
 static int
@@ -47,6 +47,9 @@ int curve25519_keypair_generate(curve25519_keypair_t *keypair_out,
 void curve25519_handshake(uint8_t *output,
                           const curve25519_secret_key_t *,
                           const curve25519_public_key_t *);
+void curve25519_handshake_batch(int n, uint8_t *const *outputs,
+                          const curve25519_secret_key_t *const *skeys,
+                          const curve25519_public_key_t *const *pkeys);
 
 int curve25519_keypair_write_to_file(const curve25519_keypair_t *keypair,
                                      const char *fname,
@@ -59,8 +62,15 @@ int curve25519_keypair_read_from_file(curve25519_keypair_t *keypair_out,
 int curve25519_rand_seckey_bytes(uint8_t *out, int extra_strong);
 
 #ifdef CRYPTO_CURVE25519_PRIVATE
+/** Largest number of scalar multiplications that curve25519_impl_batch()
+ * will do at once.  Must be no more than the donna backend's limit. */
+#define CURVE25519_BATCH_MAX 16
+
 STATIC int curve25519_impl(uint8_t *output, const uint8_t *secret,
                            const uint8_t *basepoint);
+STATIC int curve25519_impl_batch(int n, uint8_t *const *outputs,
+                                 const uint8_t *const *secrets,
+                                 const uint8_t *const *basepoints);
 
 STATIC int curve25519_basepoint_impl(uint8_t *output, const uint8_t *secret);
 #endif
@@ -0,0 +1,586 @@
+/* Copyright (c) 2007-2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file geoip_table.c
+ * \brief Compact, read-only tables that map IP address ranges to countries,
+ * and the file format for storing them precompiled.
+ *
+ * A geoip_table_t holds the ranges of a single address family, sorted and
+ * packed into flat arrays, along with an index from the top 16 bits of an
+ * address (for IPv4, its /16) to the ranges that might contain it.  Looking
+ * up an address takes a binary search within one such bucket, which seldom
+ * holds more than a few dozen ranges.
+ *
+ * Tables are never modified once they're built, so lookups need no locking,
+ * and the in-memory layout is the same as the file layout, so that a
+ * compiled table can be used straight from a memory-mapped file.  Every
+ * integer is in network order.  The layout is:
+ *
+ * <pre>
+ *   GEOIP_TABLE_MAGIC                            [16 bytes]
+ *   family (4 or 6), then three zero bytes       [4 bytes]
+ *   digest of the file we built the table from   [20 bytes]
+ *   number of countries, N_C                     [4 bytes]
+ *   number of ranges, N_R                        [4 bytes]
+ *   two-letter lowercase country codes           [N_C * 2 bytes]
+ *   index of the first range in each bucket      [(65536 + 1) * 4 bytes]
+ *   ranges: lowest address, highest address,
+ *     country                                    [N_R * (2 * A + 2) bytes]
+ * </pre>
+ *
+ * where A is 4 for IPv4 and 16 for IPv6.  The ranges are sorted and don't
+ * overlap.  Bucket B starts with the first range that ends at or after the
+ * first address in B, and the first range of bucket B+1 is the last one
+ * that might contain an address in B.
+ */
+
+#include "orconfig.h"
+#include "geoip_table.h"
+#include "container.h"
+#include "torlog.h"
+#include "util.h"
+
+#include <string.h>
+
+/** How many buckets does a geoip table have? */
+#define GEOIP_N_BUCKETS 65536
+/** Length of the fixed-size header of a compiled geoip table. */
+#define GEOIP_HEADER_LEN (GEOIP_TABLE_MAGIC_LEN + 4 + GEOIP_TABLE_DIGEST_LEN \
+                          + 4 + 4)
+
+struct geoip_table_t {
+  /** Which address family does this table describe? */
+  sa_family_t family;
+  /** Length of one address in this table: 4 or 16. */
+  int addr_len;
+  /** Length of one range in this table. */
+  int range_len;
+  /** How many countries are in this table? */
+  uint32_t n_countries;
+  /** How many ranges are in this table? */
+  uint32_t n_ranges;
+  /** The digest of the file that this table was built from. */
+  const char *digest;
+  /** The country codes, two characters apiece, not NUL-terminated. */
+  const char *countries;
+  /** The bucket index. */
+  const char *buckets;
+  /** The ranges. */
+  const char *ranges;
+  /** If this table lives in a memory-mapped file, that file; else NULL. */
+  tor_mmap_t *map;
+  /** If this table lives in memory that we allocated, that memory; else
+   * NULL. */
+  char *mem;
+};
+
+/** One address range added to a geoip_table_builder_t. */
+typedef struct geoip_builder_range_t {
+  uint8_t low[16]; /**< Lowest address in the range, in network order. */
+  uint8_t high[16]; /**< Highest address in the range, in network order. */
+  int country; /**< Index of the range's country within the builder. */
+} geoip_builder_range_t;
+
+struct geoip_table_builder_t {
+  /** Which address family are we building a table for? */
+  sa_family_t family;
+  /** Length of one address of that family: 4 or 16. */
+  int addr_len;
+  /** List of geoip_builder_range_t. */
+  smartlist_t *ranges;
+  /** List of the lowercase country codes that we've seen, as strings. */
+  smartlist_t *countries;
+  /** Map from lowercase country code to its index in countries, plus 1. */
+  strmap_t *country_idxplus1;
+};
+
+/** Parse one line of a GeoIP file for <b>family</b>.  If it describes an
+ * address range, store the range's lowest and highest addresses in
+ * *<b>low_out</b> and *<b>high_out</b>, store its two-letter country code
+ * in the 3-byte buffer <b>country_out</b>, and return 1.  If it's a
+ * comment, return 0.  If it's malformed, return -1.
+ *
+ * Recognized line formats for IPv4 are:
+ *   INTIPLOW,INTIPHIGH,CC
+ * and
+ *   "INTIPLOW","INTIPHIGH","CC","CC3","COUNTRY NAME"
+ * where INTIPLOW and INTIPHIGH are IPv4 addresses encoded as 4-byte unsigned
+ * integers, and CC is a country code.
+ *
+ * Recognized line format for IPv6 is:
+ *   IPV6LOW,IPV6HIGH,CC
+ * where IPV6LOW and IPV6HIGH are IPv6 addresses and CC is a country code.
+ */
+int
+geoip_table_parse_line(const char *line, sa_family_t family,
+                       tor_addr_t *low_out, tor_addr_t *high_out,
+                       char *country_out)
+{
+  while (TOR_ISSPACE(*line))
+    ++line;
+  if (*line == '#')
+    return 0;
+
+  if (family == AF_INET) {
+    unsigned int low, high;
+    char c[3];
+    if (tor_sscanf(line,"%u,%u,%2s", &low, &high, c) == 3 ||
+        tor_sscanf(line,"\"%u\",\"%u\",\"%2s\",", &low, &high, c) == 3) {
+      tor_addr_from_ipv4h(low_out, low);
+      tor_addr_from_ipv4h(high_out, high);
+    } else {
+      return -1;
+    }
+    strlcpy(country_out, c, 3);
+  } else if (family == AF_INET6) {
+    char buf[512];
+    char *low_str, *high_str, *country;
+    struct in6_addr low, high;
+    char *strtok_state;
+    strlcpy(buf, line, sizeof(buf));
+    low_str = tor_strtok_r(buf, ",", &strtok_state);
+    if (!low_str)
+      return -1;
+    high_str = tor_strtok_r(NULL, ",", &strtok_state);
+    if (!high_str)
+      return -1;
+    country = tor_strtok_r(NULL, "\n", &strtok_state);
+    if (!country)
+      return -1;
+    if (strlen(country) != 2)
+      return -1;
+    if (tor_inet_pton(AF_INET6, low_str, &low) <= 0)
+      return -1;
+    tor_addr_from_in6(low_out, &low);
+    if (tor_inet_pton(AF_INET6, high_str, &high) <= 0)
+      return -1;
+    tor_addr_from_in6(high_out, &high);
+    strlcpy(country_out, country, 3);
+  } else {
+    return -1;
+  }
+  return 1;
+}
+
+/** Helper: store <b>addr</b> in network order in <b>out</b>, which must
+ * hold 4 bytes if <b>addr</b> is IPv4 and 16 if it is IPv6. */
+static void
+geoip_addr_to_bytes(const tor_addr_t *addr, uint8_t *out)
+{
+  if (tor_addr_family(addr) == AF_INET)
+    set_uint32(out, tor_addr_to_ipv4n(addr));
+  else
+    memcpy(out, tor_addr_to_in6_addr8(addr), 16);
+}
+
+/** Return a new, empty builder for a geoip table of <b>family</b>, which
+ * must be AF_INET or AF_INET6. */
+geoip_table_builder_t *
+geoip_table_builder_new(sa_family_t family)
+{
+  geoip_table_builder_t *builder;
+  tor_assert(family == AF_INET || family == AF_INET6);
+  builder = tor_malloc_zero(sizeof(geoip_table_builder_t));
+  builder->family = family;
+  builder->addr_len = (family == AF_INET) ? 4 : 16;
+  builder->ranges = smartlist_new();
+  builder->countries = smartlist_new();
+  builder->country_idxplus1 = strmap_new();
+  return builder;
+}
+
+/** Add to <b>builder</b> a range mapping every address from <b>low</b> to
+ * <b>high</b>, inclusive, to the two-letter country code <b>country</b>.
+ * Return 0 on success, or -1 if the range is not a valid range of the
+ * builder's family. */
+int
+geoip_table_builder_add(geoip_table_builder_t *builder,
+                        const tor_addr_t *low, const tor_addr_t *high,
+                        const char *country)
+{
+  geoip_builder_range_t *range;
+  void *idxplus1;
+
+  if (tor_addr_family(low) != builder->family ||
+      tor_addr_family(high) != builder->family)
+    return -1;
+  if (tor_addr_compare(high, low, CMP_EXACT) < 0)
+    return -1;
+  if (strlen(country) != 2)
+    return -1;
+
+  idxplus1 = strmap_get_lc(builder->country_idxplus1, country);
+  if (!idxplus1) {
+    char *cc = tor_strdup(country);
+    tor_strlower(cc);
+    smartlist_add(builder->countries, cc);
+    idxplus1 = (void*)(intptr_t)smartlist_len(builder->countries);
+    strmap_set_lc(builder->country_idxplus1, country, idxplus1);
+  }
+
+  range = tor_malloc_zero(sizeof(geoip_builder_range_t));
+  geoip_addr_to_bytes(low, range->low);
+  geoip_addr_to_bytes(high, range->high);
+  range->country = (int)(((intptr_t)idxplus1) - 1);
+  smartlist_add(builder->ranges, range);
+  return 0;
+}
+
+/** Sorting helper: compare two geoip_builder_range_t by their lowest
+ * address.  (Comparing all 16 bytes is fine for IPv4 too, since the unused
+ * bytes are always zero.) */
+static int
+geoip_builder_compare_ranges_(const void **a_, const void **b_)
+{
+  const geoip_builder_range_t *a = *a_, *b = *b_;
+  return fast_memcmp(a->low, b->low, sizeof(a->low));
+}
+
+/** Return the bucket that the network-order address <b>addr</b> falls
+ * into. */
+static INLINE unsigned
+geoip_addr_bucket(const uint8_t *addr)
+{
+  return (((unsigned)addr[0]) << 8) | addr[1];
+}
+
+/** Sort the ranges in <b>builder</b>, and encode them as a compiled geoip
+ * table that records <b>digest</b> (GEOIP_TABLE_DIGEST_LEN bytes) as the
+ * digest of its source.  Ranges that overlap an earlier range are dropped.
+ * Return a newly allocated buffer holding the table, and set
+ * *<b>len_out</b> to its length. */
+char *
+geoip_table_builder_encode(geoip_table_builder_t *builder,
+                           const char *digest, size_t *len_out)
+{
+  const int addr_len = builder->addr_len;
+  const int range_len = 2 * addr_len + 2;
+  smartlist_t *ranges = smartlist_new();
+  const geoip_builder_range_t *prev = NULL;
+  size_t len;
+  char *buf, *cp;
+  int bucket, i;
+
+  smartlist_sort(builder->ranges, geoip_builder_compare_ranges_);
+  SMARTLIST_FOREACH_BEGIN(builder->ranges, const geoip_builder_range_t *, r) {
+    if (prev && fast_memcmp(r->low, prev->high, addr_len) <= 0) {
+      log_info(LD_GENERAL, "Skipping overlapping GeoIP range.");
+      continue;
+    }
+    smartlist_add(ranges, (void*)r);
+    prev = r;
+  } SMARTLIST_FOREACH_END(r);
+
+  len = GEOIP_HEADER_LEN + 2 * smartlist_len(builder->countries) +
+    4 * (GEOIP_N_BUCKETS + 1) + range_len * smartlist_len(ranges);
+  cp = buf = tor_malloc_zero(len);
+
+  memcpy(cp, GEOIP_TABLE_MAGIC, GEOIP_TABLE_MAGIC_LEN);
+  cp += GEOIP_TABLE_MAGIC_LEN;
+  cp[0] = (builder->family == AF_INET) ? 4 : 6;
+  cp += 4;
+  memcpy(cp, digest, GEOIP_TABLE_DIGEST_LEN);
+  cp += GEOIP_TABLE_DIGEST_LEN;
+  set_uint32(cp, htonl(smartlist_len(builder->countries)));
+  set_uint32(cp+4, htonl(smartlist_len(ranges)));
+  cp += 8;
+
+  SMARTLIST_FOREACH_BEGIN(builder->countries, const char *, cc) {
+    memcpy(cp, cc, 2);
+    cp += 2;
+  } SMARTLIST_FOREACH_END(cc);
+
+  /* Since the ranges are sorted and don't overlap, their highest addresses
+   * are sorted too. */
+  i = 0;
+  for (bucket = 0; bucket < GEOIP_N_BUCKETS; ++bucket) {
+    while (i < smartlist_len(ranges)) {
+      const geoip_builder_range_t *r = smartlist_get(ranges, i);
+      if ((int)geoip_addr_bucket(r->high) >= bucket)
+        break;
+      ++i;
+    }
+    set_uint32(cp, htonl(i));
+    cp += 4;
+  }
+  set_uint32(cp, htonl(smartlist_len(ranges)));
+  cp += 4;
+
+  SMARTLIST_FOREACH_BEGIN(ranges, const geoip_builder_range_t *, r) {
+    memcpy(cp, r->low, addr_len);
+    memcpy(cp + addr_len, r->high, addr_len);
+    set_uint16(cp + 2 * addr_len, htons((uint16_t)r->country));
+    cp += range_len;
+  } SMARTLIST_FOREACH_END(r);
+
+  tor_assert(cp == buf + len);
+  smartlist_free(ranges);
+  *len_out = len;
+  return buf;
+}
+
+/** Release all storage held by <b>builder</b>. */
+void
+geoip_table_builder_free(geoip_table_builder_t *builder)
+{
+  if (!builder)
+    return;
+  SMARTLIST_FOREACH(builder->ranges, geoip_builder_range_t *, r, tor_free(r));
+  smartlist_free(builder->ranges);
+  SMARTLIST_FOREACH(builder->countries, char *, cc, tor_free(cc));
+  smartlist_free(builder->countries);
+  strmap_free(builder->country_idxplus1, NULL);
+  tor_free(builder);
+}
+
+/** Return true iff the <b>len</b>-byte buffer <b>data</b> looks like a
+ * compiled geoip table, rather than a GeoIP text file. */
+int
+geoip_table_looks_compiled(const char *data, size_t len)
+{
+  return len >= GEOIP_TABLE_MAGIC_LEN &&
+    fast_memeq(data, GEOIP_TABLE_MAGIC, GEOIP_TABLE_MAGIC_LEN);
+}
+
+/** Return the position of the first range in bucket <b>bucket</b> of
+ * <b>table</b>. */
+static INLINE uint32_t
+geoip_table_bucket_start(const geoip_table_t *table, unsigned bucket)
+{
+  return ntohl(get_uint32(table->buckets + 4 * bucket));
+}
+
+/** Return a pointer to range number <b>idx</b> of <b>table</b>. */
+static INLINE const char *
+geoip_table_range(const geoip_table_t *table, uint32_t idx)
+{
+  return table->ranges + (size_t)idx * table->range_len;
+}
+
+/** Fill in the fields of <b>table</b> from the <b>len</b>-byte compiled
+ * table in <b>data</b>, checking that it's well-formed.  Return 0 on
+ * success and -1 on failure. */
+static int
+geoip_table_parse(geoip_table_t *table, const char *data, size_t len)
+{
+  const char *cp = data;
+  uint64_t expected_len;
+  uint32_t i, prev_start = 0;
+
+  if (len < GEOIP_HEADER_LEN || !geoip_table_looks_compiled(data, len))
+    return -1;
+  cp += GEOIP_TABLE_MAGIC_LEN;
+  if (cp[0] == 4)
+    table->family = AF_INET;
+  else if (cp[0] == 6)
+    table->family = AF_INET6;
+  else
+    return -1;
+  table->addr_len = (table->family == AF_INET) ? 4 : 16;
+  table->range_len = 2 * table->addr_len + 2;
+  cp += 4;
+  table->digest = cp;
+  cp += GEOIP_TABLE_DIGEST_LEN;
+  table->n_countries = ntohl(get_uint32(cp));
+  table->n_ranges = ntohl(get_uint32(cp+4));
+  cp += 8;
+
+  expected_len = GEOIP_HEADER_LEN + 2 * (uint64_t)table->n_countries +
+    4 * (uint64_t)(GEOIP_N_BUCKETS + 1) +
+    table->range_len * (uint64_t)table->n_ranges;
+  if (expected_len != len)
+    return -1;
+  table->countries = cp;
+  table->buckets = cp + 2 * (size_t)table->n_countries;
+  table->ranges = table->buckets + 4 * (GEOIP_N_BUCKETS + 1);
+
+  for (i = 0; i < 2 * table->n_countries; ++i) {
+    if (!TOR_ISPRINT(table->countries[i]) ||
+        TOR_ISSPACE(table->countries[i]))
+      return -1;
+  }
+  for (i = 0; i <= GEOIP_N_BUCKETS; ++i) {
+    uint32_t start = geoip_table_bucket_start(table, i);
+    if (start < prev_start || start > table->n_ranges)
+      return -1;
+    prev_start = start;
+  }
+  if (prev_start != table->n_ranges)
+    return -1;
+  for (i = 0; i < table->n_ranges; ++i) {
+    const char *r = geoip_table_range(table, i);
+    const int a = table->addr_len;
+    if (ntohs(get_uint16(r + 2 * a)) >= table->n_countries)
+      return -1;
+    if (fast_memcmp(r, r + a, a) > 0)
+      return -1;
+    if (i && fast_memcmp(r - table->range_len + a, r, a) >= 0)
+      return -1;
+  }
+  return 0;
+}
+
+/** Return a new geoip table that uses the <b>len</b>-byte compiled table
+ * in <b>buf</b>, or NULL if <b>buf</b> isn't a well-formed compiled table.
+ * Takes ownership of <b>buf</b>, which must have come from tor_malloc(),
+ * either way. */
+geoip_table_t *
+geoip_table_new_from_buf(char *buf, size_t len)
+{
+  geoip_table_t *table = tor_malloc_zero(sizeof(geoip_table_t));
+  table->mem = buf;
+  if (geoip_table_parse(table, buf, len) < 0) {
+    geoip_table_free(table);
+    return NULL;
+  }
+  return table;
+}
+
+/** Return a new geoip table that uses the compiled table in the
+ * memory-mapped file <b>map</b>, or NULL if the file isn't a well-formed
+ * compiled table.  Takes ownership of <b>map</b> either way. */
+geoip_table_t *
+geoip_table_new_from_mmap(tor_mmap_t *map)
+{
+  geoip_table_t *table = tor_malloc_zero(sizeof(geoip_table_t));
+  table->map = map;
+  if (geoip_table_parse(table, map->data, map->size) < 0) {
+    geoip_table_free(table);
+    return NULL;
+  }
+  return table;
+}
+
+/** Release all storage held by <b>table</b>. */
+void
+geoip_table_free(geoip_table_t *table)
+{
+  if (!table)
+    return;
+  if (table->map)
+    tor_munmap_file(table->map);
+  tor_free(table->mem);
+  tor_free(table);
+}
+
+/** Return the address family of the ranges in <b>table</b>. */
+sa_family_t
+geoip_table_get_family(const geoip_table_t *table)
+{
+  return table->family;
+}
+
+/** Return the GEOIP_TABLE_DIGEST_LEN-byte digest of the file that
+ * <b>table</b> was built from. */
+const char *
+geoip_table_get_digest(const geoip_table_t *table)
+{
+  return table->digest;
+}
+
+/** Return the number of countries in <b>table</b>. */
+int
+geoip_table_get_n_countries(const geoip_table_t *table)
+{
+  return (int)table->n_countries;
+}
+
+/** Copy the two-letter lowercase code of country <b>idx</b> in
+ * <b>table</b>, with a terminating NUL, into the 3-byte buffer
+ * <b>out</b>. */
+void
+geoip_table_get_country_code(const geoip_table_t *table, int idx, char *out)
+{
+  tor_assert(idx >= 0 && (uint32_t)idx < table->n_countries);
+  memcpy(out, table->countries + 2 * idx, 2);
+  out[2] = '\0';
+}
+
+/** Return the index in <b>table</b> of the country of the network-order
+ * address <b>addr</b>, or -1 if no range in <b>table</b> contains it. */
+static int
+geoip_table_lookup(const geoip_table_t *table, const uint8_t *addr)
+{
+  const int a = table->addr_len;
+  const unsigned bucket = geoip_addr_bucket(addr);
+  uint32_t lo, hi;
+  const char *r;
+
+  if (!table->n_ranges)
+    return -1;
+  /* The ranges that might contain addr are the ones in its bucket, and the
+   * first one in the next bucket. */
+  lo = geoip_table_bucket_start(table, bucket);
+  hi = geoip_table_bucket_start(table, bucket + 1);
+  if (hi >= table->n_ranges)
+    hi = table->n_ranges - 1;
+  if (lo > hi)
+    return -1;
+
+  /* Find the last of those ranges that starts at or below addr. */
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo + 1) / 2;
+    if (fast_memcmp(geoip_table_range(table, mid), addr, a) <= 0)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  r = geoip_table_range(table, lo);
+  if (fast_memcmp(r, addr, a) > 0 || fast_memcmp(r + a, addr, a) < 0)
+    return -1;
+  return ntohs(get_uint16(r + 2 * a));
+}
+
+/** Return the index in the IPv4 table <b>table</b> of the country of
+ * <b>addr</b>, an IPv4 address in host order, or -1 if no range in
+ * <b>table</b> contains it. */
+int
+geoip_table_lookup_ipv4(const geoip_table_t *table, uint32_t addr)
+{
+  uint8_t buf[4];
+  tor_assert(table->family == AF_INET);
+  set_uint32(buf, htonl(addr));
+  return geoip_table_lookup(table, buf);
+}
+
+/** Return the index in the IPv6 table <b>table</b> of the country of
+ * <b>addr</b>, or -1 if no range in <b>table</b> contains it. */
+int
+geoip_table_lookup_ipv6(const geoip_table_t *table,
+                        const struct in6_addr *addr)
+{
+  tor_assert(table->family == AF_INET6);
+  return geoip_table_lookup(table, addr->s6_addr);
+}
+
+
+/** Add every range of <b>table</b> to <b>builder</b>, which must be for the
+ * same address family.  Return 0 on success and -1 on failure. */
+int
+geoip_table_builder_add_table(geoip_table_builder_t *builder,
+                              const geoip_table_t *table)
+{
+  const int a = table->addr_len;
+  uint32_t i;
+
+  if (table->family != builder->family)
+    return -1;
+  for (i = 0; i < table->n_ranges; ++i) {
+    const char *r = geoip_table_range(table, i);
+    tor_addr_t low, high;
+    char cc[3];
+    if (a == 4) {
+      tor_addr_from_ipv4n(&low, get_uint32(r));
+      tor_addr_from_ipv4n(&high, get_uint32(r + a));
+    } else {
+      tor_addr_from_ipv6_bytes(&low, r);
+      tor_addr_from_ipv6_bytes(&high, r + a);
+    }
+    geoip_table_get_country_code(table, ntohs(get_uint16(r + 2 * a)), cc);
+    if (geoip_table_builder_add(builder, &low, &high, cc) < 0)
+      return -1;
+  }
+  return 0;
+}
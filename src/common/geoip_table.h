@@ -0,0 +1,57 @@
+/* Copyright (c) 2007-2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file geoip_table.h
+ * \brief Header file for geoip_table.c.
+ **/
+
+#ifndef TOR_GEOIP_TABLE_H
+#define TOR_GEOIP_TABLE_H
+
+#include "address.h"
+#include "compat.h"
+
+/** The string that every compiled GeoIP table starts with. */
+#define GEOIP_TABLE_MAGIC "tor-geoip-tbl-1\n"
+/** Length of GEOIP_TABLE_MAGIC, not counting its terminating NUL. */
+#define GEOIP_TABLE_MAGIC_LEN 16
+/** Length of the source file digest stored in a compiled GeoIP table. */
+#define GEOIP_TABLE_DIGEST_LEN 20
+
+/** A read-only table mapping the address ranges of one family to countries;
+ * see geoip_table.c. */
+typedef struct geoip_table_t geoip_table_t;
+/** A set of address ranges from which to build a geoip_table_t. */
+typedef struct geoip_table_builder_t geoip_table_builder_t;
+
+int geoip_table_parse_line(const char *line, sa_family_t family,
+                           tor_addr_t *low_out, tor_addr_t *high_out,
+                           char *country_out);
+
+geoip_table_builder_t *geoip_table_builder_new(sa_family_t family);
+int geoip_table_builder_add(geoip_table_builder_t *builder,
+                            const tor_addr_t *low, const tor_addr_t *high,
+                            const char *country);
+int geoip_table_builder_add_table(geoip_table_builder_t *builder,
+                                  const geoip_table_t *table);
+char *geoip_table_builder_encode(geoip_table_builder_t *builder,
+                                 const char *digest, size_t *len_out);
+void geoip_table_builder_free(geoip_table_builder_t *builder);
+
+int geoip_table_looks_compiled(const char *data, size_t len);
+geoip_table_t *geoip_table_new_from_buf(char *buf, size_t len);
+geoip_table_t *geoip_table_new_from_mmap(tor_mmap_t *map);
+void geoip_table_free(geoip_table_t *table);
+
+sa_family_t geoip_table_get_family(const geoip_table_t *table);
+const char *geoip_table_get_digest(const geoip_table_t *table);
+int geoip_table_get_n_countries(const geoip_table_t *table);
+void geoip_table_get_country_code(const geoip_table_t *table, int idx,
+                                  char *out);
+int geoip_table_lookup_ipv4(const geoip_table_t *table, uint32_t addr);
+int geoip_table_lookup_ipv6(const geoip_table_t *table,
+                            const struct in6_addr *addr);
+
+#endif
+
@@ -0,0 +1,118 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file histogram.c
+ * \brief Log-linear histograms for cheaply recording distributions of
+ * values, such as latencies.
+ **/
+
+#define HISTOGRAM_PRIVATE
+#include "orconfig.h"
+#include "histogram.h"
+#include "util.h"
+
+/** Return a new, empty histogram. */
+histogram_t *
+histogram_new(void)
+{
+  return tor_malloc_zero(sizeof(histogram_t));
+}
+
+/** Release all storage held by <b>hist</b>. */
+void
+histogram_free(histogram_t *hist)
+{
+  tor_free(hist);
+}
+
+/** Forget every value that has been recorded in <b>hist</b>. */
+void
+histogram_clear(histogram_t *hist)
+{
+  memset(hist, 0, sizeof(*hist));
+}
+
+/** Add every value that has been recorded in <b>src</b> to <b>dest</b>. */
+void
+histogram_add_histogram(histogram_t *dest, const histogram_t *src)
+{
+  int i;
+  for (i = 0; i < HISTOGRAM_N_BUCKETS; ++i)
+    dest->counts[i] += src->counts[i];
+  dest->n_values += src->n_values;
+  dest->total += src->total;
+  if (src->max > dest->max)
+    dest->max = src->max;
+}
+
+/** Return the largest value that would be recorded in the bucket with index
+ * <b>idx</b>. */
+STATIC uint32_t
+histogram_bucket_max_value(int idx)
+{
+  const int sub_buckets = 1 << HISTOGRAM_SUB_BUCKET_BITS;
+  int log2;
+  uint32_t sub;
+  if (idx < sub_buckets)
+    return (uint32_t)idx;
+  log2 = (idx >> HISTOGRAM_SUB_BUCKET_BITS) + HISTOGRAM_SUB_BUCKET_BITS - 1;
+  sub = (uint32_t)(idx & (sub_buckets - 1)) + 1;
+  return (((uint32_t)sub_buckets + sub) <<
+          (log2 - HISTOGRAM_SUB_BUCKET_BITS)) - 1;
+}
+
+/** Return a value such that about <b>percentile</b> percent of the values
+ * in <b>hist</b> are no greater than it.  The answer is rounded up to the
+ * top of its bucket, but is never more than the largest recorded value.
+ * Return 0 if <b>hist</b> is empty. */
+uint32_t
+histogram_get_percentile(const histogram_t *hist, double percentile)
+{
+  uint64_t target, seen = 0;
+  int i;
+
+  if (hist->n_values == 0)
+    return 0;
+  percentile = CLAMP(0.0, percentile, 100.0);
+  target = (uint64_t)(percentile / 100.0 * hist->n_values + 0.5);
+  if (target < 1)
+    target = 1;
+
+  for (i = 0; i < HISTOGRAM_N_BUCKETS; ++i) {
+    seen += hist->counts[i];
+    if (seen >= target) {
+      uint32_t v = histogram_bucket_max_value(i);
+      return MIN(v, hist->max);
+    }
+  }
+  return hist->max;
+}
+
+/** Return the mean of all the values recorded in <b>hist</b>, or 0 if there
+ * are none. */
+uint32_t
+histogram_get_mean(const histogram_t *hist)
+{
+  if (hist->n_values == 0)
+    return 0;
+  return (uint32_t)(hist->total / hist->n_values);
+}
+
+/** Return a newly allocated string summarizing <b>hist</b>, in the form
+ * "count:N,mean:N,p50:N,p90:N,p99:N,max:N". */
+char *
+histogram_format(const histogram_t *hist)
+{
+  char *result = NULL;
+  tor_asprintf(&result,
+               "count:"U64_FORMAT",mean:%u,p50:%u,p90:%u,p99:%u,max:%u",
+               U64_PRINTF_ARG(hist->n_values),
+               (unsigned)histogram_get_mean(hist),
+               (unsigned)histogram_get_percentile(hist, 50.0),
+               (unsigned)histogram_get_percentile(hist, 90.0),
+               (unsigned)histogram_get_percentile(hist, 99.0),
+               (unsigned)hist->max);
+  return result;
+}
+
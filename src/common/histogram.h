@@ -0,0 +1,94 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file histogram.h
+ * \brief Header for histogram.c
+ **/
+
+#ifndef TOR_HISTOGRAM_H
+#define TOR_HISTOGRAM_H
+
+#include "orconfig.h"
+#include "torint.h"
+#include "compat.h"
+#include "testsupport.h"
+
+/** Each power of two in a histogram_t is split into
+ * 1&lt;&lt;HISTOGRAM_SUB_BUCKET_BITS equal-width buckets, so every recorded
+ * value is accurate to within 1 part in 8. */
+#define HISTOGRAM_SUB_BUCKET_BITS 3
+/** Values of 1&lt;&lt;HISTOGRAM_VALUE_BITS or more are recorded as if they
+ * were 1&lt;&lt;HISTOGRAM_VALUE_BITS - 1.  For microseconds, that's about 16
+ * seconds. */
+#define HISTOGRAM_VALUE_BITS 24
+/** Number of buckets in a histogram_t. */
+#define HISTOGRAM_N_BUCKETS \
+  ((HISTOGRAM_VALUE_BITS - HISTOGRAM_SUB_BUCKET_BITS + 1) << \
+   HISTOGRAM_SUB_BUCKET_BITS)
+/** Largest value that a histogram_t can record exactly. */
+#define HISTOGRAM_MAX_VALUE ((UINT32_C(1) << HISTOGRAM_VALUE_BITS) - 1)
+
+/** A log-linear histogram of 32-bit values, in the style of HdrHistogram:
+ * small values each get their own bucket, and every larger power of two is
+ * split into the same number of buckets.  Recording a value is a couple of
+ * shifts and an increment, so we can afford to do it for every cell. */
+typedef struct histogram_t {
+  /** Number of values recorded. */
+  uint64_t n_values;
+  /** Sum of all values recorded, after clamping. */
+  uint64_t total;
+  /** Largest value recorded, after clamping. */
+  uint32_t max;
+  /** Number of values that fell into each bucket. */
+  uint32_t counts[HISTOGRAM_N_BUCKETS];
+} histogram_t;
+
+/** Return the index of the bucket in a histogram_t that holds
+ * <b>value</b>, which must be no more than HISTOGRAM_MAX_VALUE. */
+static INLINE int
+histogram_bucket_idx(uint32_t value)
+{
+  int log2;
+  if (value < (1u << HISTOGRAM_SUB_BUCKET_BITS))
+    return (int)value;
+#ifdef __GNUC__
+  log2 = 31 - __builtin_clz(value);
+#else
+  log2 = 0;
+  while (value >> (log2 + 1))
+    ++log2;
+#endif
+  return ((log2 - HISTOGRAM_SUB_BUCKET_BITS + 1) << HISTOGRAM_SUB_BUCKET_BITS)
+    + (int)((value >> (log2 - HISTOGRAM_SUB_BUCKET_BITS)) &
+            ((1u << HISTOGRAM_SUB_BUCKET_BITS) - 1));
+}
+
+/** Record <b>value</b> in <b>hist</b>. */
+static INLINE void
+histogram_add(histogram_t *hist, uint32_t value)
+{
+  if (value > HISTOGRAM_MAX_VALUE)
+    value = HISTOGRAM_MAX_VALUE;
+  ++hist->counts[histogram_bucket_idx(value)];
+  ++hist->n_values;
+  hist->total += value;
+  if (value > hist->max)
+    hist->max = value;
+}
+
+histogram_t *histogram_new(void);
+void histogram_free(histogram_t *hist);
+void histogram_clear(histogram_t *hist);
+void histogram_add_histogram(histogram_t *dest, const histogram_t *src);
+uint32_t histogram_get_percentile(const histogram_t *hist,
+                                  double percentile);
+uint32_t histogram_get_mean(const histogram_t *hist);
+char *histogram_format(const histogram_t *hist);
+
+#ifdef HISTOGRAM_PRIVATE
+STATIC uint32_t histogram_bucket_max_value(int idx);
+#endif
+
+#endif
+
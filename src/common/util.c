@@ -99,6 +99,11 @@
 #if defined(HAVE_SYS_PRCTL_H) && defined(__linux__)
 #include <sys/prctl.h>
 #endif
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+/** Defined if we can scan strings sixteen bytes at a time with SSE2. */
+#define USE_SSE2_SCANNING
+#endif
 
 #ifdef __clang_analyzer__
 #undef MALLOC_ZERO_WORKS
@@ -907,6 +912,31 @@ const char *
 find_whitespace_eos(const char *s, const char *eos)
 {
   /* tor_assert(s); */
+#ifdef USE_SSE2_SCANNING
+  /* Directory documents have lots of long-ish words (digests, flags,
+   * policies), so it pays to look at sixteen bytes at once while we can
+   * without reading past <b>eos</b>. */
+  if (eos - s >= 16) {
+    const __m128i nul = _mm_setzero_si128();
+    const __m128i hash = _mm_set1_epi8('#');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i tab = _mm_set1_epi8('\t');
+    do {
+      __m128i v = _mm_loadu_si128((const __m128i *)s);
+      __m128i hit = _mm_or_si128(
+          _mm_or_si128(_mm_cmpeq_epi8(v, nul), _mm_cmpeq_epi8(v, hash)),
+          _mm_or_si128(
+              _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, cr)),
+              _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, tab))));
+      int mask = _mm_movemask_epi8(hit);
+      if (mask)
+        return s + __builtin_ctz((unsigned)mask);
+      s += 16;
+    } while (eos - s >= 16);
+  }
+#endif
   while (s < eos) {
     switch (*s)
     {
@@ -9,20 +9,32 @@
 #include "tor_queue.h"
 #include "torlog.h"
 
+/** A list of workqueue_entry_t, linked by their next_work fields. */
+TOR_TAILQ_HEAD(work_tailq_s, workqueue_entry_s);
+
+/** A worker thread hands its replies to the main thread in groups of at
+ * most this many, so that it doesn't have to take the reply queue's lock
+ * and maybe write to its alert socket once per item.  It hands them over
+ * early whenever its own queue runs dry, so that no reply waits on work
+ * that hasn't arrived yet. */
+#define WORKQUEUE_REPLY_BATCH_MAX 16
+
+/** Once a worker thread has more than this many items waiting on its queue,
+ * we wake up a sleeping worker (if there is one) each time we add another,
+ * so that it can come and take some of them. */
+#define WORKQUEUE_WAKE_IDLE_THRESHOLD 4
+
 struct threadpool_s {
   /** An array of pointers to workerthread_t: one for each running worker
-   * thread. */
+   * thread.  This doesn't change once the threads are running, so the
+   * threads can read it without holding any lock. */
   struct workerthread_s **threads;
 
-  /** Condition variable that we wait on when we have no work, and which
-   * gets signaled when our queue becomes nonempty. */
-  tor_cond_t condition;
-  /** Queue of pending work that we have to do. */
-  TOR_TAILQ_HEAD(, workqueue_entry_s) work;
-
   /** The current 'update generation' of the threadpool.  Any thread that is
    * at an earlier generation needs to run the update function. */
   unsigned generation;
+  /** Index of the thread to which we'll give the next item of work. */
+  int next_thread;
 
   /** Function that should be run for updates on each thread. */
   workqueue_reply_t (*update_fn)(void *, void *);
@@ -33,7 +45,9 @@ struct threadpool_s {
 
   /** Number of elements in threads. */
   int n_threads;
-  /** Mutex to protect all the above fields. */
+  /** Mutex to protect all the above fields.  The worker threads only take
+   * this when they run an update, so it's cheap for us to take it when
+   * queueing work. */
   tor_mutex_t lock;
 
   /** A reply queue to use when constructing new threads. */
@@ -43,6 +57,13 @@ struct threadpool_s {
   void *(*new_thread_state_fn)(void*);
   void (*free_thread_state_fn)(void*);
   void *new_thread_state_arg;
+
+  /** How many threads have we started that haven't exited?  Protected by
+   * lock. */
+  int n_running;
+  /** Condition variable that a thread signals when it exits after being
+   * told to; see n_running. */
+  tor_cond_t exit_condition;
 };
 
 struct workqueue_entry_s {
@@ -53,7 +74,15 @@ struct workqueue_entry_s {
    * is set when the workqueue_entry_t is created, and won't be cleared until
    * after it's handled in the main thread. */
   struct threadpool_s *on_pool;
-  /** True iff this entry is waiting for a worker to start processing it. */
+  /** The thread on whose queue this workqueue_entry_t was put.  Any thread
+   * in the pool may end up running it, but it stays on this thread's queue
+   * until then. */
+  struct workerthread_s *on_thread;
+  /** The update generation of the pool when this entry was queued.  No
+   * thread may run it until it has run the update for that generation. */
+  unsigned generation;
+  /** True iff this entry is waiting for a worker to start processing it.
+   * Protected by on_thread's lock. */
   uint8_t pending;
   /** Function to run in the worker thread. */
   workqueue_reply_t (*fn)(void *state, void *arg);
@@ -67,7 +96,7 @@ struct replyqueue_s {
   /** Mutex to protect the answers field */
   tor_mutex_t lock;
   /** Doubly-linked list of answers that the reply queue needs to handle. */
-  TOR_TAILQ_HEAD(, workqueue_entry_s) answers;
+  struct work_tailq_s answers;
 
   /** Mechanism to wake up the main thread when it is receiving answers. */
   alert_sockets_t alert;
@@ -75,7 +104,11 @@ struct replyqueue_s {
 
 /** A worker thread represents a single thread in a thread pool.  To avoid
  * contention, each gets its own queue. This breaks the guarantee that that
- * queued work will get executed strictly in order. */
+ * queued work will get executed strictly in order.
+ *
+ * A thread with nothing on its own queue takes work from the front of the
+ * other threads' queues before it goes to sleep, so that one slow item
+ * doesn't hold up everything queued behind it. */
 typedef struct workerthread_s {
   /** Which thread it this?  In range 0..in_pool->n_threads-1 */
   int index;
@@ -86,11 +119,30 @@ typedef struct workerthread_s {
   void *state;
   /** Reply queue to which we pass our results. */
   replyqueue_t *reply_queue;
-  /** The current update generation of this thread */
+  /** The current update generation of this thread.  Only this thread
+   * touches this field. */
   unsigned generation;
+
+  /** Mutex to protect the fields below. */
+  tor_mutex_t lock;
+  /** Condition variable that we wait on when we have no work, and which
+   * gets signaled when our queue becomes nonempty or we have an update to
+   * run. */
+  tor_cond_t condition;
+  /** Queue of pending work that was given to this thread. */
+  struct work_tailq_s work;
+  /** How many items are on work? */
+  int n_work;
+  /** True iff this thread is waiting on condition for something to do. */
+  unsigned int sleeping : 1;
+  /** True iff this thread should exit as soon as it notices. */
+  unsigned int should_exit : 1;
+  /** The latest update generation of the pool that this thread has been
+   * told about.  If it's ahead of generation, we have an update to run. */
+  unsigned pool_generation;
 } workerthread_t;
 
-static void queue_reply(replyqueue_t *queue, workqueue_entry_t *work);
+static void queue_replies(replyqueue_t *queue, struct work_tailq_s *replies);
 
 /** Allocate and return a new workqueue_entry_t, set up to run the function
  * <b>fn</b> in the worker thread, and <b>reply_fn</b> in the main
@@ -139,13 +191,15 @@ workqueue_entry_cancel(workqueue_entry_t *ent)
 {
   int cancelled = 0;
   void *result = NULL;
-  tor_mutex_acquire(&ent->on_pool->lock);
+  workerthread_t *thread = ent->on_thread;
+  tor_mutex_acquire(&thread->lock);
   if (ent->pending) {
-    TOR_TAILQ_REMOVE(&ent->on_pool->work, ent, next_work);
+    TOR_TAILQ_REMOVE(&thread->work, ent, next_work);
+    --thread->n_work;
     cancelled = 1;
     result = ent->arg;
   }
-  tor_mutex_release(&ent->on_pool->lock);
+  tor_mutex_release(&thread->lock);
 
   if (cancelled) {
     workqueue_entry_free(ent);
@@ -153,14 +207,44 @@ workqueue_entry_cancel(workqueue_entry_t *ent)
   return result;
 }
 
-/**DOCDOC
-
-   must hold lock */
+/** Return true iff <b>thread</b> has an update to run.  Must hold
+ * <b>thread</b>'s lock. */
 static int
-worker_thread_has_work(workerthread_t *thread)
+worker_thread_has_update(const workerthread_t *thread)
+{
+  return thread->generation != thread->pool_generation;
+}
+
+/** Try to take an item of work that was queued for some other thread in
+ * <b>thread</b>'s pool.  We skip any item that was queued after an update
+ * that <b>thread</b> hasn't run yet.  Return the item, or NULL if there's
+ * nothing we can take. */
+static workqueue_entry_t *
+worker_thread_steal_work(workerthread_t *thread)
 {
-  return !TOR_TAILQ_EMPTY(&thread->in_pool->work) ||
-    thread->generation != thread->in_pool->generation;
+  threadpool_t *pool = thread->in_pool;
+  int i;
+
+  for (i = 1; i < pool->n_threads; ++i) {
+    workerthread_t *victim =
+      pool->threads[(thread->index + i) % pool->n_threads];
+    workqueue_entry_t *work;
+
+    tor_mutex_acquire(&victim->lock);
+    work = TOR_TAILQ_FIRST(&victim->work);
+    if (work && work->generation == thread->generation) {
+      TOR_TAILQ_REMOVE(&victim->work, work, next_work);
+      --victim->n_work;
+      work->pending = 0;
+    } else {
+      work = NULL;
+    }
+    tor_mutex_release(&victim->lock);
+
+    if (work)
+      return work;
+  }
+  return NULL;
 }
 
 /**
@@ -173,68 +257,129 @@ worker_thread_main(void *thread_)
   threadpool_t *pool = thread->in_pool;
   workqueue_entry_t *work;
   workqueue_reply_t result;
+  /* Replies we haven't handed to the main thread yet. */
+  struct work_tailq_s replies;
+  int n_replies = 0;
 
-  tor_mutex_acquire(&pool->lock);
+  TOR_TAILQ_INIT(&replies);
+
+  tor_mutex_acquire(&thread->lock);
   while (1) {
-    /* lock must be held at this point. */
-    while (worker_thread_has_work(thread)) {
-      /* lock must be held at this point. */
-      if (thread->in_pool->generation != thread->generation) {
-        void *arg = thread->in_pool->update_args[thread->index];
-        thread->in_pool->update_args[thread->index] = NULL;
-        workqueue_reply_t (*update_fn)(void*,void*) =
-            thread->in_pool->update_fn;
-        thread->generation = thread->in_pool->generation;
-        tor_mutex_release(&pool->lock);
-
-        workqueue_reply_t r = update_fn(thread->state, arg);
-
-        if (r != WQ_RPL_REPLY) {
-          return;
-        }
-
-        tor_mutex_acquire(&pool->lock);
-        continue;
-      }
-      work = TOR_TAILQ_FIRST(&pool->work);
-      TOR_TAILQ_REMOVE(&pool->work, work, next_work);
-      work->pending = 0;
+    /* our lock must be held at this point. */
+    if (thread->should_exit) {
+      tor_mutex_release(&thread->lock);
+      break;
+    }
+
+    if (worker_thread_has_update(thread)) {
+      void *arg;
+      workqueue_reply_t (*update_fn)(void*,void*);
+      workqueue_reply_t r;
+      tor_mutex_release(&thread->lock);
+
+      tor_mutex_acquire(&pool->lock);
+      arg = pool->update_args[thread->index];
+      pool->update_args[thread->index] = NULL;
+      update_fn = pool->update_fn;
+      thread->generation = pool->generation;
       tor_mutex_release(&pool->lock);
 
-      /* We run the work function without holding the thread lock. This
-       * is the main thread's first opportunity to give us more work. */
-      result = work->fn(thread->state, work->arg);
+      r = update_fn(thread->state, arg);
+
+      if (r != WQ_RPL_REPLY)
+        break;
+
+      tor_mutex_acquire(&thread->lock);
+      continue;
+    }
 
-      /* Queue the reply for the main thread. */
-      queue_reply(thread->reply_queue, work);
+    work = TOR_TAILQ_FIRST(&thread->work);
+    if (work) {
+      TOR_TAILQ_REMOVE(&thread->work, work, next_work);
+      --thread->n_work;
+      work->pending = 0;
+    }
+    tor_mutex_release(&thread->lock);
+
+    if (!work)
+      work = worker_thread_steal_work(thread);
+
+    if (work) {
+      /* We run the work function without holding any lock. This is the
+       * main thread's first opportunity to give us more work. */
+      result = work->fn(thread->state, work->arg);
+      TOR_TAILQ_INSERT_TAIL(&replies, work, next_work);
+      ++n_replies;
 
       /* We may need to exit the thread. */
-      if (result != WQ_RPL_REPLY) {
-        return;
+      if (result != WQ_RPL_REPLY)
+        break;
+
+      /* Hold the reply for the main thread only while we have a partial
+       * batch and more of our own work to get on with. */
+      tor_mutex_acquire(&thread->lock);
+      if (n_replies >= WORKQUEUE_REPLY_BATCH_MAX ||
+          TOR_TAILQ_EMPTY(&thread->work)) {
+        tor_mutex_release(&thread->lock);
+        queue_replies(thread->reply_queue, &replies);
+        n_replies = 0;
+        tor_mutex_acquire(&thread->lock);
       }
-      tor_mutex_acquire(&pool->lock);
+      continue;
     }
-    /* At this point the lock is held, and there is no work in this thread's
-     * queue. */
+
+    tor_mutex_acquire(&thread->lock);
+    /* Something may have been queued for us while we weren't holding the
+     * lock. */
+    if (!TOR_TAILQ_EMPTY(&thread->work) || worker_thread_has_update(thread) ||
+        thread->should_exit)
+      continue;
 
     /* TODO: support an idle-function */
 
-    /* Okay. Now, wait till somebody has work for us. */
-    if (tor_cond_wait(&pool->condition, &pool->lock, NULL) < 0) {
+    /* Okay. Now, wait till somebody has work for us, or till some other
+     * thread has more than it can keep up with. */
+    thread->sleeping = 1;
+    if (tor_cond_wait(&thread->condition, &thread->lock, NULL) < 0) {
       log_warn(LD_GENERAL, "Fail tor_cond_wait.");
     }
+    thread->sleeping = 0;
+  }
+
+  /* However we got here, hand over the replies we still hold, and tell the
+   * pool that we're gone. */
+  queue_replies(thread->reply_queue, &replies);
+  tor_mutex_acquire(&pool->lock);
+  --pool->n_running;
+  tor_cond_signal_all(&pool->exit_condition);
+  tor_mutex_release(&pool->lock);
+}
+
+/** Move every entry from <b>src</b> to the end of <b>dst</b>, in order. */
+static void
+work_tailq_append_all(struct work_tailq_s *dst, struct work_tailq_s *src)
+{
+  workqueue_entry_t *work;
+  while ((work = TOR_TAILQ_FIRST(src))) {
+    TOR_TAILQ_REMOVE(src, work, next_work);
+    TOR_TAILQ_INSERT_TAIL(dst, work, next_work);
   }
 }
 
-/** Put a reply on the reply queue.  The reply must not currently be on
- * any thread's work queue. */
+/** Move all the replies in <b>replies</b> onto the reply queue, and wake
+ * up the main thread if it might be asleep.  The replies must not currently
+ * be on any thread's work queue. */
 static void
-queue_reply(replyqueue_t *queue, workqueue_entry_t *work)
+queue_replies(replyqueue_t *queue, struct work_tailq_s *replies)
 {
   int was_empty;
+
+  if (TOR_TAILQ_EMPTY(replies))
+    return;
+
   tor_mutex_acquire(&queue->lock);
   was_empty = TOR_TAILQ_EMPTY(&queue->answers);
-  TOR_TAILQ_INSERT_TAIL(&queue->answers, work, next_work);
+  work_tailq_append_all(&queue->answers, replies);
   tor_mutex_release(&queue->lock);
 
   if (was_empty) {
@@ -244,8 +389,8 @@ queue_reply(replyqueue_t *queue, workqueue_entry_t *work)
   }
 }
 
-/** Allocate and start a new worker thread to use state object <b>state</b>,
- * and send responses to <b>replyqueue</b>. */
+/** Allocate a new worker thread to use state object <b>state</b>, and
+ * send responses to <b>replyqueue</b>.  Don't start it yet. */
 static workerthread_t *
 workerthread_new(void *state, threadpool_t *pool, replyqueue_t *replyqueue)
 {
@@ -253,14 +398,98 @@ workerthread_new(void *state, threadpool_t *pool, replyqueue_t *replyqueue)
   thr->state = state;
   thr->reply_queue = replyqueue;
   thr->in_pool = pool;
+  thr->generation = thr->pool_generation = pool->generation;
+  tor_mutex_init_nonrecursive(&thr->lock);
+  tor_cond_init(&thr->condition);
+  TOR_TAILQ_INIT(&thr->work);
 
-  if (spawn_func(worker_thread_main, thr) < 0) {
-    log_err(LD_GENERAL, "Can't launch worker thread.");
-    tor_free(thr);
-    return NULL;
+  return thr;
+}
+
+/** Pick the threads that should get the next <b>n</b> items of work queued
+ * on <b>pool</b>: return the index of the first one.  The others follow it
+ * in order. */
+static int
+threadpool_pick_threads(threadpool_t *pool, int n)
+{
+  int idx;
+  tor_mutex_acquire(&pool->lock);
+  idx = pool->next_thread;
+  pool->next_thread = (int)((idx + (unsigned)n) % pool->n_threads);
+  tor_mutex_release(&pool->lock);
+  return idx;
+}
+
+/** Put <b>ent</b> at the end of <b>thread</b>'s queue, or at the front if
+ * <b>at_head</b> is true.  Must hold <b>thread</b>'s lock. */
+static void
+workerthread_add_work(workerthread_t *thread, workqueue_entry_t *ent,
+                      int at_head)
+{
+  ent->on_thread = thread;
+  ent->generation = thread->pool_generation;
+  ent->pending = 1;
+  ++thread->n_work;
+  if (at_head)
+    TOR_TAILQ_INSERT_HEAD(&thread->work, ent, next_work);
+  else
+    TOR_TAILQ_INSERT_TAIL(&thread->work, ent, next_work);
+}
+
+/** If <b>thread</b> has a long queue, wake up some other thread in its pool
+ * that's asleep, so that it can take some of that work.  Must not hold any
+ * thread's lock. */
+static void
+threadpool_wake_idle_thread(threadpool_t *pool, workerthread_t *thread,
+                            int n_work)
+{
+  int i;
+  if (n_work <= WORKQUEUE_WAKE_IDLE_THRESHOLD)
+    return;
+
+  for (i = 1; i < pool->n_threads; ++i) {
+    workerthread_t *other =
+      pool->threads[(thread->index + i) % pool->n_threads];
+    int woke = 0;
+    tor_mutex_acquire(&other->lock);
+    if (other->sleeping && TOR_TAILQ_EMPTY(&other->work)) {
+      tor_cond_signal_one(&other->condition);
+      other->sleeping = 0;
+      woke = 1;
+    }
+    tor_mutex_release(&other->lock);
+    if (woke)
+      return;
   }
+}
 
-  return thr;
+/** Helper: implement threadpool_queue_work() and
+ * threadpool_queue_work_first(). */
+static workqueue_entry_t *
+threadpool_queue_work_impl(threadpool_t *pool,
+                           workqueue_reply_t (*fn)(void *, void *),
+                           void (*reply_fn)(void *),
+                           void *arg, int at_head)
+{
+  workqueue_entry_t *ent = workqueue_entry_new(fn, reply_fn, arg);
+  workerthread_t *thread;
+  int n_work;
+  ent->on_pool = pool;
+
+  thread = pool->threads[threadpool_pick_threads(pool, 1)];
+
+  tor_mutex_acquire(&thread->lock);
+
+  workerthread_add_work(thread, ent, at_head);
+  n_work = thread->n_work;
+
+  tor_cond_signal_one(&thread->condition);
+
+  tor_mutex_release(&thread->lock);
+
+  threadpool_wake_idle_thread(pool, thread, n_work);
+
+  return ent;
 }
 
 /**
@@ -286,19 +515,70 @@ threadpool_queue_work(threadpool_t *pool,
                       void (*reply_fn)(void *),
                       void *arg)
 {
-  workqueue_entry_t *ent = workqueue_entry_new(fn, reply_fn, arg);
-  ent->on_pool = pool;
-  ent->pending = 1;
+  return threadpool_queue_work_impl(pool, fn, reply_fn, arg, 0);
+}
 
-  tor_mutex_acquire(&pool->lock);
+/**
+ * As threadpool_queue_work(), but put the work at the front of a thread's
+ * queue, ahead of anything already waiting there.  Use this to put back
+ * work that was cancelled only so that it could be changed, so that it
+ * doesn't lose its place.
+ */
+MOCK_IMPL(workqueue_entry_t *,
+threadpool_queue_work_first,(threadpool_t *pool,
+                             workqueue_reply_t (*fn)(void *, void *),
+                             void (*reply_fn)(void *),
+                             void *arg))
+{
+  return threadpool_queue_work_impl(pool, fn, reply_fn, arg, 1);
+}
+
+/**
+ * Queue <b>n</b> items of work for the threads in a thread pool, as if by
+ * calling threadpool_queue_work() once for each element of <b>args</b>,
+ * but taking each thread's lock at most once.
+ *
+ * On success, set <b>entries_out</b>[i] to the workqueue_entry_t for
+ * <b>args</b>[i] (each can be cancelled separately with
+ * workqueue_entry_cancel()) and return 0.  On failure, return -1.
+ */
+int
+threadpool_queue_work_batch(threadpool_t *pool,
+                            workqueue_reply_t (*fn)(void *, void *),
+                            void (*reply_fn)(void *),
+                            void **args, int n,
+                            workqueue_entry_t **entries_out)
+{
+  int i, t, first, n_targets;
 
-  TOR_TAILQ_INSERT_TAIL(&pool->work, ent, next_work);
+  if (n < 0)
+    return -1;
+  if (n == 0)
+    return 0;
 
-  tor_cond_signal_one(&pool->condition);
+  for (i = 0; i < n; ++i) {
+    entries_out[i] = workqueue_entry_new(fn, reply_fn, args[i]);
+    entries_out[i]->on_pool = pool;
+  }
 
-  tor_mutex_release(&pool->lock);
+  /* Deal the items out to the threads in turn, starting with the one that
+   * would have gotten the first of them from threadpool_queue_work(). */
+  first = threadpool_pick_threads(pool, n);
+  n_targets = MIN(n, pool->n_threads);
+  for (t = 0; t < n_targets; ++t) {
+    workerthread_t *thread = pool->threads[(first + t) % pool->n_threads];
+    int n_work;
+    tor_mutex_acquire(&thread->lock);
+    for (i = t; i < n; i += pool->n_threads) {
+      workerthread_add_work(thread, entries_out[i], 0);
+    }
+    n_work = thread->n_work;
+    tor_cond_signal_one(&thread->condition);
+    tor_mutex_release(&thread->lock);
+    threadpool_wake_idle_thread(pool, thread, n_work);
+  }
 
-  return ent;
+  return 0;
 }
 
 /**
@@ -346,7 +626,15 @@ threadpool_queue_update(threadpool_t *pool,
   pool->update_fn = fn;
   ++pool->generation;
 
-  tor_cond_signal_all(&pool->condition);
+  /* Tell every thread about it, so that none of them will start on any work
+   * we queue after this until it's run the update. */
+  for (i = 0; i < n_threads; ++i) {
+    workerthread_t *thread = pool->threads[i];
+    tor_mutex_acquire(&thread->lock);
+    thread->pool_generation = pool->generation;
+    tor_cond_signal_one(&thread->condition);
+    tor_mutex_release(&thread->lock);
+  }
 
   tor_mutex_release(&pool->lock);
 
@@ -364,32 +652,78 @@ threadpool_queue_update(threadpool_t *pool,
 /** Don't have more than this many threads per pool. */
 #define MAX_THREADS 1024
 
-/** Launch threads until we have <b>n</b>. */
+/** Tell the first <b>n_started</b> threads of <b>pool</b>, which have no
+ * work queued, to exit, and wait until they have.  Then free all of the
+ * pool's threads, and their states.  We use this when we couldn't start
+ * every thread the pool was supposed to have. */
+static void
+threadpool_stop_threads(threadpool_t *pool, int n_started)
+{
+  int i;
+
+  for (i = 0; i < n_started; ++i) {
+    workerthread_t *thread = pool->threads[i];
+    tor_mutex_acquire(&thread->lock);
+    thread->should_exit = 1;
+    tor_cond_signal_one(&thread->condition);
+    tor_mutex_release(&thread->lock);
+  }
+
+  tor_mutex_acquire(&pool->lock);
+  while (pool->n_running > 0) {
+    if (tor_cond_wait(&pool->exit_condition, &pool->lock, NULL) < 0) {
+      log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+    }
+  }
+  tor_mutex_release(&pool->lock);
+
+  for (i = 0; i < pool->n_threads; ++i) {
+    workerthread_t *thread = pool->threads[i];
+    tor_assert(TOR_TAILQ_EMPTY(&thread->work));
+    if (pool->free_thread_state_fn)
+      pool->free_thread_state_fn(thread->state);
+    tor_cond_uninit(&thread->condition);
+    tor_mutex_uninit(&thread->lock);
+    tor_free(thread);
+  }
+  tor_free(pool->threads);
+  pool->n_threads = 0;
+}
+
+/** Launch <b>n</b> threads for <b>pool</b>, which must not have any
+ * threads yet.  Since the threads look at each other's queues, we set all
+ * of them up before we start any of them. */
 static int
 threadpool_start_threads(threadpool_t *pool, int n)
 {
-  if (n < 0)
+  int i;
+
+  if (n < 1)
     return -1;
   if (n > MAX_THREADS)
     n = MAX_THREADS;
 
   tor_mutex_acquire(&pool->lock);
 
-  if (pool->n_threads < n)
-    pool->threads = tor_reallocarray(pool->threads,
-                                     sizeof(workerthread_t*), n);
+  tor_assert(pool->n_threads == 0);
+  pool->threads = tor_calloc(n, sizeof(workerthread_t*));
 
-  while (pool->n_threads < n) {
+  for (i = 0; i < n; ++i) {
     void *state = pool->new_thread_state_fn(pool->new_thread_state_arg);
     workerthread_t *thr = workerthread_new(state, pool, pool->reply_queue);
+    thr->index = i;
+    pool->threads[i] = thr;
+  }
+  pool->n_threads = n;
 
-    if (!thr) {
-      pool->free_thread_state_fn(state);
+  for (i = 0; i < n; ++i) {
+    if (spawn_func(worker_thread_main, pool->threads[i]) < 0) {
+      log_err(LD_GENERAL, "Can't launch worker thread.");
       tor_mutex_release(&pool->lock);
+      threadpool_stop_threads(pool, i);
       return -1;
     }
-    thr->index = pool->n_threads;
-    pool->threads[pool->n_threads++] = thr;
+    ++pool->n_running;
   }
   tor_mutex_release(&pool->lock);
 
@@ -413,8 +747,7 @@ threadpool_new(int n_threads,
   threadpool_t *pool;
   pool = tor_malloc_zero(sizeof(threadpool_t));
   tor_mutex_init_nonrecursive(&pool->lock);
-  tor_cond_init(&pool->condition);
-  TOR_TAILQ_INIT(&pool->work);
+  tor_cond_init(&pool->exit_condition);
 
   pool->new_thread_state_fn = new_thread_state_fn;
   pool->new_thread_state_arg = arg;
@@ -422,7 +755,8 @@ threadpool_new(int n_threads,
   pool->reply_queue = replyqueue;
 
   if (threadpool_start_threads(pool, n_threads) < 0) {
-    tor_cond_uninit(&pool->condition);
+    /* threadpool_start_threads() has stopped whatever threads it started. */
+    tor_cond_uninit(&pool->exit_condition);
     tor_mutex_uninit(&pool->lock);
     tor_free(pool);
     return NULL;
@@ -478,6 +812,8 @@ replyqueue_get_socket(replyqueue_t *rq)
 void
 replyqueue_process(replyqueue_t *queue)
 {
+  struct work_tailq_s batch;
+
   if (queue->alert.drain_fn(queue->alert.read_fd) < 0) {
     static ratelim_t warn_limit = RATELIM_INIT(7200);
     log_fn_ratelim(&warn_limit, LOG_WARN, LD_GENERAL,
@@ -485,20 +821,22 @@ replyqueue_process(replyqueue_t *queue)
                  tor_socket_strerror(tor_socket_errno(queue->alert.read_fd)));
   }
 
+  /* Take everything that's there now in one go, so that the worker
+   * threads don't contend with us for the lock once per reply.  Anything
+   * that arrives after this will alert us again. */
+  TOR_TAILQ_INIT(&batch);
+
   tor_mutex_acquire(&queue->lock);
-  while (!TOR_TAILQ_EMPTY(&queue->answers)) {
-    /* lock must be held at this point.*/
-    workqueue_entry_t *work = TOR_TAILQ_FIRST(&queue->answers);
-    TOR_TAILQ_REMOVE(&queue->answers, work, next_work);
-    tor_mutex_release(&queue->lock);
+  work_tailq_append_all(&batch, &queue->answers);
+  tor_mutex_release(&queue->lock);
+
+  while (!TOR_TAILQ_EMPTY(&batch)) {
+    workqueue_entry_t *work = TOR_TAILQ_FIRST(&batch);
+    TOR_TAILQ_REMOVE(&batch, work, next_work);
     work->on_pool = NULL;
 
     work->reply_fn(work->arg);
     workqueue_entry_free(work);
-
-    tor_mutex_acquire(&queue->lock);
   }
-
-  tor_mutex_release(&queue->lock);
 }
 
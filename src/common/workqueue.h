@@ -27,6 +27,16 @@ workqueue_entry_t *threadpool_queue_work(threadpool_t *pool,
                                                                  void *),
                                          void (*reply_fn)(void *),
                                          void *arg);
+MOCK_DECL(workqueue_entry_t *, threadpool_queue_work_first,
+          (threadpool_t *pool,
+           workqueue_reply_t (*fn)(void *, void *),
+           void (*reply_fn)(void *),
+           void *arg));
+int threadpool_queue_work_batch(threadpool_t *pool,
+                                workqueue_reply_t (*fn)(void *, void *),
+                                void (*reply_fn)(void *),
+                                void **args, int n,
+                                workqueue_entry_t **entries_out);
 
 int threadpool_queue_update(threadpool_t *pool,
                             void *(*dup_fn)(void *),
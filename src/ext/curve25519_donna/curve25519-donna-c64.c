@@ -449,3 +449,86 @@ curve25519_donna(u8 *mypublic, const u8 *secret, const u8 *basepoint) {
   fcontract(mypublic, z);
   return 0;
 }
+
+/* Largest batch that curve25519_donna_batch() will take. */
+#define CURVE25519_DONNA_BATCH_MAX 16
+
+/* From Tor's crypto.c: like memset(), but not optimized away. */
+void memwipe(void *mem, uint8_t byte, size_t sz);
+
+/* Calculate curve25519 for each of the n (secret, basepoint) pairs, storing
+ * the results in mypublic.  The results are the same as from n calls to
+ * curve25519_donna(), but we share one field inversion among all of them
+ * with Montgomery's trick: that saves around a tenth of the work for each
+ * point after the first.
+ *
+ * A basepoint of low order gives a z coordinate of 0, which would make the
+ * shared inversion 0 as well.  So we replace any such z with 1 for the
+ * inversion, and zero that output afterwards, without branching.
+ *
+ * Requires 1 <= n <= CURVE25519_DONNA_BATCH_MAX. */
+int curve25519_donna_batch(int n, u8 *const *mypublic,
+                           const u8 *const *secret,
+                           const u8 *const *basepoint);
+
+int
+curve25519_donna_batch(int n, u8 *const *mypublic,
+                       const u8 *const *secret,
+                       const u8 *const *basepoint) {
+  felem bp, one = {1}, t, inv;
+  felem x[CURVE25519_DONNA_BATCH_MAX], z[CURVE25519_DONNA_BATCH_MAX];
+  felem acc[CURVE25519_DONNA_BATCH_MAX];
+  u8 is_zero[CURVE25519_DONNA_BATCH_MAX];
+  u8 e[32], zbytes[32];
+  int i, k;
+
+  if (n < 1 || n > CURVE25519_DONNA_BATCH_MAX)
+    return -1;
+
+  for (k = 0; k < n; ++k) {
+    u8 nonzero = 0;
+    for (i = 0; i < 32; ++i) e[i] = secret[k][i];
+    e[0] &= 248;
+    e[31] &= 127;
+    e[31] |= 64;
+
+    fexpand(bp, basepoint[k]);
+    cmult(x[k], z[k], e, bp);
+
+    fmul(t, z[k], one);
+    fcontract(zbytes, t);
+    for (i = 0; i < 32; ++i) nonzero |= zbytes[i];
+    is_zero[k] = (u8)((((uint32_t)nonzero) - 1) >> 31);
+    z[k][0] += is_zero[k];
+
+    if (k == 0)
+      memcpy(acc[0], z[0], sizeof(acc[0]));
+    else
+      fmul(acc[k], acc[k-1], z[k]);
+  }
+
+  crecip(inv, acc[n-1]);
+
+  for (k = n-1; k >= 0; --k) {
+    const u8 mask = (u8)(is_zero[k] - 1);
+    if (k > 0) {
+      fmul(t, inv, acc[k-1]);
+      fmul(inv, inv, z[k]);
+    } else {
+      memcpy(t, inv, sizeof(t));
+    }
+    fmul(t, x[k], t);
+    fcontract(mypublic[k], t);
+    for (i = 0; i < 32; ++i) mypublic[k][i] &= mask;
+  }
+
+  memwipe(e, 0, sizeof(e));
+  memwipe(x, 0, sizeof(x));
+  memwipe(z, 0, sizeof(z));
+  memwipe(acc, 0, sizeof(acc));
+  memwipe(t, 0, sizeof(t));
+  memwipe(inv, 0, sizeof(inv));
+  memwipe(zbytes, 0, sizeof(zbytes));
+  memwipe(is_zero, 0, sizeof(is_zero));
+  return 0;
+}
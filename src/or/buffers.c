@@ -69,6 +69,10 @@ static int parse_socks_client(const uint8_t *data, size_t datalen,
 
 #define CHUNK_HEADER_LEN STRUCT_OFFSET(chunk_t, mem[0])
 
+/** Return true iff <b>chunk</b> refers to memory owned by somebody else,
+ * rather than holding its data in <b>chunk</b>-\>mem. */
+#define CHUNK_IS_REF(chunk) ((chunk)->ref_free_fn != NULL)
+
 /** Return the number of bytes needed to allocate a chunk to hold
  * <b>memlen</b> bytes. */
 #define CHUNK_ALLOC_SIZE(memlen) (CHUNK_HEADER_LEN + (memlen))
@@ -89,6 +93,8 @@ CHUNK_WRITE_PTR(chunk_t *chunk)
 static INLINE size_t
 CHUNK_REMAINING_CAPACITY(const chunk_t *chunk)
 {
+  if (CHUNK_IS_REF(chunk))
+    return 0;
   return (chunk->mem + chunk->memlen) - (chunk->data + chunk->datalen);
 }
 
@@ -116,6 +122,8 @@ chunk_free_unchecked(chunk_t *chunk)
   tor_assert(total_bytes_allocated_in_chunks >=
              CHUNK_ALLOC_SIZE(chunk->memlen));
   total_bytes_allocated_in_chunks -= CHUNK_ALLOC_SIZE(chunk->memlen);
+  if (CHUNK_IS_REF(chunk))
+    chunk->ref_free_fn(chunk->ref_arg);
   tor_free(chunk);
 }
 static INLINE chunk_t *
@@ -131,6 +139,8 @@ chunk_new_with_alloc_size(size_t alloc)
   ch->memlen = CHUNK_SIZE_WITH_ALLOC(alloc);
   total_bytes_allocated_in_chunks += alloc;
   ch->data = &ch->mem[0];
+  ch->ref_free_fn = NULL;
+  ch->ref_arg = NULL;
   return ch;
 }
 
@@ -195,6 +205,21 @@ buf_pullup(buf_t *buf, size_t bytes)
   if (buf->head->datalen >= bytes)
     return;
 
+  if (CHUNK_IS_REF(buf->head)) {
+    /* We can't write into memory we don't own; copy the head's data into a
+     * chunk of our own that's big enough to hold everything. */
+    chunk_t *newhead =
+      chunk_new_with_alloc_size(preferred_chunk_size(capacity));
+    memcpy(newhead->mem, buf->head->data, buf->head->datalen);
+    newhead->datalen = buf->head->datalen;
+    newhead->inserted_time = buf->head->inserted_time;
+    newhead->next = buf->head->next;
+    if (buf->tail == buf->head)
+      buf->tail = newhead;
+    chunk_free_unchecked(buf->head);
+    buf->head = newhead;
+  }
+
   if (buf->head->memlen >= capacity) {
     /* We don't need to grow the first chunk, but we might need to repack it.*/
     size_t needed = capacity - buf->head->datalen;
@@ -364,7 +389,16 @@ buf_free(buf_t *buf)
 static chunk_t *
 chunk_copy(const chunk_t *in_chunk)
 {
-  chunk_t *newch = tor_memdup(in_chunk, CHUNK_ALLOC_SIZE(in_chunk->memlen));
+  chunk_t *newch;
+  if (CHUNK_IS_REF(in_chunk)) {
+    /* The copy gets its own storage; we can't share the reference. */
+    newch = chunk_new_with_alloc_size(preferred_chunk_size(in_chunk->datalen));
+    memcpy(newch->mem, in_chunk->data, in_chunk->datalen);
+    newch->datalen = in_chunk->datalen;
+    newch->inserted_time = in_chunk->inserted_time;
+    return newch;
+  }
+  newch = tor_memdup(in_chunk, CHUNK_ALLOC_SIZE(in_chunk->memlen));
   total_bytes_allocated_in_chunks += CHUNK_ALLOC_SIZE(in_chunk->memlen);
 #ifdef DEBUG_CHUNK_ALLOC
   newch->DBG_alloc = CHUNK_ALLOC_SIZE(in_chunk->memlen);
@@ -794,6 +828,95 @@ write_to_buf(const char *string, size_t string_len, buf_t *buf)
   return (int)buf->datalen;
 }
 
+/** Append the <b>string_len</b> bytes at <b>string</b> to the end of
+ * <b>buf</b> without copying them.  The caller must keep those bytes alive
+ * and unchanged until we call <b>free_fn</b>(<b>free_arg</b>), which we do
+ * exactly once: when the last of them has been removed from <b>buf</b>, when
+ * <b>buf</b> is cleared, or right away if we can't add them.
+ *
+ * Return the new length of the buffer on success, -1 on failure.
+ */
+int
+write_ref_to_buf(const char *string, size_t string_len,
+                 void (*free_fn)(void *), void *free_arg, buf_t *buf)
+{
+  chunk_t *chunk;
+  struct timeval now;
+  tor_assert(free_fn);
+
+  if (!string_len || buf->datalen + string_len >= INT_MAX) {
+    free_fn(free_arg);
+    return string_len ? -1 : (int)buf->datalen;
+  }
+  check();
+
+  chunk = chunk_new_with_alloc_size(CHUNK_ALLOC_SIZE(0));
+  chunk->data = (char *)string;
+  chunk->datalen = string_len;
+  chunk->ref_free_fn = free_fn;
+  chunk->ref_arg = free_arg;
+  tor_gettimeofday_cached_monotonic(&now);
+  chunk->inserted_time = (uint32_t)tv_to_msec(&now);
+
+  if (buf->tail) {
+    tor_assert(buf->head);
+    buf->tail->next = chunk;
+    buf->tail = chunk;
+  } else {
+    tor_assert(!buf->head);
+    buf->head = buf->tail = chunk;
+  }
+  buf->datalen += string_len;
+
+  check();
+  return (int)buf->datalen;
+}
+
+/** Pack the fixed-length <b>cell</b> into wire format (with circuit IDs
+ * of the width given by <b>wide_circ_ids</b>) and append it to <b>buf</b>.
+ * When there's room in the last chunk, we pack the cell straight into it,
+ * rather than packing it somewhere else first and copying it in.  When
+ * there's some room but not enough, we fill it and put the rest of the cell
+ * in a new chunk, as write_to_buf() would.
+ *
+ * Return the new length of the buffer on success, -1 on failure.
+ */
+int
+write_cell_to_buf(const cell_t *cell, buf_t *buf, int wide_circ_ids)
+{
+  const size_t cell_network_size = get_cell_network_size(wide_circ_ids);
+  const size_t header_len = cell_network_size - CELL_PAYLOAD_SIZE;
+  char header[5];
+  char *dest;
+
+  check();
+  if (wide_circ_ids) {
+    set_uint32(header, htonl(cell->circ_id));
+  } else {
+    set_uint16(header, htons(cell->circ_id));
+  }
+  set_uint8(header+header_len-1, cell->command);
+
+  if (buf->tail && CHUNK_REMAINING_CAPACITY(buf->tail) &&
+      CHUNK_REMAINING_CAPACITY(buf->tail) < cell_network_size) {
+    write_to_buf(header, header_len, buf);
+    return write_to_buf((const char *)cell->payload, CELL_PAYLOAD_SIZE, buf);
+  }
+  if (!buf->tail || !CHUNK_REMAINING_CAPACITY(buf->tail))
+    buf_add_chunk_with_capacity(buf, cell_network_size, 1);
+
+  dest = CHUNK_WRITE_PTR(buf->tail);
+  memcpy(dest, header, header_len);
+  memcpy(dest+header_len, cell->payload, CELL_PAYLOAD_SIZE);
+
+  buf->datalen += cell_network_size;
+  buf->tail->datalen += cell_network_size;
+
+  check();
+  tor_assert(buf->datalen < INT_MAX);
+  return (int)buf->datalen;
+}
+
 /** Helper: copy the first <b>string_len</b> bytes from <b>buf</b>
  * onto <b>string</b>.
  */
@@ -913,6 +1036,36 @@ fetch_var_cell_from_buf(buf_t *buf, var_cell_t **out, int linkproto)
   return 1;
 }
 
+/** If <b>buf</b> starts with a whole fixed-length cell (with circuit IDs of
+ * the width given by <b>wide_circ_ids</b>), pull it off the buffer, unpack
+ * it into *<b>out</b>, and return 1.  Otherwise return 0.
+ *
+ * We unpack the payload straight out of the buffer's chunks, rather than
+ * fetching the whole cell into a temporary and unpacking it from there. */
+int
+fetch_cell_from_buf(buf_t *buf, cell_t *out, int wide_circ_ids)
+{
+  char hdr[5];
+  const int circ_id_len = get_circ_id_size(wide_circ_ids);
+  check();
+  if (buf->datalen < (size_t)get_cell_network_size(wide_circ_ids))
+    return 0;
+
+  peek_from_buf(hdr, circ_id_len + 1, buf);
+  if (wide_circ_ids)
+    out->circ_id = ntohl(get_uint32(hdr));
+  else
+    out->circ_id = ntohs(get_uint16(hdr));
+  out->command = get_uint8(hdr + circ_id_len);
+  buf_remove_from_front(buf, circ_id_len + 1);
+
+  peek_from_buf((char*) out->payload, CELL_PAYLOAD_SIZE, buf);
+  buf_remove_from_front(buf, CELL_PAYLOAD_SIZE);
+  check();
+
+  return 1;
+}
+
 #ifdef USE_BUFFEREVENTS
 /** Try to read <b>n</b> bytes from <b>buf</b> at <b>pos</b> (which may be
  * NULL for the start of the buffer), copying the data only if necessary.  Set
@@ -2418,6 +2571,13 @@ assert_buf_ok(buf_t *buf)
     tor_assert(buf->tail);
     for (ch = buf->head; ch; ch = ch->next) {
       total += ch->datalen;
+      if (CHUNK_IS_REF(ch)) {
+        tor_assert(ch->memlen == 0);
+        tor_assert(ch->datalen > 0);
+        if (!ch->next)
+          tor_assert(ch == buf->tail);
+        continue;
+      }
       tor_assert(ch->datalen <= ch->memlen);
       tor_assert(ch->data >= &ch->mem[0]);
       tor_assert(ch->data <= &ch->mem[0]+ch->memlen);
@@ -36,11 +36,15 @@ int flush_buf(tor_socket_t s, buf_t *buf, size_t sz, size_t *buf_flushlen);
 int flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t sz, size_t *buf_flushlen);
 
 int write_to_buf(const char *string, size_t string_len, buf_t *buf);
+int write_cell_to_buf(const cell_t *cell, buf_t *buf, int wide_circ_ids);
+int write_ref_to_buf(const char *string, size_t string_len,
+                     void (*free_fn)(void *), void *free_arg, buf_t *buf);
 int write_to_buf_zlib(buf_t *buf, tor_zlib_state_t *state,
                       const char *data, size_t data_len, int done);
 int move_buf_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen);
 int fetch_from_buf(char *string, size_t string_len, buf_t *buf);
 int fetch_var_cell_from_buf(buf_t *buf, var_cell_t **out, int linkproto);
+int fetch_cell_from_buf(buf_t *buf, cell_t *out, int wide_circ_ids);
 int fetch_from_buf_http(buf_t *buf,
                         char **headers_out, size_t max_headerlen,
                         char **body_out, size_t *body_used, size_t max_bodylen,
@@ -116,6 +120,11 @@ typedef struct chunk_t {
   char *data; /**< A pointer to the first byte of data stored in <b>mem</b>. */
   uint32_t inserted_time; /**< Timestamp in truncated ms since epoch
                            * when this chunk was inserted. */
+  /** If set, this chunk has no storage of its own: <b>data</b> points into
+   * memory that belongs to somebody else, and we call
+   * <b>ref_free_fn</b>(<b>ref_arg</b>) once we're done with it. */
+  void (*ref_free_fn)(void *);
+  void *ref_arg; /**< Argument to pass to <b>ref_free_fn</b>. */
   char mem[FLEXIBLE_ARRAY_MEMBER]; /**< The actual memory used for storage in
                 * this chunk. */
 } chunk_t;
@@ -27,6 +27,7 @@
 #include "circuitmux.h"
 #include "entrynodes.h"
 #include "geoip.h"
+#include "histogram.h"
 #include "nodelist.h"
 #include "relay.h"
 #include "rephist.h"
@@ -848,6 +849,9 @@ channel_free(channel_t *chan)
 
   /* We're in CLOSED or ERROR, so the cell queue is already empty */
 
+  histogram_free(chan->cell_queue_latency);
+  histogram_free(chan->outbuf_latency);
+
   tor_free(chan);
 }
 
@@ -934,6 +938,9 @@ channel_force_free(channel_t *chan)
   }
   TOR_SIMPLEQ_INIT(&chan->outgoing_queue);
 
+  histogram_free(chan->cell_queue_latency);
+  histogram_free(chan->outbuf_latency);
+
   tor_free(chan);
 }
 
@@ -2901,6 +2908,85 @@ channel_send_destroy(circid_t circ_id, channel_t *chan, int reason)
   return 0;
 }
 
+/** Helper: append to <b>parts</b> the QueueLatency and OutbufLatency
+ * summaries of <b>queue_hist</b> and <b>outbuf_hist</b>, either of which may
+ * be NULL, and the number <b>n_outbuf_untimed</b> of cells left out of
+ * <b>outbuf_hist</b>. */
+static void
+channel_append_cell_latency(smartlist_t *parts,
+                            const histogram_t *queue_hist,
+                            const histogram_t *outbuf_hist,
+                            uint64_t n_outbuf_untimed)
+{
+  static const histogram_t empty;
+  char *queue_str = histogram_format(queue_hist ? queue_hist : &empty);
+  char *outbuf_str = histogram_format(outbuf_hist ? outbuf_hist : &empty);
+  smartlist_add_asprintf(parts, "QueueLatency=%s OutbufLatency=%s "
+                         "OutbufUntimed="U64_FORMAT,
+                         queue_str, outbuf_str,
+                         U64_PRINTF_ARG(n_outbuf_untimed));
+  tor_free(queue_str);
+  tor_free(outbuf_str);
+}
+
+/** Implementation for GETINFO control command: knows the answer for
+ * questions about "cell-latency/..." */
+int
+getinfo_helper_cell_latency(control_connection_t *conn,
+                            const char *question, char **answer,
+                            const char **errmsg)
+{
+  smartlist_t *lines;
+  (void) conn;
+
+  if (!get_options()->CellLatencyStatistics) {
+    *errmsg = "CellLatencyStatistics is not enabled";
+    return -1;
+  }
+
+  lines = smartlist_new();
+  if (!strcmp(question, "cell-latency/summary")) {
+    histogram_t *queue_total = histogram_new();
+    histogram_t *outbuf_total = histogram_new();
+    uint64_t untimed_total = 0;
+    if (all_channels) {
+      SMARTLIST_FOREACH_BEGIN(all_channels, const channel_t *, chan) {
+        if (chan->cell_queue_latency)
+          histogram_add_histogram(queue_total, chan->cell_queue_latency);
+        if (chan->outbuf_latency)
+          histogram_add_histogram(outbuf_total, chan->outbuf_latency);
+        untimed_total += chan->n_outbuf_untimed;
+      } SMARTLIST_FOREACH_END(chan);
+    }
+    channel_append_cell_latency(lines, queue_total, outbuf_total,
+                                untimed_total);
+    histogram_free(queue_total);
+    histogram_free(outbuf_total);
+  } else if (!strcmp(question, "cell-latency/channels")) {
+    if (all_channels) {
+      SMARTLIST_FOREACH_BEGIN(all_channels, const channel_t *, chan) {
+        smartlist_t *parts;
+        if (!chan->cell_queue_latency && !chan->outbuf_latency)
+          continue;
+        parts = smartlist_new();
+        smartlist_add_asprintf(parts, "ChannelID="U64_FORMAT,
+                               U64_PRINTF_ARG(chan->global_identifier));
+        channel_append_cell_latency(parts, chan->cell_queue_latency,
+                                    chan->outbuf_latency,
+                                    chan->n_outbuf_untimed);
+        smartlist_add(lines, smartlist_join_strings(parts, " ", 0, NULL));
+        SMARTLIST_FOREACH(parts, char *, cp, tor_free(cp));
+        smartlist_free(parts);
+      } SMARTLIST_FOREACH_END(chan);
+    }
+  }
+
+  *answer = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return 0;
+}
+
 /**
  * Dump channel statistics to the log
  *
@@ -4064,6 +4150,34 @@ channel_num_cells_writeable(channel_t *chan)
   return result;
 }
 
+/**
+ * Return the number of bytes the lower layer has accepted from this
+ * channel but not yet handed to the network.
+ */
+
+size_t
+channel_num_bytes_queued(channel_t *chan)
+{
+  tor_assert(chan);
+  tor_assert(chan->num_bytes_queued);
+
+  return chan->num_bytes_queued(chan);
+}
+
+/**
+ * Return the socket the lower layer writes this channel to, or
+ * TOR_INVALID_SOCKET if it has none or doesn't say.
+ */
+
+tor_socket_t
+channel_get_socket(channel_t *chan)
+{
+  tor_assert(chan);
+
+  if (chan->get_socket) return chan->get_socket(chan);
+  else return TOR_INVALID_SOCKET;
+}
+
 /*********************
  * Timestamp updates *
  ********************/
@@ -83,6 +83,11 @@ struct channel_s {
   /** Heap index for use by the scheduler */
   int sched_heap_idx;
 
+  /** Bucket index and bucket list linkage for use by the scheduler, when
+   * it is using SCHEDULER_QUEUE_BUCKETS */
+  int sched_bucket;
+  TOR_TAILQ_ENTRY(channel_s) sched_bucket_link;
+
   /** Timestamps for both cell channels and listeners */
   time_t timestamp_created; /* Channel created */
   time_t timestamp_active; /* Any activity */
@@ -128,6 +133,12 @@ struct channel_s {
    * the original address.
    */
   const char * (*get_remote_descr)(channel_t *, int);
+  /**
+   * Optional: return the socket the lower layer writes to, or
+   * TOR_INVALID_SOCKET if there isn't one.  Used by the scheduler to ask
+   * the kernel how much it can send.
+   */
+  tor_socket_t (*get_socket)(channel_t *);
   /** Check if the lower layer has queued writes */
   int (*has_queued_writes)(channel_t *);
   /**
@@ -243,6 +254,15 @@ struct channel_s {
    * lower-layer queueing.
    */
   uint64_t bytes_in_queue;
+
+  /** If CellLatencyStatistics is set, how long (in microseconds) the cells
+   * we've sent spent in their circuits' cell queues, and in our lower
+   * layer's output buffer.  NULL until we've timed a cell. */
+  struct histogram_t *cell_queue_latency;
+  struct histogram_t *outbuf_latency;
+  /** Number of cells we've sent without timing them in outbuf_latency,
+   * because too many cells were already being timed on our outbuf. */
+  uint64_t n_outbuf_untimed;
 };
 
 struct channel_listener_s {
@@ -347,6 +367,9 @@ void channel_free_all(void);
 
 /* Dump some statistics in the log */
 void channel_dumpstats(int severity);
+int getinfo_helper_cell_latency(control_connection_t *conn,
+                                const char *question, char **answer,
+                                const char **errmsg);
 void channel_listener_dumpstats(int severity);
 
 /* Set the cmux policy on all active channels */
@@ -577,6 +600,8 @@ void channel_listener_dump_transport_statistics(channel_listener_t *chan_l,
 /* Flow control queries */
 uint64_t channel_get_global_queue_estimate(void);
 int channel_num_cells_writeable(channel_t *chan);
+size_t channel_num_bytes_queued(channel_t *chan);
+tor_socket_t channel_get_socket(channel_t *chan);
 
 /* Timestamp queries */
 time_t channel_when_created(channel_t *chan);
@@ -63,6 +63,7 @@ static int
 channel_tls_get_transport_name_method(channel_t *chan, char **transport_out);
 static const char *
 channel_tls_get_remote_descr_method(channel_t *chan, int flags);
+static tor_socket_t channel_tls_get_socket_method(channel_t *chan);
 static int channel_tls_has_queued_writes_method(channel_t *chan);
 static int channel_tls_is_canonical_method(channel_t *chan, int req);
 static int
@@ -118,6 +119,7 @@ channel_tls_common_init(channel_tls_t *tlschan)
   chan->get_overhead_estimate = channel_tls_get_overhead_estimate_method;
   chan->get_remote_addr = channel_tls_get_remote_addr_method;
   chan->get_remote_descr = channel_tls_get_remote_descr_method;
+  chan->get_socket = channel_tls_get_socket_method;
   chan->get_transport_name = channel_tls_get_transport_name_method;
   chan->has_queued_writes = channel_tls_has_queued_writes_method;
   chan->is_canonical = channel_tls_is_canonical_method;
@@ -708,6 +710,23 @@ channel_tls_matches_target_method(channel_t *chan,
   return tor_addr_eq(&(tlschan->conn->real_addr), target);
 }
 
+/**
+ * Tell the upper layer which socket our TLS connection writes to, so the
+ * scheduler can ask the kernel about it.
+ */
+
+static tor_socket_t
+channel_tls_get_socket_method(channel_t *chan)
+{
+  channel_tls_t *tlschan = BASE_CHAN_TO_TLS(chan);
+
+  tor_assert(tlschan);
+
+  if (!(tlschan->conn)) return TOR_INVALID_SOCKET;
+
+  return TO_CONN(tlschan->conn)->s;
+}
+
 /**
  * Tell the upper layer how many bytes we have queued and not yet
  * sent.
@@ -803,8 +822,10 @@ channel_tls_write_packed_cell_method(channel_t *chan,
   tor_assert(packed_cell);
 
   if (tlschan->conn) {
-    connection_write_to_buf(packed_cell->body, cell_network_size,
-                            TO_CONN(tlschan->conn));
+    if (packed_cell->inserted_usec && get_options()->CellLatencyStatistics)
+      connection_or_note_cell_to_outbuf(tlschan->conn, cell_network_size);
+    connection_write_packed_cell_to_buf(packed_cell, TO_CONN(tlschan->conn),
+                                        chan->wide_circ_ids);
 
     /* This is where the cell is finished; used to be done from relay.c */
     packed_cell_free(packed_cell);
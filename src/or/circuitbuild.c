@@ -448,6 +448,7 @@ origin_circuit_init(uint8_t purpose, int flags)
   circ->build_state->is_internal =
     ((flags & CIRCLAUNCH_IS_INTERNAL) ? 1 : 0);
   circ->base_.purpose = purpose;
+  origin_circuit_update_purpose_index(circ);
   return circ;
 }
 
@@ -818,6 +819,8 @@ circuit_pick_extend_handshake(uint8_t *cell_type_out,
 {
   uint8_t t;
   circuit_pick_create_handshake(&t, handshake_type_out, ei);
+  if (node_prev && node_prev->rs)
+    routerstatus_decode_lazy_fields(node_prev->rs);
   /* XXXX024 The check for whether the node has a curve25519 key is a bad
    * proxy for whether it can do extend2 cells; once a version that
    * handles extend2 cells is out, remove it. */
@@ -1490,29 +1493,27 @@ circuit_all_predicted_ports_handled(time_t now, int *need_uptime,
   return enough;
 }
 
-/** Return 1 if <b>node</b> can handle one or more of the ports in
- * <b>needed_ports</b>, else return 0.
+/** Return a newly allocated bitarray, indexed like nodelist_get_list(), of
+ * the nodes that can handle one or more of the ports in
+ * <b>needed_ports</b>.
  */
-static int
-node_handles_some_port(const node_t *node, smartlist_t *needed_ports)
-{ /* XXXX MOVE */
+static bitarray_t *
+nodes_handling_some_port(const smartlist_t *needed_ports)
+{
+  const node_snapshot_t *snap = nodelist_get_snapshot();
+  const int n_words = (snap->n_nodes + BITARRAY_MASK) >> BITARRAY_SHIFT;
+  bitarray_t *result = bitarray_init_zero(snap->n_nodes);
   int i;
-  uint16_t port;
-
-  for (i = 0; i < smartlist_len(needed_ports); ++i) {
-    addr_policy_result_t r;
-    /* alignment issues aren't a worry for this dereference, since
-       needed_ports is explicitly a smartlist of uint16_t's */
-    port = *(uint16_t *)smartlist_get(needed_ports, i);
-    tor_assert(port);
-    if (node)
-      r = compare_tor_addr_to_node_policy(NULL, port, node);
-    else
-      continue;
-    if (r != ADDR_POLICY_REJECTED && r != ADDR_POLICY_PROBABLY_REJECTED)
-      return 1;
-  }
-  return 0;
+
+  tor_assert(snap->n_nodes == smartlist_len(nodelist_get_list()));
+  SMARTLIST_FOREACH_BEGIN(needed_ports, const uint16_t *, port) {
+    const bitarray_t *exits;
+    tor_assert(*port);
+    exits = nodelist_get_exits_for_port(*port);
+    for (i = 0; i < n_words; ++i)
+      result[i] |= exits[i];
+  } SMARTLIST_FOREACH_END(port);
+  return result;
 }
 
 /** Return true iff <b>conn</b> needs another general circuit to be
@@ -1691,6 +1692,7 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
 
     int attempt;
     smartlist_t *needed_ports, *supporting;
+    bitarray_t *handles_needed_port;
 
     if (best_support == -1) {
       if (need_uptime || need_capacity) {
@@ -1708,12 +1710,14 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
     }
     supporting = smartlist_new();
     needed_ports = circuit_get_unhandled_ports(time(NULL));
+    handles_needed_port = nodes_handling_some_port(needed_ports);
     for (attempt = 0; attempt < 2; attempt++) {
       /* try once to pick only from routers that satisfy a needed port,
        * then if there are none, pick from any that support exiting. */
       SMARTLIST_FOREACH_BEGIN(the_nodes, const node_t *, node) {
         if (n_supported[node_sl_idx] != -1 &&
-            (attempt || node_handles_some_port(node, needed_ports))) {
+            (attempt ||
+             bitarray_is_set(handles_needed_port, node_sl_idx))) {
 //          log_fn(LOG_DEBUG,"Try %d: '%s' is a possibility.",
 //                 try, router->nickname);
           smartlist_add(supporting, (void*)node);
@@ -1731,6 +1735,7 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
     }
     SMARTLIST_FOREACH(needed_ports, uint16_t *, cp, tor_free(cp));
     smartlist_free(needed_ports);
+    bitarray_free(handles_needed_port);
     smartlist_free(supporting);
   }
 
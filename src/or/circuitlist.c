@@ -21,6 +21,8 @@
 #include "connection_edge.h"
 #include "connection_or.h"
 #include "control.h"
+#include "cpuworker.h"
+#include "histogram.h"
 #include "main.h"
 #include "networkstatus.h"
 #include "nodelist.h"
@@ -48,6 +50,22 @@ static smartlist_t *circuits_pending_chans = NULL;
  * circuit_mark_for_close and which are waiting for circuit_about_to_free. */
 static smartlist_t *circuits_pending_close = NULL;
 
+/** A list of all the circuits that originate here, in the order they were
+ * created.  Periodic tasks that only care about our own circuits walk this
+ * instead of global_circuitlist, so that a relay carrying many circuits for
+ * others doesn't pay for them. */
+static smartlist_t *global_origin_circuit_list = NULL;
+
+/** The number of distinct circuit states. */
+#define N_CIRCUIT_STATES (CIRCUIT_STATE_OPEN+1)
+
+/** For each origin circuit purpose and circuit state, a list of the origin
+ * circuits with that purpose and state that have not been marked for close.
+ * These let us find candidate circuits for a stream, or circuits of a given
+ * kind, without walking every circuit we know about. */
+static smartlist_t *
+origin_circuits_by_purpose[CIRCUIT_PURPOSE_MAX_+1][N_CIRCUIT_STATES];
+
 static void circuit_free_cpath_node(crypt_path_t *victim);
 static void cpath_ref_decref(crypt_path_reference_t *cpath_ref);
 //static void circuit_set_rend_token(or_circuit_t *circ, int is_rend_circ,
@@ -397,6 +415,112 @@ circuit_set_state(circuit_t *circ, uint8_t state)
   if (state == CIRCUIT_STATE_OPEN)
     tor_assert(!circ->n_chan_create_cell);
   circ->state = state;
+  if (CIRCUIT_IS_ORIGIN(circ))
+    origin_circuit_update_purpose_index(TO_ORIGIN_CIRCUIT(circ));
+}
+
+/** Remove <b>circ</b> from whichever per-purpose, per-state origin circuit
+ * list holds it, if any. */
+static void
+origin_circuit_remove_from_purpose_index(origin_circuit_t *circ)
+{
+  smartlist_t *lst;
+  int idx;
+
+  if (!circ->in_purpose_index)
+    return;
+
+  lst = origin_circuits_by_purpose[circ->purpose_index_purpose]
+                                  [circ->purpose_index_state];
+  idx = circ->purpose_index_idx;
+  tor_assert(smartlist_get(lst, idx) == circ);
+  smartlist_del(lst, idx);
+  if (idx < smartlist_len(lst)) {
+    origin_circuit_t *moved = smartlist_get(lst, idx);
+    moved->purpose_index_idx = idx;
+  }
+  circ->in_purpose_index = 0;
+}
+
+/** Make sure that <b>circ</b> is listed in the per-purpose, per-state origin
+ * circuit list that matches its current purpose and state, or in none of
+ * them if it has been marked for close.  Call this whenever the purpose, the
+ * state, or the marked-for-close status of an origin circuit changes. */
+void
+origin_circuit_update_purpose_index(origin_circuit_t *circ)
+{
+  circuit_t *base = TO_CIRCUIT(circ);
+  smartlist_t **lstp;
+
+  if (circ->in_purpose_index &&
+      !base->marked_for_close &&
+      circ->purpose_index_purpose == base->purpose &&
+      circ->purpose_index_state == base->state)
+    return;
+
+  origin_circuit_remove_from_purpose_index(circ);
+
+  if (base->marked_for_close ||
+      !CIRCUIT_IS_ORIGIN(base) ||
+      base->purpose > CIRCUIT_PURPOSE_MAX_ ||
+      base->state >= N_CIRCUIT_STATES)
+    return;
+
+  lstp = &origin_circuits_by_purpose[base->purpose][base->state];
+  if (!*lstp)
+    *lstp = smartlist_new();
+  circ->purpose_index_idx = smartlist_len(*lstp);
+  smartlist_add(*lstp, circ);
+  circ->in_purpose_index = 1;
+  circ->purpose_index_purpose = base->purpose;
+  circ->purpose_index_state = base->state;
+}
+
+/** Return a list of all the origin circuits with purpose <b>purpose</b>
+ * and state <b>state</b> that have not been marked for close.  The list
+ * belongs to circuitlist.c; callers must not modify it, and must not keep it
+ * across calls that might change a circuit's purpose, state, or
+ * marked-for-close status. */
+smartlist_t *
+circuit_get_origin_circuits_by_purpose(uint8_t purpose, uint8_t state)
+{
+  smartlist_t **lstp;
+
+  tor_assert(purpose <= CIRCUIT_PURPOSE_MAX_);
+  tor_assert(state < N_CIRCUIT_STATES);
+
+  lstp = &origin_circuits_by_purpose[purpose][state];
+  if (!*lstp)
+    *lstp = smartlist_new();
+  return *lstp;
+}
+
+/** Return the number of origin circuits with purpose <b>purpose</b> that
+ * have not been marked for close and are not yet open. */
+int
+circuit_count_building_origin_circuits(uint8_t purpose)
+{
+  int state, n = 0;
+
+  tor_assert(purpose <= CIRCUIT_PURPOSE_MAX_);
+
+  for (state = 0; state < N_CIRCUIT_STATES; ++state) {
+    if (state != CIRCUIT_STATE_OPEN)
+      n += smartlist_len(circuit_get_origin_circuits_by_purpose(purpose,
+                                                                state));
+  }
+  return n;
+}
+
+/** Return a list of all the circuits that originate here, including those
+ * that have been marked for close but not yet freed.  The list belongs to
+ * circuitlist.c, and must not be modified by the caller. */
+smartlist_t *
+circuit_get_global_origin_circuit_list(void)
+{
+  if (NULL == global_origin_circuit_list)
+    global_origin_circuit_list = smartlist_new();
+  return global_origin_circuit_list;
 }
 
 /** Append to <b>out</b> all circuits in state CHAN_WAIT waiting for
@@ -460,7 +584,12 @@ circuit_close_all_marked(void)
     return;
 
   smartlist_t *lst = circuit_get_global_list();
-  SMARTLIST_FOREACH_BEGIN(circuits_pending_close, circuit_t *, circ) {
+  int i;
+  /* Freeing one circuit can mark others for close (for instance, the rest
+   * of its onion handshake batch, if we can't requeue it), so check the
+   * length each time around. */
+  for (i = 0; i < smartlist_len(circuits_pending_close); ++i) {
+    circuit_t *circ = smartlist_get(circuits_pending_close, i);
     tor_assert(circ->marked_for_close);
 
     /* Remove it from the circuit list. */
@@ -474,7 +603,7 @@ circuit_close_all_marked(void)
 
     circuit_about_to_free(circ);
     circuit_free(circ);
-  } SMARTLIST_FOREACH_END(circ);
+  }
 
   smartlist_clear(circuits_pending_close);
 }
@@ -727,6 +856,10 @@ origin_circuit_new(void)
 
   init_circuit_base(TO_CIRCUIT(circ));
 
+  smartlist_add(circuit_get_global_origin_circuit_list(), circ);
+  circ->global_origin_circuit_list_idx =
+    smartlist_len(circuit_get_global_origin_circuit_list()) - 1;
+
   circuit_build_times_update_last_circ(get_circuit_build_times_mutable());
 
   return circ;
@@ -770,6 +903,17 @@ circuit_free(circuit_t *circ)
     mem = ocirc;
     memlen = sizeof(origin_circuit_t);
     tor_assert(circ->magic == ORIGIN_CIRCUIT_MAGIC);
+    origin_circuit_remove_from_purpose_index(ocirc);
+    if (ocirc->global_origin_circuit_list_idx != -1) {
+      int idx = ocirc->global_origin_circuit_list_idx;
+      origin_circuit_t *c2 = smartlist_get(global_origin_circuit_list, idx);
+      tor_assert(c2 == ocirc);
+      smartlist_del(global_origin_circuit_list, idx);
+      if (idx < smartlist_len(global_origin_circuit_list)) {
+        c2 = smartlist_get(global_origin_circuit_list, idx);
+        c2->global_origin_circuit_list_idx = idx;
+      }
+    }
     if (ocirc->build_state) {
         extend_info_free(ocirc->build_state->chosen_exit);
         circuit_free_cpath_node(ocirc->build_state->pending_final_cpath);
@@ -803,6 +947,7 @@ circuit_free(circuit_t *circ)
 
     should_free = (ocirc->workqueue_entry == NULL);
 
+    cpuworker_cancel_circ_relay_crypt(ocirc);
     crypto_cipher_free(ocirc->p_crypto);
     crypto_digest_free(ocirc->p_digest);
     crypto_cipher_free(ocirc->n_crypto);
@@ -845,6 +990,9 @@ circuit_free(circuit_t *circ)
    * "active" checks will be violated. */
   cell_queue_clear(&circ->n_chan_cells);
 
+  histogram_free(circ->cell_latency_exitward);
+  histogram_free(circ->cell_latency_appward);
+
   if (should_free) {
     memwipe(mem, 0xAA, memlen); /* poison memory */
     tor_free(mem);
@@ -911,6 +1059,19 @@ circuit_free_all(void)
   smartlist_free(circuits_pending_chans);
   circuits_pending_chans = NULL;
 
+  smartlist_free(global_origin_circuit_list);
+  global_origin_circuit_list = NULL;
+
+  {
+    int purpose, state;
+    for (purpose = 0; purpose <= CIRCUIT_PURPOSE_MAX_; ++purpose) {
+      for (state = 0; state < N_CIRCUIT_STATES; ++state) {
+        smartlist_free(origin_circuits_by_purpose[purpose][state]);
+        origin_circuits_by_purpose[purpose][state] = NULL;
+      }
+    }
+  }
+
   {
     chan_circid_circuit_map_t **elt, **next, *c;
     for (elt = HT_START(chan_circid_map, &chan_circid_map);
@@ -1287,10 +1448,11 @@ circuit_unlink_all_from_channel(channel_t *chan, int reason)
 origin_circuit_t *
 circuit_get_ready_rend_circ_by_rend_data(const rend_data_t *rend_data)
 {
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
-    if (!circ->marked_for_close &&
-        circ->purpose == CIRCUIT_PURPOSE_C_REND_READY) {
-      origin_circuit_t *ocirc = TO_ORIGIN_CIRCUIT(circ);
+  int state;
+  for (state = 0; state < N_CIRCUIT_STATES; ++state) {
+    smartlist_t *circs = circuit_get_origin_circuits_by_purpose(
+                                     CIRCUIT_PURPOSE_C_REND_READY, state);
+    SMARTLIST_FOREACH_BEGIN(circs, origin_circuit_t *, ocirc) {
       if (ocirc->rend_data &&
           !rend_cmp_service_ids(rend_data->onion_address,
                                 ocirc->rend_data->onion_address) &&
@@ -1298,14 +1460,13 @@ circuit_get_ready_rend_circ_by_rend_data(const rend_data_t *rend_data)
                     rend_data->rend_cookie,
                     REND_COOKIE_LEN))
         return ocirc;
-    }
+    } SMARTLIST_FOREACH_END(ocirc);
   }
-  SMARTLIST_FOREACH_END(circ);
   return NULL;
 }
 
-/** Return the first circuit originating here in global_circuitlist after
- * <b>start</b> whose purpose is <b>purpose</b>, and where
+/** Return the first circuit originating here in global_origin_circuit_list
+ * after <b>start</b> whose purpose is <b>purpose</b>, and where
  * <b>digest</b> (if set) matches the rend_pk_digest field. Return NULL if no
  * circuit is found.  If <b>start</b> is NULL, begin at the start of the list.
  */
@@ -1314,26 +1475,27 @@ circuit_get_next_by_pk_and_purpose(origin_circuit_t *start,
                                    const char *digest, uint8_t purpose)
 {
   int idx;
-  smartlist_t *lst = circuit_get_global_list();
+  smartlist_t *lst = circuit_get_global_origin_circuit_list();
   tor_assert(CIRCUIT_PURPOSE_IS_ORIGIN(purpose));
   if (start == NULL)
     idx = 0;
   else
-    idx = TO_CIRCUIT(start)->global_circuitlist_idx + 1;
+    idx = start->global_origin_circuit_list_idx + 1;
 
   for ( ; idx < smartlist_len(lst); ++idx) {
-    circuit_t *circ = smartlist_get(lst, idx);
+    origin_circuit_t *ocirc = smartlist_get(lst, idx);
+    circuit_t *circ = TO_CIRCUIT(ocirc);
 
     if (circ->marked_for_close)
       continue;
     if (circ->purpose != purpose)
       continue;
     if (!digest)
-      return TO_ORIGIN_CIRCUIT(circ);
-    else if (TO_ORIGIN_CIRCUIT(circ)->rend_data &&
-             tor_memeq(TO_ORIGIN_CIRCUIT(circ)->rend_data->rend_pk_digest,
+      return ocirc;
+    else if (ocirc->rend_data &&
+             tor_memeq(ocirc->rend_data->rend_pk_digest,
                      digest, DIGEST_LEN))
-      return TO_ORIGIN_CIRCUIT(circ);
+      return ocirc;
   }
   return NULL;
 }
@@ -1539,13 +1701,10 @@ circuit_find_to_cannibalize(uint8_t purpose, extend_info_t *info,
             "capacity %d, internal %d",
             purpose, need_uptime, need_capacity, internal);
 
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ_) {
-    if (CIRCUIT_IS_ORIGIN(circ_) &&
-        circ_->state == CIRCUIT_STATE_OPEN &&
-        !circ_->marked_for_close &&
-        circ_->purpose == CIRCUIT_PURPOSE_C_GENERAL &&
-        !circ_->timestamp_dirty) {
-      origin_circuit_t *circ = TO_ORIGIN_CIRCUIT(circ_);
+  SMARTLIST_FOREACH_BEGIN(circuit_get_origin_circuits_by_purpose(
+                                CIRCUIT_PURPOSE_C_GENERAL, CIRCUIT_STATE_OPEN),
+                          origin_circuit_t *, circ) {
+    if (!TO_CIRCUIT(circ)->timestamp_dirty) {
       if ((!need_uptime || circ->build_state->need_uptime) &&
           (!need_capacity || circ->build_state->need_capacity) &&
           (internal == circ->build_state->is_internal) &&
@@ -1589,7 +1748,7 @@ circuit_find_to_cannibalize(uint8_t purpose, extend_info_t *info,
       }
     }
   }
-  SMARTLIST_FOREACH_END(circ_);
+  SMARTLIST_FOREACH_END(circ);
   return best;
 }
 
@@ -1629,13 +1788,14 @@ circuit_get_cpath_hop(origin_circuit_t *circ, int hopnum)
 void
 circuit_mark_all_unused_circs(void)
 {
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
-    if (CIRCUIT_IS_ORIGIN(circ) &&
-        !circ->marked_for_close &&
+  SMARTLIST_FOREACH_BEGIN(circuit_get_global_origin_circuit_list(),
+                          origin_circuit_t *, ocirc) {
+    circuit_t *circ = TO_CIRCUIT(ocirc);
+    if (!circ->marked_for_close &&
         !circ->timestamp_dirty)
       circuit_mark_for_close(circ, END_CIRC_REASON_FINISHED);
   }
-  SMARTLIST_FOREACH_END(circ);
+  SMARTLIST_FOREACH_END(ocirc);
 }
 
 /** Go through the circuitlist; for each circuit that starts at us
@@ -1648,14 +1808,14 @@ circuit_mark_all_unused_circs(void)
 void
 circuit_mark_all_dirty_circs_as_unusable(void)
 {
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
-    if (CIRCUIT_IS_ORIGIN(circ) &&
-        !circ->marked_for_close &&
-        circ->timestamp_dirty) {
-      mark_circuit_unusable_for_new_conns(TO_ORIGIN_CIRCUIT(circ));
+  SMARTLIST_FOREACH_BEGIN(circuit_get_global_origin_circuit_list(),
+                          origin_circuit_t *, ocirc) {
+    if (!TO_CIRCUIT(ocirc)->marked_for_close &&
+        TO_CIRCUIT(ocirc)->timestamp_dirty) {
+      mark_circuit_unusable_for_new_conns(ocirc);
     }
   }
-  SMARTLIST_FOREACH_END(circ);
+  SMARTLIST_FOREACH_END(ocirc);
 }
 
 /** Mark <b>circ</b> to be closed next time we call
@@ -1724,6 +1884,9 @@ circuit_mark_for_close_, (circuit_t *circ, int reason, int line,
   circ->marked_for_close_reason = reason;
   circ->marked_for_close_orig_reason = orig_reason;
 
+  if (CIRCUIT_IS_ORIGIN(circ))
+    origin_circuit_update_purpose_index(TO_ORIGIN_CIRCUIT(circ));
+
   if (!CIRCUIT_IS_ORIGIN(circ)) {
     or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
     if (or_circ->rend_splice) {
@@ -1872,8 +2035,10 @@ marked_circuit_free_cells(circuit_t *circ)
     return;
   }
   cell_queue_clear(&circ->n_chan_cells);
-  if (! CIRCUIT_IS_ORIGIN(circ))
+  if (! CIRCUIT_IS_ORIGIN(circ)) {
     cell_queue_clear(& TO_OR_CIRCUIT(circ)->p_chan_cells);
+    cpuworker_cancel_circ_relay_crypt(TO_OR_CIRCUIT(circ));
+  }
 }
 
 static size_t
@@ -1935,6 +2100,7 @@ n_cells_in_circ_queues(const circuit_t *c)
   if (! CIRCUIT_IS_ORIGIN(c)) {
     circuit_t *cc = (circuit_t *) c;
     n += TO_OR_CIRCUIT(cc)->p_chan_cells.n;
+    n += TO_OR_CIRCUIT(cc)->relaycrypt_n_cells;
   }
   return n;
 }
@@ -2306,6 +2472,15 @@ assert_circuit_ok(const circuit_t *c)
     tor_assert(!circuits_pending_chans ||
                !smartlist_contains(circuits_pending_chans, c));
   }
+  if (origin_circ && origin_circ->in_purpose_index) {
+    const smartlist_t *lst =
+      origin_circuits_by_purpose[origin_circ->purpose_index_purpose]
+                                [origin_circ->purpose_index_state];
+    tor_assert(!c->marked_for_close);
+    tor_assert(origin_circ->purpose_index_purpose == c->purpose);
+    tor_assert(origin_circ->purpose_index_state == c->state);
+    tor_assert(smartlist_get(lst, origin_circ->purpose_index_idx) == c);
+  }
   if (origin_circ && origin_circ->cpath) {
     assert_cpath_ok(origin_circ->cpath);
   }
@@ -15,6 +15,7 @@
 #include "testsupport.h"
 
 MOCK_DECL(smartlist_t *, circuit_get_global_list, (void));
+smartlist_t *circuit_get_global_origin_circuit_list(void);
 const char *circuit_state_to_string(int state);
 const char *circuit_purpose_to_controller_string(uint8_t purpose);
 const char *circuit_purpose_to_controller_hs_state_string(uint8_t purpose);
@@ -29,6 +30,10 @@ void channel_mark_circid_usable(channel_t *chan, circid_t id);
 time_t circuit_id_when_marked_unusable_on_channel(circid_t circ_id,
                                                   channel_t *chan);
 void circuit_set_state(circuit_t *circ, uint8_t state);
+void origin_circuit_update_purpose_index(origin_circuit_t *circ);
+smartlist_t *circuit_get_origin_circuits_by_purpose(uint8_t purpose,
+                                                    uint8_t state);
+int circuit_count_building_origin_circuits(uint8_t purpose);
 void circuit_close_all_marked(void);
 int32_t circuit_initial_package_window(void);
 origin_circuit_t *origin_circuit_new(void);
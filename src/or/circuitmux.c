@@ -1999,3 +1999,24 @@ circuitmux_compare_muxes, (circuitmux_t *cmux_1, circuitmux_t *cmux_2))
   }
 }
 
+/**
+ * Return a scalar priority for this cmux, for schedulers that want to sort
+ * channels into buckets instead of comparing them pairwise.  Lower values
+ * are more preferred, consistent with circuitmux_compare_muxes().
+ *
+ * If the cmux has no policy, or the policy does not support the
+ * get_priority method, return 0.0.
+ */
+
+double
+circuitmux_get_priority(circuitmux_t *cmux)
+{
+  tor_assert(cmux);
+
+  if (cmux->policy && cmux->policy->get_priority) {
+    return cmux->policy->get_priority(cmux, cmux->policy_data);
+  } else {
+    return 0.0;
+  }
+}
+
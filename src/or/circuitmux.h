@@ -60,6 +60,10 @@ struct circuitmux_policy_s {
   /* Optional: channel comparator for use by the scheduler */
   int (*cmp_cmux)(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
                   circuitmux_t *cmux_2, circuitmux_policy_data_t *pol_data_2);
+  /* Optional: scalar priority for use by bucketed schedulers; lower values
+   * are more preferred, in the same sense as cmp_cmux */
+  double (*get_priority)(circuitmux_t *cmux,
+                         circuitmux_policy_data_t *pol_data);
 };
 
 /*
@@ -155,6 +159,7 @@ void circuitmux_mark_destroyed_circids_usable(circuitmux_t *cmux,
 /* Optional interchannel comparisons for scheduling */
 MOCK_DECL(int, circuitmux_compare_muxes,
           (circuitmux_t *cmux_1, circuitmux_t *cmux_2));
+double circuitmux_get_priority(circuitmux_t *cmux);
 
 #endif /* TOR_CIRCUITMUX_H */
 
@@ -190,6 +190,8 @@ ewma_pick_active_circuit(circuitmux_t *cmux,
 static int
 ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
               circuitmux_t *cmux_2, circuitmux_policy_data_t *pol_data_2);
+static double
+ewma_get_priority(circuitmux_t *cmux, circuitmux_policy_data_t *pol_data);
 
 /*** EWMA global variables ***/
 
@@ -213,7 +215,8 @@ circuitmux_policy_t ewma_policy = {
   /*.notify_set_n_cells =*/ NULL, /* EWMA doesn't need this */
   /*.notify_xmit_cells =*/ ewma_notify_xmit_cells,
   /*.pick_active_circuit =*/ ewma_pick_active_circuit,
-  /*.cmp_cmux =*/ ewma_cmp_cmux
+  /*.cmp_cmux =*/ ewma_cmp_cmux,
+  /*.get_priority =*/ ewma_get_priority
 };
 
 /*** EWMA method implementations using the below EWMA helper functions ***/
@@ -509,6 +512,36 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
   }
 }
 
+/**
+ * Return the EWMA cell count of the best active circuit on this cmux,
+ * scaled to the current tick so that values from different cmuxes are
+ * comparable.  Return 0.0 if there are no active circuits.
+ */
+
+static double
+ewma_get_priority(circuitmux_t *cmux, circuitmux_policy_data_t *pol_data)
+{
+  ewma_policy_data_t *pol = NULL;
+  cell_ewma_t *ce = NULL;
+  unsigned int tick;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+
+  pol = TO_EWMA_POL_DATA(pol_data);
+
+  if (smartlist_len(pol->active_circuit_pqueue) == 0)
+    return 0.0;
+
+  ce = smartlist_get(pol->active_circuit_pqueue, 0);
+  tick = cell_ewma_get_tick();
+  if (tick == pol->active_circuit_pqueue_last_recalibrated)
+    return ce->cell_count;
+  else
+    return ce->cell_count *
+      get_scale_factor(pol->active_circuit_pqueue_last_recalibrated, tick);
+}
+
 /** Helper for sorting cell_ewma_t values in their priority queue. */
 static int
 compare_cell_ewma_counts(const void *p1, const void *p2)
@@ -271,6 +271,8 @@ circuit_get_best(const entry_connection_t *conn,
   origin_circuit_t *best=NULL;
   struct timeval now;
   int intro_going_on_but_too_old = 0;
+  uint8_t purposes[4];
+  int n_purposes, i, state;
 
   tor_assert(conn);
 
@@ -280,31 +282,46 @@ circuit_get_best(const entry_connection_t *conn,
 
   tor_gettimeofday(&now);
 
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
-    origin_circuit_t *origin_circ;
-    if (!CIRCUIT_IS_ORIGIN(circ))
-      continue;
-    origin_circ = TO_ORIGIN_CIRCUIT(circ);
-
-    /* Log an info message if we're going to launch a new intro circ in
-     * parallel */
-    if (purpose == CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT &&
-        !must_be_open && origin_circ->hs_circ_has_timed_out) {
-        intro_going_on_but_too_old = 1;
-        continue;
-    }
+  /* Only look at the circuits whose purpose circuit_is_acceptable() might
+   * accept, and only at the open ones if we need an open circuit. */
+  n_purposes = 0;
+  if (purpose == CIRCUIT_PURPOSE_C_REND_JOINED && !must_be_open) {
+    purposes[n_purposes++] = CIRCUIT_PURPOSE_C_ESTABLISH_REND;
+    purposes[n_purposes++] = CIRCUIT_PURPOSE_C_REND_READY;
+    purposes[n_purposes++] = CIRCUIT_PURPOSE_C_REND_READY_INTRO_ACKED;
+  } else if (purpose == CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT &&
+             !must_be_open) {
+    purposes[n_purposes++] = CIRCUIT_PURPOSE_C_INTRODUCING;
+  }
+  purposes[n_purposes++] = purpose;
+
+  for (i = 0; i < n_purposes; ++i) {
+    for (state = must_be_open ? CIRCUIT_STATE_OPEN : 0;
+         state <= CIRCUIT_STATE_OPEN; ++state) {
+      smartlist_t *circs =
+        circuit_get_origin_circuits_by_purpose(purposes[i], state);
+      SMARTLIST_FOREACH_BEGIN(circs, origin_circuit_t *, origin_circ) {
+        /* Log an info message if we're going to launch a new intro circ in
+         * parallel */
+        if (purpose == CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT &&
+            !must_be_open && origin_circ->hs_circ_has_timed_out) {
+            intro_going_on_but_too_old = 1;
+            continue;
+        }
 
-    if (!circuit_is_acceptable(origin_circ,conn,must_be_open,purpose,
-                               need_uptime,need_internal, (time_t)now.tv_sec))
-      continue;
+        if (!circuit_is_acceptable(origin_circ,conn,must_be_open,purpose,
+                                   need_uptime,need_internal,
+                                   (time_t)now.tv_sec))
+          continue;
 
-    /* now this is an acceptable circ to hand back. but that doesn't
-     * mean it's the *best* circ to hand back. try to decide.
-     */
-    if (!best || circuit_is_better(origin_circ,best,conn))
-      best = origin_circ;
+        /* now this is an acceptable circ to hand back. but that doesn't
+         * mean it's the *best* circ to hand back. try to decide.
+         */
+        if (!best || circuit_is_better(origin_circ,best,conn))
+          best = origin_circ;
+      } SMARTLIST_FOREACH_END(origin_circ);
+    }
   }
-  SMARTLIST_FOREACH_END(circ);
 
   if (!best && intro_going_on_but_too_old)
     log_info(LD_REND|LD_CIRC, "There is an intro circuit being created "
@@ -318,20 +335,7 @@ circuit_get_best(const entry_connection_t *conn,
 static int
 count_pending_general_client_circuits(void)
 {
-  int count = 0;
-
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
-    if (circ->marked_for_close ||
-        circ->state == CIRCUIT_STATE_OPEN ||
-        circ->purpose != CIRCUIT_PURPOSE_C_GENERAL ||
-        !CIRCUIT_IS_ORIGIN(circ))
-      continue;
-
-    ++count;
-  }
-  SMARTLIST_FOREACH_END(circ);
-
-  return count;
+  return circuit_count_building_origin_circuits(CIRCUIT_PURPOSE_C_GENERAL);
 }
 
 #if 0
@@ -386,9 +390,10 @@ circuit_expire_building(void)
    * we want to be more lenient with timeouts, in case the
    * user has relocated and/or changed network connections.
    * See bug #3443. */
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, next_circ) {
-    if (!CIRCUIT_IS_ORIGIN(next_circ) || /* didn't originate here */
-        next_circ->marked_for_close) { /* don't mess with marked circs */
+  SMARTLIST_FOREACH_BEGIN(circuit_get_global_origin_circuit_list(),
+                          origin_circuit_t *, next_origin_circ) {
+    circuit_t *next_circ = TO_CIRCUIT(next_origin_circ);
+    if (next_circ->marked_for_close) { /* don't mess with marked circs */
       continue;
     }
 
@@ -400,7 +405,7 @@ circuit_expire_building(void)
       any_opened_circs = 1;
       break;
     }
-  } SMARTLIST_FOREACH_END(next_circ);
+  } SMARTLIST_FOREACH_END(next_origin_circ);
 
 #define SET_CUTOFF(target, msec) do {                       \
     long ms = tor_lround(msec);                             \
@@ -471,10 +476,11 @@ circuit_expire_building(void)
              MAX(get_circuit_build_close_time_ms()*2 + 1000,
                  options->SocksTimeout * 1000));
 
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *,victim) {
+  SMARTLIST_FOREACH_BEGIN(circuit_get_global_origin_circuit_list(),
+                          origin_circuit_t *, origin_victim) {
+    circuit_t *victim = TO_CIRCUIT(origin_victim);
     struct timeval cutoff;
-    if (!CIRCUIT_IS_ORIGIN(victim) || /* didn't originate here */
-        victim->marked_for_close)     /* don't mess with marked circs */
+    if (victim->marked_for_close)     /* don't mess with marked circs */
       continue;
 
     /* If we haven't yet started the first hop, it means we don't have
@@ -777,7 +783,7 @@ circuit_expire_building(void)
       circuit_mark_for_close(victim, END_CIRC_REASON_TIMEOUT);
 
     pathbias_count_timeout(TO_ORIGIN_CIRCUIT(victim));
-  } SMARTLIST_FOREACH_END(victim);
+  } SMARTLIST_FOREACH_END(origin_victim);
 }
 
 /** For debugging #8387: track when we last called
@@ -798,13 +804,11 @@ circuit_log_ancient_one_hop_circuits(int age)
   int n_found = 0;
   smartlist_t *log_these = smartlist_new();
 
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
-    const origin_circuit_t *ocirc;
-    if (! CIRCUIT_IS_ORIGIN(circ))
-      continue;
+  SMARTLIST_FOREACH_BEGIN(circuit_get_global_origin_circuit_list(),
+                          const origin_circuit_t *, ocirc) {
+    const circuit_t *circ = TO_CIRCUIT(ocirc);
     if (circ->timestamp_created.tv_sec >= cutoff)
       continue;
-    ocirc = CONST_TO_ORIGIN_CIRCUIT(circ);
 
     if (ocirc->build_state && ocirc->build_state->onehop_tunnel) {
       ++n_found;
@@ -813,7 +817,7 @@ circuit_log_ancient_one_hop_circuits(int age)
         smartlist_add(log_these, (origin_circuit_t*) ocirc);
     }
   }
-  SMARTLIST_FOREACH_END(circ);
+  SMARTLIST_FOREACH_END(ocirc);
 
   if (n_found == 0)
     goto done;
@@ -944,20 +948,21 @@ circuit_stream_is_being_handled(entry_connection_t *conn,
                                 uint16_t port, int min)
 {
   const node_t *exitnode;
-  int num=0;
+  int num=0, state;
   time_t now = time(NULL);
   int need_uptime = smartlist_contains_int_as_string(
                                    get_options()->LongLivedPorts,
                                    conn ? conn->socks_request->port : port);
 
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
-    if (CIRCUIT_IS_ORIGIN(circ) &&
-        !circ->marked_for_close &&
-        circ->purpose == CIRCUIT_PURPOSE_C_GENERAL &&
-        (!circ->timestamp_dirty ||
-         circ->timestamp_dirty + get_options()->MaxCircuitDirtiness > now)) {
-      origin_circuit_t *origin_circ = TO_ORIGIN_CIRCUIT(circ);
+  for (state = 0; state <= CIRCUIT_STATE_OPEN; ++state) {
+    smartlist_t *circs =
+      circuit_get_origin_circuits_by_purpose(CIRCUIT_PURPOSE_C_GENERAL, state);
+    SMARTLIST_FOREACH_BEGIN(circs, origin_circuit_t *, origin_circ) {
+      circuit_t *circ = TO_CIRCUIT(origin_circ);
       cpath_build_state_t *build_state = origin_circ->build_state;
+      if (circ->timestamp_dirty &&
+          circ->timestamp_dirty + get_options()->MaxCircuitDirtiness <= now)
+        continue;
       if (build_state->is_internal || build_state->onehop_tunnel)
         continue;
       if (origin_circ->unusable_for_new_conns)
@@ -978,9 +983,8 @@ circuit_stream_is_being_handled(entry_connection_t *conn,
             return 1;
         }
       }
-    }
+    } SMARTLIST_FOREACH_END(origin_circ);
   }
-  SMARTLIST_FOREACH_END(circ);
   return 0;
 }
 
@@ -1277,8 +1281,10 @@ circuit_expire_old_circuits_clientside(void)
     cutoff.tv_sec -= get_options()->CircuitIdleTimeout;
   }
 
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
-    if (circ->marked_for_close || !CIRCUIT_IS_ORIGIN(circ))
+  SMARTLIST_FOREACH_BEGIN(circuit_get_global_origin_circuit_list(),
+                          origin_circuit_t *, origin_circ) {
+    circuit_t *circ = TO_CIRCUIT(origin_circ);
+    if (circ->marked_for_close)
       continue;
     /* If the circuit has been dirty for too long, and there are no streams
      * on it, mark it for close.
@@ -1329,7 +1335,7 @@ circuit_expire_old_circuits_clientside(void)
         }
       }
     }
-  } SMARTLIST_FOREACH_END(circ);
+  } SMARTLIST_FOREACH_END(origin_circ);
 }
 
 /** How long do we wait before killing circuits with the properties
@@ -1401,18 +1407,13 @@ reset_bandwidth_test(void)
 int
 circuit_enough_testing_circs(void)
 {
-  int num = 0;
+  int num;
 
   if (have_performed_bandwidth_test)
     return 1;
 
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
-    if (!circ->marked_for_close && CIRCUIT_IS_ORIGIN(circ) &&
-        circ->purpose == CIRCUIT_PURPOSE_TESTING &&
-        circ->state == CIRCUIT_STATE_OPEN)
-      num++;
-  }
-  SMARTLIST_FOREACH_END(circ);
+  num = smartlist_len(circuit_get_origin_circuits_by_purpose(
+                                CIRCUIT_PURPOSE_TESTING, CIRCUIT_STATE_OPEN));
   return num >= NUM_PARALLEL_TESTING_CIRCS;
 }
 
@@ -2548,6 +2549,7 @@ circuit_change_purpose(circuit_t *circ, uint8_t new_purpose)
   circ->purpose = new_purpose;
 
   if (CIRCUIT_IS_ORIGIN(circ)) {
+    origin_circuit_update_purpose_index(TO_ORIGIN_CIRCUIT(circ));
     control_event_circuit_purpose_changed(TO_ORIGIN_CIRCUIT(circ),
                                           old_purpose);
   }
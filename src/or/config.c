@@ -182,6 +182,7 @@ static config_var_t option_vars_[] = {
   V(BridgePassword,              STRING,   NULL),
   V(BridgeRecordUsageByCountry,  BOOL,     "1"),
   V(BridgeRelay,                 BOOL,     "0"),
+  V(CellLatencyStatistics,       BOOL,     "0"),
   V(CellStatistics,              BOOL,     "0"),
   V(LearnCircuitBuildTimeout,    BOOL,     "1"),
   V(CircuitBuildTimeout,         INTERVAL, "0"),
@@ -195,6 +196,7 @@ static config_var_t option_vars_[] = {
   V(ClientTransportPlugin,       LINELIST, NULL),
   V(ClientUseIPv6,               BOOL,     "0"),
   V(ConsensusParams,             STRING,   NULL),
+  V(ConsensusDiffHistory,        UINT,     "12"),
   V(ConnLimit,                   UINT,     "1000"),
   V(ConnDirectionStatistics,     BOOL,     "0"),
   V(ConstrainedSockets,          BOOL,     "0"),
@@ -388,6 +390,7 @@ static config_var_t option_vars_[] = {
   V(RejectPlaintextPorts,        CSV,      ""),
   V(RelayBandwidthBurst,         MEMUNIT,  "0"),
   V(RelayBandwidthRate,          MEMUNIT,  "0"),
+  V(RelayCryptoThreads,          UINT,     "0"),
   V(RendPostPeriod,              INTERVAL, "1 hour"),
   V(RephistTrackTime,            INTERVAL, "24 hours"),
   V(RunAsDaemon,                 BOOL,     "0"),
@@ -406,6 +409,9 @@ static config_var_t option_vars_[] = {
   V(SchedulerLowWaterMark__,     MEMUNIT,  "100 MB"),
   V(SchedulerHighWaterMark__,    MEMUNIT,  "101 MB"),
   V(SchedulerMaxFlushCells__,    UINT,     "1000"),
+  V(SchedulerKIST__,             BOOL,     "0"),
+  V(SchedulerKISTRunInterval__,  MSEC_INTERVAL, "10 msec"),
+  V(SchedulerQueue__,            STRING,   "Heap"),
   V(ShutdownWaitLength,          INTERVAL, "30 seconds"),
   V(SocksListenAddress,          LINELIST, NULL),
   V(SocksPolicy,                 LINELIST, NULL),
@@ -1414,6 +1420,9 @@ options_act(const or_options_t *old_options)
   if (consider_adding_dir_servers(options, old_options) < 0)
     return -1;
 
+  /* Let bulk signature checks use every CPU we're allowed to use. */
+  crypto_pk_checksig_batch_set_threads(get_num_cpus(options));
+
 #ifdef NON_ANONYMOUS_MODE_ENABLED
   log_warn(LD_GENERAL, "This copy of Tor was compiled to run in a "
       "non-anonymous mode. It will provide NO ANONYMITY.");
@@ -1588,6 +1597,16 @@ options_act(const or_options_t *old_options)
                            (uint32_t)options->SchedulerHighWaterMark__,
                            (options->SchedulerMaxFlushCells__ > 0) ?
                            options->SchedulerMaxFlushCells__ : 1000);
+  {
+    scheduler_queue_type_t queue_type = SCHEDULER_QUEUE_HEAP;
+    /* Already checked in options_validate() */
+    if (options->SchedulerQueue__)
+      scheduler_parse_queue_type(options->SchedulerQueue__, &queue_type);
+    scheduler_set_queue_type(queue_type);
+  }
+  scheduler_set_kist(options->SchedulerKIST__ &&
+                     scheduler_kist_is_supported(),
+                     options->SchedulerKISTRunInterval__);
 
   /* Set up accounting */
   if (accounting_parse_options(options, 0)<0) {
@@ -2824,6 +2843,23 @@ options_validate(or_options_t *old_options, or_options_t *options,
     return -1;
   }
 
+  if (options->SchedulerQueue__) {
+    scheduler_queue_type_t queue_type;
+    if (scheduler_parse_queue_type(options->SchedulerQueue__,
+                                   &queue_type) < 0)
+      REJECT("SchedulerQueue__ must be Heap or Buckets.");
+  }
+
+  if (options->SchedulerKISTRunInterval__ <= 0 ||
+      options->SchedulerKISTRunInterval__ > 1000) {
+    REJECT("SchedulerKISTRunInterval__ must be between 1 msec and "
+           "1 second.");
+  }
+  if (options->SchedulerKIST__ && !scheduler_kist_is_supported()) {
+    log_warn(LD_CONFIG, "SchedulerKIST__ is set, but this platform can't "
+             "tell us how much data its sockets can send. Ignoring.");
+  }
+
   if (options->NodeFamilies) {
     options->NodeFamilySets = smartlist_new();
     for (cl = options->NodeFamilies; cl; cl = cl->next) {
@@ -4028,6 +4064,12 @@ options_transition_allowed(const or_options_t *old,
     return -1;
   }
 
+  if (old->RelayCryptoThreads != new_val->RelayCryptoThreads) {
+    *msg = tor_strdup("While Tor is running, changing RelayCryptoThreads "
+                      "is not allowed.");
+    return -1;
+  }
+
   if (old->DisableIOCP != new_val->DisableIOCP) {
     *msg = tor_strdup("While Tor is running, changing DisableIOCP "
                       "is not allowed.");
@@ -639,6 +639,7 @@ connection_free_(connection_t *conn)
     tor_free(TO_OR_CONN(conn)->ext_or_conn_id);
     tor_free(TO_OR_CONN(conn)->ext_or_auth_correct_client_hash);
     tor_free(TO_OR_CONN(conn)->ext_or_transport);
+    connection_or_clear_outbuf_marks(TO_OR_CONN(conn));
   }
 
 #ifdef USE_BUFFEREVENTS
@@ -3941,6 +3942,10 @@ connection_handle_write_impl(connection_t *conn, int force)
     result = flush_buf_tls(or_conn->tls, conn->outbuf,
                            max_to_write, &conn->outbuf_flushlen);
 
+    if (or_conn->outbuf_marks)
+      connection_or_note_outbuf_flushed(or_conn,
+                                  initial_size - buf_datalen(conn->outbuf));
+
     /* If we just flushed the last bytes, tell the channel on the
      * or_conn to check if it needs to geoip_change_dirreq_state() */
     /* XXXX move this to flushed_some or finished_flushing -NM */
@@ -4121,6 +4126,46 @@ connection_flush(connection_t *conn)
   return connection_handle_write(conn, 1);
 }
 
+/** Helper: we just tried to add <b>added</b> bytes to <b>conn</b>'s
+ * outbuf, and the buffer function returned <b>r</b>.  On failure, close
+ * whatever needs closing; on success, ask <b>conn</b> to start writing. */
+static void
+connection_handle_outbuf_write_result(connection_t *conn, int r,
+                                      size_t added)
+{
+  if (r < 0) {
+    if (CONN_IS_EDGE(conn)) {
+      /* if it failed, it means we have our package/delivery windows set
+         wrong compared to our max outbuf size. close the whole circuit. */
+      log_warn(LD_NET,
+               "write_to_buf failed. Closing circuit (fd %d).", (int)conn->s);
+      circuit_mark_for_close(circuit_get_by_edge_conn(TO_EDGE_CONN(conn)),
+                             END_CIRC_REASON_INTERNAL);
+    } else if (conn->type == CONN_TYPE_OR) {
+      or_connection_t *orconn = TO_OR_CONN(conn);
+      log_warn(LD_NET,
+               "write_to_buf failed on an orconn; notifying of error "
+               "(fd %d)", (int)(conn->s));
+      connection_or_close_for_error(orconn, 0);
+    } else {
+      log_warn(LD_NET,
+               "write_to_buf failed. Closing connection (fd %d).",
+               (int)conn->s);
+      connection_mark_for_close(conn);
+    }
+    return;
+  }
+
+  /* If we receive optimistic data in the EXIT_CONN_STATE_RESOLVING
+   * state, we don't want to try to write it right away, since
+   * conn->write_event won't be set yet.  Otherwise, write data from
+   * this conn as the socket is available. */
+  if (conn->write_event) {
+    connection_start_writing(conn);
+  }
+  conn->outbuf_flushlen += added;
+}
+
 /** Append <b>len</b> bytes of <b>string</b> onto <b>conn</b>'s
  * outbuf, and ask it to start writing.
  *
@@ -4172,43 +4217,93 @@ connection_write_to_buf_impl_,(const char *string, size_t len,
   } else {
     CONN_LOG_PROTECT(conn, r = write_to_buf(string, len, conn->outbuf));
   }
-  if (r < 0) {
-    if (CONN_IS_EDGE(conn)) {
-      /* if it failed, it means we have our package/delivery windows set
-         wrong compared to our max outbuf size. close the whole circuit. */
-      log_warn(LD_NET,
-               "write_to_buf failed. Closing circuit (fd %d).", (int)conn->s);
-      circuit_mark_for_close(circuit_get_by_edge_conn(TO_EDGE_CONN(conn)),
-                             END_CIRC_REASON_INTERNAL);
-    } else if (conn->type == CONN_TYPE_OR) {
-      or_connection_t *orconn = TO_OR_CONN(conn);
-      log_warn(LD_NET,
-               "write_to_buf failed on an orconn; notifying of error "
-               "(fd %d)", (int)(conn->s));
-      connection_or_close_for_error(orconn, 0);
-    } else {
-      log_warn(LD_NET,
-               "write_to_buf failed. Closing connection (fd %d).",
-               (int)conn->s);
-      connection_mark_for_close(conn);
-    }
-    return;
-  }
-
-  /* If we receive optimistic data in the EXIT_CONN_STATE_RESOLVING
-   * state, we don't want to try to write it right away, since
-   * conn->write_event won't be set yet.  Otherwise, write data from
-   * this conn as the socket is available. */
-  if (conn->write_event) {
-    connection_start_writing(conn);
-  }
   if (zlib) {
-    conn->outbuf_flushlen += buf_datalen(conn->outbuf) - old_datalen;
+    connection_handle_outbuf_write_result(conn, r,
+                                    buf_datalen(conn->outbuf) - old_datalen);
   } else {
-    conn->outbuf_flushlen += len;
+    connection_handle_outbuf_write_result(conn, r, len);
   }
 }
 
+/** Append the <b>len</b> bytes at <b>string</b> onto <b>conn</b>'s outbuf
+ * by reference, without copying them, and ask it to start writing.  We call
+ * <b>free_fn</b>(<b>free_arg</b>) once we no longer need the bytes; see
+ * write_ref_to_buf(). */
+void
+connection_write_ref_to_buf(const char *string, size_t len,
+                            void (*free_fn)(void *), void *free_arg,
+                            connection_t *conn)
+{
+  int r;
+  /* if it's marked for close, only allow write if we mean to flush it */
+  if (!len || (conn->marked_for_close && !conn->hold_open_until_flushed)) {
+    free_fn(free_arg);
+    return;
+  }
+
+  IF_HAS_BUFFEREVENT(conn, {
+    connection_write_to_buf(string, len, conn);
+    free_fn(free_arg);
+    return;
+  });
+
+  CONN_LOG_PROTECT(conn, r = write_ref_to_buf(string, len, free_fn, free_arg,
+                                              conn->outbuf));
+  connection_handle_outbuf_write_result(conn, r, len);
+}
+
+/** Pack the fixed-length <b>cell</b> (with circuit IDs of the width given
+ * by <b>wide_circ_ids</b>) straight onto the end of <b>conn</b>'s outbuf,
+ * and ask it to start writing. */
+void
+connection_write_cell_to_buf(const cell_t *cell, connection_t *conn,
+                             int wide_circ_ids)
+{
+  int r;
+  /* if it's marked for close, only allow write if we mean to flush it */
+  if (conn->marked_for_close && !conn->hold_open_until_flushed)
+    return;
+
+  IF_HAS_BUFFEREVENT(conn, {
+    packed_cell_t networkcell;
+    cell_pack(&networkcell, cell, wide_circ_ids);
+    connection_write_to_buf(networkcell.body,
+                            get_cell_network_size(wide_circ_ids), conn);
+    return;
+  });
+
+  CONN_LOG_PROTECT(conn, r = write_cell_to_buf(cell, conn->outbuf,
+                                               wide_circ_ids));
+  connection_handle_outbuf_write_result(conn, r,
+                                        get_cell_network_size(wide_circ_ids));
+}
+
+/** Append the packed <b>cell</b> (with circuit IDs of the width given by
+ * <b>wide_circ_ids</b>) straight onto the end of <b>conn</b>'s outbuf,
+ * filling the last chunk before starting another, and ask it to start
+ * writing.  We copy the cell rather than adding it by reference: a chunk of
+ * its own would cost as much to allocate as the copy, and would go out as a
+ * TLS record of its own. */
+void
+connection_write_packed_cell_to_buf(const packed_cell_t *cell,
+                                    connection_t *conn, int wide_circ_ids)
+{
+  int r;
+  const size_t cell_network_size = get_cell_network_size(wide_circ_ids);
+  /* if it's marked for close, only allow write if we mean to flush it */
+  if (conn->marked_for_close && !conn->hold_open_until_flushed)
+    return;
+
+  IF_HAS_BUFFEREVENT(conn, {
+    connection_write_to_buf(cell->body, cell_network_size, conn);
+    return;
+  });
+
+  CONN_LOG_PROTECT(conn, r = write_to_buf(cell->body, cell_network_size,
+                                          conn->outbuf));
+  connection_handle_outbuf_write_result(conn, r, cell_network_size);
+}
+
 /** Return a connection with given type, address, port, and purpose;
  * or NULL if no such connection exists. */
 connection_t *
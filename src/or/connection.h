@@ -140,6 +140,14 @@ int connection_flush(connection_t *conn);
 
 MOCK_DECL(void, connection_write_to_buf_impl_,
           (const char *string, size_t len, connection_t *conn, int zlib));
+void connection_write_cell_to_buf(const cell_t *cell, connection_t *conn,
+                                  int wide_circ_ids);
+void connection_write_packed_cell_to_buf(const packed_cell_t *cell,
+                                         connection_t *conn,
+                                         int wide_circ_ids);
+void connection_write_ref_to_buf(const char *string, size_t len,
+                                 void (*free_fn)(void *), void *free_arg,
+                                 connection_t *conn);
 /* DOCDOC connection_write_to_buf */
 static void connection_write_to_buf(const char *string, size_t len,
                                     connection_t *conn);
@@ -29,6 +29,7 @@
 #include "dirserv.h"
 #include "entrynodes.h"
 #include "geoip.h"
+#include "histogram.h"
 #include "main.h"
 #include "link_handshake.h"
 #include "networkstatus.h"
@@ -438,8 +439,10 @@ cell_pack(packed_cell_t *dst, const cell_t *src, int wide_circ_ids)
   memcpy(dest+1, src->payload, CELL_PAYLOAD_SIZE);
 }
 
+#ifdef USE_BUFFEREVENTS
 /** Unpack the network-order buffer <b>src</b> into a host-order
- * cell_t structure <b>dest</b>.
+ * cell_t structure <b>dest</b>.  (Without bufferevents, we use
+ * fetch_cell_from_buf() to do this straight from the inbuf.)
  */
 static void
 cell_unpack(cell_t *dest, const char *src, int wide_circ_ids)
@@ -454,6 +457,7 @@ cell_unpack(cell_t *dest, const char *src, int wide_circ_ids)
   dest->command = get_uint8(src);
   memcpy(dest->payload, src+1, CELL_PAYLOAD_SIZE);
 }
+#endif
 
 /** Write the header of <b>cell</b> into the first VAR_CELL_MAX_HEADER_SIZE
  * bytes of <b>hdr_out</b>. Returns number of bytes used. */
@@ -1958,15 +1962,10 @@ connection_or_set_state_open(or_connection_t *conn)
 void
 connection_or_write_cell_to_buf(const cell_t *cell, or_connection_t *conn)
 {
-  packed_cell_t networkcell;
-  size_t cell_network_size = get_cell_network_size(conn->wide_circ_ids);
-
   tor_assert(cell);
   tor_assert(conn);
 
-  cell_pack(&networkcell, cell, conn->wide_circ_ids);
-
-  connection_write_to_buf(networkcell.body, cell_network_size, TO_CONN(conn));
+  connection_write_cell_to_buf(cell, TO_CONN(conn), conn->wide_circ_ids);
 
   /* Touch the channel's active timestamp if there is one */
   if (conn->chan)
@@ -2000,6 +1999,91 @@ connection_or_write_var_cell_to_buf,(const var_cell_t *cell,
     channel_timestamp_active(TLS_CHAN_TO_BASE(conn->chan));
 }
 
+/** Largest number of cells on a single OR connection's outbuf whose
+ * latency we'll measure at once.  If more cells than this are waiting,
+ * we don't time the extra ones, but we count them in the channel's
+ * n_outbuf_untimed so that readers can tell how much the histogram
+ * leaves out. */
+#define OUTBUF_MARKS_MAX 64
+
+/** Timestamps for some of the cells on an OR connection's outbuf, so we can
+ * tell how long each one waits there before flush_buf_tls() sends it. */
+typedef struct or_conn_outbuf_marks_t {
+  /** Total number of bytes flushed from the outbuf since we started
+   * keeping marks. */
+  uint64_t n_flushed;
+  /** Index of the oldest mark in <b>marks</b>. */
+  int head;
+  /** Number of marks in use. */
+  int n;
+  /** A ring buffer of marks, oldest first. */
+  struct {
+    /** Value that n_flushed will have once this cell has been flushed. */
+    uint64_t flushed_at;
+    /** When this cell was added to the outbuf, as from
+     * cell_latency_timestamp(). */
+    uint32_t added_usec;
+  } marks[OUTBUF_MARKS_MAX];
+} or_conn_outbuf_marks_t;
+
+/** Note that we're about to add a <b>cell_len</b>-byte cell to the end of
+ * <b>conn</b>'s outbuf, so that connection_or_note_outbuf_flushed() can
+ * tell how long it waited there. */
+void
+connection_or_note_cell_to_outbuf(or_connection_t *conn, size_t cell_len)
+{
+  or_conn_outbuf_marks_t *om;
+  int idx;
+
+  if (!conn->outbuf_marks)
+    conn->outbuf_marks = tor_malloc_zero(sizeof(or_conn_outbuf_marks_t));
+  om = conn->outbuf_marks;
+  if (om->n == OUTBUF_MARKS_MAX) {
+    if (conn->chan)
+      ++TLS_CHAN_TO_BASE(conn->chan)->n_outbuf_untimed;
+    return;
+  }
+
+  idx = (om->head + om->n) % OUTBUF_MARKS_MAX;
+  om->marks[idx].flushed_at =
+    om->n_flushed + connection_get_outbuf_len(TO_CONN(conn)) + cell_len;
+  om->marks[idx].added_usec = cell_latency_timestamp();
+  ++om->n;
+}
+
+/** Note that <b>n_flushed</b> bytes have been flushed from the front of
+ * <b>conn</b>'s outbuf, and record the latency of every timed cell that
+ * has now been sent in its channel's outbuf_latency histogram. */
+void
+connection_or_note_outbuf_flushed(or_connection_t *conn, size_t n_flushed)
+{
+  or_conn_outbuf_marks_t *om = conn->outbuf_marks;
+  channel_t *chan;
+
+  if (!om)
+    return;
+  om->n_flushed += n_flushed;
+  chan = conn->chan ? TLS_CHAN_TO_BASE(conn->chan) : NULL;
+
+  while (om->n && om->marks[om->head].flushed_at <= om->n_flushed) {
+    if (chan) {
+      if (!chan->outbuf_latency)
+        chan->outbuf_latency = histogram_new();
+      histogram_add(chan->outbuf_latency,
+                    cell_latency_since(om->marks[om->head].added_usec));
+    }
+    om->head = (om->head + 1) % OUTBUF_MARKS_MAX;
+    --om->n;
+  }
+}
+
+/** Release all storage held for timing cells on <b>conn</b>'s outbuf. */
+void
+connection_or_clear_outbuf_marks(or_connection_t *conn)
+{
+  tor_free(conn->outbuf_marks);
+}
+
 /** See whether there's a variable-length cell waiting on <b>or_conn</b>'s
  * inbuf.  Return values as for fetch_var_cell_from_buf(). */
 static int
@@ -2014,10 +2098,49 @@ connection_fetch_var_cell_from_buf(or_connection_t *or_conn, var_cell_t **out)
   }
 }
 
+/** Hand the <b>n_cells</b> fixed-length cells in <b>cells</b>, which we
+ * just pulled off <b>conn</b>'s inbuf, to the channel layer in order. If
+ * there are several, let the relay crypto prepare for them all at once
+ * first. */
+static void
+connection_or_handle_cell_batch(or_connection_t *conn, cell_t *cells,
+                                int n_cells)
+{
+  int i;
+
+  if (n_cells > 1 && conn->chan)
+    relay_crypt_prepare_cell_batch(TLS_CHAN_TO_BASE(conn->chan),
+                                   cells, n_cells);
+
+  for (i = 0; i < n_cells; ++i)
+    channel_tls_handle_cell(&cells[i], conn);
+}
+
+/** If <b>or_conn</b>'s inbuf starts with a whole fixed-length cell, pull it
+ * off and unpack it into *<b>out</b>, and return 1. Otherwise return 0. */
+static int
+connection_fetch_cell_from_buf(or_connection_t *or_conn, cell_t *out)
+{
+  connection_t *conn = TO_CONN(or_conn);
+  IF_HAS_BUFFEREVENT(conn, {
+    char buf[CELL_MAX_NETWORK_SIZE];
+    size_t cell_network_size = get_cell_network_size(or_conn->wide_circ_ids);
+    if (connection_get_inbuf_len(conn) < cell_network_size)
+      return 0;
+    connection_fetch_from_buf(buf, cell_network_size, conn);
+    cell_unpack(out, buf, or_conn->wide_circ_ids);
+    return 1;
+  }) ELSE_IF_NO_BUFFEREVENT {
+    return fetch_cell_from_buf(conn->inbuf, out, or_conn->wide_circ_ids);
+  }
+}
+
 /** Process cells from <b>conn</b>'s inbuf.
  *
  * Loop: while inbuf contains a cell, pull it off the inbuf, unpack it,
- * and hand it to command_process_cell().
+ * and hand it to command_process_cell().  Once the connection is open,
+ * we pull off up to RELAY_CRYPT_BATCH_MAX consecutive fixed-length cells
+ * before handing them over, so that their relay crypto can be batched.
  *
  * Always return 0.
  */
@@ -2025,6 +2148,8 @@ static int
 connection_or_process_cells_from_inbuf(or_connection_t *conn)
 {
   var_cell_t *var_cell;
+  cell_t cells[RELAY_CRYPT_BATCH_MAX];
+  int n_cells = 0;
 
   while (1) {
     log_debug(LD_OR,
@@ -2033,6 +2158,10 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
               conn->base_.s,(int)connection_get_inbuf_len(TO_CONN(conn)),
               tor_tls_get_pending_bytes(conn->tls));
     if (connection_fetch_var_cell_from_buf(conn, &var_cell)) {
+      /* Anything we've already pulled off the inbuf came first. */
+      connection_or_handle_cell_batch(conn, cells, n_cells);
+      n_cells = 0;
+
       if (!var_cell)
         return 0; /* not yet. */
 
@@ -2044,26 +2173,28 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
       channel_tls_handle_var_cell(var_cell, conn);
       var_cell_free(var_cell);
     } else {
-      const int wide_circ_ids = conn->wide_circ_ids;
-      size_t cell_network_size = get_cell_network_size(conn->wide_circ_ids);
-      char buf[CELL_MAX_NETWORK_SIZE];
-      cell_t cell;
-      if (connection_get_inbuf_len(TO_CONN(conn))
-          < cell_network_size) /* whole response available? */
+      /* retrieve cell info from the inbuf (create the host-order struct
+       * from the network-order string) */
+      if (!connection_fetch_cell_from_buf(conn, &cells[n_cells])) {
+        /* whole cell not available yet */
+        connection_or_handle_cell_batch(conn, cells, n_cells);
         return 0; /* not yet */
+      }
+      ++n_cells;
 
       /* Touch the channel's active timestamp if there is one */
       if (conn->chan)
         channel_timestamp_active(TLS_CHAN_TO_BASE(conn->chan));
 
       circuit_build_times_network_is_live(get_circuit_build_times_mutable());
-      connection_fetch_from_buf(buf, cell_network_size, TO_CONN(conn));
-
-      /* retrieve cell info from buf (create the host-order struct from the
-       * network-order string) */
-      cell_unpack(&cell, buf, wide_circ_ids);
 
-      channel_tls_handle_cell(&cell, conn);
+      /* Until the handshake is done, every cell can change how we read the
+       * next one, so don't hold any of them back. */
+      if (n_cells == RELAY_CRYPT_BATCH_MAX ||
+          conn->base_.state != OR_CONN_STATE_OPEN) {
+        connection_or_handle_cell_batch(conn, cells, n_cells);
+        n_cells = 0;
+      }
     }
   }
 }
@@ -80,6 +80,11 @@ void connection_or_write_cell_to_buf(const cell_t *cell,
                                      or_connection_t *conn);
 MOCK_DECL(void,connection_or_write_var_cell_to_buf,(const var_cell_t *cell,
                                                    or_connection_t *conn));
+void connection_or_note_cell_to_outbuf(or_connection_t *conn,
+                                       size_t cell_len);
+void connection_or_note_outbuf_flushed(or_connection_t *conn,
+                                       size_t n_flushed);
+void connection_or_clear_outbuf_marks(or_connection_t *conn);
 int connection_or_send_versions(or_connection_t *conn, int v3_plus);
 MOCK_DECL(int,connection_or_send_netinfo,(or_connection_t *conn));
 int connection_or_send_certs_cell(or_connection_t *conn);
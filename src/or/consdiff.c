@@ -0,0 +1,639 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file consdiff.c
+ * \brief Generate and apply ed-style diffs between consensus documents.
+ *
+ * A consensus diff looks like this:
+ *
+ *   network-status-diff-version 1
+ *   hash [hex SHA256 of the base] [hex SHA256 of the target]
+ *   [ed commands]
+ *
+ * The ed commands are "N,Mc", "Nc", "N,Md", "Nd" and "Na".  Each "c" and
+ * "a" command is followed by the lines it adds, and then by a line
+ * containing only a ".".  Commands appear in decreasing order of line
+ * number, so that applying one never changes the line numbers in the ones
+ * after it; we refuse diffs whose commands overlap or are out of order.
+ *
+ * Consecutive consensuses mostly differ in a few router entries, and router
+ * entries are sorted by identity.  So rather than running a general diff
+ * algorithm over the whole document, we match up router entries by identity
+ * and diff each pair on its own.  That keeps the work linear in the size of
+ * the documents.
+ **/
+
+#define CONSDIFF_PRIVATE
+#include "or.h"
+#include "consdiff.h"
+
+/** Don't run the quadratic longest-common-subsequence algorithm on a pair of
+ * ranges whose lengths multiply to more than this; replace the whole range
+ * instead. */
+#define CONSDIFF_MAX_LCS_CELLS (1<<20)
+
+/** A range of lines in the base document that a diff replaces with a range
+ * of lines from the target document.  Both ranges are 0-based and
+ * half-open. */
+typedef struct cdhunk_t {
+  int a_start, a_end;
+  int b_start, b_end;
+} cdhunk_t;
+
+/** State for building a list of hunks, in order, as we walk forward through
+ * the base and target documents. */
+typedef struct cdbuilder_t {
+  cdhunk_t *hunks;
+  int n_hunks;
+  int n_allocated;
+  /** True iff <b>cur</b> is a hunk we're still adding lines to. */
+  int open;
+  cdhunk_t cur;
+} cdbuilder_t;
+
+/** One command from a consensus diff, as we apply it. */
+typedef struct cdcommand_t {
+  /** The range of base lines that the command replaces; 0-based and
+   * half-open. */
+  int lo, hi;
+  /** Index of the first line in the diff to add in place of that range. */
+  int first_new;
+  /** Number of lines in the diff to add in place of that range. */
+  int n_new;
+} cdcommand_t;
+
+/** Split the <b>len</b>-byte string <b>s</b> into lines, and return them in
+ * a newly allocated array, setting *<b>n_out</b> to its length.  A newline
+ * at the very end of <b>s</b> doesn't start a new line. */
+STATIC cdline_t *
+consdiff_split_lines(const char *s, size_t len, int *n_out)
+{
+  const char *cp = s, *end = s + len;
+  int n = 0, n_allocated = 64;
+  cdline_t *lines = tor_malloc(n_allocated * sizeof(cdline_t));
+
+  while (cp < end) {
+    const char *eol = memchr(cp, '\n', end - cp);
+    if (!eol)
+      eol = end;
+    if (n == n_allocated) {
+      n_allocated *= 2;
+      lines = tor_reallocarray(lines, n_allocated, sizeof(cdline_t));
+    }
+    lines[n].s = cp;
+    lines[n].len = eol - cp;
+    ++n;
+    cp = eol + 1;
+  }
+  *n_out = n;
+  return lines;
+}
+
+/** Return true iff the lines <b>a</b> and <b>b</b> are the same. */
+static INLINE int
+lines_eq(const cdline_t *a, const cdline_t *b)
+{
+  return a->len == b->len && fast_memeq(a->s, b->s, a->len);
+}
+
+/** Return true iff <b>line</b> is exactly <b>s</b>. */
+static INLINE int
+line_is(const cdline_t *line, const char *s)
+{
+  return line->len == strlen(s) && fast_memeq(line->s, s, line->len);
+}
+
+/** Return true iff <b>line</b> starts with <b>prefix</b>. */
+static INLINE int
+line_starts_with(const cdline_t *line, const char *prefix)
+{
+  size_t n = strlen(prefix);
+  return line->len >= n && fast_memeq(line->s, prefix, n);
+}
+
+/** Add the hunk we're building in <b>bld</b>, if any, to its list. */
+static void
+cdbuilder_close(cdbuilder_t *bld)
+{
+  if (!bld->open)
+    return;
+  bld->open = 0;
+  if (bld->n_hunks == bld->n_allocated) {
+    bld->n_allocated = bld->n_allocated ? bld->n_allocated * 2 : 16;
+    bld->hunks = tor_reallocarray(bld->hunks, bld->n_allocated,
+                                  sizeof(cdhunk_t));
+  }
+  bld->hunks[bld->n_hunks++] = bld->cur;
+}
+
+/** Make sure that <b>bld</b> has a hunk open whose ranges end at base line
+ * <b>i</b> and target line <b>j</b>. */
+static void
+cdbuilder_open(cdbuilder_t *bld, int i, int j)
+{
+  if (!bld->open) {
+    bld->open = 1;
+    bld->cur.a_start = bld->cur.a_end = i;
+    bld->cur.b_start = bld->cur.b_end = j;
+  }
+  tor_assert(bld->cur.a_end == i);
+  tor_assert(bld->cur.b_end == j);
+}
+
+/** Note that we're removing the <b>n</b> base lines starting at <b>i</b>,
+ * and that the target is at line <b>j</b>. */
+static void
+cdbuilder_del(cdbuilder_t *bld, int i, int j, int n)
+{
+  if (!n)
+    return;
+  cdbuilder_open(bld, i, j);
+  bld->cur.a_end += n;
+}
+
+/** Note that we're adding the <b>n</b> target lines starting at <b>j</b>,
+ * and that the base is at line <b>i</b>. */
+static void
+cdbuilder_ins(cdbuilder_t *bld, int i, int j, int n)
+{
+  if (!n)
+    return;
+  cdbuilder_open(bld, i, j);
+  bld->cur.b_end += n;
+}
+
+/** Add to <b>bld</b> the hunks that turn base lines [<b>a_lo</b>,
+ * <b>a_hi</b>) of <b>a</b> into target lines [<b>b_lo</b>, <b>b_hi</b>) of
+ * <b>b</b>. */
+static void
+diff_range(cdbuilder_t *bld, const cdline_t *a, int a_lo, int a_hi,
+           const cdline_t *b, int b_lo, int b_hi)
+{
+  int n_suffix = 0, n, m, i, j;
+
+  while (a_lo < a_hi && b_lo < b_hi && lines_eq(&a[a_lo], &b[b_lo])) {
+    cdbuilder_close(bld);
+    ++a_lo;
+    ++b_lo;
+  }
+  while (a_lo < a_hi && b_lo < b_hi && lines_eq(&a[a_hi-1], &b[b_hi-1])) {
+    --a_hi;
+    --b_hi;
+    ++n_suffix;
+  }
+
+  n = a_hi - a_lo;
+  m = b_hi - b_lo;
+  if (n == 0 || m == 0 || (uint64_t)n * m > CONSDIFF_MAX_LCS_CELLS) {
+    cdbuilder_del(bld, a_lo, b_lo, n);
+    cdbuilder_ins(bld, a_hi, b_lo, m);
+  } else {
+    /* LCS(i,j) is the length of the longest common subsequence of
+     * a[a_lo+i .. a_hi) and b[b_lo+j .. b_hi). */
+    uint32_t *lcs = tor_calloc((size_t)(n+1) * (m+1), sizeof(uint32_t));
+#define LCS(i,j) lcs[(size_t)(i) * (m+1) + (j)]
+    for (i = n-1; i >= 0; --i) {
+      for (j = m-1; j >= 0; --j) {
+        if (lines_eq(&a[a_lo+i], &b[b_lo+j]))
+          LCS(i,j) = LCS(i+1,j+1) + 1;
+        else
+          LCS(i,j) = MAX(LCS(i+1,j), LCS(i,j+1));
+      }
+    }
+    i = j = 0;
+    while (i < n || j < m) {
+      if (i < n && j < m && lines_eq(&a[a_lo+i], &b[b_lo+j])) {
+        cdbuilder_close(bld);
+        ++i;
+        ++j;
+      } else if (j == m || (i < n && LCS(i+1,j) >= LCS(i,j+1))) {
+        cdbuilder_del(bld, a_lo+i, b_lo+j, 1);
+        ++i;
+      } else {
+        cdbuilder_ins(bld, a_lo+i, b_lo+j, 1);
+        ++j;
+      }
+    }
+#undef LCS
+    tor_free(lcs);
+  }
+
+  if (n_suffix)
+    cdbuilder_close(bld);
+}
+
+/** Return the value of the base64 digit <b>c</b>, or -1 if it isn't one. */
+static INLINE int
+base64_digit_value(char c)
+{
+  if (c >= 'A' && c <= 'Z')
+    return c - 'A';
+  if (c >= 'a' && c <= 'z')
+    return c - 'a' + 26;
+  if (c >= '0' && c <= '9')
+    return c - '0' + 52;
+  if (c == '+')
+    return 62;
+  if (c == '/')
+    return 63;
+  return -1;
+}
+
+/** If <b>line</b> is the "r" line of a router entry, return 0 and point
+ * *<b>id_out</b> and *<b>id_len_out</b> at the base64 identity digest on
+ * it.  Otherwise return -1. */
+static int
+get_entry_identity(const cdline_t *line, const char **id_out,
+                   size_t *id_len_out)
+{
+  const char *end = line->s + line->len, *cp, *id;
+  if (!line_starts_with(line, "r "))
+    return -1;
+  cp = memchr(line->s + 2, ' ', end - (line->s + 2));
+  if (!cp)
+    return -1;
+  id = ++cp;
+  while (cp < end && *cp != ' ') {
+    if (base64_digit_value(*cp) < 0)
+      return -1;
+    ++cp;
+  }
+  if (cp == id)
+    return -1;
+  *id_out = id;
+  *id_len_out = cp - id;
+  return 0;
+}
+
+/** Compare the router entries whose "r" lines are <b>a</b> and <b>b</b>,
+ * in the order that a consensus sorts them: by identity digest.  (Comparing
+ * base64 digit values one at a time gives the same order as comparing the
+ * digests themselves.) */
+static int
+compare_entries(const cdline_t *a, const cdline_t *b)
+{
+  const char *a_id = NULL, *b_id = NULL;
+  size_t a_len = 0, b_len = 0, i;
+  get_entry_identity(a, &a_id, &a_len);
+  get_entry_identity(b, &b_id, &b_len);
+  for (i = 0; i < a_len && i < b_len; ++i) {
+    int d = base64_digit_value(a_id[i]) - base64_digit_value(b_id[i]);
+    if (d)
+      return d;
+  }
+  if (a_len != b_len)
+    return a_len < b_len ? -1 : 1;
+  return 0;
+}
+
+/** Find the router entries in the <b>n</b> lines of <b>lines</b>.  On
+ * success, set *<b>starts_out</b> to a newly allocated list of the lines
+ * where the entries start, *<b>n_entries_out</b> to its length, and
+ * *<b>footer_out</b> to the line just after the last entry, and return 0.
+ * Return -1 if there are no entries, or they aren't strictly sorted by
+ * identity. */
+static int
+find_entries(const cdline_t *lines, int n, int **starts_out,
+             int *n_entries_out, int *footer_out)
+{
+  int *starts = NULL;
+  int n_entries = 0, n_allocated = 0, i, footer = n;
+  const char *id;
+  size_t id_len;
+
+  for (i = 0; i < n; ++i) {
+    if (line_starts_with(&lines[i], "directory-footer") ||
+        line_starts_with(&lines[i], "directory-signature ")) {
+      footer = i;
+      break;
+    }
+    if (!line_starts_with(&lines[i], "r "))
+      continue;
+    if (get_entry_identity(&lines[i], &id, &id_len) < 0)
+      goto err;
+    if (n_entries &&
+        compare_entries(&lines[starts[n_entries-1]], &lines[i]) >= 0)
+      goto err;
+    if (n_entries == n_allocated) {
+      n_allocated = n_allocated ? n_allocated * 2 : 256;
+      starts = tor_reallocarray(starts, n_allocated, sizeof(int));
+    }
+    starts[n_entries++] = i;
+  }
+  if (!n_entries)
+    goto err;
+
+  *starts_out = starts;
+  *n_entries_out = n_entries;
+  *footer_out = footer;
+  return 0;
+ err:
+  tor_free(starts);
+  return -1;
+}
+
+/** Add to <b>bld</b> the hunks that turn the <b>n_a</b> lines of <b>a</b>
+ * into the <b>n_b</b> lines of <b>b</b>. */
+static void
+diff_documents(cdbuilder_t *bld, const cdline_t *a, int n_a,
+               const cdline_t *b, int n_b)
+{
+  int *a_starts = NULL, *b_starts = NULL;
+  int a_n_entries, b_n_entries, a_footer, b_footer;
+  int ia = 0, ib = 0;
+
+  if (find_entries(a, n_a, &a_starts, &a_n_entries, &a_footer) < 0 ||
+      find_entries(b, n_b, &b_starts, &b_n_entries, &b_footer) < 0) {
+    /* This doesn't look like a consensus; diff it the slow way. */
+    diff_range(bld, a, 0, n_a, b, 0, n_b);
+    goto done;
+  }
+
+#define ENTRY_START(starts, idx, n_entries, footer) \
+  ((idx) < (n_entries) ? (starts)[idx] : (footer))
+#define A_START(idx) ENTRY_START(a_starts, (idx), a_n_entries, a_footer)
+#define B_START(idx) ENTRY_START(b_starts, (idx), b_n_entries, b_footer)
+
+  diff_range(bld, a, 0, a_starts[0], b, 0, b_starts[0]);
+  while (ia < a_n_entries || ib < b_n_entries) {
+    int c;
+    if (ia == a_n_entries)
+      c = 1;
+    else if (ib == b_n_entries)
+      c = -1;
+    else
+      c = compare_entries(&a[a_starts[ia]], &b[b_starts[ib]]);
+
+    if (c == 0) {
+      diff_range(bld, a, A_START(ia), A_START(ia+1),
+                 b, B_START(ib), B_START(ib+1));
+      ++ia;
+      ++ib;
+    } else if (c < 0) {
+      /* This router is gone. */
+      cdbuilder_del(bld, A_START(ia), B_START(ib),
+                    A_START(ia+1) - A_START(ia));
+      ++ia;
+    } else {
+      /* This router is new. */
+      cdbuilder_ins(bld, A_START(ia), B_START(ib),
+                    B_START(ib+1) - B_START(ib));
+      ++ib;
+    }
+  }
+  diff_range(bld, a, a_footer, n_a, b, b_footer, n_b);
+
+#undef A_START
+#undef B_START
+#undef ENTRY_START
+
+ done:
+  cdbuilder_close(bld);
+  tor_free(a_starts);
+  tor_free(b_starts);
+}
+
+/** Return a newly allocated ed-style diff that turns the consensus
+ * <b>base</b> into the consensus <b>target</b>, or NULL if we can't
+ * represent the change as a diff. */
+char *
+consdiff_gen_diff(const char *base, const char *target)
+{
+  size_t base_len = strlen(base), target_len = strlen(target);
+  cdline_t *a = NULL, *b = NULL;
+  int n_a, n_b, i, j;
+  cdbuilder_t bld;
+  smartlist_t *out = smartlist_new();
+  char digest[DIGEST256_LEN];
+  char base_hex[HEX_DIGEST256_LEN+1], target_hex[HEX_DIGEST256_LEN+1];
+  char *result = NULL;
+
+  memset(&bld, 0, sizeof(bld));
+  a = consdiff_split_lines(base, base_len, &n_a);
+  b = consdiff_split_lines(target, target_len, &n_b);
+  diff_documents(&bld, a, n_a, b, n_b);
+
+  crypto_digest256(digest, base, base_len, DIGEST_SHA256);
+  base16_encode(base_hex, sizeof(base_hex), digest, sizeof(digest));
+  crypto_digest256(digest, target, target_len, DIGEST_SHA256);
+  base16_encode(target_hex, sizeof(target_hex), digest, sizeof(digest));
+  smartlist_add_asprintf(out, "%s\n", CONSDIFF_FIRST_LINE);
+  smartlist_add_asprintf(out, "hash %s %s\n", base_hex, target_hex);
+
+  for (i = bld.n_hunks - 1; i >= 0; --i) {
+    const cdhunk_t *h = &bld.hunks[i];
+    if (h->a_start == h->a_end) {
+      smartlist_add_asprintf(out, "%da\n", h->a_start);
+    } else {
+      char cmd = (h->b_start == h->b_end) ? 'd' : 'c';
+      if (h->a_end - h->a_start == 1)
+        smartlist_add_asprintf(out, "%d%c\n", h->a_end, cmd);
+      else
+        smartlist_add_asprintf(out, "%d,%d%c\n", h->a_start+1, h->a_end, cmd);
+    }
+    for (j = h->b_start; j < h->b_end; ++j) {
+      if (line_is(&b[j], ".")) {
+        /* ed can't add a line that's just a dot. */
+        log_info(LD_DIR, "Can't make a diff to a document with a line "
+                 "containing only a dot.");
+        goto done;
+      }
+      smartlist_add_asprintf(out, "%.*s\n", (int)b[j].len, b[j].s);
+    }
+    if (h->b_start < h->b_end)
+      smartlist_add(out, tor_strdup(".\n"));
+  }
+
+  result = smartlist_join_strings(out, "", 0, NULL);
+
+ done:
+  SMARTLIST_FOREACH(out, char *, cp, tor_free(cp));
+  smartlist_free(out);
+  tor_free(bld.hunks);
+  tor_free(a);
+  tor_free(b);
+  return result;
+}
+
+/** Return the number of bytes it takes to write lines [<b>lo</b>,
+ * <b>hi</b>) of <b>lines</b>, with their newlines. */
+static size_t
+lines_size(const cdline_t *lines, int lo, int hi)
+{
+  size_t total = 0;
+  int i;
+  for (i = lo; i < hi; ++i)
+    total += lines[i].len + 1;
+  return total;
+}
+
+/** Copy lines [<b>lo</b>, <b>hi</b>) of <b>lines</b>, with their newlines,
+ * to <b>cp</b>, and return a pointer just past what we wrote. */
+static char *
+lines_copy(char *cp, const cdline_t *lines, int lo, int hi)
+{
+  int i;
+  for (i = lo; i < hi; ++i) {
+    memcpy(cp, lines[i].s, lines[i].len);
+    cp += lines[i].len;
+    *cp++ = '\n';
+  }
+  return cp;
+}
+
+/** Apply the consensus diff <b>diff</b> to the consensus <b>base</b>.
+ * Return the resulting consensus in a newly allocated string, or NULL if
+ * the diff is malformed, isn't meant for <b>base</b>, or doesn't give the
+ * document it promised. */
+char *
+consdiff_apply_diff(const char *base, const char *diff)
+{
+  cdline_t *a = NULL, *d = NULL;
+  int n_a = 0, n_d = 0, k, c, pos, prev_lo;
+  cdcommand_t *cmds = NULL;
+  int n_cmds = 0, n_allocated = 0;
+  char digest[DIGEST256_LEN];
+  char want_base[DIGEST256_LEN], want_target[DIGEST256_LEN];
+  const char *hash_line;
+  size_t base_len = strlen(base), total;
+  char *result = NULL, *cp;
+
+  d = consdiff_split_lines(diff, strlen(diff), &n_d);
+  if (n_d < 2 || !line_is(&d[0], CONSDIFF_FIRST_LINE)) {
+    log_info(LD_DIR, "Consensus diff has a bad header.");
+    goto err;
+  }
+  hash_line = d[1].s;
+  if (d[1].len != strlen("hash ") + 2*HEX_DIGEST256_LEN + 1 ||
+      !line_starts_with(&d[1], "hash ") ||
+      hash_line[strlen("hash ") + HEX_DIGEST256_LEN] != ' ' ||
+      base16_decode(want_base, sizeof(want_base),
+                    hash_line + strlen("hash "), HEX_DIGEST256_LEN) < 0 ||
+      base16_decode(want_target, sizeof(want_target),
+                    hash_line + strlen("hash ") + HEX_DIGEST256_LEN + 1,
+                    HEX_DIGEST256_LEN) < 0) {
+    log_info(LD_DIR, "Consensus diff has a bad hash line.");
+    goto err;
+  }
+  crypto_digest256(digest, base, base_len, DIGEST_SHA256);
+  if (tor_memneq(digest, want_base, DIGEST256_LEN)) {
+    log_info(LD_DIR, "Consensus diff isn't meant for the consensus we "
+             "have.");
+    goto err;
+  }
+
+  a = consdiff_split_lines(base, base_len, &n_a);
+  prev_lo = n_a;
+  k = 2;
+  while (k < n_d) {
+    char buf[32];
+    char *next = NULL;
+    int ok, start, end, lo, hi, has_end = 0;
+    char op;
+    if (d[k].len >= sizeof(buf))
+      goto bad_command;
+    memcpy(buf, d[k].s, d[k].len);
+    buf[d[k].len] = '\0';
+    start = end = (int)tor_parse_long(buf, 10, 0, n_a, &ok, &next);
+    if (!ok)
+      goto bad_command;
+    if (*next == ',') {
+      end = (int)tor_parse_long(next+1, 10, 0, n_a, &ok, &next);
+      if (!ok)
+        goto bad_command;
+      has_end = 1;
+    }
+    op = *next;
+    if (!op || next[1])
+      goto bad_command;
+    if (op == 'a') {
+      if (has_end)
+        goto bad_command; /* "a" takes a single line number. */
+      lo = hi = start;
+    } else if (op == 'c' || op == 'd') {
+      if (start < 1 || end < start)
+        goto bad_command;
+      lo = start - 1;
+      hi = end;
+    } else {
+      goto bad_command;
+    }
+    if (hi > prev_lo)
+      goto bad_command; /* Out of order, or overlapping. */
+    prev_lo = lo;
+
+    if (n_cmds == n_allocated) {
+      n_allocated = n_allocated ? n_allocated * 2 : 16;
+      cmds = tor_reallocarray(cmds, n_allocated, sizeof(cdcommand_t));
+    }
+    cmds[n_cmds].lo = lo;
+    cmds[n_cmds].hi = hi;
+    cmds[n_cmds].first_new = ++k;
+    if (op != 'd') {
+      while (k < n_d && !line_is(&d[k], "."))
+        ++k;
+      if (k == n_d)
+        goto bad_command; /* No terminating dot. */
+      cmds[n_cmds].n_new = k - cmds[n_cmds].first_new;
+      if (!cmds[n_cmds].n_new)
+        goto bad_command;
+      ++k;
+    } else {
+      cmds[n_cmds].n_new = 0;
+    }
+    ++n_cmds;
+  }
+
+  /* The commands are in decreasing order, so walk them backwards. */
+  total = 0;
+  pos = 0;
+  for (c = n_cmds - 1; c >= 0; --c) {
+    total += lines_size(a, pos, cmds[c].lo);
+    total += lines_size(d, cmds[c].first_new,
+                        cmds[c].first_new + cmds[c].n_new);
+    pos = cmds[c].hi;
+  }
+  total += lines_size(a, pos, n_a);
+
+  cp = result = tor_malloc(total + 1);
+  pos = 0;
+  for (c = n_cmds - 1; c >= 0; --c) {
+    cp = lines_copy(cp, a, pos, cmds[c].lo);
+    cp = lines_copy(cp, d, cmds[c].first_new,
+                    cmds[c].first_new + cmds[c].n_new);
+    pos = cmds[c].hi;
+  }
+  cp = lines_copy(cp, a, pos, n_a);
+  tor_assert(cp == result + total);
+  *cp = '\0';
+
+  crypto_digest256(digest, result, total, DIGEST_SHA256);
+  if (tor_memneq(digest, want_target, DIGEST256_LEN)) {
+    log_info(LD_DIR, "Consensus diff didn't give the document it promised.");
+    goto err;
+  }
+  goto done;
+
+ bad_command:
+  log_info(LD_DIR, "Consensus diff has a bad command on line %d.", k+1);
+ err:
+  tor_free(result);
+ done:
+  tor_free(a);
+  tor_free(d);
+  tor_free(cmds);
+  return result;
+}
+
+/** Return true iff the <b>len</b>-byte <b>document</b> looks like a
+ * consensus diff, rather than a consensus. */
+int
+looks_like_a_consensus_diff(const char *document, size_t len)
+{
+  const size_t first_len = strlen(CONSDIFF_FIRST_LINE);
+  return len >= first_len &&
+    fast_memeq(document, CONSDIFF_FIRST_LINE, first_len) &&
+    (len == first_len || document[first_len] == '\n');
+}
+
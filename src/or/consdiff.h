@@ -0,0 +1,35 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file consdiff.h
+ * \brief Header file for consdiff.c.
+ **/
+
+#ifndef TOR_CONSDIFF_H
+#define TOR_CONSDIFF_H
+
+#include "testsupport.h"
+
+/** The first line of every consensus diff. */
+#define CONSDIFF_FIRST_LINE "network-status-diff-version 1"
+
+char *consdiff_gen_diff(const char *base, const char *target);
+char *consdiff_apply_diff(const char *base, const char *diff);
+int looks_like_a_consensus_diff(const char *document, size_t len);
+
+#ifdef CONSDIFF_PRIVATE
+
+/** One line of a document that we're diffing: a pointer into the
+ * document, and the length of the line, not counting its newline. */
+typedef struct cdline_t {
+  const char *s;
+  size_t len;
+} cdline_t;
+
+STATIC cdline_t *consdiff_split_lines(const char *s, size_t len,
+                                      int *n_out);
+#endif
+
+#endif
+
@@ -32,6 +32,7 @@
 #include "dnsserv.h"
 #include "entrynodes.h"
 #include "geoip.h"
+#include "histogram.h"
 #include "hibernate.h"
 #include "main.h"
 #include "networkstatus.h"
@@ -2560,6 +2561,10 @@ static const getinfo_item_t getinfo_items[] = {
          "v2 networkstatus docs as retrieved from a DirPort."),
   ITEM("dir/status-vote/current/consensus", dir,
        "v3 Networkstatus consensus as retrieved from a DirPort."),
+  ITEM("cell-latency/summary", cell_latency,
+       "Cell queue and outbuf latency percentiles across all channels."),
+  ITEM("cell-latency/channels", cell_latency,
+       "Cell queue and outbuf latency percentiles for each channel."),
   ITEM("exit-policy/default", policies,
        "The default value appended to the configured exit policy."),
   ITEM("exit-policy/reject-private/default", policies,
@@ -5007,6 +5012,20 @@ append_cell_stats_by_command(smartlist_t *event_parts, const char *key,
   smartlist_free(key_value_strings);
 }
 
+/** Helper: if <b>hist</b> is set, append a summary of the cell latencies
+ * it holds to <b>event_parts</b>, prefixed with <b>key</b>=. */
+static void
+append_cell_latency(smartlist_t *event_parts, const char *key,
+                    const histogram_t *hist)
+{
+  char *summary;
+  if (!hist)
+    return;
+  summary = histogram_format(hist);
+  smartlist_add_asprintf(event_parts, "%s=%s", key, summary);
+  tor_free(summary);
+}
+
 /** Helper: format <b>cell_stats</b> for <b>circ</b> for inclusion in a
  * CELL_STATS event and write result string to <b>event_string</b>. */
 void
@@ -5033,6 +5052,8 @@ format_cell_stats(char **event_string, circuit_t *circ,
     append_cell_stats_by_command(event_parts, "InboundTime",
                                  cell_stats->removed_cells_appward,
                                  cell_stats->total_time_appward);
+    append_cell_latency(event_parts, "InboundLatency",
+                        circ->cell_latency_appward);
   }
   if (circ->n_chan) {
     smartlist_add_asprintf(event_parts, "OutboundQueue=%lu",
@@ -5048,6 +5069,8 @@ format_cell_stats(char **event_string, circuit_t *circ,
     append_cell_stats_by_command(event_parts, "OutboundTime",
                                  cell_stats->removed_cells_exitward,
                                  cell_stats->total_time_exitward);
+    append_cell_latency(event_parts, "OutboundLatency",
+                        circ->cell_latency_exitward);
   }
   *event_string = smartlist_join_strings(event_parts, " ", 0, NULL);
   SMARTLIST_FOREACH(event_parts, char *, cp, tor_free(cp));
@@ -5066,13 +5089,19 @@ control_event_circuit_cell_stats(void)
     return 0;
   cell_stats = tor_malloc(sizeof(cell_stats_t));;
   SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
-    if (!circ->testing_cell_stats)
-      continue;
-    sum_up_cell_stats_by_command(circ, cell_stats);
-    format_cell_stats(&event_string, circ, cell_stats);
-    send_control_event(EVENT_CELL_STATS,
-                       "650 CELL_STATS %s\r\n", event_string);
-    tor_free(event_string);
+    if (circ->testing_cell_stats) {
+      sum_up_cell_stats_by_command(circ, cell_stats);
+      format_cell_stats(&event_string, circ, cell_stats);
+      send_control_event(EVENT_CELL_STATS,
+                         "650 CELL_STATS %s\r\n", event_string);
+      tor_free(event_string);
+    }
+    /* Like the counts above, the latencies in each event cover only the
+     * cells since the last one. */
+    histogram_free(circ->cell_latency_exitward);
+    circ->cell_latency_exitward = NULL;
+    histogram_free(circ->cell_latency_appward);
+    circ->cell_latency_appward = NULL;
   }
   SMARTLIST_FOREACH_END(circ);
   tor_free(cell_stats);
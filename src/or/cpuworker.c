@@ -8,8 +8,11 @@
  * \brief Uses the workqueue/threadpool code to farm CPU-intensive activities
  * out to subprocesses.
  *
- * Right now, we only use this for processing onionskins.
+ * Right now, we use this for processing onionskins, and (if
+ * RelayCryptoThreads is set) for crypting relay cells headed back toward
+ * the origins of our OR circuits.
  **/
+#define CPUWORKER_PRIVATE
 #include "or.h"
 #include "channel.h"
 #include "circuitbuild.h"
@@ -19,6 +22,7 @@
 #include "cpuworker.h"
 #include "main.h"
 #include "onion.h"
+#include "relay.h"
 #include "rephist.h"
 #include "router.h"
 #include "workqueue.h"
@@ -29,8 +33,6 @@
 #include <event.h>
 #endif
 
-static void queue_pending_tasks(void);
-
 typedef struct worker_state_s {
   int generation;
   server_onion_keys_t *onion_keys;
@@ -55,12 +57,32 @@ worker_state_free(void *arg)
 
 static replyqueue_t *replyqueue = NULL;
 static threadpool_t *threadpool = NULL;
+/** Thread pool for crypting relay cells, or NULL if we do that in the main
+ * thread. Shares replyqueue with threadpool. */
+static threadpool_t *relaycrypt_threadpool = NULL;
 static struct event *reply_event = NULL;
 
 static tor_weak_rng_t request_sample_rng = TOR_WEAK_RNG_INIT;
 
+/** How many onion handshakes have we handed to threadpool, and not yet
+ * gotten answers for? */
 static int total_pending_tasks = 0;
 static int max_pending_tasks = 128;
+/** How many threads are in threadpool? */
+static int n_onion_threads = 1;
+
+/** Relay crypto threads don't need any state of their own. */
+static void *
+relaycrypt_state_new(void *arg)
+{
+  (void)arg;
+  return NULL;
+}
+static void
+relaycrypt_state_free(void *arg)
+{
+  (void)arg;
+}
 
 static void
 replyqueue_process_cb(evutil_socket_t sock, short events, void *arg)
@@ -89,12 +111,20 @@ cpu_init(void)
     event_add(reply_event, NULL);
   }
   if (!threadpool) {
-    threadpool = threadpool_new(get_num_cpus(get_options()),
+    n_onion_threads = get_num_cpus(get_options());
+    threadpool = threadpool_new(n_onion_threads,
                                 replyqueue,
                                 worker_state_new,
                                 worker_state_free,
                                 NULL);
   }
+  if (!relaycrypt_threadpool && get_options()->RelayCryptoThreads > 0) {
+    relaycrypt_threadpool = threadpool_new(get_options()->RelayCryptoThreads,
+                                           replyqueue,
+                                           relaycrypt_state_new,
+                                           relaycrypt_state_free,
+                                           NULL);
+  }
   /* Total voodoo. Can we make this more sensible? */
   max_pending_tasks = get_num_cpus(get_options()) * 64;
   crypto_seed_weak_rng(&request_sample_rng);
@@ -152,14 +182,59 @@ typedef struct cpuworker_reply_t {
   uint8_t rend_auth_material[DIGEST_LEN];
 } cpuworker_reply_t;
 
-typedef struct cpuworker_job_u {
+/** One onion handshake within a cpuworker_job_t. */
+typedef struct cpuworker_handshake_t {
   or_circuit_t *circ;
   union {
     cpuworker_request_t request;
     cpuworker_reply_t reply;
   } u;
+} cpuworker_handshake_t;
+
+/** Largest number of onion handshakes that we'll put in a single job.
+ * Batching them saves us a trip through the work queue and the reply queue
+ * per handshake when we're busy, but we don't want to leave threads idle
+ * while one of them works through a long batch. */
+#define CPUWORKER_MAX_BATCH 8
+
+/** A batch of onion handshakes for a worker thread to do in a row.  Every
+ * circuit in the batch has its workqueue_entry set to this job's entry. */
+typedef struct cpuworker_job_t {
+  /** Number of handshakes in <b>handshakes</b>. */
+  int n_handshakes;
+  /** Number of handshakes we have room for in <b>handshakes</b>. */
+  int n_allocated;
+  cpuworker_handshake_t handshakes[FLEXIBLE_ARRAY_MEMBER];
 } cpuworker_job_t;
 
+/** Return the size of a cpuworker_job_t with room for <b>n</b>
+ * handshakes. */
+#define CPUWORKER_JOB_LEN(n) \
+  (STRUCT_OFFSET(cpuworker_job_t, handshakes) + \
+   (n) * sizeof(cpuworker_handshake_t))
+
+/** Allocate and return a new cpuworker_job_t with room for <b>n</b>
+ * handshakes. */
+static cpuworker_job_t *
+cpuworker_job_new(int n)
+{
+  cpuworker_job_t *job;
+  tor_assert(n > 0 && n <= CPUWORKER_MAX_BATCH);
+  job = tor_malloc_zero(CPUWORKER_JOB_LEN(n));
+  job->n_allocated = n;
+  return job;
+}
+
+/** Wipe and free <b>job</b>. */
+static void
+cpuworker_job_free(cpuworker_job_t *job)
+{
+  if (!job)
+    return;
+  memwipe(job, 0, CPUWORKER_JOB_LEN(job->n_allocated));
+  tor_free(job);
+}
+
 static workqueue_reply_t
 update_state_threadfn(void *state_, void *work_)
 {
@@ -205,6 +280,10 @@ static uint64_t onionskins_usec_internal[MAX_ONION_HANDSHAKE_TYPE+1];
  * cpuworkers to give us answers for that kind of onionskin?
  */
 static uint64_t onionskins_usec_roundtrip[MAX_ONION_HANDSHAKE_TYPE+1];
+/** Indexed by handshake type, corresponding to onionskins counted in
+ * onionskins_n_processed: what's the total, over all those onionskins, of
+ * the number of handshakes in the batch that each one was sent in? */
+static uint64_t onionskins_batch_total[MAX_ONION_HANDSHAKE_TYPE+1];
 
 /** If any onionskin takes longer than this, we clip them to this
  * time. (microseconds) */
@@ -284,6 +363,7 @@ cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
 {
   uint32_t overhead;
   double relative_overhead;
+  double batch_size;
   int r;
 
   r = get_overhead_for_onionskins(&overhead,  &relative_overhead,
@@ -291,17 +371,22 @@ cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
   if (!overhead || r<0)
     return;
 
+  batch_size = U64_TO_DBL(onionskins_batch_total[onionskin_type]) /
+    U64_TO_DBL(onionskins_n_processed[onionskin_type]);
+
   log_fn(severity, LD_OR,
          "%s onionskins have averaged %u usec overhead (%.2f%%) in "
-         "cpuworker code ",
-         onionskin_type_name, (unsigned)overhead, relative_overhead*100);
+         "cpuworker code, in batches of %.2f on average.",
+         onionskin_type_name, (unsigned)overhead, relative_overhead*100,
+         batch_size);
 }
 
-/** Handle a reply from the worker threads. */
+/** Handle the reply for one handshake in a batch of <b>batch_size</b> that
+ * came back from the worker threads. */
 static void
-cpuworker_onion_handshake_replyfn(void *work_)
+cpuworker_onion_handshake_reply_one(cpuworker_handshake_t *hs,
+                                    int batch_size)
 {
-  cpuworker_job_t *job = work_;
   cpuworker_reply_t rpl;
   or_circuit_t *circ = NULL;
 
@@ -309,7 +394,7 @@ cpuworker_onion_handshake_replyfn(void *work_)
   --total_pending_tasks;
 
   /* Could avoid this, but doesn't matter. */
-  memcpy(&rpl, &job->u.reply, sizeof(rpl));
+  memcpy(&rpl, &hs->u.reply, sizeof(rpl));
 
   tor_assert(rpl.magic == CPUWORKER_REPLY_MAGIC);
 
@@ -327,26 +412,28 @@ cpuworker_onion_handshake_replyfn(void *work_)
       ++onionskins_n_processed[rpl.handshake_type];
       onionskins_usec_internal[rpl.handshake_type] += rpl.n_usec;
       onionskins_usec_roundtrip[rpl.handshake_type] += usec_roundtrip;
+      onionskins_batch_total[rpl.handshake_type] += batch_size;
       if (onionskins_n_processed[rpl.handshake_type] >= 500000) {
         /* Scale down every 500000 handshakes.  On a busy server, that's
          * less impressive than it sounds. */
         onionskins_n_processed[rpl.handshake_type] /= 2;
         onionskins_usec_internal[rpl.handshake_type] /= 2;
         onionskins_usec_roundtrip[rpl.handshake_type] /= 2;
+        onionskins_batch_total[rpl.handshake_type] /= 2;
       }
     }
   }
 
-  circ = job->circ;
+  circ = hs->circ;
 
   log_debug(LD_OR,
             "Unpacking cpuworker reply %p, circ=%p, success=%d",
-            job, circ, rpl.success);
+            hs, circ, rpl.success);
 
   if (circ->base_.magic == DEAD_CIRCUIT_MAGIC) {
     /* The circuit was supposed to get freed while the reply was
      * pending. Instead, it got left for us to free so that we wouldn't freak
-     * out when the job->circ field wound up pointing to nothing. */
+     * out when the hs->circ field wound up pointing to nothing. */
     log_debug(LD_OR, "Circuit died while reply was pending. Freeing memory.");
     circ->base_.magic = 0;
     tor_free(circ);
@@ -381,101 +468,243 @@ cpuworker_onion_handshake_replyfn(void *work_)
 
  done_processing:
   memwipe(&rpl, 0, sizeof(rpl));
-  memwipe(job, 0, sizeof(*job));
-  tor_free(job);
+}
+
+/** Handle a reply from the worker threads. */
+static void
+cpuworker_onion_handshake_replyfn(void *work_)
+{
+  cpuworker_job_t *job = work_;
+  int i;
+
+  for (i = 0; i < job->n_handshakes; ++i) {
+    cpuworker_onion_handshake_reply_one(&job->handshakes[i],
+                                        job->n_handshakes);
+  }
+
+  cpuworker_job_free(job);
   queue_pending_tasks();
 }
 
-/** Implementation function for onion handshake requests. */
+/** Implementation function for onion handshake requests.  We do all the
+ * handshakes in the job with a single call to
+ * onion_skin_server_handshake_batch(), so that ntor handshakes can share
+ * work with one another. */
 static workqueue_reply_t
 cpuworker_onion_handshake_threadfn(void *state_, void *work_)
 {
   worker_state_t *state = state_;
   cpuworker_job_t *job = work_;
+  const int n_handshakes = job->n_handshakes;
 
   /* variables for onion processing */
   server_onion_keys_t *onion_keys = state->onion_keys;
-  cpuworker_request_t req;
-  cpuworker_reply_t rpl;
-
-  memcpy(&req, &job->u.request, sizeof(req));
-
-  tor_assert(req.magic == CPUWORKER_REQUEST_MAGIC);
-  memset(&rpl, 0, sizeof(rpl));
-
-  const create_cell_t *cc = &req.create_cell;
-  created_cell_t *cell_out = &rpl.created_cell;
+  cpuworker_request_t req[CPUWORKER_MAX_BATCH];
+  cpuworker_reply_t rpl[CPUWORKER_MAX_BATCH];
+  onion_server_handshake_t hs[CPUWORKER_MAX_BATCH];
   struct timeval tv_start = {0,0}, tv_end;
-  int n;
-  rpl.timed = req.timed;
-  rpl.started_at = req.started_at;
-  rpl.handshake_type = cc->handshake_type;
-  if (req.timed)
-    tor_gettimeofday(&tv_start);
-  n = onion_skin_server_handshake(cc->handshake_type,
-                                  cc->onionskin, cc->handshake_len,
-                                  onion_keys,
-                                  cell_out->reply,
-                                  rpl.keys, CPATH_KEY_MATERIAL_LEN,
-                                  rpl.rend_auth_material);
-  if (n < 0) {
-    /* failure */
-    log_debug(LD_OR,"onion_skin_server_handshake failed.");
-    memset(&rpl, 0, sizeof(rpl));
-    rpl.success = 0;
-  } else {
-    /* success */
-    log_debug(LD_OR,"onion_skin_server_handshake succeeded.");
-    cell_out->handshake_len = n;
-    switch (cc->cell_type) {
-    case CELL_CREATE:
-      cell_out->cell_type = CELL_CREATED; break;
-    case CELL_CREATE2:
-      cell_out->cell_type = CELL_CREATED2; break;
-    case CELL_CREATE_FAST:
-      cell_out->cell_type = CELL_CREATED_FAST; break;
-    default:
-      tor_assert(0);
-      return WQ_RPL_SHUTDOWN;
-    }
-    rpl.success = 1;
+  int i, any_timed = 0;
+  workqueue_reply_t result = WQ_RPL_REPLY;
+  uint32_t n_usec = 0;
+
+  tor_assert(n_handshakes <= CPUWORKER_MAX_BATCH);
+  memset(rpl, 0, sizeof(rpl));
+  memset(hs, 0, sizeof(hs));
+
+  for (i = 0; i < n_handshakes; ++i) {
+    const create_cell_t *cc;
+    memcpy(&req[i], &job->handshakes[i].u.request, sizeof(req[i]));
+    tor_assert(req[i].magic == CPUWORKER_REQUEST_MAGIC);
+
+    cc = &req[i].create_cell;
+    rpl[i].timed = req[i].timed;
+    rpl[i].started_at = req[i].started_at;
+    rpl[i].handshake_type = cc->handshake_type;
+    any_timed |= req[i].timed;
+
+    hs[i].type = cc->handshake_type;
+    hs[i].onion_skin = cc->onionskin;
+    hs[i].onionskin_len = cc->handshake_len;
+    hs[i].reply_out = rpl[i].created_cell.reply;
+    hs[i].keys_out = rpl[i].keys;
+    hs[i].keys_out_len = CPATH_KEY_MATERIAL_LEN;
+    hs[i].rend_nonce_out = rpl[i].rend_auth_material;
   }
-  rpl.magic = CPUWORKER_REPLY_MAGIC;
-  if (req.timed) {
+
+  if (any_timed)
+    tor_gettimeofday(&tv_start);
+  onion_skin_server_handshake_batch(n_handshakes, hs, onion_keys);
+  if (any_timed) {
+    /* Charge each handshake an equal share of the time for the batch. */
     struct timeval tv_diff;
     int64_t usec;
     tor_gettimeofday(&tv_end);
     timersub(&tv_end, &tv_start, &tv_diff);
     usec = ((int64_t)tv_diff.tv_sec)*1000000 + tv_diff.tv_usec;
+    if (n_handshakes)
+      usec /= n_handshakes;
     if (usec < 0 || usec > MAX_BELIEVABLE_ONIONSKIN_DELAY)
-      rpl.n_usec = MAX_BELIEVABLE_ONIONSKIN_DELAY;
+      n_usec = MAX_BELIEVABLE_ONIONSKIN_DELAY;
     else
-      rpl.n_usec = (uint32_t) usec;
+      n_usec = (uint32_t) usec;
   }
 
-  memcpy(&job->u.reply, &rpl, sizeof(rpl));
+  for (i = 0; i < n_handshakes; ++i) {
+    const create_cell_t *cc = &req[i].create_cell;
+    created_cell_t *cell_out = &rpl[i].created_cell;
+    if (hs[i].result < 0) {
+      /* failure */
+      log_debug(LD_OR,"onion_skin_server_handshake failed.");
+      memset(&rpl[i], 0, sizeof(rpl[i]));
+      rpl[i].success = 0;
+    } else {
+      /* success */
+      log_debug(LD_OR,"onion_skin_server_handshake succeeded.");
+      cell_out->handshake_len = hs[i].result;
+      switch (cc->cell_type) {
+      case CELL_CREATE:
+        cell_out->cell_type = CELL_CREATED; break;
+      case CELL_CREATE2:
+        cell_out->cell_type = CELL_CREATED2; break;
+      case CELL_CREATE_FAST:
+        cell_out->cell_type = CELL_CREATED_FAST; break;
+      default:
+        tor_assert(0);
+        result = WQ_RPL_SHUTDOWN;
+        goto done;
+      }
+      rpl[i].success = 1;
+    }
+    rpl[i].magic = CPUWORKER_REPLY_MAGIC;
+    if (req[i].timed)
+      rpl[i].n_usec = n_usec;
 
-  memwipe(&req, 0, sizeof(req));
-  memwipe(&rpl, 0, sizeof(req));
-  return WQ_RPL_REPLY;
+    memcpy(&job->handshakes[i].u.reply, &rpl[i], sizeof(rpl[i]));
+  }
+
+ done:
+  memwipe(req, 0, sizeof(req));
+  memwipe(rpl, 0, sizeof(rpl));
+  memwipe(hs, 0, sizeof(hs));
+  return result;
 }
 
-/** Take pending tasks from the queue and assign them to cpuworkers. */
-static void
+/** Fill in <b>hs</b> with a request to answer <b>onionskin</b> for
+ * <b>circ</b>, and free <b>onionskin</b>.  Return 0 on success, or -1 if
+ * the circuit can't take an answer. */
+static int
+cpuworker_handshake_prepare(cpuworker_handshake_t *hs, or_circuit_t *circ,
+                            create_cell_t *onionskin)
+{
+  cpuworker_request_t *req = &hs->u.request;
+
+  if (!circ->p_chan) {
+    log_info(LD_OR,"circ->p_chan gone. Failing circ.");
+    tor_free(onionskin);
+    return -1;
+  }
+
+  if (connection_or_digest_is_known_relay(circ->p_chan->identity_digest))
+    rep_hist_note_circuit_handshake_assigned(onionskin->handshake_type);
+
+  memset(hs, 0, sizeof(*hs));
+  hs->circ = circ;
+  req->magic = CPUWORKER_REQUEST_MAGIC;
+  req->timed = should_time_request(onionskin->handshake_type);
+
+  memcpy(&req->create_cell, onionskin, sizeof(create_cell_t));
+
+  tor_free(onionskin);
+
+  if (req->timed)
+    tor_gettimeofday(&req->started_at);
+
+  return 0;
+}
+
+/** Take pending tasks from the queue and assign them to cpuworkers, in
+ * batches of up to CPUWORKER_MAX_BATCH. */
+STATIC void
 queue_pending_tasks(void)
 {
-  or_circuit_t *circ;
+  or_circuit_t *circ = NULL;
   create_cell_t *onionskin = NULL;
+  smartlist_t *jobs;
+  workqueue_entry_t **entries;
+  int n_todo = 0, per_job, i, j;
+  uint16_t t;
+
+  if (total_pending_tasks >= max_pending_tasks)
+    return;
 
-  while (total_pending_tasks < max_pending_tasks) {
-    circ = onion_next_task(&onionskin);
+  for (t = 0; t <= MAX_ONION_HANDSHAKE_TYPE; ++t)
+    n_todo += onion_num_pending(t);
+  n_todo = MIN(n_todo, max_pending_tasks - total_pending_tasks);
+  if (n_todo <= 0)
+    return;
 
+  /* Spread the work over all our threads before we make any batch longer
+   * than it needs to be. */
+  per_job = CEIL_DIV(n_todo, n_onion_threads);
+  per_job = CLAMP(1, per_job, CPUWORKER_MAX_BATCH);
+
+  jobs = smartlist_new();
+  while (n_todo > 0) {
+    cpuworker_job_t *job = cpuworker_job_new(MIN(per_job, n_todo));
+    while (job->n_handshakes < job->n_allocated &&
+           (circ = onion_next_task(&onionskin))) {
+      --n_todo;
+      if (cpuworker_handshake_prepare(&job->handshakes[job->n_handshakes],
+                                      circ, onionskin) < 0) {
+        log_warn(LD_OR,"assign_to_cpuworker failed. Ignoring.");
+        continue;
+      }
+      ++job->n_handshakes;
+    }
+    if (job->n_handshakes == 0) {
+      cpuworker_job_free(job);
+      if (!circ)
+        break;
+      continue;
+    }
+    total_pending_tasks += job->n_handshakes;
+    smartlist_add(jobs, job);
     if (!circ)
-      return;
+      break;
+  }
+
+  if (smartlist_len(jobs) == 0) {
+    smartlist_free(jobs);
+    return;
+  }
 
-    if (assign_onionskin_to_cpuworker(circ, onionskin))
-      log_warn(LD_OR,"assign_to_cpuworker failed. Ignoring.");
+  entries = tor_calloc(smartlist_len(jobs), sizeof(workqueue_entry_t *));
+  if (threadpool_queue_work_batch(threadpool,
+                                  cpuworker_onion_handshake_threadfn,
+                                  cpuworker_onion_handshake_replyfn,
+                                  jobs->list, smartlist_len(jobs),
+                                  entries) < 0) {
+    log_warn(LD_BUG, "Couldn't queue work on threadpool");
+    SMARTLIST_FOREACH_BEGIN(jobs, cpuworker_job_t *, job) {
+      for (j = 0; j < job->n_handshakes; ++j) {
+        circ = job->handshakes[j].circ;
+        circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_INTERNAL);
+      }
+      total_pending_tasks -= job->n_handshakes;
+      cpuworker_job_free(job);
+    } SMARTLIST_FOREACH_END(job);
+  } else {
+    for (i = 0; i < smartlist_len(jobs); ++i) {
+      cpuworker_job_t *job = smartlist_get(jobs, i);
+      log_debug(LD_OR, "Queued batch %p of %d (qe=%p)",
+                job, job->n_handshakes, entries[i]);
+      for (j = 0; j < job->n_handshakes; ++j)
+        job->handshakes[j].circ->workqueue_entry = entries[i];
+    }
   }
+
+  tor_free(entries);
+  smartlist_free(jobs);
 }
 
 /** Try to tell a cpuworker to perform the public key operations necessary to
@@ -489,8 +718,6 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
 {
   workqueue_entry_t *queue_entry;
   cpuworker_job_t *job;
-  cpuworker_request_t req;
-  int should_time;
 
   tor_assert(threadpool);
 
@@ -509,25 +736,12 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
     return 0;
   }
 
-  if (connection_or_digest_is_known_relay(circ->p_chan->identity_digest))
-    rep_hist_note_circuit_handshake_assigned(onionskin->handshake_type);
-
-  should_time = should_time_request(onionskin->handshake_type);
-  memset(&req, 0, sizeof(req));
-  req.magic = CPUWORKER_REQUEST_MAGIC;
-  req.timed = should_time;
-
-  memcpy(&req.create_cell, onionskin, sizeof(create_cell_t));
-
-  tor_free(onionskin);
-
-  if (should_time)
-    tor_gettimeofday(&req.started_at);
-
-  job = tor_malloc_zero(sizeof(cpuworker_job_t));
-  job->circ = circ;
-  memcpy(&job->u.request, &req, sizeof(req));
-  memwipe(&req, 0, sizeof(req));
+  job = cpuworker_job_new(1);
+  if (cpuworker_handshake_prepare(&job->handshakes[0], circ, onionskin) < 0) {
+    cpuworker_job_free(job);
+    return -1;
+  }
+  job->n_handshakes = 1;
 
   ++total_pending_tasks;
   queue_entry = threadpool_queue_work(threadpool,
@@ -536,12 +750,13 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
                                       job);
   if (!queue_entry) {
     log_warn(LD_BUG, "Couldn't queue work on threadpool");
-    tor_free(job);
+    --total_pending_tasks;
+    cpuworker_job_free(job);
     return -1;
   }
 
   log_debug(LD_OR, "Queued task %p (qe=%p, circ=%p)",
-            job, queue_entry, job->circ);
+            job, queue_entry, circ);
 
   circ->workqueue_entry = queue_entry;
 
@@ -549,23 +764,328 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
 }
 
 /** If <b>circ</b> has a pending handshake that hasn't been processed yet,
- * remove it from the worker queue. */
+ * remove it from the worker queue.  Any other handshakes that were batched
+ * with it go back on the queue without it. */
 void
 cpuworker_cancel_circ_handshake(or_circuit_t *circ)
 {
   cpuworker_job_t *job;
+  workqueue_entry_t *queue_entry;
+  int i;
   if (circ->workqueue_entry == NULL)
     return;
 
   job = workqueue_entry_cancel(circ->workqueue_entry);
-  if (job) {
+  if (!job) {
+    /* A worker has it; this is done in cpuworker_onion_handshake_replyfn. */
+    return;
+  }
+
+  /* It successfully cancelled. */
+  for (i = 0; i < job->n_handshakes; ++i) {
+    if (job->handshakes[i].circ == circ)
+      break;
+  }
+  tor_assert(i < job->n_handshakes);
+  --job->n_handshakes;
+  if (i != job->n_handshakes)
+    memcpy(&job->handshakes[i], &job->handshakes[job->n_handshakes],
+           sizeof(cpuworker_handshake_t));
+  memwipe(&job->handshakes[job->n_handshakes], 0xe0,
+          sizeof(cpuworker_handshake_t));
+  tor_assert(total_pending_tasks > 0);
+  --total_pending_tasks;
+  circ->workqueue_entry = NULL;
+
+  if (job->n_handshakes == 0) {
+    cpuworker_job_free(job);
+    return;
+  }
+
+  /* Put the rest of the batch back at the front of a queue, so that it
+   * doesn't lose its place to work that was queued after it. */
+  queue_entry = threadpool_queue_work_first(threadpool,
+                                          cpuworker_onion_handshake_threadfn,
+                                          cpuworker_onion_handshake_replyfn,
+                                          job);
+  for (i = 0; i < job->n_handshakes; ++i) {
+    or_circuit_t *other = job->handshakes[i].circ;
+    other->workqueue_entry = queue_entry;
+    if (!queue_entry) {
+      /* We may be closing circ along with others from the same batch, so
+       * don't mark any of them twice.  circuit_close_all_marked() frees
+       * the ones that we mark here in the same pass as circ. */
+      --total_pending_tasks;
+      if (!TO_CIRCUIT(other)->marked_for_close)
+        circuit_mark_for_close(TO_CIRCUIT(other), END_CIRC_REASON_INTERNAL);
+    }
+  }
+  if (!queue_entry) {
+    log_warn(LD_BUG, "Couldn't requeue work on threadpool");
+    cpuworker_job_free(job);
+  }
+}
+
+
+/** One relay cell waiting to be crypted by a relay crypto thread. */
+typedef struct relaycrypt_cell_t {
+  cell_t cell;
+  /** Stream that the cell came from, if we packaged it ourselves. */
+  streamid_t on_stream;
+  /** True iff we originated this cell, and so need to set its digest. */
+  unsigned int originated : 1;
+} relaycrypt_cell_t;
+
+/** A batch of inbound relay cells for a single OR circuit, to be crypted
+ * in order by a relay crypto thread. */
+typedef struct relaycrypt_job_t {
+  /** The circuit that the cells are on, or NULL if it was freed while a
+   * worker was crypting them. */
+  or_circuit_t *circ;
+  /** The circuit's inbound cipher and digest, for the worker to use. */
+  crypto_cipher_t *cipher;
+  crypto_digest_t *digest;
+  /** True iff we have to free cipher and digest ourselves, because the
+   * circuit is gone. */
+  unsigned int owns_crypto : 1;
+  /** Our entry on relaycrypt_threadpool, while we're on it. */
+  workqueue_entry_t *queue_entry;
+  /** Number of cells in <b>cells</b>. */
+  int n_cells;
+  /** Number of cells we have room for in <b>cells</b>. */
+  int n_allocated;
+  relaycrypt_cell_t *cells;
+} relaycrypt_job_t;
+
+/** Number of cells in every relaycrypt_job_t that hasn't been freed. */
+static size_t relaycrypt_total_cells = 0;
+
+/** Return true iff we're crypting inbound relay cells on worker threads. */
+int
+cpuworker_relay_crypto_enabled(void)
+{
+  return relaycrypt_threadpool != NULL;
+}
+
+/** Return the number of bytes we're spending on relay cells that are
+ * waiting for, or on, the relay crypto threads. */
+size_t
+cpuworker_relay_crypto_get_total_allocation(void)
+{
+  return relaycrypt_total_cells * sizeof(relaycrypt_cell_t);
+}
+
+/** Stop counting the cells in <b>job</b> as queued, and forget them. */
+static void
+relaycrypt_job_clear_cells(relaycrypt_job_t *job)
+{
+  tor_assert(relaycrypt_total_cells >= (size_t)job->n_cells);
+  relaycrypt_total_cells -= job->n_cells;
+  if (job->circ) {
+    job->circ->relaycrypt_n_cells -= job->n_cells;
+    tor_assert(job->circ->relaycrypt_n_cells >= 0);
+  }
+  job->n_cells = 0;
+}
+
+/** Release all storage held by <b>job</b>. */
+static void
+relaycrypt_job_free(relaycrypt_job_t *job)
+{
+  if (!job)
+    return;
+  relaycrypt_job_clear_cells(job);
+  if (job->owns_crypto) {
+    crypto_cipher_free(job->cipher);
+    crypto_digest_free(job->digest);
+  }
+  if (job->cells) {
+    memwipe(job->cells, 0, sizeof(relaycrypt_cell_t) * job->n_allocated);
+    tor_free(job->cells);
+  }
+  memwipe(job, 0, sizeof(*job));
+  tor_free(job);
+}
+
+/** Implementation function for relay crypto requests. */
+static workqueue_reply_t
+relaycrypt_threadfn(void *state_, void *work_)
+{
+  relaycrypt_job_t *job = work_;
+  int i;
+  (void)state_;
+
+  crypto_cipher_prefetch_keystream(job->cipher,
+                                   (size_t)job->n_cells * CELL_PAYLOAD_SIZE);
+  for (i = 0; i < job->n_cells; ++i) {
+    relaycrypt_cell_t *rc = &job->cells[i];
+    relay_crypt_inbound_cell(job->digest, job->cipher, &rc->cell,
+                             rc->originated);
+  }
+  return WQ_RPL_REPLY;
+}
+
+static void relaycrypt_replyfn(void *work_);
+
+/** Hand the batch of cells waiting on <b>circ</b> to a relay crypto
+ * thread.  Return 0 on success, -1 on failure. */
+static int
+relaycrypt_launch(or_circuit_t *circ)
+{
+  relaycrypt_job_t *job = circ->relaycrypt_waiting;
+
+  tor_assert(job);
+  tor_assert(!circ->relaycrypt_inflight);
+  circ->relaycrypt_waiting = NULL;
+
+  job->cipher = circ->p_crypto;
+  job->digest = circ->p_digest;
+  job->queue_entry = threadpool_queue_work(relaycrypt_threadpool,
+                                           relaycrypt_threadfn,
+                                           relaycrypt_replyfn,
+                                           job);
+  if (!job->queue_entry) {
+    log_warn(LD_BUG, "Couldn't queue relay crypto work on threadpool");
+    relaycrypt_job_free(job);
+    return -1;
+  }
+  circ->relaycrypt_inflight = job;
+  return 0;
+}
+
+/** Handle a batch of crypted cells coming back from a relay crypto
+ * thread: queue them on their circuit, and start on whatever cells arrived
+ * for the circuit in the meantime. */
+static void
+relaycrypt_replyfn(void *work_)
+{
+  relaycrypt_job_t *job = work_;
+  or_circuit_t *circ = job->circ;
+  int i, n_cells;
+
+  if (!circ) {
+    log_debug(LD_OR, "Circuit died while relay crypto was pending. "
+              "Discarding cells.");
+    relaycrypt_job_free(job);
+    return;
+  }
+
+  tor_assert(circ->relaycrypt_inflight == job);
+  circ->relaycrypt_inflight = NULL;
+
+  if (TO_CIRCUIT(circ)->marked_for_close || !circ->p_chan) {
+    relaycrypt_job_free(job);
+    relaycrypt_job_free(circ->relaycrypt_waiting);
+    circ->relaycrypt_waiting = NULL;
+    return;
+  }
+
+  /* The cells are about to move onto p_chan_cells, so stop counting them
+   * here first. */
+  n_cells = job->n_cells;
+  relaycrypt_job_clear_cells(job);
+  for (i = 0; i < n_cells; ++i) {
+    relaycrypt_cell_t *rc = &job->cells[i];
+    append_cell_to_circuit_queue(TO_CIRCUIT(circ), circ->p_chan, &rc->cell,
+                                 CELL_DIRECTION_IN, rc->on_stream);
+    if (TO_CIRCUIT(circ)->marked_for_close) {
+      /* The OOM handler may have killed the circuit, and with it the rest
+       * of its cells. */
+      break;
+    }
+  }
+  relaycrypt_job_free(job);
+
+  if (circ->relaycrypt_waiting && !TO_CIRCUIT(circ)->marked_for_close &&
+      relaycrypt_launch(circ) < 0)
+    circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_INTERNAL);
+}
+
+/** Arrange for <b>cell</b> to be crypted on a relay crypto thread and then
+ * queued for sending back toward the origin of <b>circ</b>, after every
+ * cell that we've already handed to this function for <b>circ</b>.  If
+ * <b>originated</b>, the cell is one we packaged ourselves from
+ * <b>on_stream</b>, and needs its digest set.
+ *
+ * Return 0 on success, -1 on failure. */
+int
+cpuworker_queue_relay_cell(or_circuit_t *circ, const cell_t *cell,
+                           streamid_t on_stream, int originated)
+{
+  relaycrypt_job_t *job;
+  relaycrypt_cell_t *rc;
+
+  tor_assert(relaycrypt_threadpool);
+  tor_assert(circ);
+  tor_assert(cell);
+
+  if (!circ->p_crypto || !circ->p_digest)
+    return -1;
+
+  job = circ->relaycrypt_waiting;
+  if (!job) {
+    job = circ->relaycrypt_waiting = tor_malloc_zero(sizeof(*job));
+    job->circ = circ;
+  }
+  if (job->n_cells == job->n_allocated) {
+    job->n_allocated = job->n_allocated ? job->n_allocated * 2 : 8;
+    job->cells = tor_reallocarray(job->cells, job->n_allocated,
+                                  sizeof(relaycrypt_cell_t));
+  }
+  rc = &job->cells[job->n_cells++];
+  ++circ->relaycrypt_n_cells;
+  ++relaycrypt_total_cells;
+  memcpy(&rc->cell, cell, sizeof(cell_t));
+  rc->on_stream = on_stream;
+  rc->originated = originated ? 1 : 0;
+
+  if (!circ->relaycrypt_inflight)
+    return relaycrypt_launch(circ);
+  return 0;
+}
+
+/** Forget about every relay cell that's waiting to be crypted for
+ * <b>circ</b>, which has been marked for close or is about to be freed.  If
+ * a worker is crypting some of them right now, hand it the circuit's
+ * inbound crypto state so it can be freed once the worker is done. */
+void
+cpuworker_cancel_circ_relay_crypt(or_circuit_t *circ)
+{
+  relaycrypt_job_t *job = circ->relaycrypt_inflight;
+
+  relaycrypt_job_free(circ->relaycrypt_waiting);
+  circ->relaycrypt_waiting = NULL;
+
+  if (!job)
+    return;
+  circ->relaycrypt_inflight = NULL;
+
+  if (workqueue_entry_cancel(job->queue_entry)) {
     /* It successfully cancelled. */
-    memwipe(job, 0xe0, sizeof(*job));
-    tor_free(job);
-    tor_assert(total_pending_tasks > 0);
-    --total_pending_tasks;
-    /* if (!job), this is done in cpuworker_onion_handshake_replyfn. */
-    circ->workqueue_entry = NULL;
+    relaycrypt_job_free(job);
+    return;
   }
+
+  /* A worker is using the crypto state; the reply function will free it.
+   * Its cells still count toward relaycrypt_total_cells until then. */
+  circ->relaycrypt_n_cells -= job->n_cells;
+  job->circ = NULL;
+  job->owns_crypto = 1;
+  circ->p_crypto = NULL;
+  circ->p_digest = NULL;
 }
 
+/** Hand the job <b>arg</b> to the general-purpose cpuworker pool: run
+ * <b>fn</b> on it in a worker thread, then <b>reply_fn</b> in the main
+ * thread.  Return the queue entry on success, or NULL if there is no pool
+ * (because we aren't a server) or we couldn't queue the job; in that case
+ * the caller should do the work itself. */
+workqueue_entry_t *
+cpuworker_queue_work(workqueue_reply_t (*fn)(void *, void *),
+                     void (*reply_fn)(void *),
+                     void *arg)
+{
+  if (!threadpool)
+    return NULL;
+  return threadpool_queue_work(threadpool, fn, reply_fn, arg);
+}
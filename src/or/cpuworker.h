@@ -12,6 +12,8 @@
 #ifndef TOR_CPUWORKER_H
 #define TOR_CPUWORKER_H
 
+#include "workqueue.h"
+
 void cpu_init(void);
 void cpuworkers_rotate_keyinfo(void);
 
@@ -25,5 +27,20 @@ void cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
                                       const char *onionskin_type_name);
 void cpuworker_cancel_circ_handshake(or_circuit_t *circ);
 
+int cpuworker_relay_crypto_enabled(void);
+int cpuworker_queue_relay_cell(or_circuit_t *circ, const cell_t *cell,
+                               streamid_t on_stream, int originated);
+void cpuworker_cancel_circ_relay_crypt(or_circuit_t *circ);
+size_t cpuworker_relay_crypto_get_total_allocation(void);
+
+workqueue_entry_t *cpuworker_queue_work(workqueue_reply_t (*fn)(void *,
+                                                                void *),
+                                        void (*reply_fn)(void *),
+                                        void *arg);
+
+#ifdef CPUWORKER_PRIVATE
+STATIC void queue_pending_tasks(void);
+#endif
+
 #endif
 
@@ -9,7 +9,9 @@
 #include "config.h"
 #include "connection.h"
 #include "connection_edge.h"
+#include "consdiff.h"
 #include "control.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
@@ -102,6 +104,9 @@ static void directory_initiate_command_rend(const tor_addr_t *addr,
 #define ALLOW_DIRECTORY_TIME_SKEW (30*60)
 
 #define X_ADDRESS_HEADER "X-Your-Address-Is: "
+/** HTTP header a client uses to list the consensuses (by the hex SHA256
+ * digests of their full text) that it would accept a diff from. */
+#define X_OR_DIFF_FROM_CONSENSUS_HEADER "X-Or-Diff-From-Consensus: "
 
 /** HTTP cache control: how long do we tell proxies they can cache each
  * kind of document we serve? */
@@ -1202,6 +1207,22 @@ directory_send_command(dir_connection_t *conn,
       url = directory_get_consensus_url(resource);
       log_info(LD_DIR, "Downloading consensus from %s using %s",
                hoststring, url);
+      {
+        /* Offer to take a diff from the consensus we have. */
+        int flav = networkstatus_parse_flavor_name(resource ? resource :
+                                                   "ns");
+        const networkstatus_t *ns = flav < 0 ? NULL :
+          networkstatus_get_latest_consensus_by_flavor(flav);
+        if (ns && !tor_mem_is_zero((const char*)ns->digest_full_sha256,
+                                   DIGEST256_LEN)) {
+          char hex[HEX_DIGEST256_LEN+1];
+          base16_encode(hex, sizeof(hex),
+                        (const char*)ns->digest_full_sha256, DIGEST256_LEN);
+          smartlist_add_asprintf(headers,
+                                 X_OR_DIFF_FROM_CONSENSUS_HEADER "%s\r\n",
+                                 hex);
+        }
+      }
       break;
     case DIR_PURPOSE_FETCH_CERTIFICATE:
       tor_assert(resource);
@@ -1577,6 +1598,206 @@ load_downloaded_routers(const char *body, smartlist_t *which,
   return added;
 }
 
+/** A consensus or a batch of microdescriptors that we've downloaded, and
+ * that we're parsing in a cpuworker so that the main thread doesn't stall
+ * on it.
+ *
+ * Router descriptors still parse on the main thread: their parser interns
+ * every exit policy entry in the table that addr_policy_get_canonical_entry()
+ * keeps, and adjusts those entries' reference counts when it frees a
+ * descriptor it rejects.  That table belongs to the main thread. */
+typedef struct dir_parse_job_t {
+  /** DIR_PURPOSE_FETCH_CONSENSUS or DIR_PURPOSE_FETCH_MICRODESC. */
+  uint8_t purpose;
+  /** The resource we asked for: a flavor name or a list of digests. */
+  char *requested_resource;
+  /** The address and port of the server we fetched it from, for logging. */
+  char *address;
+  uint16_t port;
+  /** The body of the response, and its length. */
+  char *body;
+  size_t body_len;
+  /** Consensus only: the file holding our current consensus of the same
+   * flavor, in case <b>body</b> is a diff from it. */
+  char *base_fname;
+  /** Consensus only: the value of the TestingTorNetwork option, which the
+   * parser needs, when we launched the job. */
+  int testing_tor_network;
+  /** Consensus only: if <b>body</b> was a diff, the result of applying
+   * it. */
+  char *applied_diff;
+  /** Consensus only: the parsed consensus, or NULL if we couldn't parse
+   * it. */
+  networkstatus_t *consensus;
+  /** Microdescriptors only: the parsed microdescriptors, and the SHA256
+   * digests of the ones we couldn't parse. */
+  smartlist_t *mds;
+  smartlist_t *invalid_digests;
+} dir_parse_job_t;
+
+/** Release all storage held by <b>job</b>. */
+static void
+dir_parse_job_free(dir_parse_job_t *job)
+{
+  if (!job)
+    return;
+  tor_free(job->requested_resource);
+  tor_free(job->address);
+  tor_free(job->body);
+  tor_free(job->base_fname);
+  tor_free(job->applied_diff);
+  networkstatus_vote_free(job->consensus);
+  if (job->mds) {
+    SMARTLIST_FOREACH(job->mds, microdesc_t *, md, microdesc_free(md));
+    smartlist_free(job->mds);
+  }
+  if (job->invalid_digests) {
+    SMARTLIST_FOREACH(job->invalid_digests, uint8_t *, d, tor_free(d));
+    smartlist_free(job->invalid_digests);
+  }
+  tor_free(job);
+}
+
+/** Worker function: tokenize and parse the document in the dir_parse_job_t
+ * <b>work_</b>.  Apart from the job, this reads only the cached consensus
+ * named in <b>base_fname</b>: the option that the consensus parser needs is
+ * copied into the job, and the parser leaves dumping unparseable documents
+ * to the main thread. */
+static workqueue_reply_t
+dir_parse_job_threadfn(void *state_, void *work_)
+{
+  dir_parse_job_t *job = work_;
+  (void)state_;
+
+  if (job->purpose == DIR_PURPOSE_FETCH_CONSENSUS) {
+    const char *text = job->body;
+    if (looks_like_a_consensus_diff(job->body, job->body_len)) {
+      char *base = read_file_to_str(job->base_fname, RFTS_IGNORE_MISSING,
+                                    NULL);
+      if (base)
+        job->applied_diff = consdiff_apply_diff(base, job->body);
+      tor_free(base);
+      /* If that failed, the main thread will notice and deal with it. */
+      if (!job->applied_diff)
+        return WQ_RPL_REPLY;
+      text = job->applied_diff;
+    }
+    job->consensus = networkstatus_parse_vote_from_string_impl(text, NULL,
+                                        NS_TYPE_CONSENSUS,
+                                        job->testing_tor_network);
+    if (job->consensus)
+      crypto_digest256((char*)job->consensus->digest_full_sha256, text,
+                       strlen(text), DIGEST_SHA256);
+  } else {
+    job->invalid_digests = smartlist_new();
+    job->mds = microdescs_parse_from_string(job->body,
+                                            job->body + job->body_len,
+                                            0, SAVED_NOWHERE,
+                                            job->invalid_digests);
+  }
+  return WQ_RPL_REPLY;
+}
+
+/** Main-thread half of handling a consensus download: install the
+ * consensus that a worker parsed for <b>job</b>. */
+static void
+dir_parse_job_finish_consensus(dir_parse_job_t *job)
+{
+  const char *flavname = job->requested_resource;
+  time_t now = time(NULL);
+  int r;
+
+  if (job->consensus) {
+    r = networkstatus_set_current_consensus_parsed(
+                       job->applied_diff ? job->applied_diff : job->body,
+                       job->consensus, flavname, 0);
+    job->consensus = NULL;
+  } else {
+    /* Let the usual code report whatever went wrong. */
+    r = networkstatus_set_current_consensus(job->body, flavname, 0);
+  }
+  if (r < 0) {
+    log_fn(r<-1?LOG_WARN:LOG_INFO, LD_DIR,
+           "Unable to load %s consensus directory downloaded from "
+           "server '%s:%d'. I'll try again soon.",
+           flavname, job->address, job->port);
+    networkstatus_consensus_download_failed(0, flavname);
+    return;
+  }
+  /* launches router downloads as needed */
+  routers_update_all_from_networkstatus(now, 3);
+  update_microdescs_from_networkstatus(now);
+  update_microdesc_downloads(now);
+  directory_info_has_arrived(now, 0);
+  log_info(LD_DIR, "Successfully loaded consensus.");
+}
+
+/** Main-thread half of handling a microdescriptor download: add the
+ * microdescriptors that a worker parsed for <b>job</b> to the cache. */
+static void
+dir_parse_job_finish_microdescs(dir_parse_job_t *job)
+{
+  smartlist_t *which = smartlist_new();
+  smartlist_t *mds;
+
+  dir_split_resource_into_fingerprints(job->requested_resource+2,
+                                       which, NULL,
+                                       DSR_DIGEST256|DSR_BASE64);
+  mds = microdescs_add_parsed_to_cache(get_microdesc_cache(),
+                                       job->mds, job->invalid_digests,
+                                       SAVED_NOWHERE, 0, time(NULL), which);
+  job->mds = job->invalid_digests = NULL;
+  if (smartlist_len(which)) {
+    /* Mark remaining ones as failed. */
+    dir_microdesc_download_failed(which, 200);
+  }
+  control_event_bootstrap(BOOTSTRAP_STATUS_LOADING_DESCRIPTORS,
+                          count_loading_descriptors_progress());
+  SMARTLIST_FOREACH(which, char *, cp, tor_free(cp));
+  smartlist_free(which);
+  smartlist_free(mds);
+}
+
+/** Main-thread function: act on the document that a worker parsed for the
+ * dir_parse_job_t <b>work_</b>, then free the job. */
+static void
+dir_parse_job_replyfn(void *work_)
+{
+  dir_parse_job_t *job = work_;
+  if (job->purpose == DIR_PURPOSE_FETCH_CONSENSUS)
+    dir_parse_job_finish_consensus(job);
+  else
+    dir_parse_job_finish_microdescs(job);
+  dir_parse_job_free(job);
+}
+
+/** We've just downloaded the consensus or microdescriptors in <b>body</b>
+ * (of length <b>body_len</b>) on <b>conn</b>.  Take ownership of
+ * <b>body</b>, and parse it in a cpuworker if we have any, or right now if
+ * we don't.  Either way, install the results from the main thread. */
+static void
+dir_parse_job_launch(dir_connection_t *conn, char *body, size_t body_len)
+{
+  dir_parse_job_t *job = tor_malloc_zero(sizeof(dir_parse_job_t));
+  job->purpose = conn->base_.purpose;
+  job->requested_resource = tor_strdup(conn->requested_resource);
+  job->address = tor_strdup(conn->base_.address);
+  job->port = conn->base_.port;
+  job->body = body;
+  job->body_len = body_len;
+  if (job->purpose == DIR_PURPOSE_FETCH_CONSENSUS) {
+    job->base_fname = networkstatus_get_cache_fname(job->requested_resource,
+                                                    0);
+    job->testing_tor_network = get_options()->TestingTorNetwork;
+  }
+
+  if (!cpuworker_queue_work(dir_parse_job_threadfn, dir_parse_job_replyfn,
+                            job)) {
+    dir_parse_job_threadfn(NULL, job);
+    dir_parse_job_replyfn(job);
+  }
+}
+
 /** We are a client, and we've finished reading the server's
  * response. Parse it and act appropriately.
  *
@@ -1757,7 +1978,6 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
   }
 
   if (conn->base_.purpose == DIR_PURPOSE_FETCH_CONSENSUS) {
-    int r;
     const char *flavname = conn->requested_resource;
     if (status_code != 200) {
       int severity = (status_code == 304) ? LOG_INFO : LOG_WARN;
@@ -1772,21 +1992,8 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
     }
     log_info(LD_DIR,"Received consensus directory (size %d) from server "
              "'%s:%d'", (int)body_len, conn->base_.address, conn->base_.port);
-    if ((r=networkstatus_set_current_consensus(body, flavname, 0))<0) {
-      log_fn(r<-1?LOG_WARN:LOG_INFO, LD_DIR,
-             "Unable to load %s consensus directory downloaded from "
-             "server '%s:%d'. I'll try again soon.",
-             flavname, conn->base_.address, conn->base_.port);
-      tor_free(body); tor_free(headers); tor_free(reason);
-      networkstatus_consensus_download_failed(0, flavname);
-      return -1;
-    }
-    /* launches router downloads as needed */
-    routers_update_all_from_networkstatus(now, 3);
-    update_microdescs_from_networkstatus(now);
-    update_microdesc_downloads(now);
-    directory_info_has_arrived(now, 0);
-    log_info(LD_DIR, "Successfully loaded consensus.");
+    dir_parse_job_launch(conn, body, body_len);
+    body = NULL;
   }
 
   if (conn->base_.purpose == DIR_PURPOSE_FETCH_CERTIFICATE) {
@@ -1978,19 +2185,10 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
       tor_free(body); tor_free(headers); tor_free(reason);
       return 0;
     } else {
-      smartlist_t *mds;
-      mds = microdescs_add_to_cache(get_microdesc_cache(),
-                                    body, body+body_len, SAVED_NOWHERE, 0,
-                                    now, which);
-      if (smartlist_len(which)) {
-        /* Mark remaining ones as failed. */
-        dir_microdesc_download_failed(which, status_code);
-      }
-      control_event_bootstrap(BOOTSTRAP_STATUS_LOADING_DESCRIPTORS,
-                              count_loading_descriptors_progress());
       SMARTLIST_FOREACH(which, char *, cp, tor_free(cp));
       smartlist_free(which);
-      smartlist_free(mds);
+      dir_parse_job_launch(conn, body, body_len);
+      body = NULL;
     }
   }
 
@@ -2606,6 +2804,39 @@ choose_compression_level(ssize_t n_bytes)
   }
 }
 
+/** If the client that sent <b>headers</b> asked for a diff from one of the
+ * consensuses it already has, and we have a diff from one of those to our
+ * current consensus of flavor <b>flav</b>, return it.  Otherwise return
+ * NULL. */
+static cached_dir_t *
+find_consensus_diff_for_request(const char *headers, int flav)
+{
+  char *header = http_get_header(headers, X_OR_DIFF_FROM_CONSENSUS_HEADER);
+  smartlist_t *hexdigests;
+  cached_dir_t *diff = NULL;
+
+  if (!header)
+    return NULL;
+  hexdigests = smartlist_new();
+  smartlist_split_string(hexdigests, header, ",",
+                         SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 0);
+  SMARTLIST_FOREACH_BEGIN(hexdigests, const char *, hex) {
+    uint8_t digest[DIGEST256_LEN];
+    if (strlen(hex) != HEX_DIGEST256_LEN ||
+        base16_decode((char*)digest, sizeof(digest), hex, strlen(hex)) < 0)
+      continue;
+    diff = dirserv_get_consensus_diff(networkstatus_get_flavor_name(flav),
+                                      digest);
+    if (diff)
+      break;
+  } SMARTLIST_FOREACH_END(hex);
+
+  SMARTLIST_FOREACH(hexdigests, char *, cp, tor_free(cp));
+  smartlist_free(hexdigests);
+  tor_free(header);
+  return diff;
+}
+
 /** Helper function: called when a dirserver gets a complete HTTP GET
  * request.  Look for a request for a directory or for a rendezvous
  * service descriptor.  On finding one, write a response into
@@ -2681,13 +2912,14 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
     smartlist_t *dir_fps = smartlist_new();
     const char *request_type = NULL;
     long lifetime = NETWORKSTATUS_CACHE_LIFETIME;
+    int flav = FLAV_NS;
+    cached_dir_t *diff;
 
     if (1) {
       networkstatus_t *v;
       time_t now = time(NULL);
       const char *want_fps = NULL;
       char *flavor = NULL;
-      int flav = FLAV_NS;
       #define CONSENSUS_URL_PREFIX "/tor/status-vote/current/consensus/"
       #define CONSENSUS_FLAVORED_PREFIX "/tor/status-vote/current/consensus-"
       /* figure out the flavor if any, and who we wanted to sign the thing */
@@ -2753,7 +2985,11 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
       goto done;
     }
 
-    dlen = dirserv_estimate_data_size(dir_fps, 0, compressed);
+    diff = find_consensus_diff_for_request(headers, flav);
+    if (diff)
+      dlen = compressed ? diff->dir_z_len : diff->dir_len;
+    else
+      dlen = dirserv_estimate_data_size(dir_fps, 0, compressed);
     if (global_write_bucket_low(TO_CONN(conn), dlen, 2)) {
       log_debug(LD_DIRSERV,
                "Client asked for network status lists, but we've been "
@@ -2789,10 +3025,23 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
     (void) request_type;
     write_http_response_header(conn, -1, compressed,
                                smartlist_len(dir_fps) == 1 ? lifetime : 0);
-    conn->fingerprint_stack = dir_fps;
     if (! compressed)
       conn->zlib_state = tor_zlib_new(0, ZLIB_METHOD, HIGH_COMPRESSION);
 
+    if (diff) {
+      /* The client already has an older consensus: just send the
+       * changes. */
+      SMARTLIST_FOREACH(dir_fps, char *, fp, tor_free(fp));
+      smartlist_free(dir_fps);
+      conn->cached_dir = diff;
+      ++diff->refcnt;
+      conn->cached_dir_offset = 0;
+      conn->dir_spool_src = DIR_SPOOL_CACHED_DIR;
+      connection_dirserv_flushed_some(conn);
+      goto done;
+    }
+
+    conn->fingerprint_stack = dir_fps;
     /* Prime the connection with some data. */
     conn->dir_spool_src = DIR_SPOOL_NETWORKSTATUS;
     connection_dirserv_flushed_some(conn);
@@ -2925,6 +3174,22 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
     }
 
     write_http_response_header(conn, -1, compressed, MICRODESC_CACHE_LIFETIME);
+
+    if (compressed) {
+      /* If lots of clients want this same set, send them all the same
+       * precompressed copy. */
+      cached_dir_t *bundle = dirserv_get_microdesc_bundle(fps);
+      if (bundle) {
+        SMARTLIST_FOREACH(fps, char *, fp, tor_free(fp));
+        smartlist_free(fps);
+        conn->cached_dir = bundle;
+        conn->cached_dir_offset = 0;
+        conn->dir_spool_src = DIR_SPOOL_CACHED_DIR;
+        connection_dirserv_flushed_some(conn);
+        goto done;
+      }
+    }
+
     conn->dir_spool_src = DIR_SPOOL_MICRODESC;
     conn->fingerprint_stack = fps;
 
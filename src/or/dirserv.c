@@ -13,7 +13,9 @@
 #include "command.h"
 #include "connection.h"
 #include "connection_or.h"
+#include "consdiff.h"
 #include "control.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
@@ -482,6 +484,7 @@ dirserv_set_node_flags_from_authoritative_status(node_t *node,
 {
   node->is_valid = (authstatus & FP_INVALID) ? 0 : 1;
   node->is_bad_exit = (authstatus & FP_BADEXIT) ? 1 : 0;
+  nodelist_snapshot_mark_dirty();
 }
 
 /** True iff <b>a</b> is more severe than <b>b</b>. */
@@ -761,6 +764,7 @@ directory_remove_invalid(void)
       node->is_bad_exit = (r&FP_BADEXIT) ? 1: 0;
     }
   } SMARTLIST_FOREACH_END(node);
+  nodelist_snapshot_mark_dirty();
 
   routerlist_assert_ok(rl);
   smartlist_free(nodes);
@@ -875,6 +879,7 @@ dirserv_set_router_is_running(routerinfo_t *router, time_t now)
   }
 
   node->is_running = answer;
+  nodelist_snapshot_mark_dirty();
 }
 
 /** Based on the routerinfo_ts in <b>routers</b>, allocate the
@@ -1186,6 +1191,14 @@ cached_dir_decref(cached_dir_t *d)
   tor_free(d);
 }
 
+/** Helper: cached_dir_decref() with a signature suitable for
+ * connection_write_ref_to_buf(). */
+static void
+cached_dir_decref_void(void *d)
+{
+  cached_dir_decref(d);
+}
+
 /** Allocate and return a new cached_dir_t containing the string <b>s</b>,
  * published at <b>published</b>. */
 cached_dir_t *
@@ -1224,6 +1237,308 @@ free_cached_dir_(void *_d)
   cached_dir_decref(d);
 }
 
+/** Name of the data subdirectory where we keep old consensuses to make diffs
+ * from. */
+#define CONSENSUS_HISTORY_SUBDIR "consensus-history"
+
+/** A consensus that we've stored in CONSENSUS_HISTORY_SUBDIR, and (once it's
+ * been computed) a diff from it to the consensus of the same flavor that
+ * we're serving now. */
+typedef struct consensus_history_entry_t {
+  /** Name of the consensus flavor. */
+  char *flavor;
+  /** When the consensus became valid. */
+  time_t valid_after;
+  /** SHA256 digest of the whole consensus text. */
+  uint8_t digest[DIGEST256_LEN];
+  /** Name of the file in CONSENSUS_HISTORY_SUBDIR holding the consensus. */
+  char *fname;
+  /** A diff to the current consensus, or NULL if we don't have one yet. */
+  cached_dir_t *diff;
+} consensus_history_entry_t;
+
+/** List of consensus_history_entry_t for every consensus that we've kept,
+ * or NULL if we haven't looked at the disk yet. */
+static smartlist_t *consensus_history = NULL;
+/** Map from flavor name to the SHA256 digest of the full text of the
+ * consensus of that flavor that we're serving now. */
+static strmap_t *current_consensus_digests = NULL;
+
+/** Release all storage held by <b>ent</b>.  Leaves its file alone. */
+static void
+consensus_history_entry_free(consensus_history_entry_t *ent)
+{
+  if (!ent)
+    return;
+  tor_free(ent->flavor);
+  tor_free(ent->fname);
+  cached_dir_decref(ent->diff);
+  tor_free(ent);
+}
+
+/** Return the entry in consensus_history for the consensus of flavor
+ * <b>flavor</b> with digest <b>digest</b>, or NULL if we have none. */
+static consensus_history_entry_t *
+consensus_history_find(const char *flavor, const uint8_t *digest)
+{
+  if (!consensus_history)
+    return NULL;
+  SMARTLIST_FOREACH(consensus_history, consensus_history_entry_t *, ent,
+    if (!strcmp(ent->flavor, flavor) &&
+        tor_memeq(ent->digest, digest, DIGEST256_LEN))
+      return ent;);
+  return NULL;
+}
+
+/** Add an entry to consensus_history for the file called <b>fname</b> in
+ * CONSENSUS_HISTORY_SUBDIR, if its name is in the format
+ * "flavor-validafter-hexdigest".  Return the new entry, or NULL if the name
+ * was no good. */
+static consensus_history_entry_t *
+consensus_history_add(const char *fname)
+{
+  consensus_history_entry_t *ent;
+  const char *dash1 = strchr(fname, '-');
+  char *dash2 = NULL;
+  time_t valid_after;
+  uint8_t digest[DIGEST256_LEN];
+  char *flavor;
+  int ok;
+
+  if (!dash1)
+    return NULL;
+  flavor = tor_strndup(fname, dash1-fname);
+  valid_after = (time_t) tor_parse_long(dash1+1, 10, 0, LONG_MAX, &ok,
+                                        &dash2);
+  if (networkstatus_parse_flavor_name(flavor) < 0 || !ok || *dash2 != '-' ||
+      strlen(dash2+1) != HEX_DIGEST256_LEN ||
+      base16_decode((char*)digest, sizeof(digest), dash2+1,
+                    HEX_DIGEST256_LEN) < 0 ||
+      consensus_history_find(flavor, digest)) {
+    tor_free(flavor);
+    return NULL;
+  }
+
+  ent = tor_malloc_zero(sizeof(consensus_history_entry_t));
+  ent->flavor = flavor;
+  ent->valid_after = valid_after;
+  memcpy(ent->digest, digest, DIGEST256_LEN);
+  ent->fname = tor_strdup(fname);
+  smartlist_add(consensus_history, ent);
+  return ent;
+}
+
+/** Make sure consensus_history is set up, reading the list of consensuses
+ * that we kept last time we ran if we haven't done so yet.  Return 0 on
+ * success, -1 if we can't use CONSENSUS_HISTORY_SUBDIR. */
+static int
+consensus_history_init(void)
+{
+  char *dirname;
+  smartlist_t *files;
+
+  if (consensus_history)
+    return 0;
+  if (check_or_create_data_subdir(CONSENSUS_HISTORY_SUBDIR) < 0)
+    return -1;
+
+  consensus_history = smartlist_new();
+  dirname = get_datadir_fname(CONSENSUS_HISTORY_SUBDIR);
+  files = tor_listdir(dirname);
+  tor_free(dirname);
+  if (files) {
+    SMARTLIST_FOREACH(files, char *, fn, {
+        if (!consensus_history_add(fn))
+          log_info(LD_DIR, "Ignoring unexpected file %s in %s", fn,
+                   CONSENSUS_HISTORY_SUBDIR);
+        tor_free(fn);
+      });
+    smartlist_free(files);
+  }
+  return 0;
+}
+
+/** Helper for sorting consensus_history_entry_t, newest first. */
+static int
+compare_history_entries_by_age_(const void **a_, const void **b_)
+{
+  const consensus_history_entry_t *a = *a_, *b = *b_;
+  if (a->valid_after > b->valid_after)
+    return -1;
+  else if (a->valid_after < b->valid_after)
+    return 1;
+  return 0;
+}
+
+/** Remove the file for <b>ent</b> from CONSENSUS_HISTORY_SUBDIR. */
+static void
+consensus_history_remove_file(const consensus_history_entry_t *ent)
+{
+  char *path = get_datadir_fname2(CONSENSUS_HISTORY_SUBDIR, ent->fname);
+  if (unlink(path) < 0 && errno != ENOENT)
+    log_info(LD_FS, "Couldn't remove %s: %s", path, strerror(errno));
+  tor_free(path);
+}
+
+/** Forget all but the newest <b>n_keep</b> consensuses of flavor
+ * <b>flavor</b> in consensus_history, and remove their files. */
+static void
+consensus_history_prune(const char *flavor, int n_keep)
+{
+  int n_seen = 0;
+  smartlist_sort(consensus_history, compare_history_entries_by_age_);
+  SMARTLIST_FOREACH_BEGIN(consensus_history, consensus_history_entry_t *,
+                          ent) {
+    if (strcmp(ent->flavor, flavor))
+      continue;
+    if (++n_seen <= n_keep)
+      continue;
+    consensus_history_remove_file(ent);
+    consensus_history_entry_free(ent);
+    SMARTLIST_DEL_CURRENT_KEEPORDER(consensus_history, ent);
+  } SMARTLIST_FOREACH_END(ent);
+}
+
+/** A request to compute a diff from an old consensus to the current one in
+ * a cpuworker. */
+typedef struct consdiff_job_t {
+  /** Name of the consensus flavor. */
+  char *flavor;
+  /** Digest of the consensus that we're making a diff from. */
+  uint8_t base_digest[DIGEST256_LEN];
+  /** Full path to the file holding that consensus. */
+  char *base_path;
+  /** A reference to the consensus that we're making a diff to. The worker
+   * may look at its text, but it must not touch its reference count. */
+  cached_dir_t *target;
+  /** Digest of <b>target</b>'s text. */
+  uint8_t target_digest[DIGEST256_LEN];
+  /** The result: a diff from the base to the target, or NULL if we
+   * couldn't make one. */
+  cached_dir_t *diff;
+} consdiff_job_t;
+
+/** Release all storage held by <b>job</b>. */
+static void
+consdiff_job_free(consdiff_job_t *job)
+{
+  if (!job)
+    return;
+  tor_free(job->flavor);
+  tor_free(job->base_path);
+  cached_dir_decref(job->target);
+  cached_dir_decref(job->diff);
+  tor_free(job);
+}
+
+/** Worker function: compute the diff for the consdiff_job_t in
+ * <b>work_</b>.  Safe to call from any thread. */
+static workqueue_reply_t
+consdiff_job_threadfn(void *state_, void *work_)
+{
+  consdiff_job_t *job = work_;
+  char *base, *diff = NULL;
+  uint8_t digest[DIGEST256_LEN];
+  (void)state_;
+
+  base = read_file_to_str(job->base_path, RFTS_IGNORE_MISSING, NULL);
+  if (base) {
+    crypto_digest256((char*)digest, base, strlen(base), DIGEST_SHA256);
+    /* Don't trust the disk: the diff promises a base with this digest. */
+    if (tor_memeq(digest, job->base_digest, DIGEST256_LEN))
+      diff = consdiff_gen_diff(base, job->target->dir);
+    tor_free(base);
+  }
+  if (diff)
+    job->diff = new_cached_dir(diff, job->target->published);
+  return WQ_RPL_REPLY;
+}
+
+/** Main-thread function: install the diff from the consdiff_job_t in
+ * <b>work_</b>, if it's still useful, and free the job. */
+static void
+consdiff_job_replyfn(void *work_)
+{
+  consdiff_job_t *job = work_;
+  const uint8_t *current = current_consensus_digests ?
+    strmap_get(current_consensus_digests, job->flavor) : NULL;
+  consensus_history_entry_t *ent =
+    consensus_history_find(job->flavor, job->base_digest);
+
+  if (!job->diff) {
+    log_info(LD_DIR, "Couldn't make a %s consensus diff from %s.",
+             job->flavor, job->base_path);
+  } else if (ent && !ent->diff && current &&
+             tor_memeq(current, job->target_digest, DIGEST256_LEN)) {
+    ent->diff = job->diff;
+    job->diff = NULL;
+  }
+  consdiff_job_free(job);
+}
+
+/** Start computing a diff from the old consensus in <b>ent</b> to
+ * <b>target</b>, whose digest is <b>target_digest</b>.  Use a cpuworker
+ * if we have any. */
+static void
+consdiff_launch_job(const consensus_history_entry_t *ent,
+                    cached_dir_t *target, const uint8_t *target_digest)
+{
+  consdiff_job_t *job = tor_malloc_zero(sizeof(consdiff_job_t));
+  job->flavor = tor_strdup(ent->flavor);
+  memcpy(job->base_digest, ent->digest, DIGEST256_LEN);
+  job->base_path = get_datadir_fname2(CONSENSUS_HISTORY_SUBDIR, ent->fname);
+  job->target = target;
+  ++target->refcnt;
+  memcpy(job->target_digest, target_digest, DIGEST256_LEN);
+
+  if (!cpuworker_queue_work(consdiff_job_threadfn, consdiff_job_replyfn,
+                            job)) {
+    consdiff_job_threadfn(NULL, job);
+    consdiff_job_replyfn(job);
+  }
+}
+
+/** We've just started serving <b>consensus</b>, of flavor <b>flavor</b>,
+ * which became valid at <b>valid_after</b> and has full-text digest
+ * <b>digest</b>.  Drop our old diffs, remember the new consensus, forget
+ * the ones that are too old, and start making diffs from the rest. */
+static void
+consensus_history_note_new_consensus(const char *flavor,
+                                     cached_dir_t *consensus,
+                                     time_t valid_after,
+                                     const uint8_t *digest)
+{
+  const int n_keep = get_options()->ConsensusDiffHistory;
+  consensus_history_entry_t *cur;
+
+  if (n_keep <= 0 || consensus_history_init() < 0)
+    return;
+
+  SMARTLIST_FOREACH(consensus_history, consensus_history_entry_t *, ent,
+    if (!strcmp(ent->flavor, flavor)) {
+      cached_dir_decref(ent->diff);
+      ent->diff = NULL;
+    });
+
+  cur = consensus_history_find(flavor, digest);
+  if (!cur) {
+    char hex[HEX_DIGEST256_LEN+1];
+    char *fname = NULL;
+    base16_encode(hex, sizeof(hex), (const char*)digest, DIGEST256_LEN);
+    tor_asprintf(&fname, "%s-%ld-%s", flavor, (long)valid_after, hex);
+    if (write_to_data_subdir(CONSENSUS_HISTORY_SUBDIR, fname,
+                             consensus->dir, "consensus history") == 0)
+      cur = consensus_history_add(fname);
+    tor_free(fname);
+  }
+  consensus_history_prune(flavor, n_keep + 1);
+  cur = consensus_history_find(flavor, digest);
+
+  SMARTLIST_FOREACH(consensus_history, consensus_history_entry_t *, ent,
+    if (ent != cur && !strcmp(ent->flavor, flavor))
+      consdiff_launch_job(ent, consensus, digest));
+}
+
 /** Replace the v3 consensus networkstatus of type <b>flavor_name</b> that
  * we're serving with <b>networkstatus</b>, published at <b>published</b>.  No
  * validation is performed. */
@@ -1235,8 +1550,11 @@ dirserv_set_cached_consensus_networkstatus(const char *networkstatus,
 {
   cached_dir_t *new_networkstatus;
   cached_dir_t *old_networkstatus;
+  uint8_t *full_digest, *old_digest;
   if (!cached_consensuses)
     cached_consensuses = strmap_new();
+  if (!current_consensus_digests)
+    current_consensus_digests = strmap_new();
 
   new_networkstatus = new_cached_dir(tor_strdup(networkstatus), published);
   memcpy(&new_networkstatus->digests, digests, sizeof(digests_t));
@@ -1244,6 +1562,19 @@ dirserv_set_cached_consensus_networkstatus(const char *networkstatus,
                                  new_networkstatus);
   if (old_networkstatus)
     cached_dir_decref(old_networkstatus);
+
+  full_digest = tor_malloc(DIGEST256_LEN);
+  crypto_digest256((char*)full_digest, networkstatus, strlen(networkstatus),
+                   DIGEST_SHA256);
+  old_digest = strmap_set(current_consensus_digests, flavor_name,
+                          full_digest);
+  tor_free(old_digest);
+  consensus_history_note_new_consensus(flavor_name, new_networkstatus,
+                                       published, full_digest);
+
+  /* Clients will want a different set of microdescriptors now. */
+  if (!strcmp(flavor_name, "microdesc"))
+    dirserv_clear_microdesc_bundles();
 }
 
 /** Return the latest downloaded consensus networkstatus in encoded, signed,
@@ -1256,6 +1587,17 @@ dirserv_get_consensus(const char *flavor_name)
   return strmap_get(cached_consensuses, flavor_name);
 }
 
+/** Return a diff from the consensus of flavor <b>flavor_name</b> with
+ * full-text SHA256 digest <b>digest</b> to the one we're serving now, or
+ * NULL if we don't have one. */
+cached_dir_t *
+dirserv_get_consensus_diff(const char *flavor_name, const uint8_t *digest)
+{
+  consensus_history_entry_t *ent =
+    consensus_history_find(flavor_name, digest);
+  return ent ? ent->diff : NULL;
+}
+
 /** If a router's uptime is at least this value, then it is always
  * considered stable, regardless of the rest of the network. This
  * way we resist attacks where an attacker doubles the size of the
@@ -1480,6 +1822,7 @@ dirserv_compute_performance_thresholds(routerlist_t *rl,
       tor_assert(ri);
       node->is_exit = (!router_exit_policy_rejects_all(ri) &&
                        exit_policy_is_general_exit(ri->exit_policy));
+      nodelist_snapshot_mark_dirty();
       uptimes[n_active] = (uint32_t)real_uptime(ri, now);
       mtbfs[n_active] = rep_hist_get_stability(id, now);
       tks  [n_active] = rep_hist_get_weighted_time_known(id, now);
@@ -3424,6 +3767,213 @@ dirserv_estimate_microdesc_size(const smartlist_t *fps, int compressed)
   return result;
 }
 
+/** A set of microdescriptors that clients have asked us for, and how
+ * popular it is.  Once a set has been requested often enough, we deflate it
+ * once and serve the compressed bytes to everybody who asks for it, rather
+ * than compressing it anew for every client. */
+typedef struct md_bundle_t {
+  /** Our key for this set in md_bundles. */
+  char key[DIGEST_LEN];
+  /** Links in md_bundles_lru. */
+  TOR_TAILQ_ENTRY(md_bundle_t) lru_links;
+  /** Number of times this set has been requested since we started
+   * tracking it. */
+  int n_requests;
+  /** The compressed concatenation of the microdescriptors in the set, or
+   * NULL if it isn't popular enough yet. */
+  cached_dir_t *compressed;
+} md_bundle_t;
+
+/** Map from the SHA1 of the digests of a list of microdescriptors, in the
+ * order we'd send them, to the md_bundle_t for that set.  We key each set
+ * on the microdescriptors we actually have, rather than on the ones the
+ * client asked for: we'd skip the missing ones anyway, and when one of them
+ * arrives the key changes with it. */
+static digestmap_t *md_bundles = NULL;
+/** Every md_bundle_t in md_bundles, least recently requested first. */
+static TOR_TAILQ_HEAD(md_bundle_lru_s, md_bundle_t) md_bundles_lru =
+  TOR_TAILQ_HEAD_INITIALIZER(md_bundles_lru);
+/** Number of entries in md_bundles. */
+static int n_md_bundles = 0;
+/** Total size of all the compressed bundles in md_bundles. */
+static size_t md_bundle_bytes = 0;
+
+/** Deflate a set of microdescriptors once it has been requested this many
+ * times. */
+#define MD_BUNDLE_MIN_REQUESTS 2
+/** Largest number of microdescriptor sets to track at once. */
+#define MD_BUNDLE_MAX_ENTRIES 256
+/** Largest number of bytes to spend on compressed microdescriptor sets. */
+#define MD_BUNDLE_MAX_BYTES (8*1024*1024)
+
+/** Release all storage held by the md_bundle_t <b>b</b>. */
+static void
+md_bundle_free_(void *b)
+{
+  md_bundle_t *bundle = b;
+  if (!bundle)
+    return;
+  cached_dir_decref(bundle->compressed);
+  tor_free(bundle);
+}
+
+/** Forget every microdescriptor set we've been tracking.  We call this
+ * whenever a new consensus arrives, since that changes which sets clients
+ * will ask for. */
+void
+dirserv_clear_microdesc_bundles(void)
+{
+  digestmap_free(md_bundles, md_bundle_free_);
+  md_bundles = NULL;
+  TOR_TAILQ_INIT(&md_bundles_lru);
+  n_md_bundles = 0;
+  md_bundle_bytes = 0;
+}
+
+/** Remove the least recently requested microdescriptor set, other than
+ * <b>keep</b>, from md_bundles. */
+static void
+md_bundles_evict_one(const md_bundle_t *keep)
+{
+  md_bundle_t *oldest = TOR_TAILQ_FIRST(&md_bundles_lru);
+  if (oldest && oldest == keep)
+    oldest = TOR_TAILQ_NEXT(oldest, lru_links);
+  if (!oldest)
+    return;
+  TOR_TAILQ_REMOVE(&md_bundles_lru, oldest, lru_links);
+  digestmap_remove(md_bundles, oldest->key);
+  if (oldest->compressed)
+    md_bundle_bytes -= oldest->compressed->dir_z_len;
+  md_bundle_free_(oldest);
+  --n_md_bundles;
+}
+
+/** Return a newly allocated cached_dir_t holding the compressed
+ * concatenation of the microdescriptors in <b>mds</b>, or NULL if we
+ * couldn't compress them. */
+static cached_dir_t *
+md_bundle_compress(const smartlist_t *mds)
+{
+  cached_dir_t *d;
+  char *body, *cp;
+  size_t body_len = 0;
+
+  SMARTLIST_FOREACH(mds, const microdesc_t *, md,
+                    body_len += md->bodylen);
+  body = cp = tor_malloc(body_len + 1);
+  SMARTLIST_FOREACH_BEGIN(mds, const microdesc_t *, md) {
+    memcpy(cp, md->body, md->bodylen);
+    cp += md->bodylen;
+  } SMARTLIST_FOREACH_END(md);
+  *cp = '\0';
+
+  d = tor_malloc_zero(sizeof(cached_dir_t));
+  d->refcnt = 1;
+  d->published = time(NULL);
+  if (tor_gzip_compress(&d->dir_z, &d->dir_z_len, body, body_len,
+                        ZLIB_METHOD)) {
+    log_warn(LD_BUG, "Error compressing microdescriptors");
+    cached_dir_decref(d);
+    d = NULL;
+  }
+
+  tor_free(body);
+  return d;
+}
+
+/** Note that a client has asked for a compressed copy of the
+ * microdescriptors whose digests are in <b>fps</b>, which must be sorted and
+ * unique.  If that set is popular enough that we have a precompressed copy
+ * of it, return a new reference to a cached_dir_t whose dir_z holds that
+ * copy.  Otherwise return NULL, and the caller should compress the
+ * microdescriptors itself. */
+cached_dir_t *
+dirserv_get_microdesc_bundle(const smartlist_t *fps)
+{
+  microdesc_cache_t *cache = get_microdesc_cache();
+  smartlist_t *mds = smartlist_new();
+  crypto_digest_t *digest;
+  char key[DIGEST_LEN];
+  md_bundle_t *bundle;
+  cached_dir_t *result = NULL;
+  int i;
+
+  /* Find the microdescriptors we have, in the order that
+   * connection_dirserv_add_microdescs_to_outbuf() would send them. */
+  for (i = smartlist_len(fps) - 1; i >= 0; --i) {
+    microdesc_t *md = microdesc_cache_lookup_by_digest256(cache,
+                                                 smartlist_get(fps, i));
+    if (md && md->body)
+      smartlist_add(mds, md);
+  }
+  if (smartlist_len(mds) == 0)
+    goto done;
+
+  digest = crypto_digest_new();
+  SMARTLIST_FOREACH(mds, const microdesc_t *, md,
+                    crypto_digest_add_bytes(digest, md->digest,
+                                            DIGEST256_LEN));
+  crypto_digest_get_digest(digest, key, DIGEST_LEN);
+  crypto_digest_free(digest);
+
+  if (!md_bundles)
+    md_bundles = digestmap_new();
+
+  bundle = digestmap_get(md_bundles, key);
+  if (bundle) {
+    TOR_TAILQ_REMOVE(&md_bundles_lru, bundle, lru_links);
+  } else {
+    if (n_md_bundles >= MD_BUNDLE_MAX_ENTRIES)
+      md_bundles_evict_one(NULL);
+    bundle = tor_malloc_zero(sizeof(md_bundle_t));
+    memcpy(bundle->key, key, DIGEST_LEN);
+    digestmap_set(md_bundles, key, bundle);
+    ++n_md_bundles;
+  }
+  TOR_TAILQ_INSERT_TAIL(&md_bundles_lru, bundle, lru_links);
+  ++bundle->n_requests;
+
+  if (!bundle->compressed && bundle->n_requests >= MD_BUNDLE_MIN_REQUESTS) {
+    bundle->compressed = md_bundle_compress(mds);
+    if (!bundle->compressed)
+      goto done;
+    md_bundle_bytes += bundle->compressed->dir_z_len;
+    /* Make room, but never evict the bundle we're about to serve. */
+    while (md_bundle_bytes > MD_BUNDLE_MAX_BYTES && n_md_bundles > 1)
+      md_bundles_evict_one(bundle);
+  }
+
+  if (bundle->compressed) {
+    result = bundle->compressed;
+    ++result->refcnt;
+  }
+
+ done:
+  smartlist_free(mds);
+  return result;
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Return the number of microdescriptor sets we're holding compressed. */
+STATIC int
+dirserv_get_n_compressed_microdesc_bundles(void)
+{
+  int n = 0;
+  digestmap_iter_t *iter;
+  if (!md_bundles)
+    return 0;
+  for (iter = digestmap_iter_init(md_bundles); !digestmap_iter_done(iter);
+       iter = digestmap_iter_next(md_bundles, iter)) {
+    const char *k;
+    void *val;
+    digestmap_iter_get(iter, &k, &val);
+    if (((md_bundle_t *)val)->compressed)
+      ++n;
+  }
+  return n;
+}
+#endif
+
 /** When we're spooling data onto our outbuf, add more whenever we dip
  * below this threshold. */
 #define DIRSERV_BUFFER_MIN 16384
@@ -3589,8 +4139,16 @@ connection_dirserv_add_dir_bytes_to_outbuf(dir_connection_t *conn)
                              conn->cached_dir->dir_z + conn->cached_dir_offset,
                              bytes, conn, bytes == remaining);
   } else {
-    connection_write_to_buf(conn->cached_dir->dir_z + conn->cached_dir_offset,
-                            bytes, TO_CONN(conn));
+    /* The compressed document never changes while we hold a reference to
+     * it, so there's no need to copy it into the outbuf: hand over the whole
+     * rest of it at once, and let the outbuf flush straight from the cached
+     * copy.  Bandwidth limits still apply when flushing. */
+    bytes = (ssize_t) remaining;
+    ++conn->cached_dir->refcnt;
+    connection_write_ref_to_buf(
+                             conn->cached_dir->dir_z + conn->cached_dir_offset,
+                             bytes, cached_dir_decref_void, conn->cached_dir,
+                             TO_CONN(conn));
   }
   conn->cached_dir_offset += bytes;
   if (conn->cached_dir_offset == (int)conn->cached_dir->dir_z_len) {
@@ -3765,6 +4323,16 @@ dirserv_free_all(void)
 
   strmap_free(cached_consensuses, free_cached_dir_);
   cached_consensuses = NULL;
+  strmap_free(current_consensus_digests, tor_free_);
+  current_consensus_digests = NULL;
+  if (consensus_history) {
+    SMARTLIST_FOREACH(consensus_history, consensus_history_entry_t *, ent,
+                      consensus_history_entry_free(ent));
+    smartlist_free(consensus_history);
+    consensus_history = NULL;
+  }
+
+  dirserv_clear_microdesc_bundles();
 
   dirserv_clear_measured_bw_cache();
 }
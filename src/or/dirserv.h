@@ -62,6 +62,8 @@ int directory_too_idle_to_fetch_descriptors(const or_options_t *options,
                                             time_t now);
 
 cached_dir_t *dirserv_get_consensus(const char *flavor_name);
+cached_dir_t *dirserv_get_consensus_diff(const char *flavor_name,
+                                         const uint8_t *digest);
 void dirserv_set_cached_consensus_networkstatus(const char *consensus,
                                                 const char *flavor_name,
                                                 const digests_t *digests,
@@ -96,6 +98,8 @@ int dirserv_have_any_microdesc(const smartlist_t *fps);
 size_t dirserv_estimate_data_size(smartlist_t *fps, int is_serverdescs,
                                   int compressed);
 size_t dirserv_estimate_microdesc_size(const smartlist_t *fps, int compressed);
+cached_dir_t *dirserv_get_microdesc_bundle(const smartlist_t *fps);
+void dirserv_clear_microdesc_bundles(void);
 
 char *routerstatus_format_entry(
                               const routerstatus_t *rs, const char *platform,
@@ -128,6 +132,9 @@ STATIC int dirserv_query_measured_bw_cache_kb(const char *node_id,
                                               long *bw_out,
                                               time_t *as_of_out);
 STATIC int dirserv_has_measured_bw(const char *node_id);
+#ifdef TOR_UNIT_TESTS
+STATIC int dirserv_get_n_compressed_microdesc_bundles(void);
+#endif
 
 STATIC int
 dirserv_read_guardfraction_file_from_str(const char *guardfraction_file_str,
@@ -16,24 +16,11 @@
 #include "control.h"
 #include "dnsserv.h"
 #include "geoip.h"
+#include "geoip_table.h"
 #include "routerlist.h"
 
 static void init_geoip_countries(void);
 
-/** An entry from the GeoIP IPv4 file: maps an IPv4 range to a country. */
-typedef struct geoip_ipv4_entry_t {
-  uint32_t ip_low; /**< The lowest IP in the range, in host order */
-  uint32_t ip_high; /**< The highest IP in the range, in host order */
-  intptr_t country; /**< An index into geoip_countries */
-} geoip_ipv4_entry_t;
-
-/** An entry from the GeoIP IPv6 file: maps an IPv6 range to a country. */
-typedef struct geoip_ipv6_entry_t {
-  struct in6_addr ip_low; /**< The lowest IP in the range, in host order */
-  struct in6_addr ip_high; /**< The highest IP in the range, in host order */
-  intptr_t country; /**< An index into geoip_countries */
-} geoip_ipv6_entry_t;
-
 /** A per-country record for GeoIP request history. */
 typedef struct geoip_country_t {
   char countrycode[3];
@@ -46,13 +33,29 @@ static smartlist_t *geoip_countries = NULL;
  * The index is encoded in the pointer, and 1 is added so that NULL can mean
  * not found. */
 static strmap_t *country_idxplus1_by_lc_code = NULL;
-/** Lists of all known geoip_ipv4_entry_t and geoip_ipv6_entry_t, sorted
- * by their respective ip_low. */
-static smartlist_t *geoip_ipv4_entries = NULL, *geoip_ipv6_entries = NULL;
 
-/** SHA1 digest of the GeoIP files to include in extra-info descriptors. */
-static char geoip_digest[DIGEST_LEN];
-static char geoip6_digest[DIGEST_LEN];
+/** The GeoIP database for one address family. */
+typedef struct geoip_db_t {
+  /** The table that we look addresses up in, or NULL if we have none. */
+  geoip_table_t *table;
+  /** For each country in <b>table</b>, its index in geoip_countries. */
+  country_t *country_map;
+  /** Entries added by geoip_parse_entry() that we haven't yet built into
+   * <b>table</b>, or NULL if there are none. */
+  geoip_table_builder_t *pending;
+  /** SHA1 digest of the GeoIP file to include in extra-info descriptors. */
+  char digest[DIGEST_LEN];
+} geoip_db_t;
+
+/** The GeoIP databases for IPv4 and IPv6. */
+static geoip_db_t geoip_ipv4_db, geoip_ipv6_db;
+
+/** Return the GeoIP database for <b>family</b>. */
+static INLINE geoip_db_t *
+geoip_get_db(sa_family_t family)
+{
+  return (family == AF_INET) ? &geoip_ipv4_db : &geoip_ipv6_db;
+}
 
 /** Return the index of the <b>country</b>'s entry in the GeoIP
  * country list if it is a valid 2-letter country code, otherwise
@@ -71,19 +74,16 @@ geoip_get_country,(const char *country))
   return (country_t)idx;
 }
 
-/** Add an entry to a GeoIP table, mapping all IP addresses between <b>low</b>
- * and <b>high</b>, inclusive, to the 2-letter country code <b>country</b>. */
-static void
-geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
-                const char *country)
+/** Return the index of the 2-letter country code <b>country</b> in the
+ * GeoIP country list, adding it to the list if it isn't there yet. */
+static country_t
+geoip_get_or_add_country(const char *country)
 {
   intptr_t idx;
   void *idxplus1_;
 
-  if (tor_addr_family(low) != tor_addr_family(high))
-    return;
-  if (tor_addr_compare(high, low, CMP_EXACT) < 0)
-    return;
+  if (!geoip_countries)
+    init_geoip_countries();
 
   idxplus1_ = strmap_get_lc(country_idxplus1_by_lc_code, country);
 
@@ -101,147 +101,109 @@ geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
     geoip_country_t *c = smartlist_get(geoip_countries, idx);
     tor_assert(!strcasecmp(c->countrycode, country));
   }
-
-  if (tor_addr_family(low) == AF_INET) {
-    geoip_ipv4_entry_t *ent = tor_malloc_zero(sizeof(geoip_ipv4_entry_t));
-    ent->ip_low = tor_addr_to_ipv4h(low);
-    ent->ip_high = tor_addr_to_ipv4h(high);
-    ent->country = idx;
-    smartlist_add(geoip_ipv4_entries, ent);
-  } else if (tor_addr_family(low) == AF_INET6) {
-    geoip_ipv6_entry_t *ent = tor_malloc_zero(sizeof(geoip_ipv6_entry_t));
-    ent->ip_low = *tor_addr_to_in6(low);
-    ent->ip_high = *tor_addr_to_in6(high);
-    ent->country = idx;
-    smartlist_add(geoip_ipv6_entries, ent);
-  }
+  return (country_t)idx;
 }
 
-/** Add an entry to the GeoIP table indicated by <b>family</b>,
- * parsing it from <b>line</b>. The format is as for geoip_load_file(). */
-STATIC int
-geoip_parse_entry(const char *line, sa_family_t family)
+/** Make <b>table</b> the table of <b>db</b>, freeing its old one. */
+static void
+geoip_db_set_table(geoip_db_t *db, geoip_table_t *table)
 {
-  tor_addr_t low_addr, high_addr;
-  char c[3];
-  char *country = NULL;
-
-  if (!geoip_countries)
-    init_geoip_countries();
-  if (family == AF_INET) {
-    if (!geoip_ipv4_entries)
-      geoip_ipv4_entries = smartlist_new();
-  } else if (family == AF_INET6) {
-    if (!geoip_ipv6_entries)
-      geoip_ipv6_entries = smartlist_new();
-  } else {
-    log_warn(LD_GENERAL, "Unsupported family: %d", family);
-    return -1;
-  }
+  int i, n;
 
-  while (TOR_ISSPACE(*line))
-    ++line;
-  if (*line == '#')
-    return 0;
+  geoip_table_free(db->table);
+  tor_free(db->country_map);
+  db->table = table;
+  if (!table)
+    return;
 
-  if (family == AF_INET) {
-    unsigned int low, high;
-    if (tor_sscanf(line,"%u,%u,%2s", &low, &high, c) == 3 ||
-        tor_sscanf(line,"\"%u\",\"%u\",\"%2s\",", &low, &high, c) == 3) {
-      tor_addr_from_ipv4h(&low_addr, low);
-      tor_addr_from_ipv4h(&high_addr, high);
-    } else
-      goto fail;
-    country = c;
-  } else {                      /* AF_INET6 */
-    char buf[512];
-    char *low_str, *high_str;
-    struct in6_addr low, high;
-    char *strtok_state;
-    strlcpy(buf, line, sizeof(buf));
-    low_str = tor_strtok_r(buf, ",", &strtok_state);
-    if (!low_str)
-      goto fail;
-    high_str = tor_strtok_r(NULL, ",", &strtok_state);
-    if (!high_str)
-      goto fail;
-    country = tor_strtok_r(NULL, "\n", &strtok_state);
-    if (!country)
-      goto fail;
-    if (strlen(country) != 2)
-      goto fail;
-    if (tor_inet_pton(AF_INET6, low_str, &low) <= 0)
-      goto fail;
-    tor_addr_from_in6(&low_addr, &low);
-    if (tor_inet_pton(AF_INET6, high_str, &high) <= 0)
-      goto fail;
-    tor_addr_from_in6(&high_addr, &high);
+  n = geoip_table_get_n_countries(table);
+  db->country_map = tor_calloc(n ? n : 1, sizeof(country_t));
+  for (i = 0; i < n; ++i) {
+    char cc[3];
+    geoip_table_get_country_code(table, i, cc);
+    db->country_map[i] = geoip_get_or_add_country(cc);
   }
-  geoip_add_entry(&low_addr, &high_addr, country);
-  return 0;
-
-  fail:
-  log_warn(LD_GENERAL, "Unable to parse line from GEOIP %s file: %s",
-           family == AF_INET ? "IPv4" : "IPv6", escaped(line));
-  return -1;
 }
 
-/** Sorting helper: return -1, 1, or 0 based on comparison of two
- * geoip_ipv4_entry_t */
-static int
-geoip_ipv4_compare_entries_(const void **_a, const void **_b)
+/** If any entries have been added to <b>db</b> since we last built its
+ * table, build a new table out of them.  The new table replaces the old
+ * one; geoip_add_entry() makes sure that it holds the old one's ranges
+ * unless we're reloading the whole file. */
+static void
+geoip_db_build_pending(geoip_db_t *db)
 {
-  const geoip_ipv4_entry_t *a = *_a, *b = *_b;
-  if (a->ip_low < b->ip_low)
-    return -1;
-  else if (a->ip_low > b->ip_low)
-    return 1;
-  else
-    return 0;
-}
+  char *buf;
+  size_t len;
+  geoip_table_t *table;
 
-/** bsearch helper: return -1, 1, or 0 based on comparison of an IP (a pointer
- * to a uint32_t in host order) to a geoip_ipv4_entry_t */
-static int
-geoip_ipv4_compare_key_to_entry_(const void *_key, const void **_member)
-{
-  /* No alignment issue here, since _key really is a pointer to uint32_t */
-  const uint32_t addr = *(uint32_t *)_key;
-  const geoip_ipv4_entry_t *entry = *_member;
-  if (addr < entry->ip_low)
-    return -1;
-  else if (addr > entry->ip_high)
-    return 1;
-  else
-    return 0;
+  if (!db->pending)
+    return;
+  buf = geoip_table_builder_encode(db->pending, db->digest, &len);
+  geoip_table_builder_free(db->pending);
+  db->pending = NULL;
+  table = geoip_table_new_from_buf(buf, len);
+  tor_assert(table); /* We just built it, so it had better be well-formed. */
+  geoip_db_set_table(db, table);
 }
 
-/** Sorting helper: return -1, 1, or 0 based on comparison of two
- * geoip_ipv6_entry_t */
-static int
-geoip_ipv6_compare_entries_(const void **_a, const void **_b)
+/** Add an entry to a GeoIP table, mapping all IP addresses between <b>low</b>
+ * and <b>high</b>, inclusive, to the 2-letter country code <b>country</b>. */
+static void
+geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
+                const char *country)
 {
-  const geoip_ipv6_entry_t *a = *_a, *b = *_b;
-  return fast_memcmp(a->ip_low.s6_addr, b->ip_low.s6_addr,
-                     sizeof(struct in6_addr));
+  geoip_db_t *db;
+  sa_family_t family = tor_addr_family(low);
+
+  if (family != AF_INET && family != AF_INET6)
+    return;
+  if (family != tor_addr_family(high))
+    return;
+  if (tor_addr_compare(high, low, CMP_EXACT) < 0)
+    return;
+
+  geoip_get_or_add_country(country);
+
+  db = geoip_get_db(family);
+  if (!db->pending) {
+    /* We're adding to a table that we've already built, so start with the
+     * ranges it has. */
+    db->pending = geoip_table_builder_new(family);
+    if (db->table)
+      geoip_table_builder_add_table(db->pending, db->table);
+  }
+  geoip_table_builder_add(db->pending, low, high, country);
 }
 
-/** bsearch helper: return -1, 1, or 0 based on comparison of an IPv6
- * (a pointer to a in6_addr) to a geoip_ipv6_entry_t */
-static int
-geoip_ipv6_compare_key_to_entry_(const void *_key, const void **_member)
+/** Add an entry to the GeoIP table indicated by <b>family</b>,
+ * parsing it from <b>line</b>. The format is as for geoip_load_file().
+ * Entries added this way are merged with the ones already loaded when we
+ * next look up an address of <b>family</b>. */
+STATIC int
+geoip_parse_entry(const char *line, sa_family_t family)
 {
-  const struct in6_addr *addr = (struct in6_addr *)_key;
-  const geoip_ipv6_entry_t *entry = *_member;
+  tor_addr_t low_addr, high_addr;
+  char country[3];
+  int r;
 
-  if (fast_memcmp(addr->s6_addr, entry->ip_low.s6_addr,
-             sizeof(struct in6_addr)) < 0)
+  if (!geoip_countries)
+    init_geoip_countries();
+  if (family != AF_INET && family != AF_INET6) {
+    log_warn(LD_GENERAL, "Unsupported family: %d", family);
     return -1;
-  else if (fast_memcmp(addr->s6_addr, entry->ip_high.s6_addr,
-                  sizeof(struct in6_addr)) > 0)
-    return 1;
-  else
-    return 0;
+  }
+
+  r = geoip_table_parse_line(line, family, &low_addr, &high_addr, country);
+  if (r < 0) {
+    while (TOR_ISSPACE(*line))
+      ++line;
+    log_warn(LD_GENERAL, "Unable to parse line from GEOIP %s file: %s",
+             family == AF_INET ? "IPv4" : "IPv6", escaped(line));
+    return -1;
+  }
+  if (r > 0)
+    geoip_add_entry(&low_addr, &high_addr, country);
+  return 0;
 }
 
 /** Return 1 if we should collect geoip stats on bridge users, and
@@ -270,10 +232,31 @@ init_geoip_countries(void)
   strmap_set_lc(country_idxplus1_by_lc_code, "??", (void*)(1));
 }
 
+/** Return true iff the file <b>filename</b> starts with the magic string of
+ * a compiled GeoIP table.  We check this by reading just the magic, so that
+ * we don't map text files that we're only going to parse. */
+static int
+geoip_file_looks_compiled(const char *filename)
+{
+  char buf[GEOIP_TABLE_MAGIC_LEN];
+  ssize_t n;
+  int fd;
+
+  fd = tor_open_cloexec(filename, O_RDONLY, 0);
+  if (fd < 0)
+    return 0;
+  n = read_all(fd, buf, sizeof(buf), 0);
+  close(fd);
+  return n == (ssize_t)sizeof(buf) &&
+    geoip_table_looks_compiled(buf, sizeof(buf));
+}
+
 /** Clear appropriate GeoIP database, based on <b>family</b>, and
  * reload it from the file <b>filename</b>. Return 0 on success, -1 on
  * failure.
  *
+ * The file may be a GeoIP table compiled by tor-geoip-compile, which we
+ * map into memory and use as it is.  Otherwise, it must be a text file.
  * Recognized line formats for IPv4 are:
  *   INTIPLOW,INTIPHIGH,CC
  * and
@@ -296,8 +279,33 @@ geoip_load_file(sa_family_t family, const char *filename)
   const or_options_t *options = get_options();
   int severity = options_need_geoip_info(options, &msg) ? LOG_WARN : LOG_INFO;
   crypto_digest_t *geoip_digest_env = NULL;
+  geoip_db_t *db;
 
   tor_assert(family == AF_INET || family == AF_INET6);
+  db = geoip_get_db(family);
+
+  if (geoip_file_looks_compiled(filename)) {
+    tor_mmap_t *map = tor_mmap_file(filename);
+    geoip_table_t *table = map ? geoip_table_new_from_mmap(map) : NULL;
+    if (!table || geoip_table_get_family(table) != family) {
+      log_fn(severity, LD_GENERAL, "GEOIP file %s is not a well-formed "
+             "compiled %s table.  %s", filename,
+             (family == AF_INET) ? "IPv4" : "IPv6", msg);
+      geoip_table_free(table);
+      return -1;
+    }
+    log_notice(LD_GENERAL, "Mapped compiled GEOIP %s file %s.",
+               (family == AF_INET) ? "IPv4" : "IPv6", filename);
+    if (!geoip_countries)
+      init_geoip_countries();
+    geoip_table_builder_free(db->pending);
+    db->pending = NULL;
+    geoip_db_set_table(db, table);
+    memcpy(db->digest, geoip_table_get_digest(table), DIGEST_LEN);
+    if (family == AF_INET)
+      refresh_all_country_info();
+    return 0;
+  }
 
   if (!(f = tor_fopen_cloexec(filename, "r"))) {
     log_fn(severity, LD_GENERAL, "Failed to open GEOIP file %s.  %s",
@@ -307,21 +315,8 @@ geoip_load_file(sa_family_t family, const char *filename)
   if (!geoip_countries)
     init_geoip_countries();
 
-  if (family == AF_INET) {
-    if (geoip_ipv4_entries) {
-      SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, e,
-                        tor_free(e));
-      smartlist_free(geoip_ipv4_entries);
-    }
-    geoip_ipv4_entries = smartlist_new();
-  } else { /* AF_INET6 */
-    if (geoip_ipv6_entries) {
-      SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, e,
-                        tor_free(e));
-      smartlist_free(geoip_ipv6_entries);
-    }
-    geoip_ipv6_entries = smartlist_new();
-  }
+  geoip_table_builder_free(db->pending);
+  db->pending = geoip_table_builder_new(family);
   geoip_digest_env = crypto_digest_new();
 
   log_notice(LD_GENERAL, "Parsing GEOIP %s file %s.",
@@ -337,21 +332,18 @@ geoip_load_file(sa_family_t family, const char *filename)
   /*XXXX abort and return -1 if no entries/illformed?*/
   fclose(f);
 
-  /* Sort list and remember file digests so that we can include it in
-   * our extra-info descriptors. */
+  /* Remember file digests so that we can include it in our extra-info
+   * descriptors, and build the table. */
+  crypto_digest_get_digest(geoip_digest_env, db->digest, DIGEST_LEN);
+  crypto_digest_free(geoip_digest_env);
+  geoip_db_build_pending(db);
+
   if (family == AF_INET) {
-    smartlist_sort(geoip_ipv4_entries, geoip_ipv4_compare_entries_);
     /* Okay, now we need to maybe change our mind about what is in
      * which country. We do this for IPv4 only since that's what we
      * store in node->country. */
     refresh_all_country_info();
-    crypto_digest_get_digest(geoip_digest_env, geoip_digest, DIGEST_LEN);
-  } else {
-    /* AF_INET6 */
-    smartlist_sort(geoip_ipv6_entries, geoip_ipv6_compare_entries_);
-    crypto_digest_get_digest(geoip_digest_env, geoip6_digest, DIGEST_LEN);
   }
-  crypto_digest_free(geoip_digest_env);
 
   return 0;
 }
@@ -365,12 +357,12 @@ geoip_load_file(sa_family_t family, const char *filename)
 STATIC int
 geoip_get_country_by_ipv4(uint32_t ipaddr)
 {
-  geoip_ipv4_entry_t *ent;
-  if (!geoip_ipv4_entries)
+  int idx;
+  geoip_db_build_pending(&geoip_ipv4_db);
+  if (!geoip_ipv4_db.table)
     return -1;
-  ent = smartlist_bsearch(geoip_ipv4_entries, &ipaddr,
-                          geoip_ipv4_compare_key_to_entry_);
-  return ent ? (int)ent->country : 0;
+  idx = geoip_table_lookup_ipv4(geoip_ipv4_db.table, ipaddr);
+  return idx >= 0 ? geoip_ipv4_db.country_map[idx] : 0;
 }
 
 /** Given an IPv6 address, return a number representing the country to
@@ -381,13 +373,12 @@ geoip_get_country_by_ipv4(uint32_t ipaddr)
 STATIC int
 geoip_get_country_by_ipv6(const struct in6_addr *addr)
 {
-  geoip_ipv6_entry_t *ent;
-
-  if (!geoip_ipv6_entries)
+  int idx;
+  geoip_db_build_pending(&geoip_ipv6_db);
+  if (!geoip_ipv6_db.table)
     return -1;
-  ent = smartlist_bsearch(geoip_ipv6_entries, addr,
-                          geoip_ipv6_compare_key_to_entry_);
-  return ent ? (int)ent->country : 0;
+  idx = geoip_table_lookup_ipv6(geoip_ipv6_db.table, addr);
+  return idx >= 0 ? geoip_ipv6_db.country_map[idx] : 0;
 }
 
 /** Given an IP address, return a number representing the country to which
@@ -432,13 +423,12 @@ geoip_get_country_name(country_t num)
 MOCK_IMPL(int,
 geoip_is_loaded,(sa_family_t family))
 {
+  geoip_db_t *db;
   tor_assert(family == AF_INET || family == AF_INET6);
   if (geoip_countries == NULL)
     return 0;
-  if (family == AF_INET)
-    return geoip_ipv4_entries != NULL;
-  else                          /* AF_INET6 */
-    return geoip_ipv6_entries != NULL;
+  db = geoip_get_db(family);
+  return db->table != NULL || db->pending != NULL;
 }
 
 /** Return the hex-encoded SHA1 digest of the loaded GeoIP file. The
@@ -448,10 +438,7 @@ const char *
 geoip_db_digest(sa_family_t family)
 {
   tor_assert(family == AF_INET || family == AF_INET6);
-  if (family == AF_INET)
-    return hex_str(geoip_digest, DIGEST_LEN);
-  else                          /* AF_INET6 */
-    return hex_str(geoip6_digest, DIGEST_LEN);
+  return hex_str(geoip_get_db(family)->digest, DIGEST_LEN);
 }
 
 /** Entry in a map from IP address to the last time we've seen an incoming
@@ -1674,20 +1661,13 @@ clear_geoip_db(void)
   }
 
   strmap_free(country_idxplus1_by_lc_code, NULL);
-  if (geoip_ipv4_entries) {
-    SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, ent,
-                      tor_free(ent));
-    smartlist_free(geoip_ipv4_entries);
-  }
-  if (geoip_ipv6_entries) {
-    SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, ent,
-                      tor_free(ent));
-    smartlist_free(geoip_ipv6_entries);
-  }
+  geoip_db_set_table(&geoip_ipv4_db, NULL);
+  geoip_db_set_table(&geoip_ipv6_db, NULL);
+  geoip_table_builder_free(geoip_ipv4_db.pending);
+  geoip_table_builder_free(geoip_ipv6_db.pending);
+  geoip_ipv4_db.pending = geoip_ipv6_db.pending = NULL;
   geoip_countries = NULL;
   country_idxplus1_by_lc_code = NULL;
-  geoip_ipv4_entries = NULL;
-  geoip_ipv6_entries = NULL;
 }
 
 /** Release all storage held in this file. */
@@ -2903,6 +2903,7 @@ tor_init(int argc, char *argv[])
   rend_cache_init();
   addressmap_init(); /* Init the client dns cache. Do it always, since it's
                       * cheap. */
+  routerparse_init();
 
   {
   /* We search for the "quiet" option first, since it decides whether we
@@ -163,17 +163,37 @@ microdescs_add_to_cache(microdesc_cache_t *cache,
                         int no_save, time_t listed_at,
                         smartlist_t *requested_digests256)
 {
-  void * const DIGEST_REQUESTED = (void*)1;
-  void * const DIGEST_RECEIVED = (void*)2;
-  void * const DIGEST_INVALID = (void*)3;
-
-  smartlist_t *descriptors, *added;
+  smartlist_t *descriptors;
   const int allow_annotations = (where != SAVED_NOWHERE);
   smartlist_t *invalid_digests = smartlist_new();
 
   descriptors = microdescs_parse_from_string(s, eos,
                                              allow_annotations,
                                              where, invalid_digests);
+  return microdescs_add_parsed_to_cache(cache, descriptors, invalid_digests,
+                                        where, no_save, listed_at,
+                                        requested_digests256);
+}
+
+/** As microdescs_add_to_cache, but takes the list of microdescriptors
+ * <b>descriptors</b> and the list of SHA256 digests of unparseable ones
+ * <b>invalid_digests</b>, as returned by microdescs_parse_from_string(),
+ * instead of a string to decode.  Takes ownership of both lists, so that
+ * the parsing can happen somewhere else, such as in a cpuworker. */
+smartlist_t *
+microdescs_add_parsed_to_cache(microdesc_cache_t *cache,
+                               smartlist_t *descriptors,
+                               smartlist_t *invalid_digests,
+                               saved_location_t where,
+                               int no_save, time_t listed_at,
+                               smartlist_t *requested_digests256)
+{
+  void * const DIGEST_REQUESTED = (void*)1;
+  void * const DIGEST_RECEIVED = (void*)2;
+  void * const DIGEST_INVALID = (void*)3;
+
+  smartlist_t *added;
+
   if (listed_at != (time_t)-1) {
     SMARTLIST_FOREACH(descriptors, microdesc_t *, md,
                       md->last_listed = listed_at);
@@ -738,6 +758,7 @@ microdesc_free_(microdesc_t *md, const char *fname, int lineno)
           node->md = NULL;
         }
       });
+    nodelist_snapshot_mark_dirty();
     if (found) {
       log_warn(LD_BUG, "microdesc_free() called from %s:%d, but md was still "
                "referenced %d node(s); held_by_nodes == %u, ht_badness == %d",
@@ -20,6 +20,12 @@ smartlist_t *microdescs_add_to_cache(microdesc_cache_t *cache,
                         const char *s, const char *eos, saved_location_t where,
                         int no_save, time_t listed_at,
                         smartlist_t *requested_digests256);
+smartlist_t *microdescs_add_parsed_to_cache(microdesc_cache_t *cache,
+                        smartlist_t *descriptors,
+                        smartlist_t *invalid_digests,
+                        saved_location_t where,
+                        int no_save, time_t listed_at,
+                        smartlist_t *requested_digests256);
 smartlist_t *microdescs_add_list_to_cache(microdesc_cache_t *cache,
                         smartlist_t *descriptors, saved_location_t where,
                         int no_save);
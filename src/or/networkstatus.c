@@ -19,12 +19,14 @@
 #include "config.h"
 #include "connection.h"
 #include "connection_or.h"
+#include "consdiff.h"
 #include "control.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
 #include "entrynodes.h"
 #include "main.h"
+#include "memarea.h"
 #include "microdesc.h"
 #include "networkstatus.h"
 #include "nodelist.h"
@@ -239,6 +241,9 @@ networkstatus_vote_free(networkstatus_t *ns)
   if (!ns)
     return;
 
+  if (ns->type == NS_TYPE_CONSENSUS)
+    nodelist_forget_consensus(ns);
+
   tor_free(ns->client_versions);
   tor_free(ns->server_versions);
   if (ns->known_flags) {
@@ -288,6 +293,8 @@ networkstatus_vote_free(networkstatus_t *ns)
 
     smartlist_free(ns->routerstatus_list);
   }
+  if (ns->lazy_rs_area)
+    memarea_drop_all(ns->lazy_rs_area);
 
   digestmap_free(ns->desc_digest_map, NULL);
 
@@ -310,19 +317,19 @@ networkstatus_get_voter_by_id(networkstatus_t *vote,
   return NULL;
 }
 
-/** Check whether the signature <b>sig</b> is correctly signed with the
- * signing key in <b>cert</b>.  Return -1 if <b>cert</b> doesn't match the
- * signing key; otherwise set the good_signature or bad_signature flag on
- * <b>voter</b>, and return 0. */
-int
-networkstatus_check_document_signature(const networkstatus_t *consensus,
-                                       document_signature_t *sig,
-                                       const authority_cert_t *cert)
+/** Helper: get ready to check whether the signature <b>sig</b> on
+ * <b>consensus</b> is correctly signed with the signing key in <b>cert</b>.
+ * Return -1 if <b>cert</b> doesn't match the signing key.  Return 0 if we
+ * already know the answer, after setting the good_signature or
+ * bad_signature flag on <b>sig</b>.  Otherwise fill in <b>check_out</b> so
+ * that crypto_pk_checksig_batch() can check the signature, and return 1. */
+static int
+networkstatus_prepare_signature_check(const networkstatus_t *consensus,
+                                      document_signature_t *sig,
+                                      const authority_cert_t *cert,
+                                      crypto_pk_checkable_t *check_out)
 {
   char key_digest[DIGEST_LEN];
-  const int dlen = sig->alg == DIGEST_SHA1 ? DIGEST_LEN : DIGEST256_LEN;
-  char *signed_digest;
-  size_t signed_digest_len;
 
   if (crypto_pk_get_digest(cert->signing_key, key_digest)<0)
     return -1;
@@ -342,23 +349,96 @@ networkstatus_check_document_signature(const networkstatus_t *consensus,
     return 0;
   }
 
-  signed_digest_len = crypto_pk_keysize(cert->signing_key);
-  signed_digest = tor_malloc(signed_digest_len);
-  if (crypto_pk_public_checksig(cert->signing_key,
-                                signed_digest,
-                                signed_digest_len,
-                                sig->signature,
-                                sig->signature_len) < dlen ||
-      tor_memneq(signed_digest, consensus->digests.d[sig->alg], dlen)) {
+  check_out->pk = cert->signing_key;
+  check_out->digest = consensus->digests.d[sig->alg];
+  check_out->digest_len = sig->alg == DIGEST_SHA1 ? DIGEST_LEN
+                                                  : DIGEST256_LEN;
+  check_out->sig = sig->signature;
+  check_out->sig_len = sig->signature_len;
+  return 1;
+}
+
+/** Helper: set the good_signature or bad_signature flag on <b>sig</b>
+ * depending on whether <b>ok</b> is true. */
+static void
+networkstatus_note_signature_result(document_signature_t *sig, int ok)
+{
+  if (ok) {
+    sig->good_signature = 1;
+  } else {
     log_warn(LD_DIR, "Got a bad signature on a networkstatus vote");
     sig->bad_signature = 1;
-  } else {
-    sig->good_signature = 1;
   }
-  tor_free(signed_digest);
+}
+
+/** Check whether the signature <b>sig</b> is correctly signed with the
+ * signing key in <b>cert</b>.  Return -1 if <b>cert</b> doesn't match the
+ * signing key; otherwise set the good_signature or bad_signature flag on
+ * <b>voter</b>, and return 0. */
+int
+networkstatus_check_document_signature(const networkstatus_t *consensus,
+                                       document_signature_t *sig,
+                                       const authority_cert_t *cert)
+{
+  crypto_pk_checkable_t check;
+  int r, ok;
+
+  r = networkstatus_prepare_signature_check(consensus, sig, cert, &check);
+  if (r <= 0)
+    return r;
+
+  crypto_pk_checksig_batch(&ok, &check, 1);
+  networkstatus_note_signature_result(sig, ok);
   return 0;
 }
 
+/** Check all at once every as-yet-unchecked signature on <b>consensus</b>
+ * from a recognized authority whose current certificate we have, so that
+ * the RSA work can be spread over several threads.  Leave every other
+ * signature alone. */
+static void
+networkstatus_check_signatures_in_batch(networkstatus_t *consensus)
+{
+  smartlist_t *sigs = smartlist_new();
+  crypto_pk_checkable_t *checks;
+  int *oks;
+  int n = 0, n_sigs = 0;
+  time_t now = time(NULL);
+
+  SMARTLIST_FOREACH(consensus->voters, networkstatus_voter_info_t *, voter,
+                    n_sigs += smartlist_len(voter->sigs));
+  checks = tor_calloc(n_sigs + 1, sizeof(crypto_pk_checkable_t));
+
+  SMARTLIST_FOREACH_BEGIN(consensus->voters, networkstatus_voter_info_t *,
+                          voter) {
+    SMARTLIST_FOREACH_BEGIN(voter->sigs, document_signature_t *, sig) {
+      authority_cert_t *cert;
+      if (sig->good_signature || sig->bad_signature || !sig->signature)
+        continue;
+      if (!trusteddirserver_get_by_v3_auth_digest(sig->identity_digest))
+        continue;
+      cert = authority_cert_get_by_digests(sig->identity_digest,
+                                           sig->signing_key_digest);
+      if (!cert || cert->expires < now)
+        continue;
+      if (networkstatus_prepare_signature_check(consensus, sig, cert,
+                                                &checks[n]) == 1) {
+        smartlist_add(sigs, sig);
+        ++n;
+      }
+    } SMARTLIST_FOREACH_END(sig);
+  } SMARTLIST_FOREACH_END(voter);
+
+  oks = tor_calloc(n + 1, sizeof(int));
+  crypto_pk_checksig_batch(oks, checks, n);
+  SMARTLIST_FOREACH(sigs, document_signature_t *, sig,
+                    networkstatus_note_signature_result(sig, oks[sig_sl_idx]));
+
+  tor_free(oks);
+  tor_free(checks);
+  smartlist_free(sigs);
+}
+
 /** Given a v3 networkstatus consensus in <b>consensus</b>, check every
  * as-yet-unchecked signature on <b>consensus</b>.  Return 1 if there is a
  * signature from every recognized authority on it, 0 if there are
@@ -388,6 +468,8 @@ networkstatus_check_consensus_signature(networkstatus_t *consensus,
 
   tor_assert(consensus->type == NS_TYPE_CONSENSUS);
 
+  networkstatus_check_signatures_in_batch(consensus);
+
   SMARTLIST_FOREACH_BEGIN(consensus->voters, networkstatus_voter_info_t *,
                           voter) {
     int good_here = 0;
@@ -1004,8 +1086,8 @@ consensus_is_waiting_for_certs(void)
 
 /** Return the most recent consensus that we have downloaded, or NULL if we
  * don't have one. */
-networkstatus_t *
-networkstatus_get_latest_consensus(void)
+MOCK_IMPL(networkstatus_t *,
+networkstatus_get_latest_consensus,(void))
 {
   return current_consensus;
 }
@@ -1060,27 +1142,36 @@ networkstatus_get_reasonably_live_consensus(time_t now, int flavor)
 /** Given two router status entries for the same router identity, return 1 if
  * if the contents have changed between them. Otherwise, return 0. */
 static int
-routerstatus_has_changed(const routerstatus_t *a, const routerstatus_t *b)
+routerstatus_has_changed(routerstatus_t *a, routerstatus_t *b)
 {
   tor_assert(tor_memeq(a->identity_digest, b->identity_digest, DIGEST_LEN));
 
-  return strcmp(a->nickname, b->nickname) ||
-         fast_memneq(a->descriptor_digest, b->descriptor_digest, DIGEST_LEN) ||
-         a->addr != b->addr ||
-         a->or_port != b->or_port ||
-         a->dir_port != b->dir_port ||
-         a->is_authority != b->is_authority ||
-         a->is_exit != b->is_exit ||
-         a->is_stable != b->is_stable ||
-         a->is_fast != b->is_fast ||
-         a->is_flagged_running != b->is_flagged_running ||
-         a->is_named != b->is_named ||
-         a->is_unnamed != b->is_unnamed ||
-         a->is_valid != b->is_valid ||
-         a->is_possible_guard != b->is_possible_guard ||
-         a->is_bad_exit != b->is_bad_exit ||
-         a->is_hs_dir != b->is_hs_dir ||
-         a->version_known != b->version_known;
+  if (strcmp(a->nickname, b->nickname) ||
+      fast_memneq(a->descriptor_digest, b->descriptor_digest, DIGEST_LEN) ||
+      a->addr != b->addr ||
+      a->or_port != b->or_port ||
+      a->dir_port != b->dir_port ||
+      a->is_authority != b->is_authority ||
+      a->is_exit != b->is_exit ||
+      a->is_stable != b->is_stable ||
+      a->is_fast != b->is_fast ||
+      a->is_flagged_running != b->is_flagged_running ||
+      a->is_named != b->is_named ||
+      a->is_unnamed != b->is_unnamed ||
+      a->is_valid != b->is_valid ||
+      a->is_possible_guard != b->is_possible_guard ||
+      a->is_bad_exit != b->is_bad_exit ||
+      a->is_hs_dir != b->is_hs_dir)
+    return 1;
+
+  /* Most entries don't change from one consensus to the next; don't decode
+   * their version lines just to find that out. */
+  if (routerstatus_lazy_fields_eq(a, b))
+    return 0;
+  routerstatus_decode_lazy_fields(a);
+  routerstatus_decode_lazy_fields(b);
+
+  return a->version_known != b->version_known;
 }
 
 /** Notify controllers of any router status entries that changed between
@@ -1107,8 +1198,8 @@ notify_control_networkstatus_changed(const networkstatus_t *old_c,
   changed = smartlist_new();
 
   SMARTLIST_FOREACH_JOIN(
-                     old_c->routerstatus_list, const routerstatus_t *, rs_old,
-                     new_c->routerstatus_list, const routerstatus_t *, rs_new,
+                     old_c->routerstatus_list, routerstatus_t *, rs_old,
+                     new_c->routerstatus_list, routerstatus_t *, rs_new,
                      tor_memcmp(rs_old->identity_digest,
                             rs_new->identity_digest, DIGEST_LEN),
                      smartlist_add(changed, (void*) rs_new)) {
@@ -1147,9 +1238,27 @@ networkstatus_copy_old_consensus_info(networkstatus_t *new_c,
   } SMARTLIST_FOREACH_JOIN_END(rs_old, rs_new);
 }
 
+/** Return a newly allocated filename for the cached consensus of flavor
+ * <b>flavorname</b> in the data directory: the one that's waiting for
+ * certificates if <b>unverified_consensus</b> is true, or the one we're
+ * using otherwise. */
+char *
+networkstatus_get_cache_fname(const char *flavorname,
+                              int unverified_consensus)
+{
+  char buf[128];
+  const char *prefix = unverified_consensus ? "unverified" : "cached";
+  if (!strcmp(flavorname, "ns"))
+    tor_snprintf(buf, sizeof(buf), "%s-consensus", prefix);
+  else
+    tor_snprintf(buf, sizeof(buf), "%s-%s-consensus", prefix, flavorname);
+  return get_datadir_fname(buf);
+}
+
 /** Try to replace the current cached v3 networkstatus with the one in
- * <b>consensus</b>.  If we don't have enough certificates to validate it,
- * store it in consensus_waiting_for_certs and launch a certificate fetch.
+ * <b>consensus</b>, or with the result of applying it to the one we have if
+ * it is a consensus diff.  If we don't have enough certificates to validate
+ * it, store it in consensus_waiting_for_certs and launch a certificate fetch.
  *
  * If flags & NSSET_FROM_CACHE, this networkstatus has come from the disk
  * cache.  If flags & NSSET_WAS_WAITING_FOR_CERTS, this networkstatus was
@@ -1168,6 +1277,20 @@ int
 networkstatus_set_current_consensus(const char *consensus,
                                     const char *flavor,
                                     unsigned flags)
+{
+  return networkstatus_set_current_consensus_parsed(consensus, NULL,
+                                                    flavor, flags);
+}
+
+/** As networkstatus_set_current_consensus(), but if <b>parsed</b> is
+ * provided, it is the result of parsing <b>consensus</b> (which must then be
+ * a whole consensus, not a diff), with its digest_full_sha256 filled in.
+ * This function takes ownership of <b>parsed</b>. */
+int
+networkstatus_set_current_consensus_parsed(const char *consensus,
+                                           networkstatus_t *parsed,
+                                           const char *flavor,
+                                           unsigned flags)
 {
   networkstatus_t *c=NULL;
   int r, result = -1;
@@ -1184,20 +1307,52 @@ networkstatus_set_current_consensus(const char *consensus,
   consensus_waiting_for_certs_t *waiting = NULL;
   time_t current_valid_after = 0;
   int free_consensus = 1; /* Free 'c' at the end of the function */
+  /* The consensus that 'c' replaces.  We keep it until the end of the
+   * function, so that the nodelist can diff 'c' against it. */
+  networkstatus_t *old_c = NULL;
   int old_ewma_enabled;
+  char *applied_diff = NULL;
 
   if (flav < 0) {
     /* XXXX we don't handle unrecognized flavors yet. */
     log_warn(LD_BUG, "Unrecognized consensus flavor %s", flavor);
+    networkstatus_vote_free(parsed);
     return -2;
   }
 
-  /* Make sure it's parseable. */
-  c = networkstatus_parse_vote_from_string(consensus, NULL, NS_TYPE_CONSENSUS);
-  if (!c) {
-    log_warn(LD_DIR, "Unable to parse networkstatus consensus");
-    result = -2;
-    goto done;
+  if (!parsed && looks_like_a_consensus_diff(consensus, strlen(consensus))) {
+    /* We asked for a diff from the consensus we have, and we got one. */
+    networkstatus_t *cur = networkstatus_get_latest_consensus_by_flavor(flav);
+    char *base_fname = networkstatus_get_cache_fname(flavor, 0);
+    char *base = read_file_to_str(base_fname, RFTS_IGNORE_MISSING, NULL);
+    tor_free(base_fname);
+    if (base)
+      applied_diff = consdiff_apply_diff(base, consensus);
+    tor_free(base);
+    if (!applied_diff) {
+      log_info(LD_DIR, "Couldn't apply a %s consensus diff. Asking for the "
+               "whole thing next time.", flavor);
+      /* Don't ask for a diff from this one again. */
+      if (cur)
+        memset(cur->digest_full_sha256, 0, DIGEST256_LEN);
+      return -1;
+    }
+    consensus = applied_diff;
+  }
+
+  if (parsed) {
+    c = parsed;
+  } else {
+    /* Make sure it's parseable. */
+    c = networkstatus_parse_vote_from_string(consensus, NULL,
+                                             NS_TYPE_CONSENSUS);
+    if (!c) {
+      log_warn(LD_DIR, "Unable to parse networkstatus consensus");
+      result = -2;
+      goto done;
+    }
+    crypto_digest256((char*)c->digest_full_sha256, consensus,
+                     strlen(consensus), DIGEST_SHA256);
   }
 
   if ((int)c->flavor != flav) {
@@ -1224,27 +1379,20 @@ networkstatus_set_current_consensus(const char *consensus,
     goto done;
   }
 
+  consensus_fname = networkstatus_get_cache_fname(flavor, 0);
+  unverified_fname = networkstatus_get_cache_fname(flavor, 1);
   if (!strcmp(flavor, "ns")) {
-    consensus_fname = get_datadir_fname("cached-consensus");
-    unverified_fname = get_datadir_fname("unverified-consensus");
     if (current_ns_consensus) {
       current_digests = &current_ns_consensus->digests;
       current_valid_after = current_ns_consensus->valid_after;
     }
   } else if (!strcmp(flavor, "microdesc")) {
-    consensus_fname = get_datadir_fname("cached-microdesc-consensus");
-    unverified_fname = get_datadir_fname("unverified-microdesc-consensus");
     if (current_md_consensus) {
       current_digests = &current_md_consensus->digests;
       current_valid_after = current_md_consensus->valid_after;
     }
   } else {
     cached_dir_t *cur;
-    char buf[128];
-    tor_snprintf(buf, sizeof(buf), "cached-%s-consensus", flavor);
-    consensus_fname = get_datadir_fname(buf);
-    tor_snprintf(buf, sizeof(buf), "unverified-%s-consensus", flavor);
-    unverified_fname = get_datadir_fname(buf);
     cur = dirserv_get_consensus(flavor);
     if (cur) {
       current_digests = &cur->digests;
@@ -1335,7 +1483,7 @@ networkstatus_set_current_consensus(const char *consensus,
   if (flav == FLAV_NS) {
     if (current_ns_consensus) {
       networkstatus_copy_old_consensus_info(c, current_ns_consensus);
-      networkstatus_vote_free(current_ns_consensus);
+      old_c = current_ns_consensus;
       /* Defensive programming : we should set current_consensus very soon,
        * but we're about to call some stuff in the meantime, and leaving this
        * dangling pointer around has proven to be trouble. */
@@ -1346,7 +1494,7 @@ networkstatus_set_current_consensus(const char *consensus,
   } else if (flav == FLAV_MICRODESC) {
     if (current_md_consensus) {
       networkstatus_copy_old_consensus_info(c, current_md_consensus);
-      networkstatus_vote_free(current_md_consensus);
+      old_c = current_md_consensus;
       /* more defensive programming */
       current_md_consensus = NULL;
     }
@@ -1444,8 +1592,10 @@ networkstatus_set_current_consensus(const char *consensus,
  done:
   if (free_consensus)
     networkstatus_vote_free(c);
+  networkstatus_vote_free(old_c);
   tor_free(consensus_fname);
   tor_free(unverified_fname);
+  tor_free(applied_diff);
   return result;
 }
 
@@ -64,7 +64,7 @@ void update_certificate_downloads(time_t now);
 int consensus_is_waiting_for_certs(void);
 int client_would_use_router(const routerstatus_t *rs, time_t now,
                             const or_options_t *options);
-networkstatus_t *networkstatus_get_latest_consensus(void);
+MOCK_DECL(networkstatus_t *,networkstatus_get_latest_consensus,(void));
 MOCK_DECL(networkstatus_t *,networkstatus_get_latest_consensus_by_flavor,
           (consensus_flavor_t f));
 networkstatus_t *networkstatus_get_live_consensus(time_t now);
@@ -75,9 +75,15 @@ networkstatus_t *networkstatus_get_reasonably_live_consensus(time_t now,
 #define NSSET_DONT_DOWNLOAD_CERTS 4
 #define NSSET_ACCEPT_OBSOLETE 8
 #define NSSET_REQUIRE_FLAVOR 16
+char *networkstatus_get_cache_fname(const char *flavorname,
+                                    int unverified_consensus);
 int networkstatus_set_current_consensus(const char *consensus,
                                         const char *flavor,
                                         unsigned flags);
+int networkstatus_set_current_consensus_parsed(const char *consensus,
+                                               networkstatus_t *parsed,
+                                               const char *flavor,
+                                               unsigned flags);
 void networkstatus_note_certs_arrived(void);
 void routers_update_all_from_networkstatus(time_t now, int dir_version);
 void routers_update_status_from_consensus_networkstatus(smartlist_t *routers,
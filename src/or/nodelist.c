@@ -24,6 +24,10 @@
 
 static void nodelist_drop_node(node_t *node, int remove_from_ht);
 static void node_free(node_t *node);
+static void nodelist_rebuild_snapshot(void);
+static INLINE int node_is_usable(const node_t *node);
+static void node_snapshot_free_all(void);
+static void exit_port_index_free_all(void);
 
 /** count_usable_descriptors counts descriptors with these flag(s)
  */
@@ -54,6 +58,9 @@ typedef struct nodelist_t {
   smartlist_t *nodes;
   /* Hash table to map from node ID digest to node. */
   HT_HEAD(nodelist_map, node_t) nodes_by_id;
+  /* The consensus that the nodes' routerstatus pointers point into, or NULL
+   * if we don't know or it has been freed. */
+  const networkstatus_t *consensus;
 
 } nodelist_t;
 
@@ -76,6 +83,16 @@ HT_GENERATE2(nodelist_map, node_t, ht_ent, node_id_hash, node_id_eq,
 /** The global nodelist. */
 static nodelist_t *the_nodelist=NULL;
 
+/** The current node snapshot, or NULL if we haven't built one. */
+static node_snapshot_t *the_snapshot = NULL;
+/** How many entries is each array in the_snapshot allocated to hold? */
+static int snapshot_capacity = 0;
+/** True iff the nodelist has changed since we last built the_snapshot. */
+static int snapshot_dirty = 1;
+/** How many times have we built a snapshot?  We never reset this, so that
+ * a snapshot's generation number is never reused. */
+static unsigned int snapshot_generation = 0;
+
 /** Create an empty nodelist if we haven't done so already. */
 static void
 init_nodelist(void)
@@ -128,6 +145,7 @@ node_get_or_create(const char *identity_digest)
 
   smartlist_add(the_nodelist->nodes, node);
   node->nodelist_idx = smartlist_len(the_nodelist->nodes) - 1;
+  snapshot_dirty = 1;
 
   node->country = -1;
 
@@ -170,6 +188,7 @@ nodelist_set_routerinfo(routerinfo_t *ri, routerinfo_t **ri_old_out)
       *ri_old_out = NULL;
   }
   node->ri = ri;
+  snapshot_dirty = 1;
 
   if (node->country == -1)
     node_set_country(node);
@@ -210,66 +229,150 @@ nodelist_add_microdesc(microdesc_t *md)
       node->md->held_by_nodes--;
     node->md = md;
     md->held_by_nodes++;
+    snapshot_dirty = 1;
   }
   return node;
 }
 
+/** Helper for nodelist_set_consensus(): make <b>node</b> use <b>rs</b>, an
+ * entry in <b>ns</b>, as its routerstatus.  If we know the entry that
+ * <b>node</b> had in the previous consensus, <b>old_rs</b> is that entry;
+ * we use it to skip work when nothing relevant has changed. */
+static void
+node_set_routerstatus(node_t *node, routerstatus_t *rs,
+                      const routerstatus_t *old_rs,
+                      const networkstatus_t *ns)
+{
+  const or_options_t *options = get_options();
+
+  node->rs = rs;
+  if (ns->flavor == FLAV_MICRODESC) {
+    if (node->md == NULL ||
+        tor_memneq(node->md->digest,rs->descriptor_digest,DIGEST256_LEN)) {
+      if (node->md)
+        node->md->held_by_nodes--;
+      node->md = microdesc_cache_lookup_by_digest256(NULL,
+                                                     rs->descriptor_digest);
+      if (node->md)
+        node->md->held_by_nodes++;
+    }
+  }
+
+  /* Looking up the country is the most expensive part of this; don't
+   * bother if the address hasn't changed. */
+  if (!old_rs || node->country == -1 ||
+      old_rs->addr != rs->addr ||
+      !tor_addr_eq(&old_rs->ipv6_addr, &rs->ipv6_addr))
+    node_set_country(node);
+
+  /* If we're not an authdir, believe others. */
+  if (!authdir_mode_v3(options)) {
+    node->is_valid = rs->is_valid;
+    node->is_running = rs->is_flagged_running;
+    node->is_fast = rs->is_fast;
+    node->is_stable = rs->is_stable;
+    node->is_possible_guard = rs->is_possible_guard;
+    node->is_exit = rs->is_exit;
+    node->is_bad_exit = rs->is_bad_exit;
+    node->is_hs_dir = rs->is_hs_dir;
+    node->ipv6_preferred = 0;
+    if (!server_mode(options) && options->ClientPreferIPv6ORPort == 1 &&
+        (tor_addr_is_null(&rs->ipv6_addr) == 0 ||
+         (node->md && tor_addr_is_null(&node->md->ipv6_addr) == 0)))
+      node->ipv6_preferred = 1;
+  }
+}
+
+/** Helper for nodelist_set_consensus(): <b>old_rs</b> was listed in the
+ * previous consensus, but isn't in the new one.  Forget about it, and drop
+ * its node if that leaves the node with nothing usable. */
+static void
+nodelist_forget_routerstatus(const routerstatus_t *old_rs)
+{
+  node_t *node = node_get_mutable_by_id(old_rs->identity_digest);
+  if (!node || node->rs != old_rs)
+    return;
+  node->rs = NULL;
+  if (node->md) {
+    /* An md is only useful if there is an rs. */
+    node->md->held_by_nodes--;
+    node->md = NULL;
+  }
+  if (! node_is_usable(node)) {
+    nodelist_drop_node(node, 1);
+    node_free(node);
+  }
+}
+
 /** Tell the nodelist that the current usable consensus is <b>ns</b>.
  * This makes the nodelist change all of the routerstatus entries for
  * the nodes, drop nodes that no longer have enough info to get used,
  * and grab microdescriptors into nodes as appropriate.
+ *
+ * If the nodelist was built from a previous consensus of the same flavor
+ * that's still in memory, we walk the two consensuses side by side in
+ * identity order, so that we only do the expensive work for entries that
+ * are new or have changed, and only look at removed nodes to drop them.
+ * Otherwise, we rebuild everything.
  */
 void
 nodelist_set_consensus(networkstatus_t *ns)
 {
-  const or_options_t *options = get_options();
-  int authdir = authdir_mode_v3(options);
-  int client = !server_mode(options);
+  const int authdir = authdir_mode_v3(get_options());
+  const networkstatus_t *old_ns;
 
   init_nodelist();
   if (ns->flavor == FLAV_MICRODESC)
     (void) get_microdesc_cache(); /* Make sure it exists first. */
 
-  SMARTLIST_FOREACH(the_nodelist->nodes, node_t *, node,
-                    node->rs = NULL);
-
-  SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
-    node_t *node = node_get_or_create(rs->identity_digest);
-    node->rs = rs;
-    if (ns->flavor == FLAV_MICRODESC) {
-      if (node->md == NULL ||
-          tor_memneq(node->md->digest,rs->descriptor_digest,DIGEST256_LEN)) {
-        if (node->md)
-          node->md->held_by_nodes--;
-        node->md = microdesc_cache_lookup_by_digest256(NULL,
-                                                       rs->descriptor_digest);
-        if (node->md)
-          node->md->held_by_nodes++;
+  old_ns = the_nodelist->consensus;
+  if (old_ns && old_ns != ns && old_ns->flavor == ns->flavor) {
+    const smartlist_t *old_list = old_ns->routerstatus_list;
+    const smartlist_t *new_list = ns->routerstatus_list;
+    const int n_old = smartlist_len(old_list);
+    const int n_new = smartlist_len(new_list);
+    int i = 0, j = 0;
+
+    while (i < n_old || j < n_new) {
+      const routerstatus_t *old_rs =
+        (i < n_old) ? smartlist_get(old_list, i) : NULL;
+      routerstatus_t *new_rs =
+        (j < n_new) ? smartlist_get(new_list, j) : NULL;
+      int cmp;
+      if (!old_rs)
+        cmp = 1;
+      else if (!new_rs)
+        cmp = -1;
+      else
+        cmp = tor_memcmp(old_rs->identity_digest, new_rs->identity_digest,
+                         DIGEST_LEN);
+
+      if (cmp < 0) {
+        nodelist_forget_routerstatus(old_rs);
+        ++i;
+      } else if (cmp > 0) {
+        node_set_routerstatus(node_get_or_create(new_rs->identity_digest),
+                              new_rs, NULL, ns);
+        ++j;
+      } else {
+        node_set_routerstatus(node_get_or_create(new_rs->identity_digest),
+                              new_rs, old_rs, ns);
+        ++i;
+        ++j;
       }
     }
+  } else {
+    SMARTLIST_FOREACH(the_nodelist->nodes, node_t *, node,
+                      node->rs = NULL);
 
-    node_set_country(node);
-
-    /* If we're not an authdir, believe others. */
-    if (!authdir) {
-      node->is_valid = rs->is_valid;
-      node->is_running = rs->is_flagged_running;
-      node->is_fast = rs->is_fast;
-      node->is_stable = rs->is_stable;
-      node->is_possible_guard = rs->is_possible_guard;
-      node->is_exit = rs->is_exit;
-      node->is_bad_exit = rs->is_bad_exit;
-      node->is_hs_dir = rs->is_hs_dir;
-      node->ipv6_preferred = 0;
-      if (client && options->ClientPreferIPv6ORPort == 1 &&
-          (tor_addr_is_null(&rs->ipv6_addr) == 0 ||
-           (node->md && tor_addr_is_null(&node->md->ipv6_addr) == 0)))
-        node->ipv6_preferred = 1;
-    }
-
-  } SMARTLIST_FOREACH_END(rs);
+    SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
+      node_set_routerstatus(node_get_or_create(rs->identity_digest),
+                            rs, NULL, ns);
+    } SMARTLIST_FOREACH_END(rs);
 
-  nodelist_purge();
+    nodelist_purge();
+  }
+  the_nodelist->consensus = ns;
 
   if (! authdir) {
     SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
@@ -288,6 +391,20 @@ nodelist_set_consensus(networkstatus_t *ns)
       }
     } SMARTLIST_FOREACH_END(node);
   }
+
+  /* Every node's routerstatus has changed, so build a fresh snapshot now
+   * rather than at our next path selection. */
+  nodelist_rebuild_snapshot();
+}
+
+/** Tell the nodelist that <b>ns</b> is about to be freed.  If it's the
+ * consensus that the nodelist was built from, we won't be able to diff
+ * the next consensus against it. */
+void
+nodelist_forget_consensus(const networkstatus_t *ns)
+{
+  if (the_nodelist && the_nodelist->consensus == ns)
+    the_nodelist->consensus = NULL;
 }
 
 /** Helper: return true iff a node has a usable amount of information*/
@@ -306,6 +423,7 @@ nodelist_remove_microdesc(const char *identity_digest, microdesc_t *md)
   if (node && node->md == md) {
     node->md = NULL;
     md->held_by_nodes--;
+    snapshot_dirty = 1;
   }
 }
 
@@ -316,6 +434,7 @@ nodelist_remove_routerinfo(routerinfo_t *ri)
   node_t *node = node_get_mutable_by_id(ri->cache_info.identity_digest);
   if (node && node->ri == ri) {
     node->ri = NULL;
+    snapshot_dirty = 1;
     if (! node_is_usable(node)) {
       nodelist_drop_node(node, 1);
       node_free(node);
@@ -345,6 +464,7 @@ nodelist_drop_node(node_t *node, int remove_from_ht)
     tmp->nodelist_idx = idx;
   }
   node->nodelist_idx = -1;
+  snapshot_dirty = 1;
 }
 
 /** Return a newly allocated smartlist of the nodes that have <b>md</b> as
@@ -395,6 +515,7 @@ nodelist_purge(void)
       /* An md is only useful if there is an rs. */
       node->md->held_by_nodes--;
       node->md = NULL;
+      snapshot_dirty = 1;
     }
 
     if (node_is_usable(node)) {
@@ -424,6 +545,8 @@ nodelist_free_all(void)
   smartlist_free(the_nodelist->nodes);
 
   tor_free(the_nodelist);
+
+  node_snapshot_free_all();
 }
 
 /** Check that the nodelist is internally consistent, and consistent with
@@ -496,6 +619,283 @@ nodelist_get_list,(void))
   return the_nodelist->nodes;
 }
 
+/** Tell the nodelist that some node has changed in a way that path
+ * selection cares about, so that the next call to nodelist_get_snapshot()
+ * must rebuild the snapshot. */
+void
+nodelist_snapshot_mark_dirty(void)
+{
+  snapshot_dirty = 1;
+}
+
+/** Return the NODE_SNAP_* flags that describe <b>node</b>. */
+uint16_t
+node_get_snapshot_flags(const node_t *node)
+{
+  uint16_t flags = 0;
+  uint32_t bw;
+  if (node->is_running)
+    flags |= NODE_SNAP_RUNNING;
+  if (node->is_valid)
+    flags |= NODE_SNAP_VALID;
+  if (node->is_fast)
+    flags |= NODE_SNAP_FAST;
+  if (node->is_stable)
+    flags |= NODE_SNAP_STABLE;
+  if (node->is_possible_guard)
+    flags |= NODE_SNAP_GUARD;
+  if (node->is_exit && !node->is_bad_exit)
+    flags |= NODE_SNAP_EXIT;
+  if (node_is_dir(node))
+    flags |= NODE_SNAP_DIR;
+  if (node_has_descriptor(node))
+    flags |= NODE_SNAP_HAS_DESC;
+  if (!node->ri || node->ri->purpose == ROUTER_PURPOSE_GENERAL)
+    flags |= NODE_SNAP_GENERAL;
+  if (node_allows_single_hop_exits(node))
+    flags |= NODE_SNAP_SINGLE_HOP_EXIT;
+  if (node_get_weighting_bandwidth(node, &bw) == 0)
+    flags |= NODE_SNAP_HAS_BW;
+  if (node->rs && node->rs->has_guardfraction) {
+    /* XXX The assert should actually check for is_guard. However,
+     * that crashes dirauths because of #13297. This should be
+     * equivalent: */
+    tor_assert(node->rs->is_possible_guard);
+    flags |= NODE_SNAP_HAS_GUARDFRACTION;
+  }
+  return flags;
+}
+
+/** Helper: make sure every array in the_snapshot can hold at least
+ * <b>n</b> entries. */
+static void
+node_snapshot_reserve(int n)
+{
+  node_snapshot_t *snap = the_snapshot;
+  if (n <= snapshot_capacity)
+    return;
+  n = MAX(n, snapshot_capacity * 2);
+  snap->nodes = tor_reallocarray(snap->nodes, n, sizeof(node_t *));
+  snap->flags = tor_reallocarray(snap->flags, n, sizeof(uint16_t));
+  snap->bandwidth = tor_reallocarray(snap->bandwidth, n, sizeof(uint32_t));
+  snap->guardfraction_pct = tor_reallocarray(snap->guardfraction_pct,
+                                             n, sizeof(uint8_t));
+  snap->ipv4h_addr = tor_reallocarray(snap->ipv4h_addr, n,
+                                      sizeof(uint32_t));
+  snapshot_capacity = n;
+}
+
+/** Rebuild the_snapshot from the nodelist. */
+static void
+nodelist_rebuild_snapshot(void)
+{
+  node_snapshot_t *snap;
+
+  init_nodelist();
+  if (!the_snapshot)
+    the_snapshot = tor_malloc_zero(sizeof(node_snapshot_t));
+  snap = the_snapshot;
+  node_snapshot_reserve(smartlist_len(the_nodelist->nodes));
+
+  SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
+    uint32_t bw = 0;
+    tor_assert(node->nodelist_idx == node_sl_idx);
+    snap->nodes[node_sl_idx] = node;
+    snap->flags[node_sl_idx] = node_get_snapshot_flags(node);
+    node_get_weighting_bandwidth(node, &bw);
+    snap->bandwidth[node_sl_idx] = bw;
+    snap->guardfraction_pct[node_sl_idx] =
+      (node->rs && node->rs->has_guardfraction) ?
+        (uint8_t)node->rs->guardfraction_percentage : 0;
+    snap->ipv4h_addr[node_sl_idx] = node_get_prim_addr_ipv4h(node);
+  } SMARTLIST_FOREACH_END(node);
+  snap->n_nodes = smartlist_len(the_nodelist->nodes);
+  snap->generation = ++snapshot_generation;
+
+  snapshot_dirty = 0;
+}
+
+/** Return a snapshot of the information that path selection needs about
+ * every node in the nodelist, rebuilding it first if the nodelist has
+ * changed.  The result is valid only until the nodelist next changes. */
+const node_snapshot_t *
+nodelist_get_snapshot(void)
+{
+  if (snapshot_dirty || !the_snapshot)
+    nodelist_rebuild_snapshot();
+  return the_snapshot;
+}
+
+/** Release all storage held by the node snapshot. */
+static void
+node_snapshot_free_all(void)
+{
+  if (the_snapshot) {
+    tor_free(the_snapshot->nodes);
+    tor_free(the_snapshot->flags);
+    tor_free(the_snapshot->bandwidth);
+    tor_free(the_snapshot->guardfraction_pct);
+    tor_free(the_snapshot->ipv4h_addr);
+    tor_free(the_snapshot);
+  }
+  snapshot_capacity = 0;
+  snapshot_dirty = 1;
+  exit_port_index_free_all();
+}
+
+/** An index from exit ports to the nodes whose exit policies might allow
+ * them, built lazily from the_snapshot and thrown away whenever the
+ * snapshot is rebuilt (that is, when a new consensus, microdescriptor or
+ * router descriptor arrives).
+ *
+ * No node's policy can change its answer except at the edge of one of its
+ * port ranges, so we split the ports into the ranges between all such
+ * edges, and keep one set of nodes per range rather than one per port. */
+typedef struct exit_port_index_t {
+  /** The generation of the_snapshot that this index was built from. */
+  unsigned int generation;
+  /** How many nodes were in the_snapshot? */
+  int n_nodes;
+  /** How many port ranges are there? */
+  int n_ranges;
+  /** The lowest port of each range, in ascending order.  The first range
+   * always starts at port 1. */
+  uint16_t *range_start;
+  /** For each range, a bitarray of the positions in the_snapshot of the
+   * nodes that might allow exiting to ports in that range, or NULL if
+   * nobody has asked about that range yet. */
+  bitarray_t **range_nodes;
+} exit_port_index_t;
+
+/** The current exit port index, or NULL if we haven't built one. */
+static exit_port_index_t *the_exit_port_index = NULL;
+
+/** Release all storage held by <b>idx</b>. */
+static void
+exit_port_index_free(exit_port_index_t *idx)
+{
+  int i;
+  if (!idx)
+    return;
+  for (i = 0; i < idx->n_ranges; ++i)
+    bitarray_free(idx->range_nodes[i]);
+  tor_free(idx->range_nodes);
+  tor_free(idx->range_start);
+  tor_free(idx);
+}
+
+/** Release all storage held by the exit port index. */
+static void
+exit_port_index_free_all(void)
+{
+  exit_port_index_free(the_exit_port_index);
+  the_exit_port_index = NULL;
+}
+
+/** Helper: mark in <b>edges</b> the first port of the range
+ * <b>min_port</b>..<b>max_port</b> and the first port after it. */
+static INLINE void
+exit_port_index_mark_edges(bitarray_t *edges, int min_port, int max_port)
+{
+  if (min_port >= 1 && min_port <= 65535)
+    bitarray_set(edges, min_port);
+  if (max_port >= 0 && max_port < 65535)
+    bitarray_set(edges, max_port + 1);
+}
+
+/** Build and return a new exit port index, with no node sets yet, for
+ * <b>snap</b>. */
+static exit_port_index_t *
+exit_port_index_new(const node_snapshot_t *snap)
+{
+  exit_port_index_t *idx = tor_malloc_zero(sizeof(exit_port_index_t));
+  bitarray_t *edges = bitarray_init_zero(65536);
+  int i, port;
+
+  bitarray_set(edges, 1);
+  for (i = 0; i < snap->n_nodes; ++i) {
+    const node_t *node = snap->nodes[i];
+    if (node->rejects_all)
+      continue;
+    if (node->ri) {
+      if (node->ri->exit_policy) {
+        SMARTLIST_FOREACH(node->ri->exit_policy, const addr_policy_t *, p,
+                          exit_port_index_mark_edges(edges, p->prt_min,
+                                                     p->prt_max));
+      }
+    } else if (node->md && node->md->exit_policy) {
+      const short_policy_t *sp = node->md->exit_policy;
+      unsigned int j;
+      for (j = 0; j < sp->n_entries; ++j)
+        exit_port_index_mark_edges(edges, sp->entries[j].min_port,
+                                   sp->entries[j].max_port);
+    }
+  }
+
+  for (port = 1; port <= 65535; ++port) {
+    if (bitarray_is_set(edges, port))
+      ++idx->n_ranges;
+  }
+  idx->range_start = tor_calloc(idx->n_ranges, sizeof(uint16_t));
+  idx->range_nodes = tor_calloc(idx->n_ranges, sizeof(bitarray_t *));
+  i = 0;
+  for (port = 1; port <= 65535; ++port) {
+    if (bitarray_is_set(edges, port))
+      idx->range_start[i++] = port;
+  }
+  bitarray_free(edges);
+
+  idx->generation = snap->generation;
+  idx->n_nodes = snap->n_nodes;
+  return idx;
+}
+
+/** Return a bitarray, indexed by position in nodelist_get_snapshot(), of
+ * the nodes whose exit policies don't reject or probably reject connections
+ * to <b>port</b> at an unknown address.  The result stays valid only until
+ * the nodelist next changes.  <b>port</b> must not be 0. */
+const bitarray_t *
+nodelist_get_exits_for_port(uint16_t port)
+{
+  const node_snapshot_t *snap = nodelist_get_snapshot();
+  exit_port_index_t *idx = the_exit_port_index;
+  int lo, hi, r;
+
+  tor_assert(port);
+  if (!idx || idx->generation != snap->generation) {
+    exit_port_index_free(idx);
+    idx = the_exit_port_index = exit_port_index_new(snap);
+  }
+
+  /* Find the last range that starts at or below port. */
+  lo = 0;
+  hi = idx->n_ranges - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (idx->range_start[mid] <= port)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  r = lo;
+
+  if (!idx->range_nodes[r]) {
+    /* Every port in the range gets the same answer from every node, so
+     * asking about this one will do. */
+    bitarray_t *nodes = bitarray_init_zero(idx->n_nodes);
+    int i;
+    for (i = 0; i < idx->n_nodes; ++i) {
+      addr_policy_result_t res =
+        compare_tor_addr_to_node_policy(NULL, port, snap->nodes[i]);
+      if (res != ADDR_POLICY_REJECTED &&
+          res != ADDR_POLICY_PROBABLY_REJECTED)
+        bitarray_set(nodes, i);
+    }
+    idx->range_nodes[r] = nodes;
+  }
+  return idx->range_nodes[r];
+}
+
 /** Given a hex-encoded nickname of the format DIGEST, $DIGEST, $DIGEST=name,
  * or $DIGEST~name, return the node with the matching identity digest and
  * nickname (if any).  Return NULL if no such node exists, or if <b>hex_id</b>
@@ -1265,8 +1665,10 @@ router_set_status(const char *digest, int up)
       log_warn(LD_NET, "We just marked ourself as down. Are your external "
                "addresses reachable?");
 
-    if (bool_neq(node->is_running, up))
+    if (bool_neq(node->is_running, up)) {
       router_dir_info_changed();
+      snapshot_dirty = 1;
+    }
 
     node->is_running = up;
   }
@@ -22,6 +22,7 @@ const node_t *node_get_by_hex_id(const char *identity_digest);
 node_t *nodelist_set_routerinfo(routerinfo_t *ri, routerinfo_t **ri_old_out);
 node_t *nodelist_add_microdesc(microdesc_t *md);
 void nodelist_set_consensus(networkstatus_t *ns);
+void nodelist_forget_consensus(const networkstatus_t *ns);
 
 void nodelist_remove_microdesc(const char *identity_digest, microdesc_t *md);
 void nodelist_remove_routerinfo(routerinfo_t *ri);
@@ -63,6 +64,77 @@ int node_has_curve25519_onion_key(const node_t *node);
 
 MOCK_DECL(smartlist_t *, nodelist_get_list, (void));
 
+/** Flags for node_snapshot_t.flags. */
+/** The node is running. */
+#define NODE_SNAP_RUNNING         (1u<<0)
+/** The node is valid. */
+#define NODE_SNAP_VALID           (1u<<1)
+/** The node is fast. */
+#define NODE_SNAP_FAST            (1u<<2)
+/** The node is stable. */
+#define NODE_SNAP_STABLE          (1u<<3)
+/** The node could be a guard. */
+#define NODE_SNAP_GUARD           (1u<<4)
+/** The node is an exit, and not a bad exit. */
+#define NODE_SNAP_EXIT            (1u<<5)
+/** The node is a directory cache; see node_is_dir(). */
+#define NODE_SNAP_DIR             (1u<<6)
+/** We have a descriptor that we can use to build circuits through the
+ * node; see node_has_descriptor(). */
+#define NODE_SNAP_HAS_DESC        (1u<<7)
+/** The node has no routerinfo, or a routerinfo with general purpose. */
+#define NODE_SNAP_GENERAL         (1u<<8)
+/** The node allows single-hop exits. */
+#define NODE_SNAP_SINGLE_HOP_EXIT (1u<<9)
+/** The bandwidth entry for the node is meaningful. */
+#define NODE_SNAP_HAS_BW          (1u<<10)
+/** The guardfraction entry for the node is meaningful. */
+#define NODE_SNAP_HAS_GUARDFRACTION (1u<<11)
+
+/** A dense copy of the information that path selection needs about every
+ * node in the nodelist, laid out as parallel arrays so that choosing a
+ * node is a linear scan rather than a walk over scattered node_t,
+ * routerstatus_t and routerinfo_t objects.  Entry <b>i</b> of each array
+ * describes the node whose nodelist_idx is <b>i</b>.
+ *
+ * Get one with nodelist_get_snapshot(); it stays valid only until the
+ * nodelist changes. */
+typedef struct node_snapshot_t {
+  /** Incremented every time we rebuild the snapshot, so that anything
+   * derived from it can tell when it's out of date. */
+  unsigned int generation;
+  /** How many nodes are in the snapshot? */
+  int n_nodes;
+  /** The nodes themselves. */
+  node_t **nodes;
+  /** NODE_SNAP_* flags for each node. */
+  uint16_t *flags;
+  /** The bandwidth to use when weighting each node, in bytes per second;
+   * see node_get_weighting_bandwidth(). */
+  uint32_t *bandwidth;
+  /** The guardfraction percentage for each node, from its consensus
+   * entry. */
+  uint8_t *guardfraction_pct;
+  /** The primary IPv4 address of each node, in host order. */
+  uint32_t *ipv4h_addr;
+} node_snapshot_t;
+
+const node_snapshot_t *nodelist_get_snapshot(void);
+void nodelist_snapshot_mark_dirty(void);
+uint16_t node_get_snapshot_flags(const node_t *node);
+const bitarray_t *nodelist_get_exits_for_port(uint16_t port);
+
+/** Return the index of <b>node</b> within <b>snap</b>, or -1 if it
+ * isn't there. */
+static INLINE int
+node_snapshot_find(const node_snapshot_t *snap, const node_t *node)
+{
+  const int idx = node->nodelist_idx;
+  if (idx >= 0 && idx < snap->n_nodes && snap->nodes[idx] == node)
+    return idx;
+  return -1;
+}
+
 /* Temporary during transition to multiple addresses.  */
 void node_get_addr(const node_t *node, tor_addr_t *addr_out);
 #define node_get_addr_ipv4h(n) node_get_prim_addr_ipv4h((n))
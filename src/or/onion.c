@@ -345,8 +345,8 @@ clear_pending_onions(void)
  * and other info we might need to do onion handshakes.  (We make a copy of
  * our keys for each cpuworker to avoid race conditions with the main thread,
  * and to avoid locking) */
-server_onion_keys_t *
-server_onion_keys_new(void)
+MOCK_IMPL(server_onion_keys_t *,
+server_onion_keys_new,(void))
 {
   server_onion_keys_t *keys = tor_malloc_zero(sizeof(server_onion_keys_t));
   memcpy(keys->my_identity, router_get_my_id_digest(), DIGEST_LEN);
@@ -520,6 +520,82 @@ onion_skin_server_handshake(int type,
   return r;
 }
 
+/** Perform the server-side step of the <b>n</b> circuit-creation
+ * handshakes in <b>handshakes</b> using the keys in <b>keys</b>, as if by
+ * calling onion_skin_server_handshake() on each, and set the result field
+ * of each to what that would have returned.  We do all the ntor handshakes
+ * together, since that's cheaper than doing them one by one. */
+void
+onion_skin_server_handshake_batch(int n, onion_server_handshake_t *handshakes,
+                                  const server_onion_keys_t *keys)
+{
+  ntor_server_request_t *ntor_reqs;
+  int *ntor_idx, *ntor_results;
+  int i, n_ntor = 0;
+
+  if (n == 1) {
+    /* Nothing to share: don't bother with the batch machinery. */
+    onion_server_handshake_t *hs = &handshakes[0];
+    hs->result = onion_skin_server_handshake(hs->type,
+                                             hs->onion_skin,
+                                             hs->onionskin_len,
+                                             keys, hs->reply_out,
+                                             hs->keys_out, hs->keys_out_len,
+                                             hs->rend_nonce_out);
+    return;
+  }
+
+  ntor_reqs = tor_calloc(n, sizeof(ntor_server_request_t));
+  ntor_idx = tor_calloc(n, sizeof(int));
+  ntor_results = tor_calloc(n, sizeof(int));
+
+  for (i = 0; i < n; ++i) {
+    onion_server_handshake_t *hs = &handshakes[i];
+    if (hs->type != ONION_HANDSHAKE_TYPE_NTOR ||
+        hs->onionskin_len < NTOR_ONIONSKIN_LEN) {
+      hs->result = onion_skin_server_handshake(hs->type,
+                                               hs->onion_skin,
+                                               hs->onionskin_len,
+                                               keys, hs->reply_out,
+                                               hs->keys_out, hs->keys_out_len,
+                                               hs->rend_nonce_out);
+      continue;
+    }
+    ntor_reqs[n_ntor].onion_skin = hs->onion_skin;
+    ntor_reqs[n_ntor].handshake_reply_out = hs->reply_out;
+    ntor_reqs[n_ntor].key_out_len = hs->keys_out_len + DIGEST_LEN;
+    ntor_reqs[n_ntor].key_out = tor_malloc(ntor_reqs[n_ntor].key_out_len);
+    ntor_idx[n_ntor] = i;
+    ++n_ntor;
+  }
+
+  if (n_ntor) {
+    onion_skin_ntor_server_handshake_batch(n_ntor, ntor_reqs,
+                                           keys->curve25519_key_map,
+                                           keys->junk_keypair,
+                                           keys->my_identity,
+                                           ntor_results);
+  }
+
+  for (i = 0; i < n_ntor; ++i) {
+    onion_server_handshake_t *hs = &handshakes[ntor_idx[i]];
+    ntor_server_request_t *req = &ntor_reqs[i];
+    if (ntor_results[i] < 0) {
+      hs->result = -1;
+    } else {
+      memcpy(hs->keys_out, req->key_out, hs->keys_out_len);
+      memcpy(hs->rend_nonce_out, req->key_out+hs->keys_out_len, DIGEST_LEN);
+      hs->result = NTOR_REPLY_LEN;
+    }
+    memwipe(req->key_out, 0, req->key_out_len);
+    tor_free(req->key_out);
+  }
+
+  tor_free(ntor_reqs);
+  tor_free(ntor_idx);
+  tor_free(ntor_results);
+}
+
 /** Perform the final (client-side) step of a circuit-creation handshake of
  * type <b>type</b>, using our state in <b>handshake_state</b> and the
  * server's response in <b>reply</b>. On success, generate <b>keys_out_len</b>
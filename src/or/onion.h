@@ -30,7 +30,7 @@ typedef struct server_onion_keys_t {
 #define MAX_ONIONSKIN_CHALLENGE_LEN 255
 #define MAX_ONIONSKIN_REPLY_LEN 255
 
-server_onion_keys_t *server_onion_keys_new(void);
+MOCK_DECL(server_onion_keys_t *, server_onion_keys_new, (void));
 void server_onion_keys_free(server_onion_keys_t *keys);
 
 void onion_handshake_state_release(onion_handshake_state_t *state);
@@ -45,6 +45,23 @@ int onion_skin_server_handshake(int type,
                       uint8_t *reply_out,
                       uint8_t *keys_out, size_t key_out_len,
                       uint8_t *rend_nonce_out);
+/** One server-side circuit-creation handshake for
+ * onion_skin_server_handshake_batch() to perform.  The fields are the
+ * arguments to onion_skin_server_handshake(), and its return value. */
+typedef struct onion_server_handshake_t {
+  int type;
+  const uint8_t *onion_skin;
+  size_t onionskin_len;
+  uint8_t *reply_out;
+  uint8_t *keys_out;
+  size_t keys_out_len;
+  uint8_t *rend_nonce_out;
+  /** Set to the length of the reply on success, or -1 on failure. */
+  int result;
+} onion_server_handshake_t;
+void onion_skin_server_handshake_batch(int n,
+                      onion_server_handshake_t *handshakes,
+                      const server_onion_keys_t *keys);
 int onion_skin_client_handshake(int type,
                       const onion_handshake_state_t *handshake_state,
                       const uint8_t *reply, size_t reply_len,
@@ -105,6 +105,18 @@ onion_skin_ntor_create(const uint8_t *router_id,
                         CURVE25519_PUBKEY_LEN*3 +       \
                         PROTOID_LEN + SERVER_STR_LEN)
 
+/** Per-handshake state for onion_skin_ntor_server_handshake_batch().  Kept
+ * in one struct to make it easy to wipe. */
+typedef struct ntor_server_state_t {
+  uint8_t secret_input[SECRET_INPUT_LEN];
+  uint8_t auth_input[AUTH_INPUT_LEN];
+  curve25519_public_key_t pubkey_X;
+  curve25519_secret_key_t seckey_y;
+  curve25519_public_key_t pubkey_Y;
+  uint8_t verify[DIGEST256_LEN];
+  const curve25519_keypair_t *keypair_bB;
+} ntor_server_state_t;
+
 /**
  * Perform the server side of an ntor handshake. Given an
  * NTOR_ONIONSKIN_LEN-byte message in <b>onion_skin</b>, our own identity
@@ -215,6 +227,172 @@ onion_skin_ntor_server_handshake(const uint8_t *onion_skin,
   return bad ? -1 : 0;
 }
 
+/**
+ * Perform the server side of <b>n</b> ntor handshakes at once, as if by
+ * calling onion_skin_ntor_server_handshake() for each of <b>requests</b>,
+ * and set <b>results_out</b>[i] to what it would have returned for
+ * <b>requests</b>[i].
+ *
+ * This is faster than doing the handshakes one at a time: the curve25519
+ * operations for all of them share their field inversions, and we only set
+ * up our HMAC keys once.  For a single handshake, though, we just call
+ * onion_skin_ntor_server_handshake(), which doesn't touch the heap.
+ */
+void
+onion_skin_ntor_server_handshake_batch(int n,
+                                       const ntor_server_request_t *requests,
+                                       const di_digest256_map_t *private_keys,
+                                       const curve25519_keypair_t *junk_keys,
+                                       const uint8_t *my_node_id,
+                                       int *results_out)
+{
+  const tweakset_t *T = &proto1_tweaks;
+  /* Sensitive heap-allocated material. */
+  ntor_server_state_t *states;
+  uint8_t **dh_out;
+  const curve25519_secret_key_t **dh_seckeys;
+  const curve25519_public_key_t **dh_pubkeys;
+  crypto_hmac_sha256_key_t *k_verify, *k_mac, *k_key;
+  int i, n_dh = 0;
+
+  if (n <= 0)
+    return;
+  if (n == 1) {
+    results_out[0] = onion_skin_ntor_server_handshake(
+                                    requests[0].onion_skin, private_keys,
+                                    junk_keys, my_node_id,
+                                    requests[0].handshake_reply_out,
+                                    requests[0].key_out,
+                                    requests[0].key_out_len);
+    return;
+  }
+
+  states = tor_calloc(n, sizeof(ntor_server_state_t));
+  dh_out = tor_calloc(2*n, sizeof(uint8_t *));
+  dh_seckeys = tor_calloc(2*n, sizeof(curve25519_secret_key_t *));
+  dh_pubkeys = tor_calloc(2*n, sizeof(curve25519_public_key_t *));
+
+  for (i = 0; i < n; ++i) {
+    const uint8_t *onion_skin = requests[i].onion_skin;
+    ntor_server_state_t *s = &states[i];
+
+    /* Decode the onion skin */
+    /* XXXX Does this possible early-return business threaten our
+     * security? */
+    if (tor_memneq(onion_skin, my_node_id, DIGEST_LEN)) {
+      results_out[i] = -1;
+      continue;
+    }
+    /* Note that on key-not-found, we go through with this operation anyway,
+     * using "junk_keys". This will result in failed authentication, but
+     * won't leak whether we recognized the key. */
+    s->keypair_bB = dimap_search(private_keys, onion_skin + DIGEST_LEN,
+                                 (void*)junk_keys);
+    if (!s->keypair_bB) {
+      results_out[i] = -1;
+      continue;
+    }
+    results_out[i] = 0;
+
+    memcpy(s->pubkey_X.public_key, onion_skin+DIGEST_LEN+DIGEST256_LEN,
+           CURVE25519_PUBKEY_LEN);
+
+    /* Make y, Y */
+    curve25519_secret_key_generate(&s->seckey_y, 0);
+    curve25519_public_key_generate(&s->pubkey_Y, &s->seckey_y);
+
+    /* NOTE: If we ever use a group other than curve25519, or a different
+     * representation for its points, we may need to perform different or
+     * additional checks on X here and on Y in the client handshake, or lose
+     * our security properties. What checks we need would depend on the
+     * properties of the group and its representation.
+     *
+     * In short: if you use anything other than curve25519, this aspect of
+     * the code will need to be reconsidered carefully. */
+
+    /* The start of secret_input is EXP(X,y) | EXP(X,b).  We compute those
+     * for every handshake at once below. */
+    dh_out[n_dh] = s->secret_input;
+    dh_seckeys[n_dh] = &s->seckey_y;
+    dh_pubkeys[n_dh] = &s->pubkey_X;
+    ++n_dh;
+    dh_out[n_dh] = s->secret_input + CURVE25519_OUTPUT_LEN;
+    dh_seckeys[n_dh] = &s->keypair_bB->seckey;
+    dh_pubkeys[n_dh] = &s->pubkey_X;
+    ++n_dh;
+  }
+
+  curve25519_handshake_batch(n_dh, dh_out, dh_seckeys, dh_pubkeys);
+
+  k_verify = crypto_hmac_sha256_key_new(T->t_verify, strlen(T->t_verify));
+  k_mac = crypto_hmac_sha256_key_new(T->t_mac, strlen(T->t_mac));
+  k_key = crypto_hmac_sha256_key_new(T->t_key, strlen(T->t_key));
+
+  for (i = 0; i < n; ++i) {
+    ntor_server_state_t *s = &states[i];
+    const ntor_server_request_t *req = &requests[i];
+    uint8_t *si = s->secret_input, *ai = s->auth_input;
+    int bad;
+
+    if (results_out[i] < 0)
+      continue;
+
+    /* build secret_input */
+    bad = safe_mem_is_zero(si, CURVE25519_OUTPUT_LEN);
+    si += CURVE25519_OUTPUT_LEN;
+    bad |= safe_mem_is_zero(si, CURVE25519_OUTPUT_LEN);
+    si += CURVE25519_OUTPUT_LEN;
+
+    APPEND(si, my_node_id, DIGEST_LEN);
+    APPEND(si, s->keypair_bB->pubkey.public_key, CURVE25519_PUBKEY_LEN);
+    APPEND(si, s->pubkey_X.public_key, CURVE25519_PUBKEY_LEN);
+    APPEND(si, s->pubkey_Y.public_key, CURVE25519_PUBKEY_LEN);
+    APPEND(si, PROTOID, PROTOID_LEN);
+    tor_assert(si == s->secret_input + sizeof(s->secret_input));
+
+    /* Compute hashes of secret_input */
+    crypto_hmac_sha256_with_key((char*)s->verify, k_verify,
+                                (const char*)s->secret_input,
+                                sizeof(s->secret_input));
+
+    /* Compute auth_input */
+    APPEND(ai, s->verify, DIGEST256_LEN);
+    APPEND(ai, my_node_id, DIGEST_LEN);
+    APPEND(ai, s->keypair_bB->pubkey.public_key, CURVE25519_PUBKEY_LEN);
+    APPEND(ai, s->pubkey_Y.public_key, CURVE25519_PUBKEY_LEN);
+    APPEND(ai, s->pubkey_X.public_key, CURVE25519_PUBKEY_LEN);
+    APPEND(ai, PROTOID, PROTOID_LEN);
+    APPEND(ai, SERVER_STR, SERVER_STR_LEN);
+    tor_assert(ai == s->auth_input + sizeof(s->auth_input));
+
+    /* Build the reply */
+    memcpy(req->handshake_reply_out, s->pubkey_Y.public_key,
+           CURVE25519_PUBKEY_LEN);
+    crypto_hmac_sha256_with_key(
+                  (char*)req->handshake_reply_out+CURVE25519_PUBKEY_LEN,
+                  k_mac, (const char*)s->auth_input, sizeof(s->auth_input));
+
+    /* Generate the key material */
+    crypto_expand_key_material_rfc5869_sha256_with_salt_key(
+                       s->secret_input, sizeof(s->secret_input),
+                       k_key,
+                       (const uint8_t*)T->m_expand, strlen(T->m_expand),
+                       req->key_out, req->key_out_len);
+
+    results_out[i] = bad ? -1 : 0;
+  }
+
+  /* Wipe all of our local state */
+  memwipe(states, 0, n * sizeof(ntor_server_state_t));
+  tor_free(states);
+  tor_free(dh_out);
+  tor_free(dh_seckeys);
+  tor_free(dh_pubkeys);
+  crypto_hmac_sha256_key_free(k_verify);
+  crypto_hmac_sha256_key_free(k_mac);
+  crypto_hmac_sha256_key_free(k_key);
+}
+
 /**
  * Perform the final client side of the ntor handshake, using the state in
  * <b>handshake_state</b> and the server's NTOR_REPLY_LEN-byte reply in
@@ -32,6 +32,25 @@ int onion_skin_ntor_server_handshake(const uint8_t *onion_skin,
                                  uint8_t *key_out,
                                  size_t key_out_len);
 
+/** One ntor handshake for onion_skin_ntor_server_handshake_batch() to
+ * perform. */
+typedef struct ntor_server_request_t {
+  /** The NTOR_ONIONSKIN_LEN-byte message from the client. */
+  const uint8_t *onion_skin;
+  /** Where to write our NTOR_REPLY_LEN-byte reply. */
+  uint8_t *handshake_reply_out;
+  /** Where to write key_out_len bytes of key material. */
+  uint8_t *key_out;
+  size_t key_out_len;
+} ntor_server_request_t;
+
+void onion_skin_ntor_server_handshake_batch(int n,
+                                 const ntor_server_request_t *requests,
+                                 const di_digest256_map_t *private_keys,
+                                 const curve25519_keypair_t *junk_keypair,
+                                 const uint8_t *my_node_id,
+                                 int *results_out);
+
 int onion_skin_ntor_client_handshake(
                              const ntor_handshake_state_t *handshake_state,
                              const uint8_t *handshake_reply,
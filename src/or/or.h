@@ -1118,6 +1118,13 @@ typedef struct packed_cell_t {
   char body[CELL_MAX_NETWORK_SIZE]; /**< Cell as packed for network. */
   uint32_t inserted_time; /**< Time (in milliseconds since epoch, with high
                            * bits truncated) when this cell was inserted. */
+  /** Time (in microseconds since epoch, with high bits truncated) when this
+   * cell was inserted, if CellLatencyStatistics was set then; otherwise 0. */
+  uint32_t inserted_usec;
+  /** The slab in the packed cell pool that holds this cell.  Set only on
+   * cells from packed_cell_new(), which are the only ones that may be passed
+   * to packed_cell_free(). Used only in relay.c. */
+  struct packed_cell_slab_t *slab;
 } packed_cell_t;
 
 /** A queue of cells on a circuit, waiting to be added to the
@@ -1546,6 +1553,11 @@ typedef struct or_connection_t {
    * bytes TLS actually sent - used for overhead estimation for scheduling.
    */
   uint64_t bytes_xmitted, bytes_xmitted_by_tls;
+
+  /** If CellLatencyStatistics is set, the times at which some of the cells
+   * on our outbuf were added to it, so we can tell how long they waited
+   * there. NULL until we've timed a cell. */
+  struct or_conn_outbuf_marks_t *outbuf_marks;
 } or_connection_t;
 
 /** Subtype of connection_t for an "edge connection" -- that is, an entry (ap)
@@ -1914,6 +1926,9 @@ typedef struct addr_policy_t {
   uint16_t prt_max; /**< Highest port number to accept/reject. */
 } addr_policy_t;
 
+/** An address policy compiled for fast matching; see policies.c. */
+typedef struct compiled_addr_policy_t compiled_addr_policy_t;
+
 /** A cached_dir_t represents a cacheable directory object, along with its
  * compressed form. */
 typedef struct cached_dir_t {
@@ -2059,6 +2074,8 @@ typedef struct {
   uint32_t bandwidthcapacity;
   smartlist_t *exit_policy; /**< What streams will this OR permit
                              * to exit on IPv4?  NULL for 'reject *:*'. */
+  /** The compiled form of exit_policy, or NULL if we haven't built it. */
+  compiled_addr_policy_t *compiled_exit_policy;
   /** What streams will this OR permit to exit on IPv6?
    * NULL for 'reject *:*' */
   struct short_policy_t *ipv6_exit_policy;
@@ -2183,6 +2200,15 @@ typedef struct routerstatus_t {
   char *exitsummary; /**< exit policy summary -
                       * XXX weasel: this probably should not stay a string. */
 
+  /** If this entry came from a consensus, we may not have decoded its "v"
+   * and "p" lines yet.  If so, this holds their arguments, each preceded by
+   * its keyword character and followed by a NUL, with an extra NUL at the
+   * end.  It points into the lazy_rs_area of the consensus, and
+   * routerstatus_decode_lazy_fields() must be called before looking at
+   * version_known, version_supports_extend2_cells, has_exitsummary, or
+   * exitsummary. */
+  const char *lazy_lines;
+
   /* ---- The fields below aren't derived from the networkstatus; they
    * hold local information only. */
 
@@ -2305,7 +2331,10 @@ typedef struct node_t {
 
   /* local info: copied from routerstatus, then possibly frobbed based
    * on experience.  Authorities set this stuff directly.  Note that
-   * these reflect knowledge of the primary (IPv4) OR port only.  */
+   * these reflect knowledge of the primary (IPv4) OR port only.  Anything
+   * outside nodelist.c that changes one of these flags must call
+   * nodelist_snapshot_mark_dirty(), since path selection reads them from
+   * the node snapshot. */
 
   unsigned int is_running:1; /**< As far as we know, is this OR currently
                               * running? */
@@ -2493,11 +2522,18 @@ typedef struct networkstatus_t {
 
   /** Digests of this document, as signed. */
   digests_t digests;
+  /** Consensus only: SHA256 digest of the entire text of this document,
+   * signatures and all, or all zero if we don't know it.  Consensus diffs
+   * name their base and target this way. */
+  uint8_t digest_full_sha256[DIGEST256_LEN];
 
   /** List of router statuses, sorted by identity digest.  For a vote,
    * the elements are vote_routerstatus_t; for a consensus, the elements
    * are routerstatus_t. */
   smartlist_t *routerstatus_list;
+  /** Consensus only: holds the undecoded lazy_lines of the entries in
+   * routerstatus_list. */
+  struct memarea_t *lazy_rs_area;
 
   /** If present, a map from descriptor digest to elements of
    * routerstatus_list. */
@@ -2920,6 +2956,12 @@ typedef struct circuit_t {
    * circuit's queues; used only if CELL_STATS events are enabled and
    * cleared after being sent to control port. */
   smartlist_t *testing_cell_stats;
+
+  /** If CellLatencyStatistics is set, how long (in microseconds) the cells
+   * we've sent exitward and appward spent in our cell queues.  NULL until
+   * we've timed a cell in that direction. */
+  struct histogram_t *cell_latency_exitward;
+  struct histogram_t *cell_latency_appward;
 } circuit_t;
 
 /** Largest number of relay_early cells that we can send on a given
@@ -3107,6 +3149,23 @@ typedef struct origin_circuit_t {
   /* XXXX NM This can get re-used after 2**32 circuits. */
   uint32_t global_identifier;
 
+  /** Index of this circuit in global_origin_circuit_list, or -1 if it is
+   * not listed there. */
+  int global_origin_circuit_list_idx;
+
+  /** True iff this circuit is listed in one of the per-purpose, per-state
+   * origin circuit lists maintained by circuitlist.c. */
+  unsigned int in_purpose_index : 1;
+  /** The purpose under which this circuit is listed. Only meaningful if
+   * in_purpose_index is set. */
+  uint8_t purpose_index_purpose;
+  /** The state under which this circuit is listed. Only meaningful if
+   * in_purpose_index is set. */
+  uint8_t purpose_index_state;
+  /** This circuit's position in its per-purpose, per-state origin circuit
+   * list. Only meaningful if in_purpose_index is set. */
+  int purpose_index_idx;
+
   /** True if we have associated one stream to this circuit, thereby setting
    * the isolation paramaters for this circuit.  Note that this doesn't
    * necessarily mean that we've <em>attached</em> any streams to the circuit:
@@ -3183,6 +3242,18 @@ typedef struct or_circuit_t {
    * a cpuworker and is waiting for a response. Used to decide whether it is
    * safe to free a circuit or if it is still in use by a cpuworker. */
   struct workqueue_entry_s *workqueue_entry;
+  /** If we're crypting this circuit's inbound relay cells on the relay
+   * crypto threads: the batch of cells that a worker is crypting now, or
+   * NULL. While this is set, p_crypto and p_digest belong to the worker.
+   * Used only in cpuworker.c. */
+  struct relaycrypt_job_t *relaycrypt_inflight;
+  /** Inbound relay cells waiting for relaycrypt_inflight to come back before
+   * they can be crypted in turn, or NULL. Used only in cpuworker.c. */
+  struct relaycrypt_job_t *relaycrypt_waiting;
+  /** Number of cells in relaycrypt_inflight and relaycrypt_waiting.  These
+   * count as queued on p_chan_cells for stream blocking and for the OOM
+   * handler. */
+  int relaycrypt_n_cells;
 
   /** The circuit_id used in the previous (backward) hop of this circuit. */
   circid_t p_circ_id;
@@ -3719,6 +3790,10 @@ typedef struct {
   uint64_t PerConnBWRate; /**< Long-term bw on a single TLS conn, if set. */
   uint64_t PerConnBWBurst; /**< Allowed burst on a single TLS conn, if set. */
   int NumCPUs; /**< How many CPUs should we try to use? */
+  /** How many worker threads should we use to crypt relay cells headed back
+   * toward the origins of our OR circuits? 0 means "do it all in the main
+   * thread". */
+  int RelayCryptoThreads;
 //int RunTesting; /**< If true, create testing circuits to measure how well the
 //                 * other ORs are running. */
   config_line_t *RendConfigLines; /**< List of configuration lines
@@ -3910,6 +3985,9 @@ typedef struct {
                     disclaimer. This allows a server administrator to show
                     that they're running Tor and anyone visiting their server
                     will know this without any specialized knowledge. */
+  /** As a directory cache, how many old consensuses of each flavor should
+   * we keep, so that we can serve diffs from them to the current one? */
+  int ConsensusDiffHistory;
   int DisableDebuggerAttachment; /**< Currently Linux only specific attempt to
                                       disable ptrace; needs BSD testing. */
   /** Boolean: if set, we start even if our resolv.conf file is missing
@@ -3973,6 +4051,10 @@ typedef struct {
   /** If true, the user wants us to collect cell statistics. */
   int CellStatistics;
 
+  /** If true, we keep histograms of how long cells wait in our circuit
+   * queues and connection outbufs. */
+  int CellLatencyStatistics;
+
   /** If true, the user wants us to collect statistics as entry node. */
   int EntryStatistics;
 
@@ -4290,6 +4372,16 @@ typedef struct {
    * when sending.
    */
   int SchedulerMaxFlushCells__;
+  /** Which data structure the global scheduler keeps pending channels in:
+   * "Heap" or "Buckets".
+   */
+  char *SchedulerQueue__;
+  /** If true, and the platform supports it, only write as many cells to
+   * each connection as the kernel can send before the next scheduler run.
+   */
+  int SchedulerKIST__;
+  /** How often (msec) to run the scheduler when SchedulerKIST__ is set. */
+  int SchedulerKISTRunInterval__;
 
   /** Is this an exit node?  This is a tristate, where "1" means "yes, and use
    * the default exit policy if none is given" and "0" means "no; exit policy
@@ -820,6 +820,311 @@ compare_tor_addr_to_addr_policy,(const tor_addr_t *addr, uint16_t port,
   }
 }
 
+/** One node in a binary trie of the address prefixes used by a
+ * compiled_addr_policy_t. */
+typedef struct policy_trie_node_t {
+  /** Index of the child node for a next address bit of 0 and of 1, or -1 if
+   * there is no such child. */
+  int child[2];
+  /** Index within compiled_addr_policy_t.ranges of the first port range for
+   * the policy entries whose prefix ends at this node. */
+  int first_range;
+  /** Number of port ranges for the policy entries whose prefix ends at this
+   * node. */
+  int n_ranges;
+} policy_trie_node_t;
+
+/** A range of ports, and the first policy entry at a given trie node that
+ * covers them. */
+typedef struct policy_port_range_t {
+  uint16_t prt_min; /**< Lowest port in this range. */
+  uint16_t prt_max; /**< Highest port in this range. */
+  /** Position of the first matching entry within the original policy. */
+  int entry;
+} policy_port_range_t;
+
+/** An address policy, compiled so that we can look up a known address and
+ * port without walking every entry in the policy.
+ *
+ * Every IPv4 and IPv6 entry lives at the trie node for its address prefix.
+ * At each node, we keep a sorted table of disjoint port ranges, each one
+ * naming the earliest entry at that node that covers it.  To match an
+ * address, we walk down the trie along the bits of the address, look up the
+ * port at each node we pass, and take the earliest entry that we found: that
+ * is the entry that the linear matcher would have stopped at.
+ */
+struct compiled_addr_policy_t {
+  /** Index of the root trie node for IPv4 (0) and IPv6 (1) entries, or -1 if
+   * the policy has no entries of that family. */
+  int root[2];
+  /** All the nodes in this trie. */
+  policy_trie_node_t *nodes;
+  int n_nodes; /**< Number of elements used in nodes. */
+  int nodes_allocated; /**< Number of elements allocated in nodes. */
+  /** All the port ranges of all the trie nodes, grouped by node. */
+  policy_port_range_t *ranges;
+  int n_ranges; /**< Number of elements used in ranges. */
+  int ranges_allocated; /**< Number of elements allocated in ranges. */
+  /** For each entry in the original policy, 1 if it accepts, 0 if it
+   * rejects. */
+  uint8_t *entry_accepts;
+  /** Number of entries in the original policy. */
+  int n_entries;
+};
+
+/** Add a new childless node with no port ranges to <b>c</b>, and return its
+ * index. */
+static int
+compiled_policy_add_node(compiled_addr_policy_t *c)
+{
+  policy_trie_node_t *node;
+  if (c->n_nodes == c->nodes_allocated) {
+    c->nodes_allocated = c->nodes_allocated ? c->nodes_allocated * 2 : 32;
+    c->nodes = tor_reallocarray(c->nodes, c->nodes_allocated,
+                                sizeof(policy_trie_node_t));
+  }
+  node = &c->nodes[c->n_nodes];
+  node->child[0] = node->child[1] = -1;
+  node->first_range = node->n_ranges = 0;
+  return c->n_nodes++;
+}
+
+/** Return bit <b>bit</b> (counting from the most significant) of
+ * <b>addr</b>, whose family is AF_INET if <b>fam</b> is 0, and AF_INET6
+ * otherwise. */
+static INLINE int
+policy_addr_get_bit(const tor_addr_t *addr, int fam, int bit)
+{
+  if (fam == 0)
+    return (tor_addr_to_ipv4h(addr) >> (31 - bit)) & 1;
+  else
+    return (tor_addr_to_in6_addr8(addr)[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+/** Helper for sorting policy_port_range_t by their lowest port. */
+static int
+compare_port_ranges_(const void **a_, const void **b_)
+{
+  const policy_port_range_t *a = *a_, *b = *b_;
+  return ((int)a->prt_min) - ((int)b->prt_min);
+}
+
+/** Given the positions <b>entries</b> (in ascending order) of all the entries
+ * of <b>policy</b> whose prefix ends at the trie node <b>node_idx</b> of
+ * <b>c</b>, compute that node's port ranges and append them to <b>c</b>. */
+static void
+compiled_policy_add_node_ranges(compiled_addr_policy_t *c, int node_idx,
+                                const smartlist_t *policy,
+                                const smartlist_t *entries)
+{
+  smartlist_t *painted = smartlist_new();
+  smartlist_t *added = smartlist_new();
+  policy_trie_node_t *node = &c->nodes[node_idx];
+
+  /* Lay down the entries in order: each one only claims those of its ports
+   * that no earlier entry at this node has claimed already. */
+  SMARTLIST_FOREACH_BEGIN(entries, void *, idx_ptr) {
+    int idx = (int)(intptr_t)idx_ptr;
+    const addr_policy_t *p = smartlist_get(policy, idx);
+    int cur = p->prt_min, hi = p->prt_max;
+    SMARTLIST_FOREACH_BEGIN(painted, policy_port_range_t *, r) {
+      if (r->prt_max < cur)
+        continue;
+      if (r->prt_min > hi)
+        break;
+      if (r->prt_min > cur) {
+        policy_port_range_t *n = tor_malloc(sizeof(policy_port_range_t));
+        n->prt_min = cur;
+        n->prt_max = r->prt_min - 1;
+        n->entry = idx;
+        smartlist_add(added, n);
+      }
+      cur = r->prt_max + 1;
+      if (cur > hi)
+        break;
+    } SMARTLIST_FOREACH_END(r);
+    if (cur <= hi) {
+      policy_port_range_t *n = tor_malloc(sizeof(policy_port_range_t));
+      n->prt_min = cur;
+      n->prt_max = hi;
+      n->entry = idx;
+      smartlist_add(added, n);
+    }
+    if (smartlist_len(added)) {
+      smartlist_add_all(painted, added);
+      smartlist_clear(added);
+      smartlist_sort(painted, compare_port_ranges_);
+    }
+  } SMARTLIST_FOREACH_END(idx_ptr);
+
+  node->first_range = c->n_ranges;
+  node->n_ranges = smartlist_len(painted);
+  if (c->n_ranges + node->n_ranges > c->ranges_allocated) {
+    c->ranges_allocated = MAX(c->ranges_allocated * 2,
+                              c->n_ranges + node->n_ranges);
+    c->ranges = tor_reallocarray(c->ranges, c->ranges_allocated,
+                                 sizeof(policy_port_range_t));
+  }
+  SMARTLIST_FOREACH_BEGIN(painted, policy_port_range_t *, r) {
+    c->ranges[c->n_ranges++] = *r;
+    tor_free(r);
+  } SMARTLIST_FOREACH_END(r);
+
+  smartlist_free(painted);
+  smartlist_free(added);
+}
+
+/** Build and return a compiled form of <b>policy</b>, for use with
+ * compare_tor_addr_to_compiled_policy().  The compiled form stays valid only
+ * as long as <b>policy</b> is not changed.  Return NULL if <b>policy</b> is
+ * NULL. */
+compiled_addr_policy_t *
+addr_policy_compile(const smartlist_t *policy)
+{
+  compiled_addr_policy_t *c;
+  /* For each trie node, a list of the positions of the entries whose prefix
+   * ends there. */
+  smartlist_t *node_entries;
+  int i;
+
+  if (!policy)
+    return NULL;
+
+  c = tor_malloc_zero(sizeof(compiled_addr_policy_t));
+  c->root[0] = c->root[1] = -1;
+  c->n_entries = smartlist_len(policy);
+  c->entry_accepts = tor_malloc_zero(c->n_entries ? c->n_entries : 1);
+  node_entries = smartlist_new();
+
+  SMARTLIST_FOREACH_BEGIN(policy, const addr_policy_t *, p) {
+    int fam, maxbits, bits, node;
+    c->entry_accepts[p_sl_idx] = (p->policy_type == ADDR_POLICY_ACCEPT);
+    switch (tor_addr_family(&p->addr)) {
+      case AF_INET:
+        fam = 0;
+        maxbits = 32;
+        break;
+      case AF_INET6:
+        fam = 1;
+        maxbits = 128;
+        break;
+      default:
+        /* Entries of any other family never match a known address. */
+        continue;
+    }
+    if (p->prt_min > p->prt_max)
+      continue;
+    bits = MIN(p->maskbits, maxbits);
+
+    if (c->root[fam] < 0) {
+      c->root[fam] = compiled_policy_add_node(c);
+      smartlist_add(node_entries, smartlist_new());
+    }
+    node = c->root[fam];
+    for (i = 0; i < bits; ++i) {
+      int b = policy_addr_get_bit(&p->addr, fam, i);
+      if (c->nodes[node].child[b] < 0) {
+        int child = compiled_policy_add_node(c);
+        smartlist_add(node_entries, smartlist_new());
+        c->nodes[node].child[b] = child;
+      }
+      node = c->nodes[node].child[b];
+    }
+    smartlist_add(smartlist_get(node_entries, node),
+                  (void*)(intptr_t)p_sl_idx);
+  } SMARTLIST_FOREACH_END(p);
+
+  for (i = 0; i < c->n_nodes; ++i) {
+    smartlist_t *entries = smartlist_get(node_entries, i);
+    if (smartlist_len(entries))
+      compiled_policy_add_node_ranges(c, i, policy, entries);
+    smartlist_free(entries);
+  }
+  smartlist_free(node_entries);
+
+  return c;
+}
+
+/** Release all storage held by <b>c</b>. */
+void
+compiled_addr_policy_free(compiled_addr_policy_t *c)
+{
+  if (!c)
+    return;
+  tor_free(c->nodes);
+  tor_free(c->ranges);
+  tor_free(c->entry_accepts);
+  tor_free(c);
+}
+
+/** Return the position of the earliest entry at <b>node</b> of <b>c</b>
+ * that covers <b>port</b>, or INT_MAX if there is none. */
+static INLINE int
+compiled_policy_node_lookup_port(const compiled_addr_policy_t *c,
+                                 const policy_trie_node_t *node,
+                                 uint16_t port)
+{
+  const policy_port_range_t *r = c->ranges + node->first_range;
+  int lo = 0, hi = node->n_ranges - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (port < r[mid].prt_min)
+      hi = mid - 1;
+    else if (port > r[mid].prt_max)
+      lo = mid + 1;
+    else
+      return r[mid].entry;
+  }
+  return INT_MAX;
+}
+
+/** Decide whether the known IPv4 or IPv6 address <b>addr</b> and the known
+ * port <b>port</b> are accepted or rejected by the compiled policy
+ * <b>c</b>. */
+static addr_policy_result_t
+compiled_addr_policy_lookup(const compiled_addr_policy_t *c,
+                            const tor_addr_t *addr, uint16_t port)
+{
+  int fam = (tor_addr_family(addr) == AF_INET) ? 0 : 1;
+  int maxbits = fam ? 128 : 32;
+  int best = INT_MAX, node = c->root[fam], bit = 0;
+
+  while (node >= 0) {
+    const policy_trie_node_t *n = &c->nodes[node];
+    if (n->n_ranges) {
+      int entry = compiled_policy_node_lookup_port(c, n, port);
+      if (entry < best)
+        best = entry;
+    }
+    if (bit == maxbits)
+      break;
+    node = n->child[policy_addr_get_bit(addr, fam, bit++)];
+  }
+
+  if (best == INT_MAX)
+    return ADDR_POLICY_ACCEPTED; /* accept all by default. */
+  return c->entry_accepts[best] ? ADDR_POLICY_ACCEPTED : ADDR_POLICY_REJECTED;
+}
+
+/** As compare_tor_addr_to_addr_policy(), but use the compiled form
+ * <b>compiled</b> of <b>policy</b> when it is present and both the address
+ * and the port are known.  <b>compiled</b> must have been built by
+ * addr_policy_compile() from <b>policy</b> in its current state. */
+addr_policy_result_t
+compare_tor_addr_to_compiled_policy(const tor_addr_t *addr, uint16_t port,
+                                    const smartlist_t *policy,
+                                    const compiled_addr_policy_t *compiled)
+{
+  if (compiled && policy && addr && port &&
+      (tor_addr_family(addr) == AF_INET ||
+       tor_addr_family(addr) == AF_INET6) &&
+      !tor_addr_is_null(addr)) {
+    tor_assert(compiled->n_entries == smartlist_len(policy));
+    return compiled_addr_policy_lookup(compiled, addr, port);
+  }
+  return compare_tor_addr_to_addr_policy(addr, port, policy);
+}
+
 /** Return true iff the address policy <b>a</b> covers every case that
  * would be covered by <b>b</b>, so that a,b is redundant. */
 static int
@@ -1391,6 +1696,7 @@ void
 policies_set_node_exitpolicy_to_reject_all(node_t *node)
 {
   node->rejects_all = 1;
+  nodelist_snapshot_mark_dirty();
 }
 
 /** Return 1 if there is at least one /8 subnet in <b>policy</b> that
@@ -2049,7 +2355,9 @@ compare_tor_addr_to_node_policy(const tor_addr_t *addr, uint16_t port,
   }
 
   if (node->ri) {
-    return compare_tor_addr_to_addr_policy(addr, port, node->ri->exit_policy);
+    return compare_tor_addr_to_compiled_policy(addr, port,
+                                               node->ri->exit_policy,
+                                               node->ri->compiled_exit_policy);
   } else if (node->md) {
     if (node->md->exit_policy == NULL)
       return ADDR_POLICY_REJECTED;
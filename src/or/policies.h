@@ -44,6 +44,13 @@ addr_policy_t *addr_policy_get_canonical_entry(addr_policy_t *ent);
 int cmp_addr_policies(smartlist_t *a, smartlist_t *b);
 MOCK_DECL(addr_policy_result_t, compare_tor_addr_to_addr_policy,
     (const tor_addr_t *addr, uint16_t port, const smartlist_t *policy));
+
+compiled_addr_policy_t *addr_policy_compile(const smartlist_t *policy);
+void compiled_addr_policy_free(compiled_addr_policy_t *c);
+addr_policy_result_t compare_tor_addr_to_compiled_policy(
+                          const tor_addr_t *addr, uint16_t port,
+                          const smartlist_t *policy,
+                          const compiled_addr_policy_t *compiled);
 addr_policy_result_t compare_tor_addr_to_node_policy(const tor_addr_t *addr,
                               uint16_t port, const node_t *node);
 
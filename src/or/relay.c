@@ -24,7 +24,9 @@
 #include "connection_edge.h"
 #include "connection_or.h"
 #include "control.h"
+#include "cpuworker.h"
 #include "geoip.h"
+#include "histogram.h"
 #include "main.h"
 #include "networkstatus.h"
 #include "nodelist.h"
@@ -56,6 +58,8 @@ static int circuit_resume_edge_reading_helper(edge_connection_t *conn,
 static int circuit_consider_stop_edge_reading(circuit_t *circ,
                                               crypt_path_t *layer_hint);
 static int circuit_queue_streams_are_blocked(circuit_t *circ);
+static int set_streams_blocked_on_circ(circuit_t *circ, channel_t *chan,
+                                       int block, streamid_t stream_id);
 static void adjust_exit_policy_from_exitpolicy_failure(origin_circuit_t *circ,
                                                   entry_connection_t *conn,
                                                   node_t *node,
@@ -71,6 +75,21 @@ static int get_max_middle_cells(void);
  * cells. */
 #define CELL_QUEUE_LOWWATER_SIZE 64
 
+/** Return the number of cells that <b>circ</b> has waiting to go out on
+ * <b>queue</b>, which must be one of its cell queues.  Inbound relay cells
+ * that are still on the relay crypto threads count as waiting on
+ * p_chan_cells. */
+static INLINE int
+circuit_n_cells_waiting_on(const circuit_t *circ, const cell_queue_t *queue)
+{
+  if (! CIRCUIT_IS_ORIGIN(circ)) {
+    const or_circuit_t *or_circ = CONST_TO_OR_CIRCUIT(circ);
+    if (queue == &or_circ->p_chan_cells)
+      return queue->n + or_circ->relaycrypt_n_cells;
+  }
+  return queue->n;
+}
+
 /** Stats: how many relay cells have originated at this hop, or have
  * been relayed onward (not recognized at this hop)?
  */
@@ -165,6 +184,125 @@ relay_crypt_one_payload(crypto_cipher_t *cipher, uint8_t *in,
   return 0;
 }
 
+/** Crypt <b>cell</b> for sending back toward the origin of an OR circuit
+ * whose inbound digest and cipher are <b>digest</b> and <b>cipher</b>. If
+ * <b>originated</b>, we packaged this cell ourselves, so set its digest
+ * first.
+ *
+ * This function touches nothing but its arguments, so a relay crypto
+ * thread may call it as long as nobody else is using the circuit's crypto
+ * state.  Return 0 on success, -1 on failure.
+ */
+int
+relay_crypt_inbound_cell(crypto_digest_t *digest, crypto_cipher_t *cipher,
+                         cell_t *cell, int originated)
+{
+  if (originated)
+    relay_set_digest(digest, cell);
+  return relay_crypt_one_payload(cipher, cell->payload, 1);
+}
+
+/** Generate, in one call per cipher, the keystream that we'll need to
+ * crypt <b>n_cells</b> relay payloads with <b>cipher</b>.  Later calls to
+ * relay_crypt_one_payload() use it up in order. */
+static void
+relay_crypt_prefetch(crypto_cipher_t *cipher, int n_cells)
+{
+  if (!cipher || n_cells < 2)
+    return;
+  if (n_cells > RELAY_CRYPT_BATCH_MAX)
+    n_cells = RELAY_CRYPT_BATCH_MAX;
+  /* Don't let unused keystream pile up if cells we prepared for got
+   * dropped before they were crypted. */
+  if (crypto_cipher_get_prefetched_len(cipher) >=
+      RELAY_CRYPT_BATCH_MAX * CELL_PAYLOAD_SIZE)
+    return;
+  crypto_cipher_prefetch_keystream(cipher,
+                                   (size_t)n_cells * CELL_PAYLOAD_SIZE);
+}
+
+/** We have just pulled the <b>n_cells</b> fixed-length cells in
+ * <b>cells</b> off <b>chan</b>, and we're about to process them in order.
+ * For every run of consecutive relay cells on the same circuit, prepare the
+ * keystream for the whole run at once, so that relay_crypt() doesn't need
+ * to call into the cipher once per cell.
+ *
+ * Only the first layer of crypto at the origin, and the single layer at a
+ * relay, can be prepared this way.  The running digests have to be updated
+ * one cell at a time, since each cell's integrity check depends on the
+ * digest of every cell before it.
+ */
+void
+relay_crypt_prepare_cell_batch(channel_t *chan, const cell_t *cells,
+                               int n_cells)
+{
+  int i, j;
+
+  tor_assert(chan);
+  tor_assert(cells || n_cells == 0);
+
+  for (i = 0; i < n_cells; i = j) {
+    const circid_t circ_id = cells[i].circ_id;
+    circuit_t *circ;
+    crypto_cipher_t *cipher = NULL;
+
+    for (j = i; j < n_cells; ++j) {
+      if ((cells[j].command != CELL_RELAY &&
+           cells[j].command != CELL_RELAY_EARLY) ||
+          cells[j].circ_id != circ_id)
+        break;
+    }
+    if (j - i < 2) {
+      j = i + 1;
+      continue;
+    }
+
+    circ = circuit_get_by_circid_channel(circ_id, chan);
+    if (!circ || circ->marked_for_close ||
+        circ->state == CIRCUIT_STATE_ONIONSKIN_PENDING)
+      continue;
+
+    if (CIRCUIT_IS_ORIGIN(circ)) {
+      crypt_path_t *cpath = TO_ORIGIN_CIRCUIT(circ)->cpath;
+      if (cpath && cpath->state == CPATH_STATE_OPEN)
+        cipher = cpath->b_crypto;
+    } else {
+      or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
+      if (chan == or_circ->p_chan && circ_id == or_circ->p_circ_id)
+        cipher = or_circ->n_crypto;
+      else if (!cpuworker_relay_crypto_enabled())
+        cipher = or_circ->p_crypto;
+    }
+    relay_crypt_prefetch(cipher, j - i);
+  }
+}
+
+/** We're about to package up to <b>n_cells</b> relay cells from an edge
+ * connection onto <b>circ</b>, to be encrypted starting at
+ * <b>layer_hint</b>.  Prepare the keystream for all of them at once on
+ * every layer that they'll pass through. */
+void
+relay_crypt_prepare_package_batch(circuit_t *circ, crypt_path_t *layer_hint,
+                                  int n_cells)
+{
+  tor_assert(circ);
+
+  if (n_cells < 2 || circ->marked_for_close)
+    return;
+
+  if (CIRCUIT_IS_ORIGIN(circ)) {
+    crypt_path_t *thishop = layer_hint;
+    if (!thishop || !circ->n_chan)
+      return;
+    do {
+      relay_crypt_prefetch(thishop->f_crypto, n_cells);
+      thishop = thishop->prev;
+    } while (thishop != TO_ORIGIN_CIRCUIT(circ)->cpath->prev);
+  } else if (!cpuworker_relay_crypto_enabled()) {
+    relay_crypt_prefetch(TO_OR_CIRCUIT(circ)->p_crypto, n_cells);
+  }
+}
+
 /** Receive a relay cell:
  *  - Crypt it (encrypt if headed toward the origin or if we <b>are</b> the
  *    origin; decrypt if we're headed toward the exit).
@@ -193,6 +331,25 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
   if (circ->marked_for_close)
     return 0;
 
+  if (cell_direction == CELL_DIRECTION_IN && ! CIRCUIT_IS_ORIGIN(circ) &&
+      cpuworker_relay_crypto_enabled()) {
+    /* We're in the middle, so this cell can't be for us: let a relay
+     * crypto thread do its one crypt, and queue it when that's done. */
+    or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
+    if (!or_circ->p_chan) {
+      log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+             "Didn't recognize cell, but circ stops here! Closing circ.");
+      return -END_CIRC_REASON_TORPROTOCOL;
+    }
+    cell->circ_id = or_circ->p_circ_id; /* switch it */
+    ++stats_n_relay_cells_relayed;
+    if (cpuworker_queue_relay_cell(or_circ, cell, 0, 0) < 0) {
+      log_warn(LD_BUG,"relay crypt failed. Dropping connection.");
+      return -END_CIRC_REASON_INTERNAL;
+    }
+    return 0;
+  }
+
   if (relay_crypt(circ, cell, cell_direction, &layer_hint, &recognized) < 0) {
     log_warn(LD_BUG,"relay crypt failed. Dropping connection.");
     return -END_CIRC_REASON_INTERNAL;
@@ -428,6 +585,22 @@ circuit_package_relay_cell(cell_t *cell, circuit_t *circ,
     }
     or_circ = TO_OR_CIRCUIT(circ);
     chan = or_circ->p_chan;
+    if (cpuworker_relay_crypto_enabled()) {
+      int streams_blocked = circ->streams_blocked_on_p_chan;
+      ++stats_n_relay_cells_relayed;
+      if (cpuworker_queue_relay_cell(or_circ, cell, on_stream, 1) < 0)
+        return -1;
+      /* The cell won't reach p_chan_cells until a worker is done with it,
+       * but it counts toward blocking our streams already, just as it
+       * would in append_cell_to_circuit_queue(). */
+      if (chan && !streams_blocked &&
+          circuit_n_cells_waiting_on(circ, &or_circ->p_chan_cells) >=
+            CELL_QUEUE_HIGHWATER_SIZE)
+        set_streams_blocked_on_circ(circ, chan, 1, 0);
+      if (chan && streams_blocked && on_stream)
+        set_streams_blocked_on_circ(circ, chan, 1, on_stream);
+      return 0;
+    }
     relay_set_digest(or_circ->p_digest, cell);
     if (relay_crypt_one_payload(or_circ->p_crypto, cell->payload, 1) < 0)
       return -1;
@@ -1844,6 +2017,7 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
     conn->base_.type == CONN_TYPE_AP &&
     conn->base_.state != AP_CONN_STATE_OPEN;
   crypt_path_t *cpath_layer = conn->cpath_layer;
+  int keystream_prepared = 0;
 
   tor_assert(conn);
 
@@ -1896,6 +2070,16 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
   if (!package_partial && bytes_to_process < RELAY_PAYLOAD_SIZE)
     return 0;
 
+  if (!keystream_prepared) {
+    int n_cells = (int)MIN(bytes_to_process / RELAY_PAYLOAD_SIZE,
+                           RELAY_CRYPT_BATCH_MAX);
+    n_cells = MIN(n_cells, conn->package_window);
+    if (max_cells)
+      n_cells = MIN(n_cells, *max_cells);
+    relay_crypt_prepare_package_batch(circ, cpath_layer, n_cells);
+    keystream_prepared = 1;
+  }
+
   if (bytes_to_process > RELAY_PAYLOAD_SIZE) {
     length = RELAY_PAYLOAD_SIZE;
   } else {
@@ -2055,7 +2239,7 @@ circuit_resume_edge_reading_helper(edge_connection_t *first_conn,
     cells_on_queue = circ->n_chan_cells.n;
   } else {
     or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
-    cells_on_queue = or_circ->p_chan_cells.n;
+    cells_on_queue = circuit_n_cells_waiting_on(circ, &or_circ->p_chan_cells);
   }
   if (CELL_QUEUE_HIGHWATER_SIZE - cells_on_queue < max_to_package)
     max_to_package = CELL_QUEUE_HIGHWATER_SIZE - cells_on_queue;
@@ -2254,23 +2438,177 @@ circuit_consider_sending_sendme(circuit_t *circ, crypt_path_t *layer_hint)
 /** The total number of cells we have allocated. */
 static size_t total_cells_allocated = 0;
 
+/** How many packed cells fit in each slab of the packed cell pool? */
+#define PACKED_CELL_SLAB_N_CELLS 64
+/** How many slabs with no cells in use will we hold on to for reuse? */
+#define PACKED_CELL_MAX_EMPTY_SLABS 8
+
+/** Which list in the packed cell pool is a slab on? */
+typedef enum {
+  PACKED_CELL_SLAB_EMPTY = 0,
+  PACKED_CELL_SLAB_PARTIAL = 1,
+  PACKED_CELL_SLAB_FULL = 2,
+} packed_cell_slab_state_t;
+
+/** A contiguous block of packed cells.  We allocate packed cells out of
+ * slabs, rather than one at a time with malloc, to keep the allocator
+ * out of the cell path and to keep the cells from fragmenting the heap. */
+typedef struct packed_cell_slab_t {
+  /** Links for the list that this slab is on. */
+  TOR_LIST_ENTRY(packed_cell_slab_t) next;
+  /** Which list is that? */
+  packed_cell_slab_state_t state;
+  /** How many cells in this slab are not in use? */
+  int n_free;
+  /** Stack of the indices of the cells that are not in use. */
+  uint8_t free_idx[PACKED_CELL_SLAB_N_CELLS];
+  /** The cells themselves. */
+  packed_cell_t cells[PACKED_CELL_SLAB_N_CELLS];
+} packed_cell_slab_t;
+
+TOR_LIST_HEAD(packed_cell_slab_list_t, packed_cell_slab_t);
+/** Slabs with no cells in use, kept for reuse. */
+static struct packed_cell_slab_list_t slabs_empty =
+  TOR_LIST_HEAD_INITIALIZER(slabs_empty);
+/** Slabs with some cells in use.  We allocate from these first. */
+static struct packed_cell_slab_list_t slabs_partial =
+  TOR_LIST_HEAD_INITIALIZER(slabs_partial);
+/** Slabs with every cell in use. */
+static struct packed_cell_slab_list_t slabs_full =
+  TOR_LIST_HEAD_INITIALIZER(slabs_full);
+/** How many slabs have we allocated in total? */
+static int n_slabs_allocated = 0;
+/** How many of those are on slabs_empty? */
+static int n_slabs_empty = 0;
+
+/** Move <b>slab</b> onto whichever list in the packed cell pool matches its
+ * number of free cells. If it's empty and we already have enough empty
+ * slabs, free it instead. */
+static void
+packed_cell_slab_relink(packed_cell_slab_t *slab)
+{
+  packed_cell_slab_state_t state;
+  if (slab->n_free == PACKED_CELL_SLAB_N_CELLS)
+    state = PACKED_CELL_SLAB_EMPTY;
+  else if (slab->n_free == 0)
+    state = PACKED_CELL_SLAB_FULL;
+  else
+    state = PACKED_CELL_SLAB_PARTIAL;
+
+  if (state == slab->state)
+    return;
+
+  TOR_LIST_REMOVE(slab, next);
+  if (slab->state == PACKED_CELL_SLAB_EMPTY)
+    --n_slabs_empty;
+  slab->state = state;
+
+  switch (state) {
+    case PACKED_CELL_SLAB_EMPTY:
+      if (n_slabs_empty >= PACKED_CELL_MAX_EMPTY_SLABS) {
+        --n_slabs_allocated;
+        tor_free(slab);
+      } else {
+        TOR_LIST_INSERT_HEAD(&slabs_empty, slab, next);
+        ++n_slabs_empty;
+      }
+      break;
+    case PACKED_CELL_SLAB_PARTIAL:
+      TOR_LIST_INSERT_HEAD(&slabs_partial, slab, next);
+      break;
+    case PACKED_CELL_SLAB_FULL:
+      TOR_LIST_INSERT_HEAD(&slabs_full, slab, next);
+      break;
+  }
+}
+
+/** Allocate a new slab for the packed cell pool, and put it on the empty
+ * list. */
+static packed_cell_slab_t *
+packed_cell_slab_new(void)
+{
+  int i;
+  packed_cell_slab_t *slab = tor_malloc(sizeof(packed_cell_slab_t));
+  slab->state = PACKED_CELL_SLAB_EMPTY;
+  slab->n_free = PACKED_CELL_SLAB_N_CELLS;
+  /* Hand out low-numbered cells first. */
+  for (i = 0; i < PACKED_CELL_SLAB_N_CELLS; ++i)
+    slab->free_idx[i] = PACKED_CELL_SLAB_N_CELLS - 1 - i;
+  TOR_LIST_INSERT_HEAD(&slabs_empty, slab, next);
+  ++n_slabs_empty;
+  ++n_slabs_allocated;
+  return slab;
+}
+
+/** Free every slab in the packed cell pool that has no cells in use, and
+ * return the number of bytes released.  We do this when we're low on
+ * memory. */
+STATIC size_t
+packed_cell_pool_release_empty_slabs(void)
+{
+  size_t released = 0;
+  packed_cell_slab_t *slab;
+  while ((slab = TOR_LIST_FIRST(&slabs_empty))) {
+    TOR_LIST_REMOVE(slab, next);
+    --n_slabs_empty;
+    --n_slabs_allocated;
+    released += sizeof(packed_cell_slab_t);
+    tor_free(slab);
+  }
+  return released;
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Set *<b>n_slabs_out</b> to the number of slabs in the packed cell pool,
+ * and *<b>n_empty_out</b> to the number of those that have no cells in
+ * use. */
+STATIC void
+packed_cell_pool_get_n_slabs(int *n_slabs_out, int *n_empty_out)
+{
+  *n_slabs_out = n_slabs_allocated;
+  *n_empty_out = n_slabs_empty;
+}
+#endif
+
 /** Release storage held by <b>cell</b>. */
 static INLINE void
 packed_cell_free_unchecked(packed_cell_t *cell)
 {
+  packed_cell_slab_t *slab = cell->slab;
   --total_cells_allocated;
-  tor_free(cell);
+  tor_assert(slab);
+  tor_assert(slab->n_free < PACKED_CELL_SLAB_N_CELLS);
+  slab->free_idx[slab->n_free++] = (uint8_t)(cell - slab->cells);
+  if (slab->n_free == 1 || slab->n_free == PACKED_CELL_SLAB_N_CELLS)
+    packed_cell_slab_relink(slab);
 }
 
 /** Allocate and return a new packed_cell_t. */
 STATIC packed_cell_t *
 packed_cell_new(void)
 {
+  packed_cell_slab_t *slab;
+  packed_cell_t *cell;
+
+  slab = TOR_LIST_FIRST(&slabs_partial);
+  if (!slab)
+    slab = TOR_LIST_FIRST(&slabs_empty);
+  if (!slab)
+    slab = packed_cell_slab_new();
+
+  tor_assert(slab->n_free > 0);
+  cell = &slab->cells[slab->free_idx[--slab->n_free]];
+  if (slab->n_free == 0 || slab->n_free == PACKED_CELL_SLAB_N_CELLS - 1)
+    packed_cell_slab_relink(slab);
+
   ++total_cells_allocated;
-  return tor_malloc_zero(sizeof(packed_cell_t));
+  memset(cell, 0, sizeof(packed_cell_t));
+  cell->slab = slab;
+  return cell;
 }
 
-/** Return a packed cell used outside by channel_t lower layer */
+/** Return a packed cell used outside by channel_t lower layer.  The cell
+ * must have come from packed_cell_new(). */
 void
 packed_cell_free(packed_cell_t *cell)
 {
@@ -2296,6 +2634,13 @@ dump_cell_pool_usage(int severity)
   tor_log(severity, LD_MM,
           "%d cells allocated on %d circuits. %d cells leaked.",
           n_cells, n_circs, (int)total_cells_allocated - n_cells);
+  tor_log(severity, LD_MM,
+          "Cell pool: %d slabs of %d cells (%d empty), using "U64_FORMAT
+          " bytes for %d cells in use.",
+          n_slabs_allocated, PACKED_CELL_SLAB_N_CELLS, n_slabs_empty,
+          U64_PRINTF_ARG((uint64_t)n_slabs_allocated *
+                         sizeof(packed_cell_slab_t)),
+          (int)total_cells_allocated);
 }
 
 /** Allocate a new copy of packed <b>cell</b>. */
@@ -2332,10 +2677,38 @@ cell_queue_append_packed_copy(circuit_t *circ, cell_queue_t *queue,
   tor_gettimeofday_cached_monotonic(&now);
 
   copy->inserted_time = (uint32_t)tv_to_msec(&now);
+  if (get_options()->CellLatencyStatistics)
+    copy->inserted_usec = cell_latency_timestamp();
 
   cell_queue_append(queue, copy);
 }
 
+/** Return the current monotonic time in microseconds, with the high bits
+ * truncated, for timing how long cells wait in our queues.  Never returns
+ * 0, so that 0 can mean "not timed". */
+uint32_t
+cell_latency_timestamp(void)
+{
+  struct timeval now;
+  uint32_t usec;
+  /* We can't use the cached time here: most cells are queued and flushed
+   * within a single pass through the event loop. */
+  tor_gettimeofday_monotonic(&now);
+  usec = (uint32_t)now.tv_sec * 1000000 + (uint32_t)now.tv_usec;
+  return usec ? usec : 1;
+}
+
+/** Return the number of microseconds that have passed since
+ * <b>timestamp</b>, a value returned by cell_latency_timestamp(). If we
+ * have no monotonic clock and the time of day has jumped backwards, return
+ * 0. */
+uint32_t
+cell_latency_since(uint32_t timestamp)
+{
+  int32_t elapsed = (int32_t)(cell_latency_timestamp() - timestamp);
+  return elapsed < 0 ? 0 : (uint32_t)elapsed;
+}
+
 /** Initialize <b>queue</b> as an empty cell queue. */
 void
 cell_queue_init(cell_queue_t *queue)
@@ -2378,11 +2751,21 @@ packed_cell_mem_cost(void)
   return sizeof(packed_cell_t);
 }
 
-/** DOCDOC */
+/** Return the number of bytes that we're spending on packed cells: the
+ * cells in use, plus any slabs we're holding on to with no cells in use.
+ * Relay cells waiting for the relay crypto threads count too.
+ *
+ * We don't count the free cells in partly used slabs.  packed_cell_new()
+ * hands those out before it touches an empty slab or allocates a new one,
+ * so they're room for queues to grow into, not growth.  And the OOM handler
+ * can only free memory a cell at a time: if we counted that slack, it would
+ * kill circuits without bringing this total down. */
 STATIC size_t
 cell_queues_get_total_allocation(void)
 {
-  return total_cells_allocated * packed_cell_mem_cost();
+  return total_cells_allocated * packed_cell_mem_cost() +
+    n_slabs_empty * sizeof(packed_cell_slab_t) +
+    cpuworker_relay_crypto_get_total_allocation();
 }
 
 /** How long after we've been low on memory should we try to conserve it? */
@@ -2415,6 +2798,8 @@ cell_queues_check_size(void)
         alloc += rend_cache_get_total_allocation();
       }
       circuits_handle_oom(alloc);
+      /* The cells we just freed may have left whole slabs unused. */
+      packed_cell_pool_release_empty_slabs();
       return 1;
     }
   }
@@ -2658,6 +3043,19 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
       }
     }
 
+    /* Record how long, to the microsecond, this cell spent in the queue. */
+    if (cell->inserted_usec && get_options()->CellLatencyStatistics) {
+      const uint32_t usec_waiting = cell_latency_since(cell->inserted_usec);
+      histogram_t **circ_hist = (circ->n_chan == chan) ?
+        &circ->cell_latency_exitward : &circ->cell_latency_appward;
+      if (!*circ_hist)
+        *circ_hist = histogram_new();
+      if (!chan->cell_queue_latency)
+        chan->cell_queue_latency = histogram_new();
+      histogram_add(*circ_hist, usec_waiting);
+      histogram_add(chan->cell_queue_latency, usec_waiting);
+    }
+
     /* If we just flushed our queue and this circuit is used for a
      * tunneled directory request, possibly advance its state. */
     if (queue->n == 0 && chan->dirreq_id)
@@ -2689,7 +3087,8 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
 
     /* Is the cell queue low enough to unblock all the streams that are waiting
      * to write to this circuit? */
-    if (streams_blocked && queue->n <= CELL_QUEUE_LOWWATER_SIZE)
+    if (streams_blocked &&
+        circuit_n_cells_waiting_on(circ, queue) <= CELL_QUEUE_LOWWATER_SIZE)
       set_streams_blocked_on_circ(circ, chan, 0, 0); /* unblock streams */
 
     /* If n_flushed < max still, loop around and pick another circuit */
@@ -2717,10 +3116,10 @@ get_max_middle_cells(void)
 
 /** Add <b>cell</b> to the queue of <b>circ</b> writing to <b>chan</b>
  * transmitting in <b>direction</b>. */
-void
-append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
-                             cell_t *cell, cell_direction_t direction,
-                             streamid_t fromstream)
+MOCK_IMPL(void,
+append_cell_to_circuit_queue,(circuit_t *circ, channel_t *chan,
+                              cell_t *cell, cell_direction_t direction,
+                              streamid_t fromstream))
 {
   or_circuit_t *orcirc = NULL;
   cell_queue_t *queue;
@@ -2836,7 +3235,8 @@ append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
 
   /* If we have too many cells on the circuit, we should stop reading from
    * the edge streams for a while. */
-  if (!streams_blocked && queue->n >= CELL_QUEUE_HIGHWATER_SIZE)
+  if (!streams_blocked &&
+      circuit_n_cells_waiting_on(circ, queue) >= CELL_QUEUE_HIGHWATER_SIZE)
     set_streams_blocked_on_circ(circ, chan, 1, 0); /* block streams */
 
   if (streams_blocked && fromstream) {
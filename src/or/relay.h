@@ -56,10 +56,12 @@ void cell_queue_append(cell_queue_t *queue, packed_cell_t *cell);
 void cell_queue_append_packed_copy(circuit_t *circ, cell_queue_t *queue,
                                    int exitward, const cell_t *cell,
                                    int wide_circ_ids, int use_stats);
+uint32_t cell_latency_timestamp(void);
+uint32_t cell_latency_since(uint32_t timestamp);
 
-void append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
-                                  cell_t *cell, cell_direction_t direction,
-                                  streamid_t fromstream);
+MOCK_DECL(void, append_cell_to_circuit_queue,
+          (circuit_t *circ, channel_t *chan, cell_t *cell,
+           cell_direction_t direction, streamid_t fromstream));
 void channel_unlink_all_circuits(channel_t *chan, smartlist_t *detached_out);
 MOCK_DECL(int, channel_flush_from_first_active_circuit,
           (channel_t *chan, int max));
@@ -80,6 +82,18 @@ void stream_choice_seed_weak_rng(void);
 int relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
                 crypt_path_t **layer_hint, char *recognized);
 
+int relay_crypt_inbound_cell(crypto_digest_t *digest, crypto_cipher_t *cipher,
+                             cell_t *cell, int originated);
+
+/** Largest number of relay cells on a single circuit whose keystream we'll
+ * generate in one batch. */
+#define RELAY_CRYPT_BATCH_MAX 16
+void relay_crypt_prepare_cell_batch(channel_t *chan, const cell_t *cells,
+                                    int n_cells);
+void relay_crypt_prepare_package_batch(circuit_t *circ,
+                                       crypt_path_t *layer_hint,
+                                       int n_cells);
+
 circid_t packed_cell_get_circid(const packed_cell_t *cell, int wide_circ_ids);
 
 #ifdef RELAY_PRIVATE
@@ -100,6 +114,10 @@ STATIC int connection_edge_process_resolved_cell(edge_connection_t *conn,
 STATIC packed_cell_t *packed_cell_new(void);
 STATIC packed_cell_t *cell_queue_pop(cell_queue_t *queue);
 STATIC size_t cell_queues_get_total_allocation(void);
+STATIC size_t packed_cell_pool_release_empty_slabs(void);
+#ifdef TOR_UNIT_TESTS
+STATIC void packed_cell_pool_get_n_slabs(int *n_slabs_out, int *n_empty_out);
+#endif
 STATIC int cell_queues_check_size(void);
 #endif
 
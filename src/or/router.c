@@ -1698,8 +1698,10 @@ router_compare_to_my_exit_policy(const tor_addr_t *addr, uint16_t port)
    * at desc_routerinfio->ipv6_exit_policy, since that's a port summary. */
   if ((tor_addr_family(addr) == AF_INET ||
        tor_addr_family(addr) == AF_INET6)) {
-    return compare_tor_addr_to_addr_policy(addr, port,
-                    desc_routerinfo->exit_policy) != ADDR_POLICY_ACCEPTED;
+    return compare_tor_addr_to_compiled_policy(addr, port,
+                    desc_routerinfo->exit_policy,
+                    desc_routerinfo->compiled_exit_policy)
+      != ADDR_POLICY_ACCEPTED;
 #if 0
   } else if (tor_addr_family(addr) == AF_INET6) {
     return get_options()->IPv6Exit &&
@@ -1925,6 +1927,7 @@ router_build_fresh_descriptor(routerinfo_t **r, extrainfo_t **e)
     policies_parse_exit_policy_from_options(options,ri->addr,&ri->ipv6_addr,
                                             &ri->exit_policy);
   }
+  ri->compiled_exit_policy = addr_policy_compile(ri->exit_policy);
   ri->policy_is_reject_star =
     policy_is_reject_star(ri->exit_policy, AF_INET) &&
     policy_is_reject_star(ri->exit_policy, AF_INET6);
@@ -1741,8 +1741,10 @@ mark_all_dirservers_up(smartlist_t *server_list)
       node_t *node;
       dir->is_running = 1;
       node = node_get_mutable_by_id(dir->digest);
-      if (node)
+      if (node) {
         node->is_running = 1;
+        nodelist_snapshot_mark_dirty();
+      }
       rs = router_get_mutable_consensus_status_by_id(dir->digest);
       if (rs) {
         rs->last_dir_503_at = 0;
@@ -1791,6 +1793,27 @@ routerlist_add_node_and_family(smartlist_t *sl, const routerinfo_t *router)
   nodelist_add_node_and_family(sl, node);
 }
 
+/** Return the NODE_SNAP_* flags that a node must have in order to be
+ * considered by router_add_running_nodes_to_smartlist() with the same
+ * arguments. */
+static uint16_t
+running_node_required_flags(int allow_invalid, int need_uptime,
+                            int need_capacity, int need_guard, int need_desc)
+{
+  uint16_t required = NODE_SNAP_RUNNING | NODE_SNAP_GENERAL;
+  if (!allow_invalid)
+    required |= NODE_SNAP_VALID;
+  if (need_desc)
+    required |= NODE_SNAP_HAS_DESC;
+  if (need_uptime)
+    required |= NODE_SNAP_STABLE;
+  if (need_capacity)
+    required |= NODE_SNAP_FAST;
+  if (need_guard)
+    required |= NODE_SNAP_GUARD;
+  return required;
+}
+
 /** Add every suitable node from our nodelist to <b>sl</b>, so that
  * we can pick a node for a circuit.
  */
@@ -1799,19 +1822,16 @@ router_add_running_nodes_to_smartlist(smartlist_t *sl, int allow_invalid,
                                       int need_uptime, int need_capacity,
                                       int need_guard, int need_desc)
 { /* XXXX MOVE */
-  SMARTLIST_FOREACH_BEGIN(nodelist_get_list(), const node_t *, node) {
-    if (!node->is_running ||
-        (!node->is_valid && !allow_invalid))
-      continue;
-    if (need_desc && !(node->ri || (node->rs && node->md)))
-      continue;
-    if (node->ri && node->ri->purpose != ROUTER_PURPOSE_GENERAL)
-      continue;
-    if (node_is_unreliable(node, need_uptime, need_capacity, need_guard))
-      continue;
+  const node_snapshot_t *snap = nodelist_get_snapshot();
+  const uint16_t required =
+    running_node_required_flags(allow_invalid, need_uptime, need_capacity,
+                                need_guard, need_desc);
+  int i;
 
-    smartlist_add(sl, (void *)node);
-  } SMARTLIST_FOREACH_END(node);
+  for (i = 0; i < snap->n_nodes; ++i) {
+    if ((snap->flags[i] & required) == required)
+      smartlist_add(sl, snap->nodes[i]);
+  }
 }
 
 /** Look through the routerlist until we find a router that has my key.
@@ -1944,6 +1964,100 @@ choose_array_element_by_weight(const u64_dbl_t *entries, int n_entries)
   return i_chosen;
 }
 
+/** Each threshold in an alias_table_t is a probability scaled to this
+ * value. */
+#define ALIAS_TABLE_SCALE (U64_LITERAL(1)<<63)
+
+/** Build and return a new alias table for choosing among
+ * <b>n_entries</b> entries with probability proportional to
+ * <b>weights</b>.  If every weight is 0, every entry is equally likely. */
+STATIC alias_table_t *
+alias_table_new(const double *weights, int n_entries)
+{
+  alias_table_t *table = tor_malloc_zero(sizeof(alias_table_t));
+  double *scaled, total = 0.0;
+  int *small, *large;
+  int i, n_small = 0, n_large = 0;
+
+  table->n_entries = n_entries;
+  table->threshold = tor_calloc(n_entries, sizeof(uint64_t));
+  table->alias = tor_calloc(n_entries, sizeof(int));
+
+  for (i = 0; i < n_entries; ++i)
+    total += weights[i];
+
+  scaled = tor_calloc(n_entries, sizeof(double));
+  small = tor_calloc(n_entries, sizeof(int));
+  large = tor_calloc(n_entries, sizeof(int));
+
+  /* Scale the weights so that they average 1.0, and sort them into the
+   * ones that are too small to fill their own column and the ones that
+   * can spare some for somebody else. */
+  for (i = 0; i < n_entries; ++i) {
+    scaled[i] = (total > 0.0) ? weights[i] * n_entries / total : 1.0;
+    if (scaled[i] < 1.0)
+      small[n_small++] = i;
+    else
+      large[n_large++] = i;
+  }
+
+  /* Fill each small column from some large one. */
+  while (n_small && n_large) {
+    const int s = small[--n_small];
+    const int l = large[n_large-1];
+    table->threshold[s] = (uint64_t)(scaled[s] * ALIAS_TABLE_SCALE);
+    table->alias[s] = l;
+    scaled[l] -= (1.0 - scaled[s]);
+    if (scaled[l] < 1.0) {
+      --n_large;
+      small[n_small++] = l;
+    }
+  }
+
+  /* Whatever is left is full, give or take rounding error. */
+  while (n_large) {
+    const int l = large[--n_large];
+    table->threshold[l] = ALIAS_TABLE_SCALE;
+    table->alias[l] = l;
+  }
+  while (n_small) {
+    const int s = small[--n_small];
+    table->threshold[s] = ALIAS_TABLE_SCALE;
+    table->alias[s] = s;
+  }
+
+  tor_free(scaled);
+  tor_free(small);
+  tor_free(large);
+  return table;
+}
+
+/** Choose a random entry from <b>table</b>, and return its index.  Return
+ * -1 if the table is empty. */
+STATIC int
+alias_table_choose(const alias_table_t *table)
+{
+  int i;
+  if (table->n_entries < 1)
+    return -1;
+  i = crypto_rand_int(table->n_entries);
+  if (crypto_rand_uint64(ALIAS_TABLE_SCALE) < table->threshold[i])
+    return i;
+  else
+    return table->alias[i];
+}
+
+/** Release all storage held by <b>table</b>. */
+STATIC void
+alias_table_free(alias_table_t *table)
+{
+  if (!table)
+    return;
+  tor_free(table->threshold);
+  tor_free(table->alias);
+  tor_free(table);
+}
+
 /** When weighting bridges, enforce these values as lower and upper
  * bound for believable bandwidth, because there is no way for us
  * to verify a bridge's bandwidth currently. */
@@ -1975,6 +2089,39 @@ kb_to_bytes(uint32_t bw)
   return (bw > (INT32_MAX/1000)) ? INT32_MAX : bw*1000;
 }
 
+/** Set *<b>bw_out</b> to the bandwidth, in bytes per second, that we should
+ * use for <b>node</b> when weighting nodes by bandwidth: its consensus
+ * bandwidth if it has one, or a bounded version of its advertised bandwidth
+ * if it's a bridge or some other router we only have a descriptor for.
+ * Return 0 on success, or -1 if we know nothing about its bandwidth. */
+int
+node_get_weighting_bandwidth(const node_t *node, uint32_t *bw_out)
+{
+  static int warned_missing_bw = 0;
+  if (node->rs) {
+    if (!node->rs->has_bandwidth) {
+      /* This should never happen, unless all the authorites downgrade
+       * to 0.2.0 or rogue routerstatuses get inserted into our consensus. */
+      if (! warned_missing_bw) {
+        log_warn(LD_BUG,
+               "Consensus is missing some bandwidths. Using a naive "
+               "router selection algorithm");
+        warned_missing_bw = 1;
+      }
+      *bw_out = 30000; /* Chosen arbitrarily */
+    } else {
+      *bw_out = kb_to_bytes(node->rs->bandwidth_kb);
+    }
+  } else if (node->ri) {
+    /* bridge or other descriptor not in our consensus */
+    *bw_out = bridge_get_advertised_bandwidth_bounded(node->ri);
+  } else {
+    /* We can't use this one. */
+    return -1;
+  }
+  return 0;
+}
+
 /** Helper function:
  * choose a random element of smartlist <b>sl</b> of nodes, weighted by
  * the advertised bandwidth of each element using the consensus
@@ -2008,37 +2155,22 @@ smartlist_choose_node_by_bandwidth_weights(const smartlist_t *sl,
   }
 }
 
-/** Given a list of routers and a weighting rule as in
- * smartlist_choose_node_by_bandwidth_weights, compute weighted bandwidth
- * values for each node and store them in a freshly allocated
- * *<b>bandwidths_out</b> of the same length as <b>sl</b>, and holding results
- * as doubles. Return 0 on success, -1 on failure. */
-static int
-compute_weighted_bandwidths(const smartlist_t *sl,
-                            bandwidth_weight_rule_t rule,
-                            u64_dbl_t **bandwidths_out)
+/** The consensus bandwidth weights to apply to each kind of node when
+ * choosing nodes for some position in a circuit, already divided by the
+ * weight scale.  See compute_weighted_bandwidths() and dir-spec.txt. */
+typedef struct bw_weights_t {
+  double Wg, Wm, We, Wd;
+  double Wgb, Wmb, Web, Wdb;
+} bw_weights_t;
+
+/** Look up the consensus bandwidth weights that we should use when
+ * weighting nodes by <b>rule</b>, and store them in *<b>w_out</b>. */
+static void
+get_bw_weights_for_rule(bandwidth_weight_rule_t rule, bw_weights_t *w_out)
 {
   int64_t weight_scale;
   double Wg = -1, Wm = -1, We = -1, Wd = -1;
   double Wgb = -1, Wmb = -1, Web = -1, Wdb = -1;
-  uint64_t weighted_bw = 0;
-  guardfraction_bandwidth_t guardfraction_bw;
-  u64_dbl_t *bandwidths;
-
-  /* Can't choose exit and guard at same time */
-  tor_assert(rule == NO_WEIGHTING ||
-             rule == WEIGHT_FOR_EXIT ||
-             rule == WEIGHT_FOR_GUARD ||
-             rule == WEIGHT_FOR_MID ||
-             rule == WEIGHT_FOR_DIR);
-
-  if (smartlist_len(sl) == 0) {
-    log_info(LD_CIRC,
-             "Empty routerlist passed in to consensus weight node "
-             "selection for rule %s",
-             bandwidth_weight_rule_to_string(rule));
-    return -1;
-  }
 
   weight_scale = networkstatus_get_weight_scale_param(NULL);
 
@@ -2105,101 +2237,149 @@ compute_weighted_bandwidths(const smartlist_t *sl,
   Web /= weight_scale;
   Wdb /= weight_scale;
 
+  w_out->Wg = Wg;
+  w_out->Wm = Wm;
+  w_out->We = We;
+  w_out->Wd = Wd;
+  w_out->Wgb = Wgb;
+  w_out->Wmb = Wmb;
+  w_out->Web = Web;
+  w_out->Wdb = Wdb;
+}
+
+/** Return the weighted bandwidth of <b>node</b> under the weights
+ * <b>w</b> for <b>rule</b>, given its NODE_SNAP_* <b>flags</b>, its
+ * weighting bandwidth <b>bw</b>, and its <b>guardfraction_pct</b>.  Return
+ * 0 for a node whose bandwidth we don't know. */
+static double
+node_get_weighted_bandwidth(const node_t *node, const bw_weights_t *w,
+                            bandwidth_weight_rule_t rule, uint16_t flags,
+                            uint32_t bw, uint8_t guardfraction_pct)
+{
+  const int is_exit = (flags & NODE_SNAP_EXIT) != 0;
+  const int is_guard = (flags & NODE_SNAP_GUARD) != 0;
+  const int is_dir = (flags & NODE_SNAP_DIR) != 0;
+  int this_bw = (int)MIN(bw, INT32_MAX);
+  double weight = 1;
+  double weight_without_guard_flag = 0; /* Used for guardfraction */
+  double final_weight = 0;
+  guardfraction_bandwidth_t guardfraction_bw;
+
+  if (!(flags & NODE_SNAP_HAS_BW)) {
+    /* We can't use this one. */
+    return 0.0;
+  }
+
+  if (is_guard && is_exit) {
+    weight = (is_dir ? w->Wdb*w->Wd : w->Wd);
+    weight_without_guard_flag = (is_dir ? w->Web*w->We : w->We);
+  } else if (is_guard) {
+    weight = (is_dir ? w->Wgb*w->Wg : w->Wg);
+    weight_without_guard_flag = (is_dir ? w->Wmb*w->Wm : w->Wm);
+  } else if (is_exit) {
+    weight = (is_dir ? w->Web*w->We : w->We);
+  } else { // middle
+    weight = (is_dir ? w->Wmb*w->Wm : w->Wm);
+  }
+  /* These should be impossible; but overflows here would be bad, so let's
+   * make sure. */
+  if (this_bw < 0)
+    this_bw = 0;
+  if (weight < 0.0)
+    weight = 0.0;
+  if (weight_without_guard_flag < 0.0)
+    weight_without_guard_flag = 0.0;
+
+  /* If guardfraction information is available in the consensus, we
+   * want to calculate this router's bandwidth according to its
+   * guardfraction. Quoting from proposal236:
+   *
+   *    Let Wpf denote the weight from the 'bandwidth-weights' line a
+   *    client would apply to N for position p if it had the guard
+   *    flag, Wpn the weight if it did not have the guard flag, and B the
+   *    measured bandwidth of N in the consensus.  Then instead of choosing
+   *    N for position p proportionally to Wpf*B or Wpn*B, clients should
+   *    choose N proportionally to F*Wpf*B + (1-F)*Wpn*B.
+   */
+  if ((flags & NODE_SNAP_HAS_GUARDFRACTION) && rule != WEIGHT_FOR_GUARD) {
+    guard_get_guardfraction_bandwidth(&guardfraction_bw,
+                                      this_bw,
+                                      guardfraction_pct);
+
+    /* Calculate final_weight = F*Wpf*B + (1-F)*Wpn*B */
+    final_weight =
+      guardfraction_bw.guard_bw * weight +
+      guardfraction_bw.non_guard_bw * weight_without_guard_flag;
+
+    log_debug(LD_GENERAL, "%s: Guardfraction weight %f instead of %f (%s)",
+              node_get_nickname(node), final_weight, weight*this_bw,
+              bandwidth_weight_rule_to_string(rule));
+  } else { /* no guardfraction information. calculate the weight normally. */
+    final_weight = weight*this_bw;
+  }
+
+  return final_weight + 0.5;
+}
+
+/** Given a list of routers and a weighting rule as in
+ * smartlist_choose_node_by_bandwidth_weights, compute weighted bandwidth
+ * values for each node and store them in a freshly allocated
+ * *<b>bandwidths_out</b> of the same length as <b>sl</b>, and holding results
+ * as doubles. Return 0 on success, -1 on failure. */
+static int
+compute_weighted_bandwidths(const smartlist_t *sl,
+                            bandwidth_weight_rule_t rule,
+                            u64_dbl_t **bandwidths_out)
+{
+  bw_weights_t w;
+  const node_snapshot_t *snap;
+  u64_dbl_t *bandwidths;
+
+  /* Can't choose exit and guard at same time */
+  tor_assert(rule == NO_WEIGHTING ||
+             rule == WEIGHT_FOR_EXIT ||
+             rule == WEIGHT_FOR_GUARD ||
+             rule == WEIGHT_FOR_MID ||
+             rule == WEIGHT_FOR_DIR);
+
+  if (smartlist_len(sl) == 0) {
+    log_info(LD_CIRC,
+             "Empty routerlist passed in to consensus weight node "
+             "selection for rule %s",
+             bandwidth_weight_rule_to_string(rule));
+    return -1;
+  }
+
+  get_bw_weights_for_rule(rule, &w);
+  snap = nodelist_get_snapshot();
+
   bandwidths = tor_calloc(smartlist_len(sl), sizeof(u64_dbl_t));
 
-  // Cycle through smartlist and total the bandwidth.
-  static int warned_missing_bw = 0;
   SMARTLIST_FOREACH_BEGIN(sl, const node_t *, node) {
-    int is_exit = 0, is_guard = 0, is_dir = 0, this_bw = 0;
-    double weight = 1;
-    double weight_without_guard_flag = 0; /* Used for guardfraction */
-    double final_weight = 0;
-    is_exit = node->is_exit && ! node->is_bad_exit;
-    is_guard = node->is_possible_guard;
-    is_dir = node_is_dir(node);
-    if (node->rs) {
-      if (!node->rs->has_bandwidth) {
-        /* This should never happen, unless all the authorites downgrade
-         * to 0.2.0 or rogue routerstatuses get inserted into our consensus. */
-        if (! warned_missing_bw) {
-          log_warn(LD_BUG,
-                 "Consensus is missing some bandwidths. Using a naive "
-                 "router selection algorithm");
-          warned_missing_bw = 1;
-        }
-        this_bw = 30000; /* Chosen arbitrarily */
-      } else {
-        this_bw = kb_to_bytes(node->rs->bandwidth_kb);
-      }
-    } else if (node->ri) {
-      /* bridge or other descriptor not in our consensus */
-      this_bw = bridge_get_advertised_bandwidth_bounded(node->ri);
+    const int idx = node_snapshot_find(snap, node);
+    if (idx >= 0) {
+      bandwidths[node_sl_idx].dbl =
+        node_get_weighted_bandwidth(node, &w, rule, snap->flags[idx],
+                                    snap->bandwidth[idx],
+                                    snap->guardfraction_pct[idx]);
     } else {
-      /* We can't use this one. */
-      continue;
-    }
-
-    if (is_guard && is_exit) {
-      weight = (is_dir ? Wdb*Wd : Wd);
-      weight_without_guard_flag = (is_dir ? Web*We : We);
-    } else if (is_guard) {
-      weight = (is_dir ? Wgb*Wg : Wg);
-      weight_without_guard_flag = (is_dir ? Wmb*Wm : Wm);
-    } else if (is_exit) {
-      weight = (is_dir ? Web*We : We);
-    } else { // middle
-      weight = (is_dir ? Wmb*Wm : Wm);
-    }
-    /* These should be impossible; but overflows here would be bad, so let's
-     * make sure. */
-    if (this_bw < 0)
-      this_bw = 0;
-    if (weight < 0.0)
-      weight = 0.0;
-    if (weight_without_guard_flag < 0.0)
-      weight_without_guard_flag = 0.0;
-
-    /* If guardfraction information is available in the consensus, we
-     * want to calculate this router's bandwidth according to its
-     * guardfraction. Quoting from proposal236:
-     *
-     *    Let Wpf denote the weight from the 'bandwidth-weights' line a
-     *    client would apply to N for position p if it had the guard
-     *    flag, Wpn the weight if it did not have the guard flag, and B the
-     *    measured bandwidth of N in the consensus.  Then instead of choosing
-     *    N for position p proportionally to Wpf*B or Wpn*B, clients should
-     *    choose N proportionally to F*Wpf*B + (1-F)*Wpn*B.
-     */
-    if (node->rs && node->rs->has_guardfraction && rule != WEIGHT_FOR_GUARD) {
-      /* XXX The assert should actually check for is_guard. However,
-       * that crashes dirauths because of #13297. This should be
-       * equivalent: */
-      tor_assert(node->rs->is_possible_guard);
-
-      guard_get_guardfraction_bandwidth(&guardfraction_bw,
-                                        this_bw,
-                                        node->rs->guardfraction_percentage);
-
-      /* Calculate final_weight = F*Wpf*B + (1-F)*Wpn*B */
-      final_weight =
-        guardfraction_bw.guard_bw * weight +
-        guardfraction_bw.non_guard_bw * weight_without_guard_flag;
-
-      log_debug(LD_GENERAL, "%s: Guardfraction weight %f instead of %f (%s)",
-                node->rs->nickname, final_weight, weight*this_bw,
-                bandwidth_weight_rule_to_string(rule));
-    } else { /* no guardfraction information. calculate the weight normally. */
-      final_weight = weight*this_bw;
+      /* Not in the nodelist: most likely a fake node for one of our
+       * own routers. */
+      uint32_t bw = 0;
+      node_get_weighting_bandwidth(node, &bw);
+      bandwidths[node_sl_idx].dbl =
+        node_get_weighted_bandwidth(node, &w, rule,
+                                    node_get_snapshot_flags(node), bw,
+                                    node->rs ?
+                                    node->rs->guardfraction_percentage : 0);
     }
-
-    bandwidths[node_sl_idx].dbl = final_weight + 0.5;
   } SMARTLIST_FOREACH_END(node);
 
   log_debug(LD_CIRC, "Generated weighted bandwidths for rule %s based "
             "on weights "
-            "Wg=%f Wm=%f We=%f Wd=%f with total bw "U64_FORMAT,
+            "Wg=%f Wm=%f We=%f Wd=%f",
             bandwidth_weight_rule_to_string(rule),
-            Wg, Wm, We, Wd, U64_PRINTF_ARG(weighted_bw));
+            w.Wg, w.Wm, w.We, w.Wd);
 
   *bandwidths_out = bandwidths;
 
@@ -2253,6 +2433,195 @@ node_sl_choose_by_bandwidth(const smartlist_t *sl,
   return smartlist_choose_node_by_bandwidth_weights(sl, rule);
 }
 
+/** For every node in <b>sl</b> that appears in <b>snap</b>, set the
+ * corresponding entry of <b>marks</b> to 1. */
+static void
+node_snapshot_mark_nodes(const node_snapshot_t *snap, const smartlist_t *sl,
+                         uint8_t *marks)
+{
+  SMARTLIST_FOREACH_BEGIN(sl, const node_t *, node) {
+    const int idx = node_snapshot_find(snap, node);
+    if (idx >= 0)
+      marks[idx] = 1;
+  } SMARTLIST_FOREACH_END(node);
+}
+
+/** A precomputed alias table over every node in the node snapshot that has
+ * all the NODE_SNAP_* flags in <b>required</b> and none of those in
+ * <b>forbidden</b>, weighted for <b>rule</b>. */
+typedef struct node_alias_table_t {
+  bandwidth_weight_rule_t rule;
+  uint16_t required;
+  uint16_t forbidden;
+  /** For each entry in <b>table</b>, the index of its node in the
+   * snapshot. */
+  int *node_idx;
+  alias_table_t *table;
+} node_alias_table_t;
+
+/** List of node_alias_table_t built from the current node snapshot. */
+static smartlist_t *node_alias_tables = NULL;
+/** Generation of the node snapshot that node_alias_tables was built
+ * from. */
+static unsigned int node_alias_tables_generation = 0;
+
+/** Release all storage held by <b>t</b>. */
+static void
+node_alias_table_free(node_alias_table_t *t)
+{
+  if (!t)
+    return;
+  alias_table_free(t->table);
+  tor_free(t->node_idx);
+  tor_free(t);
+}
+
+/** Forget every node_alias_table_t we've built. */
+static void
+node_alias_tables_clear(void)
+{
+  if (!node_alias_tables)
+    return;
+  SMARTLIST_FOREACH(node_alias_tables, node_alias_table_t *, t,
+                    node_alias_table_free(t));
+  smartlist_clear(node_alias_tables);
+}
+
+/** Return an alias table for choosing among the nodes in <b>snap</b> with
+ * the flags in <b>required</b> and without those in <b>forbidden</b>,
+ * weighted for <b>rule</b>.  Build it if we don't have it already.  Any
+ * table built from an older snapshot is discarded first, so that new
+ * consensuses and descriptors are taken into account. */
+static const node_alias_table_t *
+node_alias_table_get(const node_snapshot_t *snap,
+                     bandwidth_weight_rule_t rule,
+                     uint16_t required, uint16_t forbidden)
+{
+  node_alias_table_t *t;
+  bw_weights_t w;
+  double *weights;
+  int i, n = 0;
+
+  if (!node_alias_tables)
+    node_alias_tables = smartlist_new();
+  if (node_alias_tables_generation != snap->generation) {
+    node_alias_tables_clear();
+    node_alias_tables_generation = snap->generation;
+  }
+
+  SMARTLIST_FOREACH_BEGIN(node_alias_tables, node_alias_table_t *, ent) {
+    if (ent->rule == rule && ent->required == required &&
+        ent->forbidden == forbidden)
+      return ent;
+  } SMARTLIST_FOREACH_END(ent);
+
+  get_bw_weights_for_rule(rule, &w);
+  t = tor_malloc_zero(sizeof(node_alias_table_t));
+  t->rule = rule;
+  t->required = required;
+  t->forbidden = forbidden;
+  t->node_idx = tor_calloc(snap->n_nodes, sizeof(int));
+  weights = tor_calloc(snap->n_nodes, sizeof(double));
+  for (i = 0; i < snap->n_nodes; ++i) {
+    const uint16_t node_flags = snap->flags[i];
+    if ((node_flags & required) != required || (node_flags & forbidden))
+      continue;
+    weights[n] = node_get_weighted_bandwidth(snap->nodes[i], &w, rule,
+                                             node_flags, snap->bandwidth[i],
+                                             snap->guardfraction_pct[i]);
+    t->node_idx[n++] = i;
+  }
+  t->table = alias_table_new(weights, n);
+  tor_free(weights);
+
+  smartlist_add(node_alias_tables, t);
+  return t;
+}
+
+/** Return true iff <b>node</b> is in one of the lists or sets of nodes
+ * that router_choose_random_node() was told to avoid. */
+static int
+node_is_excluded(const node_t *node, const smartlist_t *excludednodes,
+                 const smartlist_t *excludedsmartlist,
+                 const routerset_t *excludedset)
+{
+  return smartlist_contains(excludednodes, node) ||
+    (excludedsmartlist && smartlist_contains(excludedsmartlist, node)) ||
+    (excludedset && routerset_contains_node(excludedset, node));
+}
+
+/** How many times will we draw an excluded node from an alias table before
+ * we give up and scan every node instead? */
+#define MAX_ALIAS_TABLE_REJECTIONS 64
+
+/** Helper for router_choose_random_node(): pick a node from <b>snap</b>
+ * with a single pass over every node, skipping the excluded ones.  Slower
+ * than using an alias table, but always gives an answer when there is
+ * one. */
+static const node_t *
+choose_random_node_by_scan(const node_snapshot_t *snap,
+                           bandwidth_weight_rule_t rule,
+                           uint16_t required, uint16_t forbidden,
+                           const smartlist_t *excludednodes,
+                           const smartlist_t *excludedsmartlist,
+                           const routerset_t *excludedset)
+{
+  const node_t *choice = NULL;
+  bw_weights_t w;
+  uint8_t *excluded;
+  int *candidates;
+  u64_dbl_t *bandwidths;
+  int i, n_candidates = 0;
+
+  /* Mark everything we've been told to exclude, so that the scan below
+   * can skip it by index. */
+  excluded = tor_calloc(snap->n_nodes, sizeof(uint8_t));
+  node_snapshot_mark_nodes(snap, excludednodes, excluded);
+  if (excludedsmartlist)
+    node_snapshot_mark_nodes(snap, excludedsmartlist, excluded);
+
+  get_bw_weights_for_rule(rule, &w);
+  candidates = tor_calloc(snap->n_nodes, sizeof(int));
+  bandwidths = tor_calloc(snap->n_nodes, sizeof(u64_dbl_t));
+
+  for (i = 0; i < snap->n_nodes; ++i) {
+    const uint16_t node_flags = snap->flags[i];
+    if ((node_flags & required) != required ||
+        (node_flags & forbidden) ||
+        excluded[i])
+      continue;
+    if (excludedset && routerset_contains_node(excludedset, snap->nodes[i]))
+      continue;
+    bandwidths[n_candidates].dbl =
+      node_get_weighted_bandwidth(snap->nodes[i], &w, rule, node_flags,
+                                  snap->bandwidth[i],
+                                  snap->guardfraction_pct[i]);
+    candidates[n_candidates++] = i;
+  }
+  log_debug(LD_CIRC,
+            "We found %d running nodes that we haven't excluded.",
+            n_candidates);
+
+  // Always weight by bandwidth
+  if (n_candidates) {
+    int idx;
+    scale_array_elements_to_u64(bandwidths, n_candidates, NULL);
+    idx = choose_array_element_by_weight(bandwidths, n_candidates);
+    if (idx >= 0)
+      choice = snap->nodes[candidates[idx]];
+  } else {
+    log_info(LD_CIRC,
+             "Empty routerlist passed in to consensus weight node "
+             "selection for rule %s",
+             bandwidth_weight_rule_to_string(rule));
+  }
+
+  tor_free(excluded);
+  tor_free(candidates);
+  tor_free(bandwidths);
+  return choice;
+}
+
 /** Return a random running node from the nodelist. Never
  * pick a node that is in
  * <b>excludedsmartlist</b>, or which matches <b>excludedset</b>,
@@ -2283,59 +2652,65 @@ router_choose_random_node(smartlist_t *excludedsmartlist,
   const int weight_for_exit = (flags & CRN_WEIGHT_AS_EXIT) != 0;
   const int need_desc = (flags & CRN_NEED_DESC) != 0;
 
-  smartlist_t *sl=smartlist_new(),
-    *excludednodes=smartlist_new();
+  const node_snapshot_t *snap = nodelist_get_snapshot();
+  const node_alias_table_t *alias_table;
+  smartlist_t *excludednodes=smartlist_new();
   const node_t *choice = NULL;
   const routerinfo_t *r;
   bandwidth_weight_rule_t rule;
+  uint16_t required, forbidden = 0;
+  int tries;
 
   tor_assert(!(weight_for_exit && need_guard));
   rule = weight_for_exit ? WEIGHT_FOR_EXIT :
     (need_guard ? WEIGHT_FOR_GUARD : WEIGHT_FOR_MID);
 
+  required = running_node_required_flags(allow_invalid, need_uptime,
+                                         need_capacity, need_guard,
+                                         need_desc);
+
   /* Exclude relays that allow single hop exit circuits, if the user
    * wants to (such relays might be risky) */
-  if (get_options()->ExcludeSingleHopRelays) {
-    SMARTLIST_FOREACH(nodelist_get_list(), node_t *, node,
-      if (node_allows_single_hop_exits(node)) {
-        smartlist_add(excludednodes, node);
-      });
-  }
+  if (get_options()->ExcludeSingleHopRelays)
+    forbidden |= NODE_SNAP_SINGLE_HOP_EXIT;
 
   if ((r = routerlist_find_my_routerinfo()))
     routerlist_add_node_and_family(excludednodes, r);
 
-  router_add_running_nodes_to_smartlist(sl, allow_invalid,
-                                        need_uptime, need_capacity,
-                                        need_guard, need_desc);
-  log_debug(LD_CIRC,
-           "We found %d running nodes.",
-            smartlist_len(sl));
-
-  smartlist_subtract(sl,excludednodes);
-  log_debug(LD_CIRC,
-            "We removed %d excludednodes, leaving %d nodes.",
-            smartlist_len(excludednodes),
-            smartlist_len(sl));
+  if (excludedset && routerset_is_empty(excludedset))
+    excludedset = NULL;
 
-  if (excludedsmartlist) {
-    smartlist_subtract(sl,excludedsmartlist);
-    log_debug(LD_CIRC,
-              "We removed %d excludedsmartlist, leaving %d nodes.",
-              smartlist_len(excludedsmartlist),
-              smartlist_len(sl));
-  }
-  if (excludedset) {
-    routerset_subtract_nodes(sl,excludedset);
-    log_debug(LD_CIRC,
-              "We removed excludedset, leaving %d nodes.",
-              smartlist_len(sl));
+  /* Usually, the nodes we've been told to exclude are a tiny part of the
+   * network, so draw from the precomputed alias table for these flags
+   * and just try again if we get one of them.  That gives the same
+   * distribution as weighting only the allowed nodes. */
+  alias_table = node_alias_table_get(snap, rule, required, forbidden);
+  if (alias_table->table->n_entries == 0) {
+    log_info(LD_CIRC,
+             "Empty routerlist passed in to consensus weight node "
+             "selection for rule %s",
+             bandwidth_weight_rule_to_string(rule));
+  } else {
+    for (tries = 0; tries < MAX_ALIAS_TABLE_REJECTIONS; ++tries) {
+      const int idx = alias_table_choose(alias_table->table);
+      const node_t *node = snap->nodes[alias_table->node_idx[idx]];
+      if (!node_is_excluded(node, excludednodes, excludedsmartlist,
+                            excludedset)) {
+        choice = node;
+        break;
+      }
+    }
+    /* If we're excluding so much that we can't find anything that way,
+     * fall back to looking at every node. */
+    if (!choice) {
+      log_debug(LD_CIRC, "Drew %d excluded nodes in a row; scanning all "
+                "nodes instead.", tries);
+      choice = choose_random_node_by_scan(snap, rule, required, forbidden,
+                                          excludednodes, excludedsmartlist,
+                                          excludedset);
+    }
   }
 
-  // Always weight by bandwidth
-  choice = node_sl_choose_by_bandwidth(sl, rule);
-
-  smartlist_free(sl);
   if (!choice && (need_uptime || need_capacity || need_guard)) {
     /* try once more -- recurse but with fewer restrictions. */
     log_info(LD_CIRC,
@@ -2669,6 +3044,7 @@ routerinfo_free(routerinfo_t *router)
     smartlist_free(router->declared_family);
   }
   addr_policy_list_free(router->exit_policy);
+  compiled_addr_policy_free(router->compiled_exit_policy);
   short_policy_free(router->ipv6_exit_policy);
 
   memset(router, 77, sizeof(routerinfo_t));
@@ -3224,6 +3600,9 @@ routerlist_free_all(void)
   smartlist_free(trusted_dir_servers);
   smartlist_free(fallback_dir_servers);
   trusted_dir_servers = fallback_dir_servers = NULL;
+  node_alias_tables_clear();
+  smartlist_free(node_alias_tables);
+  node_alias_tables = NULL;
   if (trusted_dir_certs) {
     digestmap_free(trusted_dir_certs, cert_list_free_);
     trusted_dir_certs = NULL;
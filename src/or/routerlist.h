@@ -65,6 +65,7 @@ void router_add_running_nodes_to_smartlist(smartlist_t *sl, int allow_invalid,
 const routerinfo_t *routerlist_find_my_routerinfo(void);
 uint32_t router_get_advertised_bandwidth(const routerinfo_t *router);
 uint32_t router_get_advertised_bandwidth_capped(const routerinfo_t *router);
+int node_get_weighting_bandwidth(const node_t *node, uint32_t *bw_out);
 
 const node_t *node_sl_choose_by_bandwidth(const smartlist_t *sl,
                                           bandwidth_weight_rule_t rule);
@@ -231,6 +232,23 @@ STATIC int choose_array_element_by_weight(const u64_dbl_t *entries,
 STATIC void scale_array_elements_to_u64(u64_dbl_t *entries, int n_entries,
                                         uint64_t *total_out);
 
+/** A Walker/Vose alias table: lets us choose an index from a fixed array
+ * of weights, with probability proportional to its weight, in constant
+ * time. */
+typedef struct alias_table_t {
+  /** How many entries are there? */
+  int n_entries;
+  /** For each entry, the chance (out of ALIAS_TABLE_SCALE) that we keep
+   * that entry when we land on it... */
+  uint64_t *threshold;
+  /** ...and the entry that we choose instead if we don't. */
+  int *alias;
+} alias_table_t;
+
+STATIC alias_table_t *alias_table_new(const double *weights, int n_entries);
+STATIC int alias_table_choose(const alias_table_t *table);
+STATIC void alias_table_free(alias_table_t *table);
+
 MOCK_DECL(int, router_descriptor_is_older_than, (const routerinfo_t *router,
                                                  int seconds));
 MOCK_DECL(STATIC was_router_added_t, extrainfo_insert,
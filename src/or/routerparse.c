@@ -569,6 +569,23 @@ static int check_signature_token(const char *digest,
                                  int flags,
                                  const char *doctype);
 
+/** A router descriptor signature that router_parse_list_from_string() has
+ * put off checking, so that it can check many of them at once. */
+typedef struct deferred_router_sig_t {
+  /** The digest of the signed part of the descriptor. */
+  char digest[DIGEST_LEN];
+  /** The signature on the descriptor. */
+  char *sig;
+  /** The length of <b>sig</b>. */
+  size_t sig_len;
+} deferred_router_sig_t;
+
+static routerinfo_t *router_parse_entry_impl(const char *s, const char *end,
+                                      int cache_copy, int allow_annotations,
+                                      const char *prepend_annotations,
+                                      int *can_dl_again_out,
+                                      deferred_router_sig_t *deferred_sig_out);
+
 #undef DEBUG_AREA_ALLOC
 
 #ifdef DEBUG_AREA_ALLOC
@@ -588,13 +605,19 @@ static time_t last_desc_dumped = 0;
 /** For debugging purposes, dump unparseable descriptor *<b>desc</b> of
  * type *<b>type</b> to file $DATADIR/unparseable-desc. Do not write more
  * than one descriptor to disk per minute. If there is already such a
- * file in the data directory, overwrite it. */
+ * file in the data directory, overwrite it.
+ *
+ * Do nothing outside the main thread: we'd need the options to find the
+ * data directory.  When a cpuworker can't parse a consensus, the main
+ * thread parses it again, and dumps it then. */
 static void
 dump_desc(const char *desc, const char *type)
 {
   time_t now = time(NULL);
   tor_assert(desc);
   tor_assert(type);
+  if (!in_main_thread())
+    return;
   if (!last_desc_dumped || last_desc_dumped + 60 < now) {
     char *debugfile = get_datadir_fname("unparseable-desc");
     size_t filelen = 50 + strlen(type) + strlen(desc);
@@ -944,6 +967,10 @@ find_start_of_next_router_or_extrainfo(const char **s_ptr,
  * Returns 0 on success and -1 on failure.  Adds a digest to
  * <b>invalid_digests_out</b> for every entry that was unparseable or
  * invalid. (This may cause duplicate entries.)
+ *
+ * The signatures on router descriptors are checked together, once
+ * everything else has been parsed, so that the RSA work can be spread over
+ * several threads.
  */
 int
 router_parse_list_from_string(const char **s, const char *eos,
@@ -960,6 +987,10 @@ router_parse_list_from_string(const char **s, const char *eos,
   void *elt;
   const char *end, *start;
   int have_extrainfo;
+  smartlist_t *pending_routers = smartlist_new();
+  smartlist_t *pending_starts = smartlist_new();
+  deferred_router_sig_t *pending_sigs = NULL;
+  int n_pending_sigs_allocated = 0;
 
   tor_assert(s);
   tor_assert(*s);
@@ -988,6 +1019,7 @@ router_parse_list_from_string(const char **s, const char *eos,
       break;
 
     elt = NULL;
+    router = NULL;
 
     if (have_extrainfo && want_extrainfo) {
       routerlist_t *rl = router_get_routerlist();
@@ -1000,11 +1032,20 @@ router_parse_list_from_string(const char **s, const char *eos,
         elt = extrainfo;
       }
     } else if (!have_extrainfo && !want_extrainfo) {
+      int n_pending = smartlist_len(pending_routers);
+      if (n_pending == n_pending_sigs_allocated) {
+        n_pending_sigs_allocated = n_pending_sigs_allocated ?
+          n_pending_sigs_allocated * 2 : 64;
+        pending_sigs = tor_reallocarray(pending_sigs,
+                                        n_pending_sigs_allocated,
+                                        sizeof(deferred_router_sig_t));
+      }
       have_raw_digest = router_get_router_hash(*s, end-*s, raw_digest) == 0;
-      router = router_parse_entry_from_string(*s, end,
-                                              saved_location != SAVED_IN_CACHE,
-                                              allow_annotations,
-                                              prepend_annotations, &dl_again);
+      router = router_parse_entry_impl(*s, end,
+                                       saved_location != SAVED_IN_CACHE,
+                                       allow_annotations,
+                                       prepend_annotations, &dl_again,
+                                       &pending_sigs[n_pending]);
       if (router) {
         log_debug(LD_DIR, "Read router '%s', purpose '%s'",
                   router_describe(router),
@@ -1025,10 +1066,51 @@ router_parse_list_from_string(const char **s, const char *eos,
       signed_desc->saved_location = saved_location;
       signed_desc->saved_offset = *s - start;
     }
+    if (router) {
+      smartlist_add(pending_routers, router);
+      smartlist_add(pending_starts, (void*)*s);
+    } else {
+      smartlist_add(dest, elt);
+    }
     *s = end;
-    smartlist_add(dest, elt);
   }
 
+  if (smartlist_len(pending_routers)) {
+    int n_pending = smartlist_len(pending_routers);
+    crypto_pk_checkable_t *checks =
+      tor_calloc(n_pending, sizeof(crypto_pk_checkable_t));
+    int *oks = tor_calloc(n_pending, sizeof(int));
+    int i;
+    for (i = 0; i < n_pending; ++i) {
+      routerinfo_t *ri = smartlist_get(pending_routers, i);
+      checks[i].pk = ri->identity_pkey;
+      checks[i].digest = pending_sigs[i].digest;
+      checks[i].digest_len = DIGEST_LEN;
+      checks[i].sig = pending_sigs[i].sig;
+      checks[i].sig_len = pending_sigs[i].sig_len;
+    }
+    crypto_pk_checksig_batch(oks, checks, n_pending);
+    for (i = 0; i < n_pending; ++i) {
+      routerinfo_t *ri = smartlist_get(pending_routers, i);
+      if (oks[i]) {
+        smartlist_add(dest, ri);
+      } else {
+        /* As when we check the signature while parsing, a descriptor with a
+         * bad signature is one we may try downloading again. */
+        log_warn(LD_DIR, "Error reading router descriptor: invalid "
+                 "signature.");
+        dump_desc(smartlist_get(pending_starts, i), "router descriptor");
+        routerinfo_free(ri);
+      }
+      tor_free(pending_sigs[i].sig);
+    }
+    tor_free(checks);
+    tor_free(oks);
+  }
+  tor_free(pending_sigs);
+  smartlist_free(pending_routers);
+  smartlist_free(pending_starts);
+
   return 0;
 }
 
@@ -1120,6 +1202,23 @@ router_parse_entry_from_string(const char *s, const char *end,
                                int cache_copy, int allow_annotations,
                                const char *prepend_annotations,
                                int *can_dl_again_out)
+{
+  return router_parse_entry_impl(s, end, cache_copy, allow_annotations,
+                                 prepend_annotations, can_dl_again_out,
+                                 NULL);
+}
+
+/** Helper: as router_parse_entry_from_string(), but if
+ * <b>deferred_sig_out</b> is provided, don't check the signature on the
+ * descriptor: instead, store what we would need to check it in
+ * *<b>deferred_sig_out</b>, and leave the checking to the caller.  On
+ * success, the caller must free <b>deferred_sig_out</b>-&gt;sig. */
+static routerinfo_t *
+router_parse_entry_impl(const char *s, const char *end,
+                        int cache_copy, int allow_annotations,
+                        const char *prepend_annotations,
+                        int *can_dl_again_out,
+                        deferred_router_sig_t *deferred_sig_out)
 {
   routerinfo_t *router = NULL;
   char digest[128];
@@ -1554,6 +1653,7 @@ router_parse_entry_from_string(const char *s, const char *end,
                       goto err;
                     });
   policy_expand_private(&router->exit_policy);
+  router->compiled_exit_policy = addr_policy_compile(router->exit_policy);
 
   if ((tok = find_opt_by_keyword(tokens, K_IPV6_POLICY)) && tok->n_args) {
     router->ipv6_exit_policy = parse_short_policy(tok->args[0]);
@@ -1624,9 +1724,19 @@ router_parse_entry_from_string(const char *s, const char *end,
 
   /* We've checked everything that's covered by the hash. */
   can_dl_again = 1;
-  if (check_signature_token(digest, DIGEST_LEN, tok, router->identity_pkey, 0,
-                            "router descriptor") < 0)
+  if (deferred_sig_out) {
+    if (strcmp(tok->object_type, "SIGNATURE")) {
+      log_warn(LD_DIR, "Bad object type on router descriptor signature");
+      goto err;
+    }
+    memcpy(deferred_sig_out->digest, digest, DIGEST_LEN);
+    deferred_sig_out->sig = tor_memdup(tok->object_body, tok->object_size);
+    deferred_sig_out->sig_len = tok->object_size;
+  } else if (check_signature_token(digest, DIGEST_LEN, tok,
+                                   router->identity_pkey, 0,
+                                   "router descriptor") < 0) {
     goto err;
+  }
 
   if (!router->platform) {
     router->platform = tor_strdup("<unknown>");
@@ -2140,6 +2250,150 @@ routerstatus_parse_guardfraction(const char *guardfraction_str,
   return 0;
 }
 
+/** Helper: set the version fields of <b>rs</b> from <b>version</b>, the
+ * argument of its "v" line. */
+static void
+routerstatus_set_version(routerstatus_t *rs, const char *version)
+{
+  rs->version_known = 1;
+  if (!strcmpstart(version, "Tor ")) {
+    rs->version_supports_extend2_cells =
+      tor_version_as_new_as(version, "0.2.4.8-alpha");
+  }
+}
+
+/** Helper for lazy routerstatus parsing.  Look at the lines of the
+ * routerstatus entry from <b>s</b> up to <b>eos</b>, and find its "v" and
+ * "p" lines, which most users of a consensus never look at.  If there are
+ * any, copy every other line into <b>area</b>, and set *<b>eager_out</b>
+ * and *<b>eager_eos_out</b> to the start and end of the copy.  Copy the
+ * arguments of the "v" and "p" lines into <b>lazy_area</b>, in the format
+ * described for routerstatus_t.lazy_lines, and set *<b>lazy_out</b> to the
+ * copy.  Return 0 on success.
+ *
+ * Return -1, and leave the outputs alone, if there is nothing to put off or
+ * if there's anything unusual about the entry that tokenizing it all at
+ * once would notice, so that the caller will parse it the usual way. */
+static int
+routerstatus_split_lazy_lines(memarea_t *area, memarea_t *lazy_area,
+                              const char *s, const char *eos,
+                              const char **eager_out,
+                              const char **eager_eos_out,
+                              const char **lazy_out)
+{
+  const char *line, *next, *eol, *arg;
+  size_t eager_len = 0, lazy_len = 0;
+  int n_v = 0, n_p = 0;
+  char *eager, *lazy, *ecp, *lcp;
+
+  if (memchr(s, '\0', eos-s))
+    return -1;
+
+  /* First pass: decide whether we can split this entry, and how much room
+   * we'll need. */
+  for (line = s; line < eos; line = next) {
+    eol = memchr(line, '\n', eos-line);
+    next = eol ? eol+1 : eos;
+    if (!eol)
+      eol = eos;
+    if (eol - line >= 2 && (line[0] == 'v' || line[0] == 'p') &&
+        line[1] == ' ') {
+      arg = eat_whitespace_eos_no_nl(line+1, eol);
+      if (arg == eol)
+        return -1; /* Too few arguments. */
+      if (line[0] == 'v') {
+        ++n_v;
+      } else {
+        ++n_p;
+        if (eol-arg < 7 || (fast_memcmp(arg, "accept ", 7) &&
+                            fast_memcmp(arg, "reject ", 7)))
+          return -1; /* Unknown policy summary type. */
+      }
+      lazy_len += (eol-arg) + 2;
+    } else if (!strcmpstart(line, "opt ") || !strcmpstart(line, "-----")) {
+      return -1; /* Might be another "v" or "p", or an object. */
+    } else {
+      eager_len += next-line;
+    }
+  }
+  if (n_v > 1 || n_p > 1)
+    return -1; /* Too many. */
+  if (n_v + n_p == 0)
+    return -1; /* Nothing to do. */
+
+  /* Second pass: copy the lines where they go. */
+  ecp = eager = memarea_alloc(area, eager_len+1);
+  lcp = lazy = memarea_alloc(lazy_area, lazy_len+1);
+  for (line = s; line < eos; line = next) {
+    eol = memchr(line, '\n', eos-line);
+    next = eol ? eol+1 : eos;
+    if (!eol)
+      eol = eos;
+    if (eol - line >= 2 && (line[0] == 'v' || line[0] == 'p') &&
+        line[1] == ' ') {
+      arg = eat_whitespace_eos_no_nl(line+1, eol);
+      *lcp++ = line[0];
+      memcpy(lcp, arg, eol-arg);
+      lcp += eol-arg;
+      *lcp++ = '\0';
+    } else {
+      memcpy(ecp, line, next-line);
+      ecp += next-line;
+    }
+  }
+  *ecp = '\0';
+  *lcp = '\0';
+  tor_assert(ecp == eager + eager_len);
+  tor_assert(lcp == lazy + lazy_len);
+
+  *eager_out = eager;
+  *eager_eos_out = ecp;
+  *lazy_out = lazy;
+  return 0;
+}
+
+/** If we put off decoding the "v" and "p" lines of <b>rs</b> when we parsed
+ * its consensus, decode them now. */
+void
+routerstatus_decode_lazy_fields(routerstatus_t *rs)
+{
+  const char *cp = rs->lazy_lines;
+  if (!cp)
+    return;
+  rs->lazy_lines = NULL;
+
+  for ( ; *cp; cp += strlen(cp)+1) {
+    if (cp[0] == 'v') {
+      routerstatus_set_version(rs, cp+1);
+    } else if (cp[0] == 'p') {
+      tor_free(rs->exitsummary);
+      rs->exitsummary = tor_strdup(cp+1);
+      rs->has_exitsummary = 1;
+    }
+  }
+}
+
+/** Return true iff neither <b>a</b> nor <b>b</b> has had its "v" and "p"
+ * lines decoded yet, and those lines are identical, so that decoding them
+ * would give identical results. */
+int
+routerstatus_lazy_fields_eq(const routerstatus_t *a, const routerstatus_t *b)
+{
+  const char *cpa = a->lazy_lines, *cpb = b->lazy_lines;
+  if (!cpa || !cpb)
+    return 0;
+
+  for (;;) {
+    size_t len_a = strlen(cpa), len_b = strlen(cpb);
+    if (len_a != len_b || fast_memneq(cpa, cpb, len_a))
+      return 0;
+    if (!len_a)
+      return 1;
+    cpa += len_a+1;
+    cpb += len_b+1;
+  }
+}
+
 /** Given a string at *<b>s</b>, containing a routerstatus object, and an
  * empty smartlist at <b>tokens</b>, parse and return the first router status
  * object in the string, and advance *<b>s</b> to just after the end of the
@@ -2153,6 +2407,10 @@ routerstatus_parse_guardfraction(const char *guardfraction_str,
  * make that consensus.
  *
  * Parse according to the syntax used by the consensus flavor <b>flav</b>.
+ *
+ * If <b>lazy_area</b> is provided and this is a consensus entry, don't
+ * decode the "v" and "p" lines yet: keep copies of them in <b>lazy_area</b>
+ * for routerstatus_decode_lazy_fields().
  **/
 static routerstatus_t *
 routerstatus_parse_entry_from_string(memarea_t *area,
@@ -2160,9 +2418,11 @@ routerstatus_parse_entry_from_string(memarea_t *area,
                                      networkstatus_t *vote,
                                      vote_routerstatus_t *vote_rs,
                                      int consensus_method,
-                                     consensus_flavor_t flav)
+                                     consensus_flavor_t flav,
+                                     memarea_t *lazy_area)
 {
   const char *eos, *s_dup = *s;
+  const char *tok_start, *tok_eos, *lazy_lines = NULL;
   routerstatus_t *rs = NULL;
   directory_token_t *tok;
   char timebuf[ISO_TIME_LEN+1];
@@ -2177,7 +2437,14 @@ routerstatus_parse_entry_from_string(memarea_t *area,
 
   eos = find_start_of_next_routerstatus(*s);
 
-  if (tokenize_string(area,*s, eos, tokens, rtrstatus_token_table,0)) {
+  tok_start = *s;
+  tok_eos = eos;
+  if (lazy_area && !vote)
+    routerstatus_split_lazy_lines(area, lazy_area, *s, eos,
+                                  &tok_start, &tok_eos, &lazy_lines);
+
+  if (tokenize_string(area, tok_start, tok_eos, tokens,
+                      rtrstatus_token_table, 0)) {
     log_warn(LD_DIR, "Error tokenizing router status");
     goto err;
   }
@@ -2200,6 +2467,7 @@ routerstatus_parse_entry_from_string(memarea_t *area,
     rs = &vote_rs->status;
   } else {
     rs = tor_malloc_zero(sizeof(routerstatus_t));
+    rs->lazy_lines = lazy_lines;
   }
 
   if (!is_legal_nickname(tok->args[0])) {
@@ -2299,12 +2567,7 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   }
   if ((tok = find_opt_by_keyword(tokens, K_V))) {
     tor_assert(tok->n_args == 1);
-    rs->version_known = 1;
-    if (strcmpstart(tok->args[0], "Tor ")) {
-    } else {
-      rs->version_supports_extend2_cells =
-        tor_version_as_new_as(tok->args[0], "0.2.4.8-alpha");
-    }
+    routerstatus_set_version(rs, tok->args[0]);
     if (vote_rs) {
       vote_rs->version = tor_strdup(tok->args[0]);
     }
@@ -2831,6 +3094,19 @@ networkstatus_verify_bw_weights(networkstatus_t *ns, int consensus_method)
 networkstatus_t *
 networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
                                      networkstatus_type_t ns_type)
+{
+  return networkstatus_parse_vote_from_string_impl(s, eos_out, ns_type,
+                                          get_options()->TestingTorNetwork);
+}
+
+/** As networkstatus_parse_vote_from_string(), but take the value of the
+ * TestingTorNetwork option as <b>testing_tor_network</b> instead of reading
+ * it, so that a cpuworker can call this without touching the options. */
+networkstatus_t *
+networkstatus_parse_vote_from_string_impl(const char *s,
+                                          const char **eos_out,
+                                          networkstatus_type_t ns_type,
+                                          int testing_tor_network)
 {
   smartlist_t *tokens = smartlist_new();
   smartlist_t *rs_tokens = NULL, *footer_tokens = NULL;
@@ -2961,13 +3237,13 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
   if (!ok)
     goto err;
   if (ns->valid_after +
-      (get_options()->TestingTorNetwork ?
+      (testing_tor_network ?
        MIN_VOTE_INTERVAL_TESTING : MIN_VOTE_INTERVAL) > ns->fresh_until) {
     log_warn(LD_DIR, "Vote/consensus freshness interval is too short");
     goto err;
   }
   if (ns->valid_after +
-      (get_options()->TestingTorNetwork ?
+      (testing_tor_network ?
        MIN_VOTE_INTERVAL_TESTING : MIN_VOTE_INTERVAL)*2 > ns->valid_until) {
     log_warn(LD_DIR, "Vote/consensus liveness interval is too short");
     goto err;
@@ -3173,12 +3449,14 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
   rs_area = memarea_new();
   s = end_of_header;
   ns->routerstatus_list = smartlist_new();
+  if (ns->type == NS_TYPE_CONSENSUS)
+    ns->lazy_rs_area = memarea_new();
 
   while (!strcmpstart(s, "r ")) {
     if (ns->type != NS_TYPE_CONSENSUS) {
       vote_routerstatus_t *rs = tor_malloc_zero(sizeof(vote_routerstatus_t));
       if (routerstatus_parse_entry_from_string(rs_area, &s, rs_tokens, ns,
-                                               rs, 0, 0))
+                                               rs, 0, 0, NULL))
         smartlist_add(ns->routerstatus_list, rs);
       else {
         tor_free(rs->version);
@@ -3189,7 +3467,8 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
       if ((rs = routerstatus_parse_entry_from_string(rs_area, &s, rs_tokens,
                                                      NULL, NULL,
                                                      ns->consensus_method,
-                                                     flav)))
+                                                     flav,
+                                                     ns->lazy_rs_area)))
         smartlist_add(ns->routerstatus_list, rs);
     }
   }
@@ -3990,6 +4269,157 @@ token_check_object(memarea_t *area, const char *kwd,
   return tok;
 }
 
+/** Marks an empty slot in a token_table_index_t. */
+#define TOKEN_INDEX_EMPTY 0xff
+/** Most slots that a token_table_index_t may use. */
+#define TOKEN_INDEX_MAX_SLOTS 256
+
+/** A perfect hash of the keywords in a token table, so that get_next_token()
+ * can find a keyword with one hash and one comparison instead of trying
+ * every entry in the table. */
+typedef struct token_table_index_t {
+  /** The table that this index is for. */
+  const token_rule_t *table;
+  /** A seed for token_keyword_hash() under which no two keywords in
+   * <b>table</b> collide. */
+  uint32_t seed;
+  /** The number of slots we use, minus one. */
+  uint32_t mask;
+  /** For each slot, the position in <b>table</b> of the keyword that hashes
+   * to it, or TOKEN_INDEX_EMPTY. */
+  uint8_t slots[TOKEN_INDEX_MAX_SLOTS];
+} token_table_index_t;
+
+/** Indices for every token table we know about; filled in by
+ * routerparse_init(). */
+static token_table_index_t token_table_indices[16];
+/** How many entries of token_table_indices are in use? */
+static int n_token_table_indices = 0;
+
+/** Return a hash of the <b>len</b>-byte keyword at <b>s</b>, using
+ * <b>seed</b>. */
+static INLINE uint32_t
+token_keyword_hash(uint32_t seed, const char *s, size_t len)
+{
+  uint32_t h = seed ^ (uint32_t)len;
+  while (len--) {
+    h ^= (uint8_t) *s++;
+    h *= 0x01000193;
+  }
+  return h ^ (h >> 16);
+}
+
+/** Try to build a collision-free index for <b>table</b> in <b>index</b>.
+ * Return 0 on success and -1 if we couldn't find one. */
+static int
+token_table_index_build(token_table_index_t *index,
+                        const token_rule_t *table)
+{
+  uint32_t n_slots, seed;
+  int n, i;
+
+  for (n = 0; table[n].t; ++n)
+    ;
+  if (n >= TOKEN_INDEX_EMPTY)
+    return -1;
+
+  for (n_slots = 16; n_slots < 4*(uint32_t)n; n_slots <<= 1)
+    ;
+  for ( ; n_slots <= TOKEN_INDEX_MAX_SLOTS; n_slots <<= 1) {
+    for (seed = 1; seed < 65536; ++seed) {
+      memset(index->slots, TOKEN_INDEX_EMPTY, sizeof(index->slots));
+      for (i = 0; i < n; ++i) {
+        const char *kwd = table[i].t;
+        uint32_t slot = token_keyword_hash(seed, kwd, strlen(kwd)) &
+          (n_slots - 1);
+        if (index->slots[slot] == TOKEN_INDEX_EMPTY)
+          index->slots[slot] = (uint8_t) i;
+        else if (strcmp(table[index->slots[slot]].t, kwd))
+          break; /* A real collision; try another seed. */
+        /* Otherwise it's a repeated keyword: the first one wins, as it
+         * would in a linear search. */
+      }
+      if (i == n) {
+        index->table = table;
+        index->seed = seed;
+        index->mask = n_slots - 1;
+        return 0;
+      }
+    }
+  }
+  return -1;
+}
+
+/** Return the index for <b>table</b>, or NULL if we haven't built one. */
+static INLINE const token_table_index_t *
+token_table_index_get(const token_rule_t *table)
+{
+  int i;
+  for (i = 0; i < n_token_table_indices; ++i) {
+    if (token_table_indices[i].table == table)
+      return &token_table_indices[i];
+  }
+  return NULL;
+}
+
+/** Return the position in <b>table</b> of the <b>len</b>-byte keyword at
+ * <b>s</b>, or -1 if there is no such keyword in <b>table</b>. */
+static INLINE int
+token_table_find(const token_rule_t *table, const char *s, size_t len)
+{
+  const token_table_index_t *index = token_table_index_get(table);
+  int i;
+
+  if (index) {
+    i = index->slots[token_keyword_hash(index->seed, s, len) & index->mask];
+    if (i != TOKEN_INDEX_EMPTY && !strcmp_len(s, table[i].t, len))
+      return i;
+    return -1;
+  }
+
+  for (i = 0; table[i].t ; ++i) {
+    if (!strcmp_len(s, table[i].t, len))
+      return i;
+  }
+  return -1;
+}
+
+/** Build the keyword indices for all of our token tables.  This must be
+ * called from the main thread before any other thread parses a
+ * document; until it is called, we look keywords up the slow way. */
+void
+routerparse_init(void)
+{
+  token_rule_t *tables[] = {
+    rtrstatus_token_table,
+    microdesc_token_table,
+    routerdesc_token_table,
+    extrainfo_token_table,
+    networkstatus_token_table,
+    networkstatus_consensus_token_table,
+    networkstatus_vote_footer_token_table,
+    networkstatus_detached_signature_token_table,
+    dir_key_certificate_table,
+    desc_token_table,
+    ipo_token_table,
+    client_keys_token_table,
+  };
+  unsigned i;
+
+  if (n_token_table_indices)
+    return;
+
+  for (i = 0; i < ARRAY_LENGTH(tables); ++i) {
+    token_table_index_t *index = &token_table_indices[n_token_table_indices];
+    tor_assert(n_token_table_indices < (int)ARRAY_LENGTH(token_table_indices));
+    if (token_table_index_build(index, tables[i]) == 0)
+      ++n_token_table_indices;
+    else
+      log_info(LD_BUG, "Couldn't build a keyword index for a token table; "
+               "using linear search for it instead.");
+  }
+}
+
 /** Helper: parse space-separated arguments from the string <b>s</b> ending at
  * <b>eol</b>, and store them in the args field of <b>tok</b>.  Store the
  * number of parsed elements into the n_args field of <b>tok</b>.  Allocate
@@ -4003,14 +4433,15 @@ get_token_arguments(memarea_t *area, directory_token_t *tok,
 #define MAX_ARGS 512
   char *mem = memarea_strndup(area, s, eol-s);
   char *cp = mem;
+  const char *end = mem + strlen(mem);
   int j = 0;
   char *args[MAX_ARGS];
   while (*cp) {
     if (j == MAX_ARGS)
       return -1;
     args[j++] = cp;
-    cp = (char*)find_whitespace(cp);
-    if (!cp || !*cp)
+    cp = (char*)find_whitespace_eos(cp, end);
+    if (!*cp)
       break; /* End of the line. */
     *cp++ = '\0';
     cp = (char*)eat_whitespace(cp);
@@ -4068,38 +4499,35 @@ get_next_token(memarea_t *area,
     RET_ERR("Unexpected EOF");
   }
 
-  /* Search the table for the appropriate entry.  (I tried a binary search
-   * instead, but it wasn't any faster.) */
-  for (i = 0; table[i].t ; ++i) {
-    if (!strcmp_len(*s, table[i].t, next-*s)) {
-      /* We've found the keyword. */
-      kwd = table[i].t;
-      tok->tp = table[i].v;
-      o_syn = table[i].os;
-      *s = eat_whitespace_eos_no_nl(next, eol);
-      /* We go ahead whether there are arguments or not, so that tok->args is
-       * always set if we want arguments. */
-      if (table[i].concat_args) {
-        /* The keyword takes the line as a single argument */
-        tok->args = ALLOC(sizeof(char*));
-        tok->args[0] = STRNDUP(*s,eol-*s); /* Grab everything on line */
-        tok->n_args = 1;
-      } else {
-        /* This keyword takes multiple arguments. */
-        if (get_token_arguments(area, tok, *s, eol)<0) {
-          tor_snprintf(ebuf, sizeof(ebuf),"Far too many arguments to %s", kwd);
-          RET_ERR(ebuf);
-        }
-        *s = eol;
-      }
-      if (tok->n_args < table[i].min_args) {
-        tor_snprintf(ebuf, sizeof(ebuf), "Too few arguments to %s", kwd);
-        RET_ERR(ebuf);
-      } else if (tok->n_args > table[i].max_args) {
-        tor_snprintf(ebuf, sizeof(ebuf), "Too many arguments to %s", kwd);
+  /* Look up the keyword in the table. */
+  i = token_table_find(table, *s, next-*s);
+  if (i >= 0) {
+    /* We've found the keyword. */
+    kwd = table[i].t;
+    tok->tp = table[i].v;
+    o_syn = table[i].os;
+    *s = eat_whitespace_eos_no_nl(next, eol);
+    /* We go ahead whether there are arguments or not, so that tok->args is
+     * always set if we want arguments. */
+    if (table[i].concat_args) {
+      /* The keyword takes the line as a single argument */
+      tok->args = ALLOC(sizeof(char*));
+      tok->args[0] = STRNDUP(*s,eol-*s); /* Grab everything on line */
+      tok->n_args = 1;
+    } else {
+      /* This keyword takes multiple arguments. */
+      if (get_token_arguments(area, tok, *s, eol)<0) {
+        tor_snprintf(ebuf, sizeof(ebuf),"Far too many arguments to %s", kwd);
         RET_ERR(ebuf);
       }
-      break;
+      *s = eol;
+    }
+    if (tok->n_args < table[i].min_args) {
+      tor_snprintf(ebuf, sizeof(ebuf), "Too few arguments to %s", kwd);
+      RET_ERR(ebuf);
+    } else if (tok->n_args > table[i].max_args) {
+      tor_snprintf(ebuf, sizeof(ebuf), "Too many arguments to %s", kwd);
+      RET_ERR(ebuf);
     }
   }
 
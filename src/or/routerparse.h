@@ -51,12 +51,20 @@ int tor_version_same_series(tor_version_t *a, tor_version_t *b);
 void sort_version_list(smartlist_t *lst, int remove_duplicates);
 void assert_addr_policy_ok(smartlist_t *t);
 void dump_distinct_digest_count(int severity);
+void routerparse_init(void);
+void routerstatus_decode_lazy_fields(routerstatus_t *rs);
+int routerstatus_lazy_fields_eq(const routerstatus_t *a,
+                                const routerstatus_t *b);
 
 int compare_vote_routerstatus_entries(const void **_a, const void **_b);
 int networkstatus_verify_bw_weights(networkstatus_t *ns, int);
 networkstatus_t *networkstatus_parse_vote_from_string(const char *s,
                                                  const char **eos_out,
                                                  networkstatus_type_t ns_type);
+networkstatus_t *networkstatus_parse_vote_from_string_impl(const char *s,
+                                                 const char **eos_out,
+                                                 networkstatus_type_t ns_type,
+                                                 int testing_tor_network);
 ns_detached_signatures_t *networkstatus_parse_detached_signatures(
                                           const char *s, const char *eos);
 
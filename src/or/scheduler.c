@@ -21,6 +21,16 @@
 #include <event.h>
 #endif
 
+#if defined(HAVE_SYS_IOCTL_H) && defined(HAVE_NETINET_TCP_H) && \
+  defined(HAVE_LINUX_SOCKIOS_H)
+#include <sys/ioctl.h>
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
+#if defined(TCP_INFO) && defined(SIOCOUTQ)
+#define HAVE_KIST_SUPPORT
+#endif
+#endif
+
 /*
  * Scheduler high/low watermarks
  */
@@ -36,6 +46,18 @@ static uint32_t sched_q_high_water = 32768;
 
 static uint32_t sched_max_flush_cells = 16;
 
+/*
+ * Kernel-informed socket transport (KIST) scheduling: if enabled, we run
+ * the scheduler every sched_kist_run_interval msec instead of as soon as
+ * a channel becomes pending, and each time we write no more to a channel
+ * than its socket can send before the next run, so that cells wait in
+ * our circuit queues (where EWMA can prioritize them) instead of in the
+ * kernel.
+ */
+
+STATIC int sched_kist_enabled = 0;
+static int sched_kist_run_interval = 10;
+
 /*
  * Write scheduling works by keeping track of which channels can
  * accept cells, and have cells to write.  From the scheduler's perspective,
@@ -116,6 +138,30 @@ static uint32_t sched_max_flush_cells = 16;
 /* Pqueue of channels that can write and have cells (pending work) */
 STATIC smartlist_t *channels_pending = NULL;
 
+/*
+ * Alternatively, the pending channels can live in an array of buckets,
+ * indexed by the quantized log of their circuitmux priority (see
+ * scheduler_priority_to_bucket()), with a bitmap of which buckets are
+ * non-empty.  Adding, removing and popping the most preferred channel are
+ * all constant-time, and no comparisons between channels are needed.
+ * Channels in the same bucket are served in FIFO order.
+ */
+
+TOR_TAILQ_HEAD(sched_bucket_s, channel_s);
+
+/* Which of the above holds the pending channels */
+STATIC scheduler_queue_type_t sched_queue_type = SCHEDULER_QUEUE_HEAP;
+
+/* Array of SCHEDULER_N_BUCKETS buckets of pending channels */
+STATIC struct sched_bucket_s *sched_buckets = NULL;
+
+/* Bit i is set iff sched_buckets[i] is non-empty */
+#define SCHED_BUCKET_MAP_WORDS (SCHEDULER_N_BUCKETS / 64)
+static uint64_t sched_bucket_map[SCHED_BUCKET_MAP_WORDS];
+
+/* Number of channels in sched_buckets */
+static int sched_n_bucketed = 0;
+
 /*
  * This event runs the scheduler from its callback, and is manually
  * activated whenever a channel enters open for writes/cells to send.
@@ -167,6 +213,10 @@ scheduler_free_all(void)
     smartlist_free(channels_pending);
     channels_pending = NULL;
   }
+
+  tor_free(sched_buckets);
+  memset(sched_bucket_map, 0, sizeof(sched_bucket_map));
+  sched_n_bucketed = 0;
 }
 
 /**
@@ -215,6 +265,163 @@ scheduler_compare_channels, (const void *c1_v, const void *c2_v))
   }
 }
 
+/**
+ * Map a circuitmux priority to a bucket index: bucket 0 holds everything
+ * below 1.0, and above that each doubling of the priority is split into
+ * 1<<SCHEDULER_BUCKET_FRAC_BITS buckets, up to SCHEDULER_N_BUCKETS - 1.
+ */
+
+STATIC int
+scheduler_priority_to_bucket(double priority)
+{
+  uint64_t v;
+  int lg, idx;
+
+  /* This also catches NaN */
+  if (!(priority >= 1.0))
+    return 0;
+  if (priority >= (double)(U64_LITERAL(1) << 62))
+    return SCHEDULER_N_BUCKETS - 1;
+
+  v = (uint64_t)priority;
+  lg = tor_log2(v);
+  /* Use the bits just below the leading one to pick the sub-bucket */
+  if (lg >= SCHEDULER_BUCKET_FRAC_BITS)
+    v >>= (lg - SCHEDULER_BUCKET_FRAC_BITS);
+  else
+    v <<= (SCHEDULER_BUCKET_FRAC_BITS - lg);
+  idx = 1 + (lg << SCHEDULER_BUCKET_FRAC_BITS) +
+    (int)(v & ((1 << SCHEDULER_BUCKET_FRAC_BITS) - 1));
+
+  return MIN(idx, SCHEDULER_N_BUCKETS - 1);
+}
+
+/**
+ * Return the bucket a pending channel belongs in
+ */
+
+MOCK_IMPL(STATIC int,
+scheduler_get_channel_bucket, (channel_t *chan))
+{
+  tor_assert(chan);
+
+  return scheduler_priority_to_bucket(circuitmux_get_priority(chan->cmux));
+}
+
+/** Add a channel to the given bucket */
+
+static void
+scheduler_bucket_add(channel_t *chan, int bucket)
+{
+  tor_assert(sched_buckets);
+  tor_assert(bucket >= 0 && bucket < SCHEDULER_N_BUCKETS);
+
+  chan->sched_bucket = bucket;
+  TOR_TAILQ_INSERT_TAIL(&sched_buckets[bucket], chan, sched_bucket_link);
+  sched_bucket_map[bucket >> 6] |= U64_LITERAL(1) << (bucket & 63);
+  ++sched_n_bucketed;
+}
+
+/** Remove a channel from its bucket */
+
+static void
+scheduler_bucket_remove(channel_t *chan)
+{
+  int bucket = chan->sched_bucket;
+
+  tor_assert(sched_buckets);
+  tor_assert(bucket >= 0 && bucket < SCHEDULER_N_BUCKETS);
+
+  TOR_TAILQ_REMOVE(&sched_buckets[bucket], chan, sched_bucket_link);
+  if (TOR_TAILQ_EMPTY(&sched_buckets[bucket]))
+    sched_bucket_map[bucket >> 6] &= ~(U64_LITERAL(1) << (bucket & 63));
+  chan->sched_bucket = -1;
+  --sched_n_bucketed;
+}
+
+/** Remove and return the first channel in the lowest non-empty bucket, or
+ * NULL if there are none. */
+
+static channel_t *
+scheduler_bucket_pop(void)
+{
+  channel_t *chan;
+  uint64_t word;
+  int i;
+
+  for (i = 0; i < SCHED_BUCKET_MAP_WORDS; ++i) {
+    word = sched_bucket_map[i];
+    if (word) {
+      /* Isolate the lowest set bit */
+      word &= ~word + 1;
+      chan = TOR_TAILQ_FIRST(&sched_buckets[i * 64 + tor_log2(word)]);
+      tor_assert(chan);
+      scheduler_bucket_remove(chan);
+      return chan;
+    }
+  }
+
+  return NULL;
+}
+
+/** Add a channel to the pending queue */
+
+static void
+scheduler_pending_add(channel_t *chan)
+{
+  if (sched_queue_type == SCHEDULER_QUEUE_BUCKETS) {
+    scheduler_bucket_add(chan, scheduler_get_channel_bucket(chan));
+  } else {
+    smartlist_pqueue_add(channels_pending,
+                         scheduler_compare_channels,
+                         STRUCT_OFFSET(channel_t, sched_heap_idx),
+                         chan);
+  }
+}
+
+/** Remove a channel from the pending queue */
+
+static void
+scheduler_pending_remove(channel_t *chan)
+{
+  if (sched_queue_type == SCHEDULER_QUEUE_BUCKETS) {
+    scheduler_bucket_remove(chan);
+  } else {
+    smartlist_pqueue_remove(channels_pending,
+                            scheduler_compare_channels,
+                            STRUCT_OFFSET(channel_t, sched_heap_idx),
+                            chan);
+  }
+}
+
+/** Remove and return the most preferred pending channel, or NULL if there
+ * are none. */
+
+STATIC channel_t *
+scheduler_pending_pop(void)
+{
+  if (sched_queue_type == SCHEDULER_QUEUE_BUCKETS) {
+    return scheduler_bucket_pop();
+  } else if (smartlist_len(channels_pending) > 0) {
+    return smartlist_pqueue_pop(channels_pending,
+                                scheduler_compare_channels,
+                                STRUCT_OFFSET(channel_t, sched_heap_idx));
+  } else {
+    return NULL;
+  }
+}
+
+/** Return the number of pending channels */
+
+STATIC int
+scheduler_n_pending(void)
+{
+  if (sched_queue_type == SCHEDULER_QUEUE_BUCKETS)
+    return sched_n_bucketed;
+  else
+    return smartlist_len(channels_pending);
+}
+
 /*
  * Scheduler event callback; this should get triggered once per event loop
  * if any scheduling work was created during the event loop.
@@ -253,10 +460,7 @@ scheduler_channel_doesnt_want_writes,(channel_t *chan))
      * the other lists.  It can't write any more, so it goes to
      * channels_waiting_to_write.
      */
-    smartlist_pqueue_remove(channels_pending,
-                            scheduler_compare_channels,
-                            STRUCT_OFFSET(channel_t, sched_heap_idx),
-                            chan);
+    scheduler_pending_remove(chan);
     chan->scheduler_state = SCHED_CHAN_WAITING_TO_WRITE;
     log_debug(LD_SCHED,
               "Channel " U64_FORMAT " at %p went from pending "
@@ -295,10 +499,7 @@ scheduler_channel_has_waiting_cells,(channel_t *chan))
      * channels_pending.
      */
     chan->scheduler_state = SCHED_CHAN_PENDING;
-    smartlist_pqueue_add(channels_pending,
-                         scheduler_compare_channels,
-                         STRUCT_OFFSET(channel_t, sched_heap_idx),
-                         chan);
+    scheduler_pending_add(chan);
     log_debug(LD_SCHED,
               "Channel " U64_FORMAT " at %p went from waiting_for_cells "
               "to pending",
@@ -331,6 +532,8 @@ scheduler_channel_has_waiting_cells,(channel_t *chan))
 void
 scheduler_init(void)
 {
+  int i;
+
   log_debug(LD_SCHED, "Initting scheduler");
 
   tor_assert(!run_sched_ev);
@@ -338,6 +541,12 @@ scheduler_init(void)
                                0, scheduler_evt_callback, NULL);
 
   channels_pending = smartlist_new();
+  sched_buckets = tor_calloc(SCHEDULER_N_BUCKETS, sizeof(*sched_buckets));
+  for (i = 0; i < SCHEDULER_N_BUCKETS; ++i) {
+    TOR_TAILQ_INIT(&sched_buckets[i]);
+  }
+  memset(sched_bucket_map, 0, sizeof(sched_bucket_map));
+  sched_n_bucketed = 0;
   queue_heuristic = 0;
   queue_heuristic_timestamp = approx_time();
 }
@@ -350,7 +559,7 @@ scheduler_more_work(void)
   tor_assert(channels_pending);
 
   return ((scheduler_get_queue_heuristic() < sched_q_low_water) &&
-          ((smartlist_len(channels_pending) > 0))) ? 1 : 0;
+          ((scheduler_n_pending() > 0))) ? 1 : 0;
 }
 
 /** Retrigger the scheduler in a way safe to use from the callback */
@@ -358,8 +567,94 @@ scheduler_more_work(void)
 static void
 scheduler_retrigger(void)
 {
+  struct timeval tv;
+
   tor_assert(run_sched_ev);
-  event_active(run_sched_ev, EV_TIMEOUT, 1);
+
+  if (sched_kist_enabled) {
+    /* Run on the next tick, unless we're already going to */
+    if (!event_pending(run_sched_ev, EV_TIMEOUT, NULL)) {
+      tv.tv_sec = sched_kist_run_interval / 1000;
+      tv.tv_usec = (sched_kist_run_interval % 1000) * 1000;
+      event_add(run_sched_ev, &tv);
+    }
+  } else {
+    event_active(run_sched_ev, EV_TIMEOUT, 1);
+  }
+}
+
+/**
+ * Ask the kernel how many more bytes it can usefully take on socket
+ * <b>s</b> before our next run: whatever fits in the unused part of the
+ * congestion window, plus enough to keep one congestion window's worth
+ * of unsent data queued behind it.  On success, set *<b>limit_out</b>
+ * and return 0; return -1 if we can't tell on this platform or socket.
+ */
+
+STATIC int
+scheduler_kist_socket_limit(tor_socket_t s, size_t *limit_out)
+{
+#ifdef HAVE_KIST_SUPPORT
+  struct tcp_info tcp;
+  socklen_t tcp_len = sizeof(tcp);
+  int outq = 0;
+  int64_t cwnd_bytes, unacked_bytes, tcp_space, notsent, extra_space;
+
+  tor_assert(limit_out);
+
+  if (getsockopt(s, IPPROTO_TCP, TCP_INFO, (void *)&tcp, &tcp_len) < 0)
+    return -1;
+  if (ioctl(s, SIOCOUTQ, &outq) < 0)
+    return -1;
+
+  cwnd_bytes = ((int64_t)tcp.tcpi_snd_cwnd) * tcp.tcpi_snd_mss;
+  unacked_bytes = ((int64_t)tcp.tcpi_unacked) * tcp.tcpi_snd_mss;
+
+  /* Room left in the congestion window */
+  tcp_space = cwnd_bytes - unacked_bytes;
+  if (tcp_space < 0) tcp_space = 0;
+  /* Bytes in the send buffer that haven't gone out yet */
+  notsent = outq - unacked_bytes;
+  if (notsent < 0) notsent = 0;
+  /* Top the unsent data up to one more window, so the kernel doesn't go
+   * idle before we run again */
+  extra_space = cwnd_bytes - notsent;
+  if (extra_space < 0) extra_space = 0;
+
+  *limit_out = (size_t)(tcp_space + extra_space);
+  return 0;
+#else
+  (void)s;
+  (void)limit_out;
+  return -1;
+#endif
+}
+
+/**
+ * Return how many cells KIST will let us write to <b>chan</b> on this run,
+ * after subtracting what is already waiting in its lower layer's output
+ * buffer, or INT_MAX if we can't ask the kernel about this channel.
+ */
+
+MOCK_IMPL(STATIC int,
+scheduler_kist_cells_writeable, (channel_t *chan))
+{
+  tor_socket_t s;
+  size_t limit = 0, queued;
+  size_t cell_network_size;
+
+  tor_assert(chan);
+
+  s = channel_get_socket(chan);
+  if (!SOCKET_OK(s) || scheduler_kist_socket_limit(s, &limit) < 0)
+    return INT_MAX;
+
+  queued = channel_num_bytes_queued(chan);
+  if (limit <= queued)
+    return 0;
+
+  cell_network_size = get_cell_network_size(chan->wide_circ_ids);
+  return (int) MIN((limit - queued) / cell_network_size, INT_MAX);
 }
 
 /** Notify the scheduler of a channel being closed */
@@ -371,10 +666,7 @@ scheduler_release_channel,(channel_t *chan))
   tor_assert(channels_pending);
 
   if (chan->scheduler_state == SCHED_CHAN_PENDING) {
-    smartlist_pqueue_remove(channels_pending,
-                            scheduler_compare_channels,
-                            STRUCT_OFFSET(channel_t, sched_heap_idx),
-                            chan);
+    scheduler_pending_remove(chan);
   }
 
   chan->scheduler_state = SCHED_CHAN_IDLE;
@@ -385,7 +677,7 @@ scheduler_release_channel,(channel_t *chan))
 MOCK_IMPL(void,
 scheduler_run, (void))
 {
-  int n_cells, n_chans_before, n_chans_after;
+  int n_cells, kist_cells, n_chans_before, n_chans_after;
   uint64_t q_len_before, q_heur_before, q_len_after, q_heur_after;
   ssize_t flushed, flushed_this_time;
   smartlist_t *to_readd = NULL;
@@ -394,20 +686,32 @@ scheduler_run, (void))
   log_debug(LD_SCHED, "We have a chance to run the scheduler");
 
   if (scheduler_get_queue_heuristic() < sched_q_low_water) {
-    n_chans_before = smartlist_len(channels_pending);
+    n_chans_before = scheduler_n_pending();
     q_len_before = channel_get_global_queue_estimate();
     q_heur_before = scheduler_get_queue_heuristic();
 
     while (scheduler_get_queue_heuristic() <= sched_q_high_water &&
-           smartlist_len(channels_pending) > 0) {
+           scheduler_n_pending() > 0) {
       /* Pop off a channel */
-      chan = smartlist_pqueue_pop(channels_pending,
-                                  scheduler_compare_channels,
-                                  STRUCT_OFFSET(channel_t, sched_heap_idx));
+      chan = scheduler_pending_pop();
       tor_assert(chan);
 
       /* Figure out how many cells we can write */
       n_cells = channel_num_cells_writeable(chan);
+      if (sched_kist_enabled && n_cells > 0) {
+        kist_cells = scheduler_kist_cells_writeable(chan);
+        if (kist_cells <= 0) {
+          /* The kernel has enough for now; try again next run */
+          if (!to_readd) to_readd = smartlist_new();
+          smartlist_add(to_readd, chan);
+          log_debug(LD_SCHED,
+                    "Channel " U64_FORMAT " at %p has a full socket; "
+                    "leaving it pending",
+                    U64_PRINTF_ARG(chan->global_identifier), chan);
+          continue;
+        }
+        n_cells = MIN(n_cells, kist_cells);
+      }
       if (n_cells > 0) {
         log_debug(LD_SCHED,
                   "Scheduler saw pending channel " U64_FORMAT " at %p with "
@@ -502,15 +806,12 @@ scheduler_run, (void))
     if (to_readd) {
       SMARTLIST_FOREACH_BEGIN(to_readd, channel_t *, chan) {
         chan->scheduler_state = SCHED_CHAN_PENDING;
-        smartlist_pqueue_add(channels_pending,
-                             scheduler_compare_channels,
-                             STRUCT_OFFSET(channel_t, sched_heap_idx),
-                             chan);
+        scheduler_pending_add(chan);
       } SMARTLIST_FOREACH_END(chan);
       smartlist_free(to_readd);
     }
 
-    n_chans_after = smartlist_len(channels_pending);
+    n_chans_after = scheduler_n_pending();
     q_len_after = channel_get_global_queue_estimate();
     q_heur_after = scheduler_get_queue_heuristic();
     log_debug(LD_SCHED,
@@ -552,10 +853,7 @@ scheduler_channel_wants_writes(channel_t *chan)
     /*
      * It can write now, so it goes to channels_pending.
      */
-    smartlist_pqueue_add(channels_pending,
-                         scheduler_compare_channels,
-                         STRUCT_OFFSET(channel_t, sched_heap_idx),
-                         chan);
+    scheduler_pending_add(chan);
     chan->scheduler_state = SCHED_CHAN_PENDING;
     log_debug(LD_SCHED,
               "Channel " U64_FORMAT " at %p went from waiting_to_write "
@@ -594,15 +892,18 @@ scheduler_touch_channel(channel_t *chan)
   tor_assert(chan);
 
   if (chan->scheduler_state == SCHED_CHAN_PENDING) {
-    /* Remove and re-add it */
-    smartlist_pqueue_remove(channels_pending,
-                            scheduler_compare_channels,
-                            STRUCT_OFFSET(channel_t, sched_heap_idx),
-                            chan);
-    smartlist_pqueue_add(channels_pending,
-                         scheduler_compare_channels,
-                         STRUCT_OFFSET(channel_t, sched_heap_idx),
-                         chan);
+    if (sched_queue_type == SCHEDULER_QUEUE_BUCKETS) {
+      /* Only move it if it changed buckets, so it keeps its place in line */
+      int bucket = scheduler_get_channel_bucket(chan);
+      if (bucket != chan->sched_bucket) {
+        scheduler_bucket_remove(chan);
+        scheduler_bucket_add(chan, bucket);
+      }
+    } else {
+      /* Remove and re-add it */
+      scheduler_pending_remove(chan);
+      scheduler_pending_add(chan);
+    }
   }
   /* else no-op, since it isn't in the queue */
 }
@@ -709,3 +1010,92 @@ scheduler_set_watermarks(uint32_t lo, uint32_t hi, uint32_t max_flush)
   sched_max_flush_cells = max_flush;
 }
 
+
+/**
+ * Parse the name of a pending channel queue type into *<b>out</b>; return
+ * 0 on success and -1 if the name is not recognized.
+ */
+
+int
+scheduler_parse_queue_type(const char *s, scheduler_queue_type_t *out)
+{
+  tor_assert(s);
+  tor_assert(out);
+
+  if (!strcasecmp(s, "Heap")) {
+    *out = SCHEDULER_QUEUE_HEAP;
+  } else if (!strcasecmp(s, "Buckets")) {
+    *out = SCHEDULER_QUEUE_BUCKETS;
+  } else {
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Switch the data structure we keep pending channels in, moving over any
+ * channels that are already pending.
+ */
+
+void
+scheduler_set_queue_type(scheduler_queue_type_t type)
+{
+  smartlist_t *pending;
+  channel_t *chan;
+
+  if (type == sched_queue_type)
+    return;
+
+  log_info(LD_SCHED, "Switching scheduler to %s queue",
+           (type == SCHEDULER_QUEUE_BUCKETS) ? "bucketed" : "heap");
+
+  if (!channels_pending) {
+    /* Not initialized yet; nothing to move */
+    sched_queue_type = type;
+    return;
+  }
+
+  pending = smartlist_new();
+  while ((chan = scheduler_pending_pop()))
+    smartlist_add(pending, chan);
+
+  sched_queue_type = type;
+
+  SMARTLIST_FOREACH(pending, channel_t *, c, scheduler_pending_add(c));
+  smartlist_free(pending);
+}
+
+/**
+ * Return true iff we can ask the kernel what KIST scheduling needs to know
+ * on this platform.
+ */
+
+int
+scheduler_kist_is_supported(void)
+{
+#ifdef HAVE_KIST_SUPPORT
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+/**
+ * Turn KIST scheduling on or off, and set how many msec apart its runs
+ * should be.
+ */
+
+void
+scheduler_set_kist(int enabled, int run_interval_msec)
+{
+  tor_assert(run_interval_msec > 0);
+
+  if (enabled != sched_kist_enabled) {
+    log_info(LD_SCHED, "%s KIST scheduling",
+             enabled ? "Enabling" : "Disabling");
+  }
+
+  sched_kist_enabled = enabled;
+  sched_kist_run_interval = run_interval_msec;
+}
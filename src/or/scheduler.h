@@ -13,6 +13,14 @@
 #include "channel.h"
 #include "testsupport.h"
 
+/** Data structures the scheduler can keep its pending channels in */
+typedef enum {
+  /** Binary heap ordered by scheduler_compare_channels(); O(log n) */
+  SCHEDULER_QUEUE_HEAP = 0,
+  /** Buckets of quantized circuitmux priority; O(1) */
+  SCHEDULER_QUEUE_BUCKETS
+} scheduler_queue_type_t;
+
 /* Global-visibility scheduler functions */
 
 /* Set up and shut down the scheduler from main.c */
@@ -37,6 +45,14 @@ void scheduler_touch_channel(channel_t *chan);
 /* Adjust the watermarks from config file*/
 void scheduler_set_watermarks(uint32_t lo, uint32_t hi, uint32_t max_flush);
 
+/* Choose the pending channel queue from config file */
+int scheduler_parse_queue_type(const char *s, scheduler_queue_type_t *out);
+void scheduler_set_queue_type(scheduler_queue_type_t type);
+
+/* Kernel-informed socket scheduling, from config file */
+int scheduler_kist_is_supported(void);
+void scheduler_set_kist(int enabled, int run_interval_msec);
+
 /* Things only scheduler.c and its test suite should see */
 
 #ifdef SCHEDULER_PRIVATE_
@@ -44,6 +60,18 @@ MOCK_DECL(STATIC int, scheduler_compare_channels,
           (const void *c1_v, const void *c2_v));
 STATIC uint64_t scheduler_get_queue_heuristic(void);
 STATIC void scheduler_update_queue_heuristic(time_t now);
+
+/** Number of buckets used by SCHEDULER_QUEUE_BUCKETS */
+#define SCHEDULER_N_BUCKETS 128
+/** Each doubling of circuitmux priority spans 1<<this many buckets */
+#define SCHEDULER_BUCKET_FRAC_BITS 2
+
+STATIC int scheduler_priority_to_bucket(double priority);
+MOCK_DECL(STATIC int, scheduler_get_channel_bucket, (channel_t *chan));
+STATIC int scheduler_n_pending(void);
+STATIC channel_t *scheduler_pending_pop(void);
+STATIC int scheduler_kist_socket_limit(tor_socket_t s, size_t *limit_out);
+MOCK_DECL(STATIC int, scheduler_kist_cells_writeable, (channel_t *chan));
 #endif
 
 #endif /* !defined(TOR_SCHEDULER_H) */
@@ -14,9 +14,23 @@ const char tor_git_revision[] = "";
 
 #include "orconfig.h"
 
+#define TOR_CHANNEL_INTERNAL_ /* For channel_init() */
 #include "or.h"
+#include "buffers.h"
+#include "channel.h"
+#include "channeltls.h"
+#include "circuitlist.h"
+#include "circuitmux.h"
+#include "circuitmux_ewma.h"
+#include "circuituse.h"
+#include "compat_libevent.h"
+#include "connection.h"
+#include "connection_or.h"
+#include "networkstatus.h"
 #include "onion_tap.h"
 #include "relay.h"
+#include "routerparse.h"
+#include "scheduler.h"
 #include <openssl/opensslv.h>
 #include <openssl/evp.h>
 #include <openssl/ec.h>
@@ -247,6 +261,67 @@ bench_onion_ntor(void)
   }
 }
 
+static void
+bench_onion_ntor_batch(void)
+{
+  const int iters = 1<<10;
+  const int batch_sizes[] = { 1, 2, 4, 8, 16 };
+  int i, j, b;
+  curve25519_keypair_t keypair;
+  uint64_t start, end;
+  uint8_t os[16][NTOR_ONIONSKIN_LEN];
+  uint8_t or[16][NTOR_REPLY_LEN];
+  uint8_t key_out[16][CPATH_KEY_MATERIAL_LEN];
+  ntor_server_request_t reqs[16];
+  int results[16];
+  ntor_handshake_state_t *state = NULL;
+  uint8_t nodeid[DIGEST_LEN];
+  di_digest256_map_t *keymap = NULL;
+
+  curve25519_set_impl_params(1);
+  memset(nodeid, 0, sizeof(nodeid));
+  curve25519_secret_key_generate(&keypair.seckey, 0);
+  curve25519_public_key_generate(&keypair.pubkey, &keypair.seckey);
+  dimap_add_entry(&keymap, keypair.pubkey.public_key, &keypair);
+
+  for (i = 0; i < 16; ++i) {
+    onion_skin_ntor_create(nodeid, &keypair.pubkey, &state, os[i]);
+    ntor_handshake_state_free(state);
+    state = NULL;
+    reqs[i].onion_skin = os[i];
+    reqs[i].handshake_reply_out = or[i];
+    reqs[i].key_out = key_out[i];
+    reqs[i].key_out_len = CPATH_KEY_MATERIAL_LEN;
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    onion_skin_ntor_server_handshake(os[0], keymap, NULL, nodeid, or[0],
+                                     key_out[0], CPATH_KEY_MATERIAL_LEN);
+  }
+  end = perftime();
+  printf("Server-side, unbatched: %f usec per handshake\n",
+         NANOCOUNT(start, end, iters)/1e3);
+
+  for (b = 0; b < (int)ARRAY_LENGTH(batch_sizes); ++b) {
+    const int n = batch_sizes[b];
+    const int n_batches = iters / n;
+    start = perftime();
+    for (j = 0; j < n_batches; ++j) {
+      onion_skin_ntor_server_handshake_batch(n, reqs, keymap, NULL, nodeid,
+                                             results);
+    }
+    end = perftime();
+    for (j = 0; j < n; ++j)
+      tor_assert(results[j] == 0);
+    printf("Server-side, batches of %2d: %f usec per handshake\n",
+           n, NANOCOUNT(start, end, n_batches * n)/1e3);
+  }
+
+  dimap_free(keymap, NULL);
+}
+
 static void
 bench_ed25519_impl(void)
 {
@@ -345,6 +420,44 @@ bench_cell_aes(void)
   tor_free(b);
 }
 
+static void
+bench_cell_aes_batch(void)
+{
+  uint64_t start, end;
+  const int len = 509;
+  const int iters = (1<<16);
+  const int batch_sizes[] = { 1, 2, 4, 8, 16 };
+  char *b = tor_malloc(len * 16);
+  crypto_cipher_t *c;
+  int i, j, k;
+
+  c = crypto_cipher_new(NULL);
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    crypto_cipher_crypt_inplace(c, b + (i % 16)*len, len);
+  end = perftime();
+  printf("%d bytes, no prefetch: %.2f nsec per byte\n", len,
+         NANOCOUNT(start, end, iters*len));
+
+  for (k = 0; k < (int)ARRAY_LENGTH(batch_sizes); ++k) {
+    const int batch = batch_sizes[k];
+    start = perftime();
+    for (i = 0; i < iters; i += batch) {
+      crypto_cipher_prefetch_keystream(c, (size_t)len * batch);
+      for (j = 0; j < batch; ++j)
+        crypto_cipher_crypt_inplace(c, b + j*len, len);
+    }
+    end = perftime();
+    printf("%d bytes, batches of %d cells: %.2f nsec per byte\n", len, batch,
+           NANOCOUNT(start, end, iters*len));
+  }
+
+  crypto_cipher_free(c);
+  tor_free(b);
+}
+
 /** Run digestmap_t performance benchmarks. */
 static void
 bench_dmap(void)
@@ -420,6 +533,106 @@ bench_dmap(void)
   smartlist_free(sl2);
 }
 
+/** Return a newly allocated string holding a consensus that looks like a
+ * real one, with 9 authorities and <b>n_routers</b> router entries.  The
+ * signatures are random, so it will parse, but it won't verify. */
+static char *
+bench_make_consensus(int n_routers)
+{
+  smartlist_t *sl = smartlist_new();
+  char id[DIGEST_LEN], d[DIGEST_LEN], sig[256];
+  char hex[HEX_DIGEST_LEN+1], b64_id[BASE64_DIGEST_LEN+1];
+  char b64_d[BASE64_DIGEST_LEN+1], b64_sig[512];
+  char *result;
+  int i;
+
+  smartlist_add(sl, tor_strdup(
+      "network-status-version 3\n"
+      "vote-status consensus\n"
+      "consensus-method 20\n"
+      "valid-after 2015-09-21 12:00:00\n"
+      "fresh-until 2015-09-21 13:00:00\n"
+      "valid-until 2015-09-21 15:00:00\n"
+      "voting-delay 300 300\n"
+      "client-versions 0.2.4.27,0.2.5.12,0.2.6.10,0.2.7.3-rc\n"
+      "server-versions 0.2.4.27,0.2.5.12,0.2.6.10,0.2.7.3-rc\n"
+      "known-flags Authority BadExit Exit Fast Guard HSDir Running Stable "
+      "V2Dir Valid\n"
+      "params CircuitPriorityHalflifeMsec=30000 NumDirectoryGuards=3 "
+      "UseOptimisticData=1 bwauthpid=1 pb_disablepct=0\n"));
+  for (i = 0; i < 9; ++i) {
+    memset(id, 0, sizeof(id));
+    set_uint32(id, htonl(i+1));
+    base16_encode(hex, sizeof(hex), id, sizeof(id));
+    smartlist_add_asprintf(sl, "dir-source auth%d %s 10.0.0.%d 10.0.0.%d "
+                           "80 443\n"
+                           "contact Some Authority <auth%d@example.com>\n"
+                           "vote-digest %s\n", i, hex, i+1, i+1, i, hex);
+  }
+  for (i = 0; i < n_routers; ++i) {
+    memset(id, 0, sizeof(id));
+    set_uint32(id, htonl(i * (0xffffffffu / n_routers)));
+    crypto_rand(id+4, sizeof(id)-4);
+    crypto_rand(d, sizeof(d));
+    digest_to_base64(b64_id, id);
+    digest_to_base64(b64_d, d);
+    smartlist_add_asprintf(sl, "r router%d %s %s 2015-09-21 11:%02d:%02d "
+                           "%d.%d.%d.%d 9001 9030\n"
+                           "s Fast Guard HSDir Running Stable V2Dir Valid\n"
+                           "v Tor 0.2.7.3-rc\n"
+                           "w Bandwidth=%d\n"
+                           "p reject 1-65535\n",
+                           i, b64_id, b64_d, (i/60)%60, i%60,
+                           1 + i % 200, (i >> 8) & 255, i & 255, 1 + i % 250,
+                           20 + i % 20000);
+  }
+  smartlist_add(sl, tor_strdup("directory-footer\n"));
+  for (i = 0; i < 9; ++i) {
+    memset(id, 0, sizeof(id));
+    set_uint32(id, htonl(i+1));
+    base16_encode(hex, sizeof(hex), id, sizeof(id));
+    crypto_rand(sig, sizeof(sig));
+    base64_encode(b64_sig, sizeof(b64_sig), sig, sizeof(sig),
+                  BASE64_ENCODE_MULTILINE);
+    smartlist_add_asprintf(sl, "directory-signature sha256 %s %s\n"
+                           "-----BEGIN SIGNATURE-----\n%s"
+                           "-----END SIGNATURE-----\n", hex, hex, b64_sig);
+  }
+
+  result = smartlist_join_strings(sl, "", 0, NULL);
+  SMARTLIST_FOREACH(sl, char *, cp, tor_free(cp));
+  smartlist_free(sl);
+  return result;
+}
+
+/** Run a benchmark for parsing a consensus the size of the one the real
+ * network uses. */
+static void
+bench_parse_consensus(void)
+{
+  const int n_routers = 7000, iters = 20;
+  char *consensus = bench_make_consensus(n_routers);
+  uint64_t start, end;
+  int i;
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    networkstatus_t *ns =
+      networkstatus_parse_vote_from_string(consensus, NULL,
+                                           NS_TYPE_CONSENSUS);
+    tor_assert(ns);
+    tor_assert(smartlist_len(ns->routerstatus_list) == n_routers);
+    networkstatus_vote_free(ns);
+  }
+  end = perftime();
+  printf("Parse a %d-router consensus (%d bytes): %.2f msec\n",
+         n_routers, (int)strlen(consensus),
+         NANOCOUNT(start, end, iters)/1e6);
+
+  tor_free(consensus);
+}
+
 static void
 bench_siphash(void)
 {
@@ -491,6 +704,217 @@ bench_cell_ops(void)
   tor_free(cell);
 }
 
+/** Measure what it costs to move a relayed cell through a circuit's cell
+ * queue and channel_write_packed_cell() into a TLS channel's outbuf, and to
+ * read cells back out of a buffer, the old way (via a packed temporary) and
+ * the new way (unpacking straight out of the buffer's chunks). */
+static void
+bench_cell_buf(void)
+{
+  const int iters = 1<<16;
+  const int batch = 64;
+  const size_t sz = get_cell_network_size(1);
+  int i, j;
+  uint64_t start, end;
+  or_connection_t *orconn = or_connection_new(CONN_TYPE_OR, AF_INET);
+  channel_t *chan;
+  buf_t *outbuf;
+  cell_queue_t queue;
+  cell_t cell;
+  char tmp[CELL_MAX_NETWORK_SIZE];
+
+  memset(&cell, 0, sizeof(cell));
+  cell.circ_id = 0x12345;
+  cell.command = CELL_RELAY;
+  crypto_rand((char*)cell.payload, sizeof(cell.payload));
+
+  orconn->wide_circ_ids = 1;
+  chan = channel_tls_handle_incoming(orconn);
+  chan->wide_circ_ids = 1;
+  chan->state = CHANNEL_STATE_OPEN;
+  outbuf = TO_CONN(orconn)->outbuf;
+  cell_queue_init(&queue);
+
+  reset_perftime();
+
+  start = perftime();
+  for (i = 0; i < iters; i += batch) {
+    for (j = 0; j < batch; ++j)
+      cell_queue_append_packed_copy(NULL, &queue, 0, &cell, 1, 0);
+    for (j = 0; j < batch; ++j) {
+      packed_cell_t *packed = TOR_SIMPLEQ_FIRST(&queue.head);
+      TOR_SIMPLEQ_REMOVE_HEAD(&queue.head, next);
+      --queue.n;
+      channel_write_packed_cell(chan, packed);
+    }
+    buf_clear(outbuf);
+    TO_CONN(orconn)->outbuf_flushlen = 0;
+  }
+  end = perftime();
+  printf("Queued and written with channel_write_packed_cell: "
+         "%.2f ns per cell\n", NANOCOUNT(start, end, iters));
+
+  start = perftime();
+  for (i = 0; i < iters; i += batch) {
+    for (j = 0; j < batch; ++j)
+      write_cell_to_buf(&cell, outbuf, 1);
+    for (j = 0; j < batch; ++j) {
+      fetch_from_buf(tmp, sz, outbuf);
+      cell.circ_id = ntohl(get_uint32(tmp));
+      cell.command = get_uint8(tmp+4);
+      memcpy(cell.payload, tmp+5, CELL_PAYLOAD_SIZE);
+    }
+  }
+  end = perftime();
+  printf("Read via packed temporary (%d bytes copied per cell): "
+         "%.2f ns per cell\n", (int)(3*sz), NANOCOUNT(start, end, iters));
+
+  start = perftime();
+  for (i = 0; i < iters; i += batch) {
+    for (j = 0; j < batch; ++j)
+      write_cell_to_buf(&cell, outbuf, 1);
+    for (j = 0; j < batch; ++j)
+      fetch_cell_from_buf(outbuf, &cell, 1);
+  }
+  end = perftime();
+  printf("Read straight out of the buffer (%d bytes copied per cell): "
+         "%.2f ns per cell\n", (int)(2*sz), NANOCOUNT(start, end, iters));
+
+  /* The channel stays registered until we exit; just empty its buffer. */
+  buf_clear(outbuf);
+  TO_CONN(orconn)->outbuf_flushlen = 0;
+}
+
+static int
+bench_chan_num_cells_writeable(channel_t *chan)
+{
+  (void)chan;
+  return 0;
+}
+
+static void
+bench_scheduler_impl(channel_t **chans, int n_chans,
+                     scheduler_queue_type_t type, const char *name)
+{
+  const int iters = 1<<4;
+  int i, j;
+  uint64_t start, end;
+
+  scheduler_set_queue_type(type);
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    /* Make every channel pending, then let the scheduler pop them all.
+     * None of them are open, so they go straight back to
+     * waiting_to_write without flushing anything. */
+    for (j = 0; j < n_chans; ++j)
+      scheduler_channel_wants_writes(chans[j]);
+    scheduler_run();
+  }
+  end = perftime();
+  printf("%s: %.2f ns per channel added and popped\n",
+         name, NANOCOUNT(start, end, iters * n_chans));
+
+  for (j = 0; j < n_chans; ++j)
+    scheduler_channel_wants_writes(chans[j]);
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    for (j = 0; j < n_chans; ++j)
+      scheduler_touch_channel(chans[j]);
+  }
+  end = perftime();
+  printf("%s: %.2f ns per channel touched\n",
+         name, NANOCOUNT(start, end, iters * n_chans));
+  scheduler_run();
+}
+
+static void
+bench_scheduler(void)
+{
+  const int n_chans = 50000;
+  channel_t **chans;
+  tor_libevent_cfg cfg;
+  int i;
+
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+  scheduler_init();
+
+  chans = tor_calloc(n_chans, sizeof(channel_t *));
+  for (i = 0; i < n_chans; ++i) {
+    chans[i] = tor_malloc_zero(sizeof(channel_t));
+    channel_init(chans[i]);
+    chans[i]->state = CHANNEL_STATE_MAINT;
+    chans[i]->num_cells_writeable = bench_chan_num_cells_writeable;
+    chans[i]->cmux = circuitmux_alloc();
+    circuitmux_set_policy(chans[i]->cmux, &ewma_policy);
+    chans[i]->scheduler_state = SCHED_CHAN_WAITING_TO_WRITE;
+  }
+
+  printf("%d channels:\n", n_chans);
+  bench_scheduler_impl(chans, n_chans, SCHEDULER_QUEUE_HEAP, "Heap");
+  bench_scheduler_impl(chans, n_chans, SCHEDULER_QUEUE_BUCKETS, "Buckets");
+
+  for (i = 0; i < n_chans; ++i) {
+    scheduler_release_channel(chans[i]);
+    circuitmux_free(chans[i]->cmux);
+    tor_free(chans[i]);
+  }
+  tor_free(chans);
+  scheduler_free_all();
+}
+
+/** Measure the circuit walkers that second_elapsed_callback() runs, on a
+ * relay carrying many circuits for others and none of its own. */
+static void
+bench_circuit_housekeeping(void)
+{
+  const int n_circs = 100000;
+  const int iters = 1<<8;
+  time_t now = time(NULL);
+  uint64_t start, end;
+  int i;
+
+  for (i = 0; i < n_circs; ++i) {
+    or_circuit_t *or_circ = or_circuit_new(0, NULL);
+    or_circ->base_.purpose = CIRCUIT_PURPOSE_OR;
+    circuit_set_state(TO_CIRCUIT(or_circ), CIRCUIT_STATE_OPEN);
+  }
+  printf("%d relay circuits:\n", n_circs);
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    circuit_expire_building();
+  end = perftime();
+  printf("circuit_expire_building: %.2f usec per call\n",
+         NANOCOUNT(start, end, iters) / 1000.0);
+
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    circuit_mark_all_dirty_circs_as_unusable();
+  end = perftime();
+  printf("circuit_mark_all_dirty_circs_as_unusable: %.2f usec per call\n",
+         NANOCOUNT(start, end, iters) / 1000.0);
+
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    circuit_get_next_by_pk_and_purpose(NULL, NULL, CIRCUIT_PURPOSE_TESTING);
+  end = perftime();
+  printf("circuit_get_next_by_pk_and_purpose: %.2f usec per call\n",
+         NANOCOUNT(start, end, iters) / 1000.0);
+
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    circuit_expire_old_circuits_serverside(now);
+  end = perftime();
+  printf("circuit_expire_old_circuits_serverside: %.2f usec per call\n",
+         NANOCOUNT(start, end, iters) / 1000.0);
+
+  circuit_free_all();
+}
+
 static void
 bench_dh(void)
 {
@@ -589,13 +1013,19 @@ typedef struct benchmark_t {
 static struct benchmark_t benchmarks[] = {
   ENT(dmap),
   ENT(siphash),
+  ENT(parse_consensus),
   ENT(aes),
   ENT(onion_TAP),
   ENT(onion_ntor),
+  ENT(onion_ntor_batch),
   ENT(ed25519),
 
   ENT(cell_aes),
+  ENT(cell_aes_batch),
   ENT(cell_ops),
+  ENT(cell_buf),
+  ENT(scheduler),
+  ENT(circuit_housekeeping),
   ENT(dh),
   ENT(ecdh_p256),
   ENT(ecdh_p224),
@@ -648,6 +1078,7 @@ main(int argc, const char **argv)
     return 1;
   }
   crypto_init_siphash_key();
+  routerparse_init();
   options = options_new();
   init_logging(1);
   options->command = CMD_RUN_UNITTESTS;
@@ -47,6 +47,7 @@ double fabs(double x);
 #include "config.h"
 #include "connection_edge.h"
 #include "geoip.h"
+#include "geoip_table.h"
 #include "rendcommon.h"
 #include "rendcache.h"
 #include "test.h"
@@ -251,6 +252,74 @@ test_ntor_handshake(void *arg)
   dimap_free(s_keymap, NULL);
 }
 
+/** Run several ntor handshakes through a single call to
+ * onion_skin_ntor_server_handshake_batch(), and make sure that the good
+ * ones agree with their clients and the bad ones fail on their own. */
+static void
+test_ntor_handshake_batch(void *arg)
+{
+#define N_BATCH 6
+  ntor_handshake_state_t *c_state[N_BATCH];
+  uint8_t c_buf[N_BATCH][NTOR_ONIONSKIN_LEN];
+  uint8_t c_keys[400];
+
+  di_digest256_map_t *s_keymap=NULL;
+  curve25519_keypair_t s_keypair;
+  uint8_t s_buf[N_BATCH][NTOR_REPLY_LEN];
+  uint8_t s_keys[N_BATCH][400];
+  ntor_server_request_t reqs[N_BATCH];
+  int results[N_BATCH];
+
+  uint8_t node_id[20] = "abcdefghijklmnopqrst";
+  uint8_t other_node_id[20] = "ABCDEFGHIJKLMNOPQRST";
+  int i;
+
+  (void) arg;
+  memset(c_state, 0, sizeof(c_state));
+
+  curve25519_secret_key_generate(&s_keypair.seckey, 0);
+  curve25519_public_key_generate(&s_keypair.pubkey, &s_keypair.seckey);
+  dimap_add_entry(&s_keymap, s_keypair.pubkey.public_key, &s_keypair);
+
+  for (i = 0; i < N_BATCH; ++i) {
+    /* Handshake 2 is for some other relay. */
+    tt_int_op(0, OP_EQ,
+              onion_skin_ntor_create(i == 2 ? other_node_id : node_id,
+                                     &s_keypair.pubkey,
+                                     &c_state[i], c_buf[i]));
+    reqs[i].onion_skin = c_buf[i];
+    reqs[i].handshake_reply_out = s_buf[i];
+    reqs[i].key_out = s_keys[i];
+    reqs[i].key_out_len = sizeof(s_keys[i]);
+  }
+  /* Handshake 4 has an all-zero X. */
+  memset(c_buf[4] + DIGEST_LEN + DIGEST256_LEN, 0, CURVE25519_PUBKEY_LEN);
+
+  memset(results, 0x7f, sizeof(results));
+  onion_skin_ntor_server_handshake_batch(N_BATCH, reqs, s_keymap, NULL,
+                                         node_id, results);
+
+  for (i = 0; i < N_BATCH; ++i) {
+    if (i == 2 || i == 4) {
+      tt_int_op(results[i], OP_EQ, -1);
+      continue;
+    }
+    tt_int_op(results[i], OP_EQ, 0);
+    memset(c_keys, 0, sizeof(c_keys));
+    tt_int_op(0, OP_EQ, onion_skin_ntor_client_handshake(c_state[i], s_buf[i],
+                                                         c_keys, 400, NULL));
+    tt_mem_op(c_keys, OP_EQ, s_keys[i], 400);
+  }
+  /* Different handshakes must not end up with the same keys. */
+  tt_mem_op(s_keys[0], OP_NE, s_keys[1], 400);
+
+ done:
+  for (i = 0; i < N_BATCH; ++i)
+    ntor_handshake_state_free(c_state[i]);
+  dimap_free(s_keymap, NULL);
+#undef N_BATCH
+}
+
 /** Run unit tests for the onion queues. */
 static void
 test_onion_queues(void *arg)
@@ -945,6 +1014,160 @@ test_geoip_with_pt(void *arg)
   tor_free(s);
 }
 
+/** Helper: compile the GeoIP text <b>text</b> for <b>family</b> the way
+ * tor-geoip-compile does, and write the result to <b>fname</b>. */
+static void
+write_compiled_geoip_file(const char *fname, const char *text,
+                          sa_family_t family)
+{
+  geoip_table_builder_t *builder = geoip_table_builder_new(family);
+  smartlist_t *lines = smartlist_new();
+  char digest[DIGEST_LEN];
+  char *table;
+  size_t len;
+
+  crypto_digest(digest, text, strlen(text));
+  smartlist_split_string(lines, text, "\n", 0, 0);
+  SMARTLIST_FOREACH_BEGIN(lines, char *, line) {
+    tor_addr_t low, high;
+    char country[3];
+    if (geoip_table_parse_line(line, family, &low, &high, country) > 0)
+      geoip_table_builder_add(builder, &low, &high, country);
+    tor_free(line);
+  } SMARTLIST_FOREACH_END(line);
+  smartlist_free(lines);
+
+  table = geoip_table_builder_encode(builder, digest, &len);
+  write_bytes_to_file(fname, table, len, 1);
+  tor_free(table);
+  geoip_table_builder_free(builder);
+}
+
+/** Check that GeoIP tables compiled by tor-geoip-compile give the same
+ * answers and digests as the text files they came from, including for
+ * ranges that span several /16 buckets, and that we refuse malformed
+ * ones. */
+static void
+test_geoip_compiled(void *arg)
+{
+  const char *v4_text =
+    "# A comment\n"
+    "16777216,16777471,AU\n"
+    "16777472,16778239,CN\n"
+    "16842752,17104895,JP\n"
+    "\"3221225472\",\"3221291007\",\"US\",\"USA\",\"United States\"\n"
+    "4294967040,4294967295,ZZ\n";
+  const char *v6_text =
+    "2001:200::,2001:200:ffff:ffff:ffff:ffff:ffff:ffff,JP\n"
+    "2001:208::,2001:20f:ffff:ffff:ffff:ffff:ffff:ffff,SG\n"
+    "2a00::,2a0f:ffff:ffff:ffff:ffff:ffff:ffff:ffff,DE\n";
+  static const uint32_t v4_probes[] = {
+    0, 16777215, 16777216, 16777300, 16777471, 16777472, 16778239,
+    16778240, 16842751, 16842752, 16908288, 17000000, 17104895, 17104896,
+    3221225471u, 3221225472u, 3221291007u, 3221291008u, 4294967039u,
+    4294967040u, 4294967295u
+  };
+  static const char *v6_probes[] = {
+    "::", "2001:1ff:ffff::1", "2001:200::", "2001:200:1234::5",
+    "2001:201::", "2001:208::1", "2001:20f:ffff::", "2001:210::",
+    "2a00::", "2a05:1::1", "2a0f:ffff:ffff:ffff:ffff:ffff:ffff:ffff",
+    "2a10::", "ffff::1"
+  };
+#define N_V4_PROBES ARRAY_LENGTH(v4_probes)
+#define N_V6_PROBES ARRAY_LENGTH(v6_probes)
+  char v4_answers[N_V4_PROBES][3], v6_answers[N_V6_PROBES][3];
+  char v4_digest[HEX_DIGEST_LEN+1], v6_digest[HEX_DIGEST_LEN+1];
+  char *v4_fname = tor_strdup(get_fname("geoip-text"));
+  char *v6_fname = tor_strdup(get_fname("geoip6-text"));
+  char *v4c_fname = tor_strdup(get_fname("geoip-compiled"));
+  char *v6c_fname = tor_strdup(get_fname("geoip6-compiled"));
+  char *bad_fname = tor_strdup(get_fname("geoip-truncated"));
+  char *contents = NULL;
+  struct in6_addr in6;
+  size_t i;
+
+  (void)arg;
+
+  /* Load the text files, and remember what they say. */
+  tt_int_op(0, OP_EQ, write_str_to_file(v4_fname, v4_text, 0));
+  tt_int_op(0, OP_EQ, write_str_to_file(v6_fname, v6_text, 0));
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET, v4_fname));
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET6, v6_fname));
+  for (i = 0; i < N_V4_PROBES; ++i)
+    strlcpy(v4_answers[i],
+            geoip_get_country_name(geoip_get_country_by_ipv4(v4_probes[i])),
+            3);
+  for (i = 0; i < N_V6_PROBES; ++i) {
+    tt_int_op(1, OP_EQ, tor_inet_pton(AF_INET6, v6_probes[i], &in6));
+    strlcpy(v6_answers[i],
+            geoip_get_country_name(geoip_get_country_by_ipv6(&in6)), 3);
+  }
+  strlcpy(v4_digest, geoip_db_digest(AF_INET), sizeof(v4_digest));
+  strlcpy(v6_digest, geoip_db_digest(AF_INET6), sizeof(v6_digest));
+
+  tt_str_op(v4_answers[0], OP_EQ, "??");
+  tt_str_op(v4_answers[8], OP_EQ, "??");
+  tt_str_op(v4_answers[11], OP_EQ, "jp");
+  tt_str_op(v4_answers[16], OP_EQ, "us");
+  tt_str_op(v4_answers[20], OP_EQ, "zz");
+  tt_str_op(v6_answers[3], OP_EQ, "jp");
+  tt_str_op(v6_answers[4], OP_EQ, "??");
+  tt_str_op(v6_answers[9], OP_EQ, "de");
+
+  /* Now load compiled versions of the same files, and make sure that
+   * nothing changes. */
+  write_compiled_geoip_file(v4c_fname, v4_text, AF_INET);
+  write_compiled_geoip_file(v6c_fname, v6_text, AF_INET6);
+  clear_geoip_db();
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET, v4c_fname));
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET6, v6c_fname));
+  tt_assert(geoip_is_loaded(AF_INET));
+  tt_assert(geoip_is_loaded(AF_INET6));
+  for (i = 0; i < N_V4_PROBES; ++i)
+    tt_str_op(v4_answers[i], OP_EQ,
+              geoip_get_country_name(geoip_get_country_by_ipv4(v4_probes[i])));
+  for (i = 0; i < N_V6_PROBES; ++i) {
+    tt_int_op(1, OP_EQ, tor_inet_pton(AF_INET6, v6_probes[i], &in6));
+    tt_str_op(v6_answers[i], OP_EQ,
+              geoip_get_country_name(geoip_get_country_by_ipv6(&in6)));
+  }
+  tt_str_op(v4_digest, OP_EQ, geoip_db_digest(AF_INET));
+  tt_str_op(v6_digest, OP_EQ, geoip_db_digest(AF_INET6));
+
+  /* A table for the wrong family, or a truncated one, is refused. */
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET6, v4c_fname));
+  contents = read_file_to_str(v4c_fname, RFTS_BIN, NULL);
+  tt_assert(contents);
+  tt_int_op(0, OP_EQ, write_bytes_to_file(bad_fname, contents, 100, 1));
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET, bad_fname));
+  tt_str_op("jp", OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(17000000)));
+
+  /* Comments and malformed lines don't disturb the loaded table, and new
+   * entries are merged into it. */
+  tt_int_op(0, OP_EQ, geoip_parse_entry("# Nothing to see here", AF_INET));
+  tt_int_op(-1, OP_EQ, geoip_parse_entry("not,a,range", AF_INET));
+  tt_str_op("jp", OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(17000000)));
+  tt_int_op(0, OP_EQ, geoip_parse_entry("16777472,16778239,CN", AF_INET));
+  tt_int_op(0, OP_EQ, geoip_parse_entry("167772160,184549375,NL", AF_INET));
+  tt_str_op("nl", OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(167772161)));
+  tt_str_op("jp", OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(17000000)));
+  tt_str_op(v4_digest, OP_EQ, geoip_db_digest(AF_INET));
+
+ done:
+  tor_free(v4_fname);
+  tor_free(v6_fname);
+  tor_free(v4c_fname);
+  tor_free(v6c_fname);
+  tor_free(bad_fname);
+  tor_free(contents);
+#undef N_V4_PROBES
+#undef N_V6_PROBES
+}
+
 #undef SET_TEST_ADDRESS
 #undef SET_TEST_IPV6
 #undef CHECK_COUNTRY
@@ -1119,10 +1342,12 @@ static struct testcase_t test_array[] = {
   { "bad_onion_handshake", test_bad_onion_handshake, 0, NULL, NULL },
   ENT(onion_queues),
   { "ntor_handshake", test_ntor_handshake, 0, NULL, NULL },
+  { "ntor_handshake_batch", test_ntor_handshake_batch, 0, NULL, NULL },
   FORK(circuit_timeout),
   FORK(rend_fns),
   ENT(geoip),
   FORK(geoip_with_pt),
+  FORK(geoip_compiled),
   FORK(stats),
 
   END_OF_TESTCASES
@@ -1141,9 +1366,11 @@ extern struct testcase_t circuitlist_tests[];
 extern struct testcase_t circuitmux_tests[];
 extern struct testcase_t compat_libevent_tests[];
 extern struct testcase_t config_tests[];
+extern struct testcase_t consdiff_tests[];
 extern struct testcase_t container_tests[];
 extern struct testcase_t controller_tests[];
 extern struct testcase_t controller_event_tests[];
+extern struct testcase_t cpuworker_tests[];
 extern struct testcase_t crypto_tests[];
 extern struct testcase_t dir_tests[];
 extern struct testcase_t dir_handle_get_tests[];
@@ -1196,9 +1423,11 @@ struct testgroup_t testgroups[] = {
   { "circuitmux/", circuitmux_tests },
   { "compat/libevent/", compat_libevent_tests },
   { "config/", config_tests },
+  { "consdiff/", consdiff_tests },
   { "container/", container_tests },
   { "control/", controller_tests },
   { "control/event/", controller_event_tests },
+  { "cpuworker/", cpuworker_tests },
   { "crypto/", crypto_tests },
   { "dir/", dir_tests },
   { "dir_handle_get/", dir_handle_get_tests },
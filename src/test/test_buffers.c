@@ -6,6 +6,7 @@
 #define BUFFERS_PRIVATE
 #include "or.h"
 #include "buffers.h"
+#include "connection_or.h"
 #include "ext_orport.h"
 #include "test.h"
 
@@ -365,6 +366,75 @@ test_buffer_copy(void *arg)
     generic_buffer_free(buf2);
 }
 
+static void
+test_buffer_cells(void *arg)
+{
+  buf_t *buf = NULL;
+  cell_t cell, cell2;
+  packed_cell_t packed;
+  char b[CELL_MAX_NETWORK_SIZE];
+  const chunk_t *chunk;
+  int wide_circ_ids, i;
+  (void)arg;
+
+  for (wide_circ_ids = 0; wide_circ_ids <= 1; ++wide_circ_ids) {
+    const size_t sz = get_cell_network_size(wide_circ_ids);
+    buf = buf_new_with_capacity(4096);
+
+    /* Nothing there yet. */
+    tt_int_op(0, OP_EQ, fetch_cell_from_buf(buf, &cell2, wide_circ_ids));
+
+    /* Start off misaligned, so that some cells straddle chunks. */
+    write_to_buf("xyz", 3, buf);
+    for (i = 0; i < 20; ++i) {
+      memset(&cell, 0, sizeof(cell));
+      cell.circ_id = 0x1000 + i;
+      cell.command = CELL_RELAY;
+      memset(cell.payload, 'a' + i, CELL_PAYLOAD_SIZE);
+      tt_int_op(write_cell_to_buf(&cell, buf, wide_circ_ids), OP_EQ,
+                3 + (i+1)*sz);
+    }
+
+    /* Every chunk but the last was filled before we started another. */
+    for (chunk = buf->head; chunk != buf->tail; chunk = chunk->next)
+      tt_ptr_op(chunk->data + chunk->datalen, OP_EQ,
+                chunk->mem + chunk->memlen);
+
+    /* The bytes on the buffer must be just what cell_pack() makes. */
+    fetch_from_buf(b, 3, buf);
+    tt_mem_op(b, OP_EQ, "xyz", 3);
+    memset(&cell, 0, sizeof(cell));
+    cell.circ_id = 0x1000;
+    cell.command = CELL_RELAY;
+    memset(cell.payload, 'a', CELL_PAYLOAD_SIZE);
+    cell_pack(&packed, &cell, wide_circ_ids);
+    fetch_from_buf(b, sz, buf);
+    tt_mem_op(b, OP_EQ, packed.body, sz);
+
+    /* Now pull the rest off as cells. */
+    for (i = 1; i < 20; ++i) {
+      memset(&cell2, 0, sizeof(cell2));
+      tt_int_op(1, OP_EQ, fetch_cell_from_buf(buf, &cell2, wide_circ_ids));
+      tt_int_op(cell2.circ_id, OP_EQ, 0x1000 + i);
+      tt_int_op(cell2.command, OP_EQ, CELL_RELAY);
+      memset(cell.payload, 'a' + i, CELL_PAYLOAD_SIZE);
+      tt_mem_op(cell2.payload, OP_EQ, cell.payload, CELL_PAYLOAD_SIZE);
+    }
+    tt_int_op(buf_datalen(buf), OP_EQ, 0);
+
+    /* A partial cell stays put. */
+    write_to_buf(packed.body, sz - 1, buf);
+    tt_int_op(0, OP_EQ, fetch_cell_from_buf(buf, &cell2, wide_circ_ids));
+    tt_int_op(buf_datalen(buf), OP_EQ, sz - 1);
+
+    buf_free(buf);
+    buf = NULL;
+  }
+
+ done:
+  buf_free(buf);
+}
+
 static void
 test_buffer_ext_or_cmd(void *arg)
 {
@@ -507,6 +577,93 @@ test_buffer_allocation_tracking(void *arg)
   tor_free(junk);
 }
 
+/** Helper for test_buffer_ref: count how many times we've been told to
+ * release a reference. */
+static void
+count_ref_release(void *arg)
+{
+  ++*(int *)arg;
+}
+
+static void
+test_buffer_ref(void *arg)
+{
+  buf_t *buf = NULL, *buf2 = NULL;
+  char *big = tor_malloc(10000);
+  char tmp[10007];
+  const char *cp;
+  size_t sz;
+  int released = 0, released2 = 0;
+  int i;
+  (void)arg;
+
+  for (i = 0; i < 10000; ++i)
+    big[i] = 'a' + (i % 26);
+
+  buf = buf_new();
+  write_to_buf("Hello ", 6, buf);
+  tt_int_op(10006, OP_EQ,
+            write_ref_to_buf(big, 10000, count_ref_release, &released, buf));
+  write_to_buf("!", 1, buf);
+  tt_int_op(buf_datalen(buf), OP_EQ, 10007);
+  assert_buf_ok(buf);
+  /* The referenced bytes weren't copied or allocated. */
+  tt_int_op(buf_allocation(buf), OP_LT, 10000);
+
+  /* Copies get their own storage, and don't touch our reference. */
+  buf2 = buf_copy(buf);
+  tt_int_op(buf_datalen(buf2), OP_EQ, 10007);
+  assert_buf_ok(buf2);
+  fetch_from_buf(tmp, 10007, buf2);
+  tt_mem_op(tmp, OP_EQ, "Hello ", 6);
+  tt_mem_op(tmp+6, OP_EQ, big, 10000);
+  tt_mem_op(tmp+10006, OP_EQ, "!", 1);
+  tt_int_op(released, OP_EQ, 0);
+
+  /* Removing only part of the reference keeps it. */
+  fetch_from_buf(tmp, 100, buf);
+  tt_mem_op(tmp, OP_EQ, "Hello ", 6);
+  tt_mem_op(tmp+6, OP_EQ, big, 94);
+  tt_int_op(released, OP_EQ, 0);
+  buf_get_first_chunk_data(buf, &cp, &sz);
+  tt_ptr_op(cp, OP_EQ, big+94);
+  tt_int_op(sz, OP_EQ, 10000-94);
+
+  /* Pulling up past the end of the reference copies it and lets it go. */
+  buf_pullup(buf, 9907);
+  tt_int_op(released, OP_EQ, 1);
+  buf_get_first_chunk_data(buf, &cp, &sz);
+  tt_int_op(sz, OP_EQ, 9907);
+  tt_mem_op(cp, OP_EQ, big+94, 9906);
+  tt_mem_op(cp+9906, OP_EQ, "!", 1);
+  assert_buf_ok(buf);
+  buf_free(buf);
+
+  /* Draining the buffer, or freeing it, releases the reference exactly
+   * once. */
+  buf = buf_new();
+  write_ref_to_buf(big, 5000, count_ref_release, &released, buf);
+  write_ref_to_buf(big+5000, 5000, count_ref_release, &released2, buf);
+  fetch_from_buf(tmp, 5000, buf);
+  tt_int_op(released, OP_EQ, 2);
+  tt_int_op(released2, OP_EQ, 0);
+  buf_free(buf);
+  buf = NULL;
+  tt_int_op(released2, OP_EQ, 1);
+
+  /* An empty reference is released right away. */
+  buf = buf_new();
+  tt_int_op(0, OP_EQ,
+            write_ref_to_buf(big, 0, count_ref_release, &released, buf));
+  tt_int_op(released, OP_EQ, 3);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, buf_allocation(buf2));
+
+ done:
+  buf_free(buf);
+  buf_free(buf2);
+  tor_free(big);
+}
+
 static void
 test_buffer_time_tracking(void *arg)
 {
@@ -751,10 +908,12 @@ struct testcase_t buffer_tests[] = {
   { "basic", test_buffers_basic, TT_FORK, NULL, NULL },
   { "copy", test_buffer_copy, TT_FORK, NULL, NULL },
   { "pullup", test_buffer_pullup, TT_FORK, NULL, NULL },
+  { "cells", test_buffer_cells, TT_FORK, NULL, NULL },
   { "ext_or_cmd", test_buffer_ext_or_cmd, TT_FORK, NULL, NULL },
   { "allocation_tracking", test_buffer_allocation_tracking, TT_FORK,
     NULL, NULL },
   { "time_tracking", test_buffer_time_tracking, TT_FORK, NULL, NULL },
+  { "ref", test_buffer_ref, TT_FORK, NULL, NULL },
   { "zlib", test_buffers_zlib, TT_FORK, NULL, NULL },
   { "zlib_fin_with_nil", test_buffers_zlib_fin_with_nil, TT_FORK, NULL, NULL },
   { "zlib_fin_at_chunk_end", test_buffers_zlib_fin_at_chunk_end, TT_FORK,
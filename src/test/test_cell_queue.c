@@ -134,9 +134,73 @@ test_circuit_n_cells(void *arg)
   circuit_free(TO_CIRCUIT(origin_c));
 }
 
+static void
+test_cq_cell_pool(void *arg)
+{
+  packed_cell_t *cells[200];
+  int i, n_slabs, n_empty;
+  (void) arg;
+
+  memset(cells, 0, sizeof(cells));
+  packed_cell_pool_get_n_slabs(&n_slabs, &n_empty);
+  tt_int_op(n_slabs, OP_EQ, 0);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, 0);
+
+  for (i = 0; i < 200; ++i) {
+    cells[i] = packed_cell_new();
+    tt_assert(cells[i]);
+    /* Fresh cells are zeroed. */
+    tt_int_op(cells[i]->inserted_time, OP_EQ, 0);
+    memset(cells[i]->body, 0xff, sizeof(cells[i]->body));
+    cells[i]->inserted_time = i;
+  }
+  /* Nobody stomped on anybody else. */
+  for (i = 0; i < 200; ++i)
+    tt_int_op(cells[i]->inserted_time, OP_EQ, i);
+  packed_cell_pool_get_n_slabs(&n_slabs, &n_empty);
+  tt_int_op(n_slabs, OP_EQ, 4);
+  tt_int_op(n_empty, OP_EQ, 0);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
+            200 * packed_cell_mem_cost());
+
+  /* Free every other cell: slabs stay around, and get reused. */
+  for (i = 0; i < 200; i += 2) {
+    packed_cell_free(cells[i]);
+    cells[i] = NULL;
+  }
+  packed_cell_pool_get_n_slabs(&n_slabs, &n_empty);
+  tt_int_op(n_slabs, OP_EQ, 4);
+  for (i = 0; i < 200; i += 2)
+    cells[i] = packed_cell_new();
+  packed_cell_pool_get_n_slabs(&n_slabs, &n_empty);
+  tt_int_op(n_slabs, OP_EQ, 4);
+
+  /* Free everything: empty slabs are kept for reuse, and counted. */
+  for (i = 0; i < 200; ++i) {
+    packed_cell_free(cells[i]);
+    cells[i] = NULL;
+  }
+  packed_cell_pool_get_n_slabs(&n_slabs, &n_empty);
+  tt_int_op(n_slabs, OP_EQ, 4);
+  tt_int_op(n_empty, OP_EQ, 4);
+  tt_int_op(cell_queues_get_total_allocation(), OP_GT, 0);
+
+  /* ... until we're low on memory. */
+  tt_int_op(packed_cell_pool_release_empty_slabs(), OP_GT, 0);
+  packed_cell_pool_get_n_slabs(&n_slabs, &n_empty);
+  tt_int_op(n_slabs, OP_EQ, 0);
+  tt_int_op(n_empty, OP_EQ, 0);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, 0);
+
+ done:
+  for (i = 0; i < 200; ++i)
+    packed_cell_free(cells[i]);
+}
+
 struct testcase_t cell_queue_tests[] = {
   { "basic", test_cq_manip, TT_FORK, NULL, NULL, },
   { "circ_n_cells", test_circuit_n_cells, TT_FORK, NULL, NULL },
+  { "cell_pool", test_cq_cell_pool, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -8,6 +8,7 @@
 #include "channel.h"
 #include "circuitbuild.h"
 #include "circuitlist.h"
+#include "circuituse.h"
 #include "test.h"
 
 static channel_t *
@@ -343,10 +344,86 @@ test_pick_circid(void *arg)
   circuit_free_all();
 }
 
+static void
+test_purpose_index(void *arg)
+{
+  origin_circuit_t *c1, *c2;
+  smartlist_t *waiting, *open;
+  (void) arg;
+
+  waiting = circuit_get_origin_circuits_by_purpose(CIRCUIT_PURPOSE_C_GENERAL,
+                                                   CIRCUIT_STATE_CHAN_WAIT);
+  open = circuit_get_origin_circuits_by_purpose(CIRCUIT_PURPOSE_C_GENERAL,
+                                                CIRCUIT_STATE_OPEN);
+  tt_int_op(smartlist_len(waiting), OP_EQ, 0);
+  tt_int_op(smartlist_len(open), OP_EQ, 0);
+
+  /* New circuits are listed under their purpose and state. */
+  c1 = origin_circuit_init(CIRCUIT_PURPOSE_C_GENERAL, 0);
+  c2 = origin_circuit_init(CIRCUIT_PURPOSE_C_GENERAL, 0);
+  tt_int_op(smartlist_len(waiting), OP_EQ, 2);
+  tt_int_op(smartlist_len(open), OP_EQ, 0);
+  tt_int_op(circuit_count_building_origin_circuits(CIRCUIT_PURPOSE_C_GENERAL),
+            OP_EQ, 2);
+  assert_circuit_ok(TO_CIRCUIT(c1));
+  assert_circuit_ok(TO_CIRCUIT(c2));
+
+  /* Opening a circuit moves it to the open list. */
+  circuit_set_state(TO_CIRCUIT(c1), CIRCUIT_STATE_OPEN);
+  tt_int_op(smartlist_len(waiting), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(waiting, 0), OP_EQ, c2);
+  tt_int_op(smartlist_len(open), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(open, 0), OP_EQ, c1);
+  tt_int_op(circuit_count_building_origin_circuits(CIRCUIT_PURPOSE_C_GENERAL),
+            OP_EQ, 1);
+  assert_circuit_ok(TO_CIRCUIT(c1));
+  assert_circuit_ok(TO_CIRCUIT(c2));
+
+  /* Changing its purpose moves it to another purpose's list. */
+  circuit_change_purpose(TO_CIRCUIT(c1), CIRCUIT_PURPOSE_CONTROLLER);
+  tt_int_op(smartlist_len(open), OP_EQ, 0);
+  tt_int_op(smartlist_len(circuit_get_origin_circuits_by_purpose(
+                 CIRCUIT_PURPOSE_CONTROLLER, CIRCUIT_STATE_OPEN)), OP_EQ, 1);
+  assert_circuit_ok(TO_CIRCUIT(c1));
+
+  /* Marking it for close takes it out of the purpose lists, but not out of
+   * the list of origin circuits. */
+  circuit_mark_for_close(TO_CIRCUIT(c1), END_CIRC_REASON_FINISHED);
+  tt_int_op(smartlist_len(circuit_get_origin_circuits_by_purpose(
+                 CIRCUIT_PURPOSE_CONTROLLER, CIRCUIT_STATE_OPEN)), OP_EQ, 0);
+  tt_assert(! c1->in_purpose_index);
+  tt_int_op(smartlist_len(circuit_get_global_origin_circuit_list()),
+            OP_EQ, 2);
+
+  /* Marked circuits are skipped when searching by purpose. */
+  tt_ptr_op(circuit_get_next_by_pk_and_purpose(NULL, NULL,
+                                               CIRCUIT_PURPOSE_CONTROLLER),
+            OP_EQ, NULL);
+  tt_ptr_op(circuit_get_next_by_pk_and_purpose(NULL, NULL,
+                                               CIRCUIT_PURPOSE_C_GENERAL),
+            OP_EQ, c2);
+  tt_ptr_op(circuit_get_next_by_pk_and_purpose(c2, NULL,
+                                               CIRCUIT_PURPOSE_C_GENERAL),
+            OP_EQ, NULL);
+
+  /* Freeing a circuit takes it out of every list. */
+  circuit_free(TO_CIRCUIT(c2));
+  tt_int_op(smartlist_len(waiting), OP_EQ, 0);
+  tt_int_op(smartlist_len(circuit_get_global_origin_circuit_list()),
+            OP_EQ, 1);
+  tt_ptr_op(smartlist_get(circuit_get_global_origin_circuit_list(), 0),
+            OP_EQ, c1);
+  tt_int_op(c1->global_origin_circuit_list_idx, OP_EQ, 0);
+
+ done:
+  circuit_free_all();
+}
+
 struct testcase_t circuitlist_tests[] = {
   { "maps", test_clist_maps, TT_FORK, NULL, NULL },
   { "rend_token_maps", test_rend_token_maps, TT_FORK, NULL, NULL },
   { "pick_circid", test_pick_circid, TT_FORK, NULL, NULL },
+  { "purpose_index", test_purpose_index, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -0,0 +1,327 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#define CONSDIFF_PRIVATE
+#include "or.h"
+#include "config.h"
+#include "consdiff.h"
+#include "dirserv.h"
+#include "test.h"
+
+/** Return a newly allocated string that looks enough like a consensus for
+ * consdiff.c: a header saying <b>valid_after</b>, a router entry for each
+ * id in <b>ids</b> (with a bandwidth of <b>bw</b> plus its index), and a
+ * footer signed with <b>sig</b>. */
+static char *
+fake_consensus(const char *valid_after, const char **ids, int n_ids,
+               int bw, const char *sig)
+{
+  smartlist_t *sl = smartlist_new();
+  char *result;
+  int i;
+
+  smartlist_add_asprintf(sl, "network-status-version 3 microdesc\n"
+                         "vote-status consensus\n"
+                         "consensus-method 20\n"
+                         "valid-after %s\n"
+                         "known-flags Exit Fast Guard Running Stable Valid\n",
+                         valid_after);
+  for (i = 0; i < n_ids; ++i) {
+    smartlist_add_asprintf(sl, "r router%d %s 2015-09-21 12:00:00 "
+                           "10.0.0.%d 9001 0\n"
+                           "m dGhpcyBpcyBhIG1pY3JvZGVzYyBkaWdlc3QgJWQ\n"
+                           "s Fast Running Valid\n"
+                           "w Bandwidth=%d\n",
+                           i, ids[i], i, bw + i);
+  }
+  smartlist_add_asprintf(sl, "directory-footer\n"
+                         "bandwidth-weights Wbd=0 Wbe=0\n"
+                         "directory-signature sha256 AAAA BBBB\n"
+                         "-----BEGIN SIGNATURE-----\n"
+                         "%s\n"
+                         "-----END SIGNATURE-----\n", sig);
+  result = smartlist_join_strings(sl, "", 0, NULL);
+  SMARTLIST_FOREACH(sl, char *, cp, tor_free(cp));
+  smartlist_free(sl);
+  return result;
+}
+
+static void
+test_consdiff_split_lines(void *arg)
+{
+  cdline_t *lines = NULL;
+  int n = -1;
+  (void)arg;
+
+  lines = consdiff_split_lines("", 0, &n);
+  tt_int_op(n, OP_EQ, 0);
+  tor_free(lines);
+
+  lines = consdiff_split_lines("abc\n\nde\n", 8, &n);
+  tt_int_op(n, OP_EQ, 3);
+  tt_int_op(lines[0].len, OP_EQ, 3);
+  tt_mem_op(lines[0].s, OP_EQ, "abc", 3);
+  tt_int_op(lines[1].len, OP_EQ, 0);
+  tt_int_op(lines[2].len, OP_EQ, 2);
+  tt_mem_op(lines[2].s, OP_EQ, "de", 2);
+  tor_free(lines);
+
+  /* No final newline. */
+  lines = consdiff_split_lines("abc\nde", 6, &n);
+  tt_int_op(n, OP_EQ, 2);
+  tt_int_op(lines[1].len, OP_EQ, 2);
+
+ done:
+  tor_free(lines);
+}
+
+static void
+test_consdiff_consensus(void *arg)
+{
+  /* These are in identity order: base64 digits go A-Z, a-z, 0-9, +, /. */
+  const char *old_ids[] = { "AAAAAAAAAAAAAAAAAAAAAAAAAAA",
+                            "BAAAAAAAAAAAAAAAAAAAAAAAAAA",
+                            "aAAAAAAAAAAAAAAAAAAAAAAAAAA",
+                            "0AAAAAAAAAAAAAAAAAAAAAAAAAA",
+                            "+AAAAAAAAAAAAAAAAAAAAAAAAAA" };
+  const char *new_ids[] = { "AAAAAAAAAAAAAAAAAAAAAAAAAAA",
+                            "BAAAAAAAAAAAAAAAAAAAAAAAAAA",
+                            "zAAAAAAAAAAAAAAAAAAAAAAAAAA",
+                            "0AAAAAAAAAAAAAAAAAAAAAAAAAA",
+                            "+AAAAAAAAAAAAAAAAAAAAAAAAAA",
+                            "/AAAAAAAAAAAAAAAAAAAAAAAAAA" };
+  char *c1 = NULL, *c2 = NULL, *diff = NULL, *applied = NULL, *cp;
+  (void)arg;
+
+  c1 = fake_consensus("2015-09-21 12:00:00", old_ids, 5, 100, "sig1");
+  c2 = fake_consensus("2015-09-21 13:00:00", new_ids, 6, 100, "sig2");
+
+  diff = consdiff_gen_diff(c1, c2);
+  tt_assert(diff);
+  tt_assert(looks_like_a_consensus_diff(diff, strlen(diff)));
+  tt_assert(!looks_like_a_consensus_diff(c1, strlen(c1)));
+  /* The diff only touches what changed. */
+  tt_int_op(strlen(diff), OP_LT, strlen(c2) / 2);
+  tt_assert(strstr(diff, "valid-after 2015-09-21 13:00:00\n"));
+  tt_assert(strstr(diff, "zAAAAAAAAAAAAAAAAAAAAAAAAAA"));
+  tt_assert(!strstr(diff, "aAAAAAAAAAAAAAAAAAAAAAAAAAA"));
+
+  applied = consdiff_apply_diff(c1, diff);
+  tt_assert(applied);
+  tt_str_op(applied, OP_EQ, c2);
+  tor_free(applied);
+
+  /* The diff only applies to the consensus it was made for. */
+  tt_ptr_op(NULL, OP_EQ, consdiff_apply_diff(c2, diff));
+
+  /* If a command's lines are damaged, the result won't match the promised
+   * hash. */
+  cp = strstr(diff, "valid-after 2015-09-21 13");
+  tt_assert(cp);
+  cp[strlen("valid-after 2015-09-21 1")] = '4';
+  tt_ptr_op(NULL, OP_EQ, consdiff_apply_diff(c1, diff));
+  tor_free(diff);
+
+  /* Every router changing is fine too. */
+  tor_free(c2);
+  c2 = fake_consensus("2015-09-21 13:00:00", old_ids, 5, 500, "sig2");
+  diff = consdiff_gen_diff(c1, c2);
+  tt_assert(diff);
+  applied = consdiff_apply_diff(c1, diff);
+  tt_str_op(applied, OP_EQ, c2);
+  tor_free(applied);
+  tor_free(diff);
+
+  /* So is a diff with no changes at all. */
+  diff = consdiff_gen_diff(c1, c1);
+  tt_assert(diff);
+  applied = consdiff_apply_diff(c1, diff);
+  tt_str_op(applied, OP_EQ, c1);
+
+ done:
+  tor_free(c1);
+  tor_free(c2);
+  tor_free(diff);
+  tor_free(applied);
+}
+
+static void
+test_consdiff_generic(void *arg)
+{
+  /* Documents with no router entries get a plain line-by-line diff. */
+  const char *a = "one\ntwo\nthree\nfour\nfive\n";
+  const char *b = "zero\none\nthree\nfour\nfour and a half\nfive\n";
+  char *diff = NULL, *applied = NULL;
+  (void)arg;
+
+  diff = consdiff_gen_diff(a, b);
+  tt_assert(diff);
+  /* The hash line is 134 characters, plus a newline. */
+  tt_str_op(diff + strlen(CONSDIFF_FIRST_LINE "\n") + 135, OP_EQ,
+            "4a\nfour and a half\n.\n2d\n0a\nzero\n.\n");
+  applied = consdiff_apply_diff(a, diff);
+  tt_str_op(applied, OP_EQ, b);
+  tor_free(applied);
+  tor_free(diff);
+
+  /* Everything changes. */
+  diff = consdiff_gen_diff(a, "new\n");
+  tt_assert(diff);
+  tt_str_op(diff + strlen(CONSDIFF_FIRST_LINE "\n") + 135, OP_EQ,
+            "1,5c\nnew\n.\n");
+  applied = consdiff_apply_diff(a, diff);
+  tt_str_op(applied, OP_EQ, "new\n");
+  tor_free(applied);
+  tor_free(diff);
+
+  /* We can't add a line that's just a dot. */
+  tt_ptr_op(NULL, OP_EQ, consdiff_gen_diff(a, "one\n.\n"));
+
+ done:
+  tor_free(diff);
+  tor_free(applied);
+}
+
+static void
+test_consdiff_apply_bad(void *arg)
+{
+  const char *base = "one\ntwo\nthree\n";
+  char hash_line[256];
+  char base_hex[HEX_DIGEST256_LEN+1], target_hex[HEX_DIGEST256_LEN+1];
+  char digest[DIGEST256_LEN];
+  char *diff = NULL, *applied = NULL;
+  (void)arg;
+
+  crypto_digest256(digest, base, strlen(base), DIGEST_SHA256);
+  base16_encode(base_hex, sizeof(base_hex), digest, sizeof(digest));
+  crypto_digest256(digest, "one\nthree\n", 10, DIGEST_SHA256);
+  base16_encode(target_hex, sizeof(target_hex), digest, sizeof(digest));
+  tor_snprintf(hash_line, sizeof(hash_line), "hash %s %s\n",
+               base_hex, target_hex);
+
+#define TRY(body, ok) STMT_BEGIN                                        \
+    tor_asprintf(&diff, "%s\n%s%s", CONSDIFF_FIRST_LINE, hash_line, body); \
+    applied = consdiff_apply_diff(base, diff);                          \
+    if (ok)                                                             \
+      tt_str_op(applied, OP_EQ, "one\nthree\n");                        \
+    else                                                                \
+      tt_ptr_op(applied, OP_EQ, NULL);                                  \
+    tor_free(applied);                                                  \
+    tor_free(diff);                                                     \
+  STMT_END
+
+  TRY("2d\n", 1);
+  TRY("2,2d\n", 1);
+  TRY("2c\nthree\n.\n3d\n", 0); /* out of order */
+  TRY("3d\n2c\nthree\n.\n", 1);
+  TRY("3d\n3d\n", 0); /* overlapping */
+  TRY("3d\n2,3d\n", 0); /* overlapping */
+  TRY("4d\n", 0); /* past the end */
+  TRY("0d\n", 0);
+  TRY("3,2d\n", 0);
+  TRY("2x\n", 0);
+  TRY("2,3a\nfoo\n.\n", 0);
+  TRY("2c\nthree\n", 0); /* no dot */
+  TRY("2c\n.\n3d\n", 0); /* "c" with no lines */
+  TRY("d\n", 0);
+  TRY("-1d\n", 0);
+  TRY("2d \n", 0);
+#undef TRY
+
+  /* Bad headers. */
+  tt_ptr_op(NULL, OP_EQ, consdiff_apply_diff(base, "2d\n"));
+  tor_asprintf(&diff, "network-status-diff-version 2\n%s2d\n", hash_line);
+  tt_ptr_op(NULL, OP_EQ, consdiff_apply_diff(base, diff));
+  tor_free(diff);
+  tor_asprintf(&diff, "%s\nhash %s\n2d\n", CONSDIFF_FIRST_LINE, base_hex);
+  tt_ptr_op(NULL, OP_EQ, consdiff_apply_diff(base, diff));
+  tor_free(diff);
+
+ done:
+  tor_free(diff);
+  tor_free(applied);
+}
+
+static or_options_t *mock_options = NULL;
+
+static const or_options_t *
+mock_get_options(void)
+{
+  return mock_options;
+}
+
+static void
+test_consdiff_dirserv(void *arg)
+{
+  const char *ids[] = { "AAAAAAAAAAAAAAAAAAAAAAAAAAA",
+                        "BAAAAAAAAAAAAAAAAAAAAAAAAAA" };
+  char *c1 = NULL, *c2 = NULL, *c3 = NULL, *applied = NULL;
+  uint8_t d1[DIGEST256_LEN], d2[DIGEST256_LEN], d3[DIGEST256_LEN];
+  digests_t digests;
+  cached_dir_t *diff;
+  (void)arg;
+
+  mock_options = tor_malloc_zero(sizeof(or_options_t));
+  mock_options->DataDirectory = tor_strdup(get_fname("consdiff_dirserv"));
+  mock_options->ConsensusDiffHistory = 12;
+  MOCK(get_options, mock_get_options);
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(mock_options->DataDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(mock_options->DataDirectory, 0700));
+#endif
+
+  memset(&digests, 0, sizeof(digests));
+  c1 = fake_consensus("2015-09-21 12:00:00", ids, 2, 100, "sig1");
+  c2 = fake_consensus("2015-09-21 13:00:00", ids, 2, 200, "sig2");
+  c3 = fake_consensus("2015-09-21 14:00:00", ids, 1, 300, "sig3");
+  crypto_digest256((char*)d1, c1, strlen(c1), DIGEST_SHA256);
+  crypto_digest256((char*)d2, c2, strlen(c2), DIGEST_SHA256);
+  crypto_digest256((char*)d3, c3, strlen(c3), DIGEST_SHA256);
+
+  /* With no cpuworkers, the diffs get made right away. */
+  dirserv_set_cached_consensus_networkstatus(c1, "ns", &digests, 1000);
+  tt_ptr_op(NULL, OP_EQ, dirserv_get_consensus_diff("ns", d1));
+  dirserv_set_cached_consensus_networkstatus(c2, "ns", &digests, 2000);
+  diff = dirserv_get_consensus_diff("ns", d1);
+  tt_assert(diff);
+  tt_ptr_op(NULL, OP_EQ, dirserv_get_consensus_diff("microdesc", d1));
+  applied = consdiff_apply_diff(c1, diff->dir);
+  tt_str_op(applied, OP_EQ, c2);
+  tor_free(applied);
+
+  /* A new consensus replaces the old diffs. */
+  mock_options->ConsensusDiffHistory = 1;
+  dirserv_set_cached_consensus_networkstatus(c3, "ns", &digests, 3000);
+  diff = dirserv_get_consensus_diff("ns", d2);
+  tt_assert(diff);
+  applied = consdiff_apply_diff(c2, diff->dir);
+  tt_str_op(applied, OP_EQ, c3);
+  /* ... and we only keep one old consensus. */
+  tt_ptr_op(NULL, OP_EQ, dirserv_get_consensus_diff("ns", d1));
+  tt_ptr_op(NULL, OP_EQ, dirserv_get_consensus_diff("ns", d3));
+
+ done:
+  dirserv_free_all();
+  UNMOCK(get_options);
+  if (mock_options)
+    tor_free(mock_options->DataDirectory);
+  tor_free(mock_options);
+  tor_free(c1);
+  tor_free(c2);
+  tor_free(c3);
+  tor_free(applied);
+}
+
+#define CONSDIFF_TEST(name) \
+  { #name, test_consdiff_ ## name, 0, NULL, NULL }
+
+struct testcase_t consdiff_tests[] = {
+  CONSDIFF_TEST(split_lines),
+  CONSDIFF_TEST(consensus),
+  CONSDIFF_TEST(generic),
+  CONSDIFF_TEST(apply_bad),
+  CONSDIFF_TEST(dirserv),
+  END_OF_TESTCASES
+};
+
@@ -9,6 +9,7 @@
 #include "channeltls.h"
 #include "connection.h"
 #include "control.h"
+#include "histogram.h"
 #include "test.h"
 
 static void
@@ -283,10 +284,31 @@ test_cntev_format_cell_stats(void *arg)
   tt_str_op("InboundQueue=8 InboundConn=2 InboundAdded=relay:3 "
             "InboundRemoved=relay:7 InboundTime=relay:6 "
             "OutboundQueue=9 OutboundConn=1", OP_EQ, event_string);
+  tor_free(event_string);
+
+  /* With CellLatencyStatistics, the OR circuit has timed two cells in its
+   * appward queue and one in its exitward queue. */
+  or_circ->base_.cell_latency_appward = histogram_new();
+  or_circ->base_.cell_latency_exitward = histogram_new();
+  histogram_add(or_circ->base_.cell_latency_appward, 100);
+  histogram_add(or_circ->base_.cell_latency_appward, 300);
+  histogram_add(or_circ->base_.cell_latency_exitward, 2);
+  format_cell_stats(&event_string, TO_CIRCUIT(or_circ), cell_stats);
+  tt_str_op("InboundQueue=8 InboundConn=2 InboundAdded=relay:3 "
+            "InboundRemoved=relay:7 InboundTime=relay:6 "
+            "InboundLatency=count:2,mean:200,p50:103,p90:300,p99:300,"
+            "max:300 "
+            "OutboundQueue=9 OutboundConn=1 "
+            "OutboundLatency=count:1,mean:2,p50:2,p90:2,p99:2,max:2",
+            OP_EQ, event_string);
 
  done:
   tor_free(cell_stats);
   tor_free(event_string);
+  if (or_circ) {
+    histogram_free(or_circ->base_.cell_latency_appward);
+    histogram_free(or_circ->base_.cell_latency_exitward);
+  }
   tor_free(or_circ);
   tor_free(ocirc);
   tor_free(p_chan);
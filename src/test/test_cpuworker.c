@@ -0,0 +1,225 @@
+/* Copyright (c) 2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#include "orconfig.h"
+
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
+#include "or.h"
+#define CIRCUITLIST_PRIVATE
+#include "circuitlist.h"
+#include "compat_libevent.h"
+#include "config.h"
+#define CPUWORKER_PRIVATE
+#include "cpuworker.h"
+#include "onion.h"
+#include "onion_ntor.h"
+#include "workqueue.h"
+
+#include "test.h"
+#include "fakechans.h"
+
+/** Onion handshake workers copy our onion keys when they start; we have
+ * none in the unit tests, so give them empty ones instead.  None of the
+ * handshakes that we queue here ever runs. */
+static server_onion_keys_t *
+server_onion_keys_new_mock(void)
+{
+  return tor_malloc_zero(sizeof(server_onion_keys_t));
+}
+
+/** Lock and condition for blocker_threadfn(). */
+static tor_mutex_t blocker_lock;
+static tor_cond_t blocker_cond;
+/** 0 if the blocker is still queued, 1 if a worker is running it, and 2
+ * once we've told it to finish. */
+static int blocker_state = 0;
+/** Number of times blocker_replyfn() has run. */
+static int n_blocker_replies = 0;
+
+/** Work function that keeps its worker thread busy until we set
+ * blocker_state to 2, so that nothing queued after it can start. */
+static workqueue_reply_t
+blocker_threadfn(void *state, void *arg)
+{
+  (void)state;
+  (void)arg;
+  tor_mutex_acquire(&blocker_lock);
+  blocker_state = 1;
+  tor_cond_signal_all(&blocker_cond);
+  while (blocker_state != 2)
+    tor_cond_wait(&blocker_cond, &blocker_lock, NULL);
+  tor_mutex_release(&blocker_lock);
+  return WQ_RPL_REPLY;
+}
+
+static void
+blocker_replyfn(void *arg)
+{
+  (void)arg;
+  ++n_blocker_replies;
+}
+
+/** Start a single onion handshake thread, and keep it busy. */
+static void
+setup_blocked_cpuworker(void)
+{
+  tor_libevent_cfg cfg;
+
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+  get_options_mutable()->NumCPUs = 1;
+  MOCK(server_onion_keys_new, server_onion_keys_new_mock);
+  cpu_init();
+
+  tor_mutex_init(&blocker_lock);
+  tor_cond_init(&blocker_cond);
+  tor_assert(cpuworker_queue_work(blocker_threadfn, blocker_replyfn, NULL));
+  tor_mutex_acquire(&blocker_lock);
+  while (blocker_state != 1)
+    tor_cond_wait(&blocker_cond, &blocker_lock, NULL);
+  tor_mutex_release(&blocker_lock);
+}
+
+/** Let the onion handshake thread go, and wait for it to finish. */
+static void
+release_blocked_cpuworker(void)
+{
+  tor_mutex_acquire(&blocker_lock);
+  blocker_state = 2;
+  tor_cond_signal_all(&blocker_cond);
+  tor_mutex_release(&blocker_lock);
+  while (n_blocker_replies == 0)
+    event_base_loop(tor_libevent_get_base(), EVLOOP_ONCE);
+}
+
+#define N_BATCH_CIRCS 3
+
+/** Queue an onionskin for each of <b>n</b> new OR circuits on
+ * <b>chan</b>, and hand them to the blocked worker as a single batch. */
+static void
+queue_handshake_batch(or_circuit_t **circs, int n, channel_t *chan)
+{
+  int i;
+  for (i = 0; i < n; ++i) {
+    create_cell_t *cc = tor_malloc_zero(sizeof(create_cell_t));
+    cc->cell_type = CELL_CREATE2;
+    cc->handshake_type = ONION_HANDSHAKE_TYPE_NTOR;
+    cc->handshake_len = NTOR_ONIONSKIN_LEN;
+    circs[i] = or_circuit_new(0, NULL);
+    circs[i]->p_chan = chan;
+    TO_CIRCUIT(circs[i])->purpose = CIRCUIT_PURPOSE_OR;
+    TO_CIRCUIT(circs[i])->state = CIRCUIT_STATE_ONIONSKIN_PENDING;
+    tor_assert(onion_pending_add(circs[i], cc) == 0);
+  }
+  queue_pending_tasks();
+}
+
+static void
+test_cpuworker_cancel_batch_member(void *arg)
+{
+  or_circuit_t *circs[N_BATCH_CIRCS];
+  channel_t *chan = new_fake_channel();
+  int i;
+
+  (void)arg;
+  memset(circs, 0, sizeof(circs));
+  setup_blocked_cpuworker();
+
+  queue_handshake_batch(circs, N_BATCH_CIRCS, chan);
+  tt_assert(circs[0]->workqueue_entry);
+  for (i = 1; i < N_BATCH_CIRCS; ++i)
+    tt_ptr_op(circs[i]->workqueue_entry, OP_EQ, circs[0]->workqueue_entry);
+
+  /* Cancelling one handshake puts the others back on the queue together. */
+  cpuworker_cancel_circ_handshake(circs[1]);
+  tt_ptr_op(circs[1]->workqueue_entry, OP_EQ, NULL);
+  tt_assert(circs[0]->workqueue_entry);
+  tt_ptr_op(circs[2]->workqueue_entry, OP_EQ, circs[0]->workqueue_entry);
+
+  /* Cancelling the rest leaves nothing behind. */
+  cpuworker_cancel_circ_handshake(circs[0]);
+  tt_ptr_op(circs[0]->workqueue_entry, OP_EQ, NULL);
+  tt_assert(circs[2]->workqueue_entry);
+  cpuworker_cancel_circ_handshake(circs[2]);
+  tt_ptr_op(circs[2]->workqueue_entry, OP_EQ, NULL);
+
+  for (i = 0; i < N_BATCH_CIRCS; ++i)
+    tt_assert(! TO_CIRCUIT(circs[i])->marked_for_close);
+
+ done:
+  release_blocked_cpuworker();
+  UNMOCK(server_onion_keys_new);
+  for (i = 0; i < N_BATCH_CIRCS; ++i) {
+    if (circs[i]) {
+      circs[i]->p_chan = NULL;
+      circuit_free(TO_CIRCUIT(circs[i]));
+    }
+  }
+  free_fake_channel(chan);
+}
+
+static workqueue_entry_t *
+threadpool_queue_work_first_fail(threadpool_t *pool,
+                                 workqueue_reply_t (*fn)(void *, void *),
+                                 void (*reply_fn)(void *),
+                                 void *arg)
+{
+  (void)pool;
+  (void)fn;
+  (void)reply_fn;
+  (void)arg;
+  return NULL;
+}
+
+static void
+test_cpuworker_cancel_batch_member_requeue_fails(void *arg)
+{
+  or_circuit_t *circs[N_BATCH_CIRCS];
+  channel_t *chan = new_fake_channel();
+  int i;
+
+  (void)arg;
+  memset(circs, 0, sizeof(circs));
+  setup_blocked_cpuworker();
+  MOCK(threadpool_queue_work_first, threadpool_queue_work_first_fail);
+
+  queue_handshake_batch(circs, N_BATCH_CIRCS, chan);
+  tt_assert(circs[0]->workqueue_entry);
+  for (i = 0; i < N_BATCH_CIRCS; ++i)
+    circs[i]->p_chan = NULL;
+
+  /* Close one circuit while the batch is still queued.  We can't put the
+   * rest of the batch back, so its other circuits get closed too, in the
+   * same pass. */
+  circuit_mark_for_close(TO_CIRCUIT(circs[1]), END_CIRC_REASON_FINISHED);
+  circuit_close_all_marked();
+  memset(circs, 0, sizeof(circs));
+  tt_int_op(smartlist_len(circuit_get_global_list()), OP_EQ, 0);
+
+ done:
+  UNMOCK(threadpool_queue_work_first);
+  release_blocked_cpuworker();
+  UNMOCK(server_onion_keys_new);
+  for (i = 0; i < N_BATCH_CIRCS; ++i) {
+    if (circs[i]) {
+      circs[i]->p_chan = NULL;
+      circuit_free(TO_CIRCUIT(circs[i]));
+    }
+  }
+  free_fake_channel(chan);
+}
+
+#undef N_BATCH_CIRCS
+
+struct testcase_t cpuworker_tests[] = {
+  { "cancel_batch_member", test_cpuworker_cancel_batch_member,
+    TT_FORK, NULL, NULL },
+  { "cancel_batch_member_requeue_fails",
+    test_cpuworker_cancel_batch_member_requeue_fails, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
@@ -283,6 +283,7 @@ static void
 test_crypto_sha(void *arg)
 {
   crypto_digest_t *d1 = NULL, *d2 = NULL;
+  crypto_hmac_sha256_key_t *hkey = NULL;
   int i;
 #define RFC_4231_MAX_KEY_SIZE 131
   char key[RFC_4231_MAX_KEY_SIZE];
@@ -379,6 +380,30 @@ test_crypto_sha(void *arg)
                  "9b09ffa71b942fcb27635fbcd5b0e944"
                  "bfdc63644f0713938a7f51535c3a35e2");
 
+  /* A precomputed HMAC key should give the same answers. */
+  hkey = crypto_hmac_sha256_key_new(key, 131);
+  crypto_hmac_sha256_with_key(digest, hkey,
+                     "Test Using Larger Than Block-Size Key - Hash Key First",
+                     54);
+  test_memeq_hex(digest,
+                 "60e431591ee0b67f0d8a26aacbf5b77f"
+                 "8e0bc6213728c5140546040f0ee37f54");
+  crypto_hmac_sha256_key_free(hkey);
+  hkey = crypto_hmac_sha256_key_new("Jefe", 4);
+  crypto_hmac_sha256_with_key(digest, hkey,
+                              "what do ya want for nothing?", 28);
+  test_memeq_hex(digest,
+                 "5bdcc146bf60754e6a042426089575c7"
+                 "5a003f089d2739839dec58b964ec3843");
+  /* And it should be reusable. */
+  crypto_hmac_sha256_with_key(digest, hkey,
+                              "what do ya want for nothing?", 28);
+  test_memeq_hex(digest,
+                 "5bdcc146bf60754e6a042426089575c7"
+                 "5a003f089d2739839dec58b964ec3843");
+  crypto_hmac_sha256_key_free(hkey);
+  hkey = NULL;
+
   /* Incremental digest code. */
   d1 = crypto_digest_new();
   tt_assert(d1);
@@ -445,6 +470,7 @@ test_crypto_sha(void *arg)
     crypto_digest_free(d1);
   if (d2)
     crypto_digest_free(d2);
+  crypto_hmac_sha256_key_free(hkey);
   tor_free(mem_op_hex_tmp);
 }
 
@@ -662,6 +688,73 @@ test_crypto_pk_base64(void *arg)
   tor_free(encoded);
 }
 
+/** Run crypto_pk_checksig_batch() on a mix of good and bad signatures,
+ * with and without threads, and make sure the answers come back in order. */
+static void
+test_crypto_pk_checksig_batch(void *arg)
+{
+#define N_BATCH_SIGS 40
+  crypto_pk_t *pk[3] = { NULL, NULL, NULL };
+  crypto_pk_checkable_t checks[N_BATCH_SIGS];
+  char digests[N_BATCH_SIGS][DIGEST_LEN];
+  char sigs[N_BATCH_SIGS][PK_BYTES];
+  int oks[N_BATCH_SIGS];
+  int i, r, n_threads;
+
+  (void)arg;
+
+  for (i = 0; i < 3; ++i) {
+    pk[i] = pk_generate(i);
+    tt_assert(pk[i]);
+  }
+
+  for (i = 0; i < N_BATCH_SIGS; ++i) {
+    crypto_rand(digests[i], DIGEST_LEN);
+    r = crypto_pk_private_sign(pk[i % 3], sigs[i], sizeof(sigs[i]),
+                               digests[i], DIGEST_LEN);
+    tt_int_op(r, OP_EQ, PK_BYTES);
+    checks[i].pk = pk[i % 3];
+    checks[i].digest = digests[i];
+    checks[i].digest_len = DIGEST_LEN;
+    checks[i].sig = sigs[i];
+    checks[i].sig_len = r;
+  }
+
+  /* Nothing to check is fine. */
+  tt_int_op(0, OP_EQ, crypto_pk_checksig_batch(NULL, checks, 0));
+
+  for (n_threads = 1; n_threads <= 4; n_threads *= 2) {
+    crypto_pk_checksig_batch_set_threads(n_threads);
+
+    memset(oks, 0, sizeof(oks));
+    tt_int_op(0, OP_EQ, crypto_pk_checksig_batch(oks, checks, N_BATCH_SIGS));
+    for (i = 0; i < N_BATCH_SIGS; ++i)
+      tt_int_op(oks[i], OP_EQ, 1);
+  }
+
+  /* Now break a few: a wrong key, a wrong digest, and a damaged
+   * signature. */
+  checks[5].pk = pk[0];
+  digests[17][3] ^= 1;
+  sigs[33][10] ^= 0x80;
+
+  for (n_threads = 1; n_threads <= 4; n_threads *= 2) {
+    crypto_pk_checksig_batch_set_threads(n_threads);
+
+    memset(oks, 0, sizeof(oks));
+    tt_int_op(-3, OP_EQ, crypto_pk_checksig_batch(oks, checks, N_BATCH_SIGS));
+    for (i = 0; i < N_BATCH_SIGS; ++i)
+      tt_int_op(oks[i], OP_EQ, (i != 5 && i != 17 && i != 33));
+    tt_int_op(-3, OP_EQ, crypto_pk_checksig_batch(NULL, checks, N_BATCH_SIGS));
+  }
+
+ done:
+  crypto_pk_checksig_batch_set_threads(1);
+  for (i = 0; i < 3; ++i)
+    crypto_pk_free(pk[i]);
+#undef N_BATCH_SIGS
+}
+
 /** Sanity check for crypto pk digests  */
 static void
 test_crypto_digests(void *arg)
@@ -1176,6 +1269,46 @@ test_crypto_curve25519_basepoint(void *arg)
   ;
 }
 
+/** Make sure that curve25519_handshake_batch() gives the same answers as
+ * curve25519_handshake() on each of its inputs, including the all-zero
+ * public key. */
+static void
+test_crypto_curve25519_batch(void *arg)
+{
+  curve25519_keypair_t kp[CURVE25519_BATCH_MAX + 3];
+  curve25519_public_key_t zero_pk;
+  const curve25519_secret_key_t *skeys[CURVE25519_BATCH_MAX + 3];
+  const curve25519_public_key_t *pkeys[CURVE25519_BATCH_MAX + 3];
+  uint8_t out_batch[CURVE25519_BATCH_MAX + 3][32];
+  uint8_t *outputs[CURVE25519_BATCH_MAX + 3];
+  uint8_t out_single[32];
+  const int n = CURVE25519_BATCH_MAX + 3;
+  int i;
+  (void)arg;
+
+  memset(&zero_pk, 0, sizeof(zero_pk));
+  for (i = 0; i < n; ++i) {
+    tt_int_op(0, OP_EQ, curve25519_keypair_generate(&kp[i], 0));
+  }
+  for (i = 0; i < n; ++i) {
+    skeys[i] = &kp[i].seckey;
+    pkeys[i] = (i == 5) ? &zero_pk : &kp[(i+1) % n].pubkey;
+    outputs[i] = out_batch[i];
+  }
+  memset(out_batch, 0x5a, sizeof(out_batch));
+
+  curve25519_handshake_batch(n, outputs, skeys, pkeys);
+
+  for (i = 0; i < n; ++i) {
+    curve25519_handshake(out_single, skeys[i], pkeys[i]);
+    tt_mem_op(out_single, OP_EQ, out_batch[i], 32);
+  }
+  tt_assert(tor_mem_is_zero((char*)out_batch[5], 32));
+
+ done:
+  memwipe(kp, 0, sizeof(kp));
+}
+
 static void
 test_crypto_curve25519_wrappers(void *arg)
 {
@@ -1936,6 +2069,60 @@ test_crypto_failure_modes(void *arg)
   ;
 }
 
+/** Make sure that generating keystream ahead of time doesn't change what
+ * our stream cipher outputs. */
+static void
+test_crypto_aes_prefetch(void *arg)
+{
+  char *data1 = NULL, *data2 = NULL, *data3 = NULL;
+  crypto_cipher_t *env1 = NULL, *env2 = NULL;
+  int j;
+
+  int use_evp = !strcmp(arg,"evp");
+  evaluate_evp_for_aes(use_evp);
+  evaluate_ctr_for_aes();
+
+  data1 = tor_malloc(4096);
+  data2 = tor_malloc(4096);
+  data3 = tor_malloc(4096);
+  crypto_rand(data1, 4096);
+  memcpy(data2, data1, 4096);
+
+  env1 = crypto_cipher_new(NULL);
+  env2 = crypto_cipher_new(crypto_cipher_get_key(env1));
+
+  /* Reference: crypt everything in place, one 509-byte chunk at a time. */
+  for (j = 0; j + 509 <= 4096; j += 509)
+    crypto_cipher_crypt_inplace(env1, data1+j, 509);
+
+  /* Prefetch four chunks, then a partial chunk on top of what's left. */
+  crypto_cipher_prefetch_keystream(env2, 4*509);
+  tt_int_op(crypto_cipher_get_prefetched_len(env2), OP_EQ, 4*509);
+  crypto_cipher_crypt_inplace(env2, data2, 509);
+  crypto_cipher_crypt_inplace(env2, data2+509, 509);
+  tt_int_op(crypto_cipher_get_prefetched_len(env2), OP_EQ, 2*509);
+  crypto_cipher_prefetch_keystream(env2, 100);
+  tt_int_op(crypto_cipher_get_prefetched_len(env2), OP_EQ, 2*509+100);
+  /* Use more than we prefetched, with the non-inplace interface. */
+  crypto_cipher_encrypt(env2, data3, data2+2*509, 3*509);
+  memcpy(data2+2*509, data3, 3*509);
+  tt_int_op(crypto_cipher_get_prefetched_len(env2), OP_EQ, 0);
+  /* Prefetching again once the old keystream is used up. */
+  crypto_cipher_prefetch_keystream(env2, 509);
+  tt_int_op(crypto_cipher_get_prefetched_len(env2), OP_EQ, 509);
+  for (j = 5*509; j + 509 <= 4096; j += 509)
+    crypto_cipher_crypt_inplace(env2, data2+j, 509);
+
+  tt_mem_op(data1, OP_EQ, data2, 8*509);
+
+ done:
+  crypto_cipher_free(env1);
+  crypto_cipher_free(env2);
+  tor_free(data1);
+  tor_free(data2);
+  tor_free(data3);
+}
+
 #define CRYPTO_LEGACY(name)                                            \
   { #name, test_crypto_ ## name , 0, NULL, NULL }
 
@@ -1945,10 +2132,15 @@ struct testcase_t crypto_tests[] = {
   { "rng_range", test_crypto_rng_range, 0, NULL, NULL },
   { "aes_AES", test_crypto_aes, TT_FORK, &passthrough_setup, (void*)"aes" },
   { "aes_EVP", test_crypto_aes, TT_FORK, &passthrough_setup, (void*)"evp" },
+  { "aes_prefetch_AES", test_crypto_aes_prefetch, TT_FORK,
+    &passthrough_setup, (void*)"aes" },
+  { "aes_prefetch_EVP", test_crypto_aes_prefetch, TT_FORK,
+    &passthrough_setup, (void*)"evp" },
   CRYPTO_LEGACY(sha),
   CRYPTO_LEGACY(pk),
   { "pk_fingerprints", test_crypto_pk_fingerprints, TT_FORK, NULL, NULL },
   { "pk_base64", test_crypto_pk_base64, TT_FORK, NULL, NULL },
+  { "pk_checksig_batch", test_crypto_pk_checksig_batch, TT_FORK, NULL, NULL },
   CRYPTO_LEGACY(digests),
   CRYPTO_LEGACY(dh),
   { "aes_iv_AES", test_crypto_aes_iv, TT_FORK, &passthrough_setup,
@@ -1963,6 +2155,7 @@ struct testcase_t crypto_tests[] = {
   { "curve25519_basepoint",
     test_crypto_curve25519_basepoint, TT_FORK, NULL, NULL },
   { "curve25519_wrappers", test_crypto_curve25519_wrappers, 0, NULL, NULL },
+  { "curve25519_batch", test_crypto_curve25519_batch, 0, NULL, NULL },
   { "curve25519_encode", test_crypto_curve25519_encode, 0, NULL, NULL },
   { "curve25519_persist", test_crypto_curve25519_persist, 0, NULL, NULL },
   { "ed25519_simple", test_crypto_ed25519_simple, 0, NULL, NULL },
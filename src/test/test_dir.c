@@ -1846,6 +1846,12 @@ test_routerstatus_for_v3ns(routerstatus_t *rs, time_t now)
     tt_assert(rs->is_flagged_running);
     tt_assert(rs->is_valid);
     tt_assert(!rs->is_named);
+    /* The "v" line isn't decoded until somebody asks for it. */
+    tt_assert(rs->lazy_lines);
+    tt_assert(!rs->version_known);
+    routerstatus_decode_lazy_fields(rs);
+    tt_assert(!rs->lazy_lines);
+    tt_assert(rs->version_known);
     /* XXXX check version */
   } else {
     /* Weren't expecting this... */
@@ -2520,6 +2526,119 @@ test_dir_random_weighted(void *testdata)
   ;
 }
 
+static void
+test_dir_lazy_fields_eq(void *arg)
+{
+  routerstatus_t a, b;
+  static const char lines1[] = "vTor 0.2.7.6\0paccept 80,443\0";
+  static const char lines2[] = "vTor 0.2.7.6\0paccept 80\0";
+  static const char lines3[] = "vTor 0.2.7.6\0";
+  (void) arg;
+
+  memset(&a, 0, sizeof(a));
+  memset(&b, 0, sizeof(b));
+
+  /* Nothing to compare if either one has been decoded. */
+  tt_assert(! routerstatus_lazy_fields_eq(&a, &b));
+  a.lazy_lines = lines1;
+  tt_assert(! routerstatus_lazy_fields_eq(&a, &b));
+
+  b.lazy_lines = lines1;
+  tt_assert(routerstatus_lazy_fields_eq(&a, &b));
+  b.lazy_lines = lines2;
+  tt_assert(! routerstatus_lazy_fields_eq(&a, &b));
+  b.lazy_lines = lines3;
+  tt_assert(! routerstatus_lazy_fields_eq(&a, &b));
+  tt_assert(! routerstatus_lazy_fields_eq(&b, &a));
+
+ done:
+  ;
+}
+
+static void
+test_dir_alias_table(void *testdata)
+{
+  int histogram[10];
+  double vals[10] = {3,1,2,4,6,0,7,5,8,9}, total=0;
+  alias_table_t *table = NULL;
+  int i, choice;
+  const int n = 50000;
+  double max_sq_error;
+  (void) testdata;
+
+  /* Same ten weights as in test_dir_random_weighted. */
+  memset(histogram,0,sizeof(histogram));
+  for (i=0; i<10; ++i)
+    total += vals[i];
+  table = alias_table_new(vals, 10);
+  tt_int_op(table->n_entries, OP_EQ, 10);
+  for (i=0; i<n; ++i) {
+    choice = alias_table_choose(table);
+    tt_int_op(choice, OP_GE, 0);
+    tt_int_op(choice, OP_LT, 10);
+    histogram[choice]++;
+  }
+  alias_table_free(table);
+  table = NULL;
+
+  max_sq_error = 0;
+  for (i=0; i<10; ++i) {
+    int expected = (int)(n*vals[i]/total);
+    double frac_diff = 0, sq;
+    TT_BLATHER(("  %d : %5d vs %5d\n", (int)vals[i], histogram[i], expected));
+    if (expected)
+      frac_diff = (histogram[i] - expected) / ((double)expected);
+    else
+      tt_int_op(histogram[i], OP_EQ, 0);
+
+    sq = frac_diff * frac_diff;
+    if (sq > max_sq_error)
+      max_sq_error = sq;
+  }
+  tt_double_op(max_sq_error, OP_LT, .05);
+
+  /* A singleton always gets chosen, even with weight 0. */
+  vals[0] = 0;
+  table = alias_table_new(vals, 1);
+  for (i = 0; i < 100; ++i) {
+    choice = alias_table_choose(table);
+    tt_int_op(choice, OP_EQ, 0);
+  }
+  alias_table_free(table);
+  table = NULL;
+
+  /* All zeros: choose uniformly. */
+  memset(histogram,0,sizeof(histogram));
+  for (i = 0; i < 5; ++i)
+    vals[i] = 0;
+  table = alias_table_new(vals, 5);
+  for (i = 0; i < n; ++i) {
+    choice = alias_table_choose(table);
+    tt_int_op(choice, OP_GE, 0);
+    tt_int_op(choice, OP_LT, 5);
+    histogram[choice]++;
+  }
+  alias_table_free(table);
+  table = NULL;
+  max_sq_error = 0;
+  for (i=0; i<5; ++i) {
+    int expected = n/5;
+    double frac_diff = 0, sq;
+    frac_diff = (histogram[i] - expected) / ((double)expected);
+    sq = frac_diff * frac_diff;
+    if (sq > max_sq_error)
+      max_sq_error = sq;
+  }
+  tt_double_op(max_sq_error, OP_LT, .05);
+
+  /* An empty table has nothing to choose. */
+  table = alias_table_new(vals, 0);
+  tt_int_op(alias_table_choose(table), OP_EQ, -1);
+
+ done:
+  alias_table_free(table);
+}
+
 /* Function pointers for test_dir_clip_unmeasured_bw_kb() */
 
 static uint32_t alternate_clip_bw = 0;
@@ -3516,6 +3635,8 @@ struct testcase_t dir_tests[] = {
   DIR_LEGACY(param_voting),
   DIR_LEGACY(v3_networkstatus),
   DIR(random_weighted, 0),
+  DIR(alias_table, 0),
+  DIR(lazy_fields_eq, 0),
   DIR(scale_bw, 0),
   DIR_LEGACY(clip_unmeasured_bw_kb),
   DIR_LEGACY(clip_unmeasured_bw_kb_alt),
@@ -8,6 +8,7 @@
 #define CONNECTION_PRIVATE
 #define CONFIG_PRIVATE
 #define RENDCACHE_PRIVATE
+#define DIRSERV_PRIVATE
 
 #include "or.h"
 #include "config.h"
@@ -607,6 +608,120 @@ test_dir_handle_get_micro_d(void *data)
     microdesc_free_all();
 }
 
+static void
+test_dir_handle_get_micro_d_compressed_bundle(void *data)
+{
+  dir_connection_t *conn = NULL;
+  microdesc_cache_t *mc = NULL ;
+  smartlist_t *list = NULL;
+  char digest[DIGEST256_LEN];
+  char digest_base64[128];
+  char *path = NULL;
+  char *header = NULL;
+  char *body = NULL;
+  char *uncompressed = NULL;
+  size_t body_used = 0, uncompressed_len = 0;
+  int i;
+  (void) data;
+
+  MOCK(get_options, mock_get_options);
+  MOCK(connection_write_to_buf_impl_, connection_write_to_buf_mock);
+
+  /* SETUP */
+  init_mock_options();
+  const char *fn = get_fname("dir_handle_datadir_test_bundle");
+  mock_options->DataDirectory = tor_strdup(fn);
+
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(mock_options->DataDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(mock_options->DataDirectory, 0700));
+#endif
+
+  crypto_digest256(digest, microdesc, strlen(microdesc), DIGEST_SHA256);
+  base64_encode_nopad(digest_base64, sizeof(digest_base64),
+                      (uint8_t *) digest, DIGEST256_LEN);
+
+  mc = get_microdesc_cache();
+  list = microdescs_add_to_cache(mc, microdesc, NULL, SAVED_NOWHERE, 0,
+                                  time(NULL), NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(list));
+  tor_asprintf(&path, MICRODESC_GET("%s.z"), digest_base64);
+
+  /* The first request is compressed on the fly.  (Our mock
+   * connection_write_to_buf_impl_() doesn't really compress.) */
+  conn = dir_connection_new(tor_addr_family(&MOCK_TOR_ADDR));
+  tt_int_op(directory_handle_command_get(conn, path, NULL, 0), OP_EQ, 0);
+  fetch_from_buf_http(TO_CONN(conn)->outbuf, &header, MAX_HEADERS_SIZE,
+                      &body, &body_used, strlen(microdesc)+1, 0);
+  tt_assert(strstr(header, "Content-Encoding: deflate\r\n"));
+  tt_str_op(body, OP_EQ, microdesc);
+  tt_int_op(dirserv_get_n_compressed_microdesc_bundles(), OP_EQ, 0);
+  connection_free_(TO_CONN(conn));
+  conn = NULL;
+  tor_free(header);
+  tor_free(body);
+
+  /* After that, the set is popular, and everybody gets the same
+   * precompressed copy. */
+  for (i = 0; i < 2; ++i) {
+    conn = dir_connection_new(tor_addr_family(&MOCK_TOR_ADDR));
+    tt_int_op(directory_handle_command_get(conn, path, NULL, 0), OP_EQ, 0);
+    fetch_from_buf_http(TO_CONN(conn)->outbuf, &header, MAX_HEADERS_SIZE,
+                        &body, &body_used, 4096, 0);
+    tt_assert(strstr(header, "Content-Encoding: deflate\r\n"));
+    tt_int_op(dirserv_get_n_compressed_microdesc_bundles(), OP_EQ, 1);
+    tt_int_op(0, OP_EQ, tor_gzip_uncompress(&uncompressed, &uncompressed_len,
+                                           body, body_used, ZLIB_METHOD,
+                                           1, LOG_WARN));
+    tt_int_op(uncompressed_len, OP_EQ, strlen(microdesc));
+    tt_mem_op(uncompressed, OP_EQ, microdesc, uncompressed_len);
+    connection_free_(TO_CONN(conn));
+    conn = NULL;
+    tor_free(header);
+    tor_free(body);
+    tor_free(uncompressed);
+  }
+
+  /* A client asking for the same set plus a microdescriptor we don't have
+   * gets the same copy, since we'd only send it the one we have. */
+  tor_free(path);
+  tor_asprintf(&path, MICRODESC_GET("%s-%s.z"), digest_base64, B64_256_1);
+  conn = dir_connection_new(tor_addr_family(&MOCK_TOR_ADDR));
+  tt_int_op(directory_handle_command_get(conn, path, NULL, 0), OP_EQ, 0);
+  fetch_from_buf_http(TO_CONN(conn)->outbuf, &header, MAX_HEADERS_SIZE,
+                      &body, &body_used, 4096, 0);
+  tt_int_op(dirserv_get_n_compressed_microdesc_bundles(), OP_EQ, 1);
+  tt_int_op(0, OP_EQ, tor_gzip_uncompress(&uncompressed, &uncompressed_len,
+                                         body, body_used, ZLIB_METHOD,
+                                         1, LOG_WARN));
+  tt_mem_op(uncompressed, OP_EQ, microdesc, uncompressed_len);
+  connection_free_(TO_CONN(conn));
+  conn = NULL;
+  tor_free(header);
+  tor_free(body);
+  tor_free(uncompressed);
+
+  /* A new microdesc consensus empties the cache. */
+  dirserv_clear_microdesc_bundles();
+  tt_int_op(dirserv_get_n_compressed_microdesc_bundles(), OP_EQ, 0);
+
+  done:
+    UNMOCK(get_options);
+    UNMOCK(connection_write_to_buf_impl_);
+
+    or_options_free(mock_options); mock_options = NULL;
+    if (conn)
+      connection_free_(TO_CONN(conn));
+    tor_free(header);
+    tor_free(body);
+    tor_free(uncompressed);
+    tor_free(path);
+    smartlist_free(list);
+    dirserv_clear_microdesc_bundles();
+    microdesc_free_all();
+}
+
 static void
 test_dir_handle_get_micro_d_server_busy(void *data)
 {
@@ -2504,6 +2619,7 @@ struct testcase_t dir_handle_get_tests[] = {
   DIR_HANDLE_CMD(micro_d_not_found, 0),
   DIR_HANDLE_CMD(micro_d_server_busy, 0),
   DIR_HANDLE_CMD(micro_d, 0),
+  DIR_HANDLE_CMD(micro_d_compressed_bundle, 0),
   DIR_HANDLE_CMD(networkstatus_bridges_not_found_without_auth, 0),
   DIR_HANDLE_CMD(networkstatus_bridges_not_found_wrong_auth, 0),
   DIR_HANDLE_CMD(networkstatus_bridges, 0),
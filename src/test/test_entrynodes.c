@@ -12,6 +12,7 @@
 #include "entrynodes.h"
 #include "routerparse.h"
 #include "nodelist.h"
+#include "policies.h"
 #include "util.h"
 #include "routerlist.h"
 #include "routerset.h"
@@ -105,6 +106,7 @@ test_choose_random_entry_one_possible_guard(void *arg)
   our_nodelist = nodelist_get_list();
   the_guard = smartlist_get(our_nodelist, 4); /* chosen by fair dice roll */
   the_guard->is_possible_guard = 1;
+  nodelist_snapshot_mark_dirty();
 
   /* Pick an entry. Make sure we pick the node we marked as guard. */
   chosen_entry = choose_random_entry(NULL);
@@ -114,6 +116,138 @@ test_choose_random_entry_one_possible_guard(void *arg)
   ;
 }
 
+/** Test that the node snapshot matches the nodelist, that it notices
+ * changes to node flags, and that router_choose_random_node() honors the
+ * exclusions it's given when scanning it. */
+static void
+test_node_snapshot(void *arg)
+{
+  const node_snapshot_t *snap;
+  smartlist_t *our_nodelist = NULL;
+  smartlist_t *excluded = smartlist_new();
+  node_t *the_node = NULL;
+  const node_t *chosen = NULL;
+  int i;
+
+  (void) arg;
+
+  our_nodelist = nodelist_get_list();
+  snap = nodelist_get_snapshot();
+  tt_int_op(snap->n_nodes, OP_EQ, smartlist_len(our_nodelist));
+  for (i = 0; i < snap->n_nodes; ++i) {
+    const uint16_t want = NODE_SNAP_RUNNING | NODE_SNAP_VALID |
+      NODE_SNAP_HAS_DESC | NODE_SNAP_GENERAL | NODE_SNAP_HAS_BW;
+    tt_ptr_op(snap->nodes[i], OP_EQ, smartlist_get(our_nodelist, i));
+    tt_int_op(snap->flags[i] & want, OP_EQ, want);
+    tt_assert(! (snap->flags[i] & NODE_SNAP_GUARD));
+    tt_u64_op(snap->bandwidth[i], OP_GT, 0);
+    tt_int_op(snap->ipv4h_addr[i], OP_EQ,
+              node_get_prim_addr_ipv4h(snap->nodes[i]));
+  }
+
+  /* Flag changes show up once the snapshot is marked dirty. */
+  the_node = smartlist_get(our_nodelist, 2);
+  the_node->is_possible_guard = 1;
+  nodelist_snapshot_mark_dirty();
+  snap = nodelist_get_snapshot();
+  tt_assert(snap->flags[2] & NODE_SNAP_GUARD);
+  tt_assert(! (snap->flags[3] & NODE_SNAP_GUARD));
+
+  /* Exclude every node but one, and make sure that's the one we get. */
+  SMARTLIST_FOREACH(our_nodelist, node_t *, node,
+                    if (node_sl_idx != 5) smartlist_add(excluded, node));
+  chosen = router_choose_random_node(excluded, NULL, 0);
+  tt_ptr_op(chosen, OP_EQ, smartlist_get(our_nodelist, 5));
+
+  /* Then exclude that one too. */
+  smartlist_add(excluded, smartlist_get(our_nodelist, 5));
+  chosen = router_choose_random_node(excluded, NULL, 0);
+  tt_ptr_op(chosen, OP_EQ, NULL);
+
+ done:
+  smartlist_free(excluded);
+}
+
+/** Helper: replace the exit policy of <b>node</b>'s routerinfo with
+ * <b>policy_str</b>. */
+static void
+set_node_exit_policy(node_t *node, const char *policy_str)
+{
+  config_line_t line;
+  line.key = (char*)"ExitPolicy";
+  line.value = (char*)policy_str;
+  line.next = NULL;
+
+  addr_policy_list_free(node->ri->exit_policy);
+  compiled_addr_policy_free(node->ri->compiled_exit_policy);
+  node->ri->exit_policy = NULL;
+  policies_parse_exit_policy(&line, &node->ri->exit_policy,
+                             EXIT_POLICY_IPV6_ENABLED, NULL);
+  node->ri->compiled_exit_policy =
+    addr_policy_compile(node->ri->exit_policy);
+}
+
+/** Test that the exit port index agrees with each node's exit policy, and
+ * that it notices when those policies change. */
+static void
+test_node_exit_port_index(void *arg)
+{
+  static const uint16_t ports[] = {
+    1, 20, 24, 25, 26, 79, 80, 81, 443, 1024, 1025, 6666, 6667, 65535
+  };
+  smartlist_t *our_nodelist = NULL;
+  const bitarray_t *exits;
+  unsigned i;
+
+  (void) arg;
+
+  our_nodelist = nodelist_get_list();
+  tt_int_op(smartlist_len(our_nodelist), OP_GE, 4);
+  SMARTLIST_FOREACH(our_nodelist, node_t *, node, tt_assert(node->ri));
+
+  set_node_exit_policy(smartlist_get(our_nodelist, 0),
+                       "accept *:80,accept *:443,reject *:*");
+  set_node_exit_policy(smartlist_get(our_nodelist, 1),
+                       "reject *:25,accept *:1-1024,reject *:*");
+  set_node_exit_policy(smartlist_get(our_nodelist, 2),
+                       "reject 10.0.0.0/8:*,reject *:6660-6669,accept *:*");
+  set_node_exit_policy(smartlist_get(our_nodelist, 3), "reject *:*");
+  nodelist_snapshot_mark_dirty();
+
+  for (i = 0; i < ARRAY_LENGTH(ports); ++i) {
+    exits = nodelist_get_exits_for_port(ports[i]);
+    SMARTLIST_FOREACH_BEGIN(our_nodelist, const node_t *, node) {
+      addr_policy_result_t r =
+        compare_tor_addr_to_node_policy(NULL, ports[i], node);
+      int allowed = (r != ADDR_POLICY_REJECTED &&
+                     r != ADDR_POLICY_PROBABLY_REJECTED);
+      tt_int_op(!!bitarray_is_set((bitarray_t*)exits, node_sl_idx), OP_EQ,
+                allowed);
+    } SMARTLIST_FOREACH_END(node);
+  }
+
+  exits = nodelist_get_exits_for_port(443);
+  tt_assert(bitarray_is_set((bitarray_t*)exits, 0));
+  tt_assert(bitarray_is_set((bitarray_t*)exits, 1));
+  tt_assert(bitarray_is_set((bitarray_t*)exits, 2));
+  tt_assert(! bitarray_is_set((bitarray_t*)exits, 3));
+  exits = nodelist_get_exits_for_port(25);
+  tt_assert(! bitarray_is_set((bitarray_t*)exits, 0));
+  tt_assert(! bitarray_is_set((bitarray_t*)exits, 1));
+  tt_assert(bitarray_is_set((bitarray_t*)exits, 2));
+  exits = nodelist_get_exits_for_port(6667);
+  tt_assert(! bitarray_is_set((bitarray_t*)exits, 2));
+
+  /* Once a node turns out to reject everything, it leaves the index. */
+  policies_set_node_exitpolicy_to_reject_all(smartlist_get(our_nodelist, 0));
+  exits = nodelist_get_exits_for_port(443);
+  tt_assert(! bitarray_is_set((bitarray_t*)exits, 0));
+  tt_assert(bitarray_is_set((bitarray_t*)exits, 1));
+
+ done:
+  ;
+}
+
 /** Helper to conduct tests for populate_live_entry_guards().
 
    This test adds some entry guards to our list, and then tests
@@ -631,6 +765,10 @@ static const struct testcase_setup_t fake_network = {
 struct testcase_t entrynodes_tests[] = {
   { "entry_is_time_to_retry", test_entry_is_time_to_retry,
     TT_FORK, NULL, NULL },
+  { "node_snapshot", test_node_snapshot,
+    TT_FORK, &fake_network, NULL },
+  { "node_exit_port_index", test_node_exit_port_index,
+    TT_FORK, &fake_network, NULL },
   { "choose_random_entry_no_guards", test_choose_random_entry_no_guards,
     TT_FORK, &fake_network, NULL },
   { "choose_random_entry_one_possibleguard",
@@ -79,6 +79,7 @@ helper_setup_fake_routerlist(void)
     node->is_valid = 1;
     node->is_possible_guard = 0;
   } SMARTLIST_FOREACH_END(node);
+  nodelist_snapshot_mark_dirty();
 
  done:
   UNMOCK(router_descriptor_is_older_than);
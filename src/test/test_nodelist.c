@@ -7,6 +7,7 @@
  **/
 
 #include "or.h"
+#include "networkstatus.h"
 #include "nodelist.h"
 #include "test.h"
 
@@ -60,12 +61,118 @@ test_nodelist_node_get_verbose_nickname_not_named(void *arg)
   return;
 }
 
+/** Helper: return a new fake consensus listing one running, valid router
+ * for each identity digest whose first byte is in <b>ids</b>.  <b>ids</b>
+ * must be sorted. */
+static networkstatus_t *
+fake_consensus_new(const char *ids)
+{
+  networkstatus_t *ns = tor_malloc_zero(sizeof(networkstatus_t));
+  ns->type = NS_TYPE_CONSENSUS;
+  ns->flavor = FLAV_NS;
+  ns->routerstatus_list = smartlist_new();
+  for ( ; *ids; ++ids) {
+    routerstatus_t *rs = tor_malloc_zero(sizeof(routerstatus_t));
+    memset(rs->identity_digest, *ids, DIGEST_LEN);
+    strlcpy(rs->nickname, "fake", sizeof(rs->nickname));
+    rs->addr = 0x7f000001;
+    rs->or_port = 9001;
+    rs->is_flagged_running = rs->is_valid = 1;
+    smartlist_add(ns->routerstatus_list, rs);
+  }
+  return ns;
+}
+
+/** The consensus that mock_get_latest_consensus() reports as current. */
+static networkstatus_t *mock_latest_consensus = NULL;
+
+static networkstatus_t *
+mock_get_latest_consensus(void)
+{
+  return mock_latest_consensus;
+}
+
+/** Test that nodelist_set_consensus() updates the nodelist correctly when
+ * it can diff the new consensus against the old one, and when it can't. */
+static void
+test_nodelist_set_consensus_incremental(void *arg)
+{
+  networkstatus_t *ns1 = NULL, *ns2 = NULL, *ns3 = NULL;
+  char id[DIGEST_LEN];
+  const node_t *node;
+  routerstatus_t *rs;
+
+  (void) arg;
+
+  MOCK(networkstatus_get_latest_consensus, mock_get_latest_consensus);
+
+  ns1 = fake_consensus_new("ABC");
+  mock_latest_consensus = ns1;
+  nodelist_set_consensus(ns1);
+  tt_int_op(smartlist_len(nodelist_get_list()), OP_EQ, 3);
+
+  /* Mark B as down; the next consensus should bring it back. */
+  memset(id, 'B', DIGEST_LEN);
+  router_set_status(id, 0);
+  tt_int_op(node_get_by_id(id)->is_running, OP_EQ, 0);
+
+  /* A goes away, D arrives, and C becomes fast. */
+  ns2 = fake_consensus_new("BCD");
+  rs = smartlist_get(ns2->routerstatus_list, 1);
+  rs->is_fast = 1;
+  mock_latest_consensus = ns2;
+  nodelist_set_consensus(ns2);
+  networkstatus_vote_free(ns1);
+  ns1 = NULL;
+  nodelist_assert_ok();
+
+  tt_int_op(smartlist_len(nodelist_get_list()), OP_EQ, 3);
+  memset(id, 'A', DIGEST_LEN);
+  tt_ptr_op(node_get_by_id(id), OP_EQ, NULL);
+  memset(id, 'B', DIGEST_LEN);
+  node = node_get_by_id(id);
+  tt_assert(node);
+  tt_ptr_op(node->rs, OP_EQ, smartlist_get(ns2->routerstatus_list, 0));
+  tt_int_op(node->is_running, OP_EQ, 1);
+  tt_int_op(node->is_fast, OP_EQ, 0);
+  memset(id, 'C', DIGEST_LEN);
+  node = node_get_by_id(id);
+  tt_assert(node);
+  tt_ptr_op(node->rs, OP_EQ, rs);
+  tt_int_op(node->is_fast, OP_EQ, 1);
+  memset(id, 'D', DIGEST_LEN);
+  node = node_get_by_id(id);
+  tt_assert(node);
+  tt_ptr_op(node->rs, OP_EQ, smartlist_get(ns2->routerstatus_list, 2));
+
+  /* Once the old consensus is gone, we rebuild from scratch. */
+  networkstatus_vote_free(ns2);
+  ns2 = NULL;
+  ns3 = fake_consensus_new("DE");
+  mock_latest_consensus = ns3;
+  nodelist_set_consensus(ns3);
+  tt_int_op(smartlist_len(nodelist_get_list()), OP_EQ, 2);
+  memset(id, 'E', DIGEST_LEN);
+  node = node_get_by_id(id);
+  tt_assert(node);
+  tt_ptr_op(node->rs, OP_EQ, smartlist_get(ns3->routerstatus_list, 1));
+
+ done:
+  UNMOCK(networkstatus_get_latest_consensus);
+  mock_latest_consensus = NULL;
+  nodelist_free_all();
+  networkstatus_vote_free(ns1);
+  networkstatus_vote_free(ns2);
+  networkstatus_vote_free(ns3);
+}
+
 #define NODE(name, flags) \
   { #name, test_nodelist_##name, (flags), NULL, NULL }
 
 struct testcase_t nodelist_tests[] = {
   NODE(node_get_verbose_nickname_by_id_null_node, TT_FORK),
   NODE(node_get_verbose_nickname_not_named, TT_FORK),
+  NODE(set_consensus_incremental, TT_FORK),
   END_OF_TESTCASES
 };
 
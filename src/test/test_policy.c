@@ -1036,6 +1036,144 @@ test_policies_getinfo_helper_policies(void *arg)
   smartlist_free(mock_my_routerinfo.exit_policy);
 }
 
+/** Helper: assert that the compiled form of <b>policy</b> agrees with the
+ * linear matcher about <b>addr</b> at a handful of ports around <b>port</b>,
+ * and at a random port. */
+static void
+test_policy_compiled_check_addr(const smartlist_t *policy,
+                                const compiled_addr_policy_t *compiled,
+                                const tor_addr_t *addr, int port)
+{
+  int ports[4], i;
+  ports[0] = port - 1;
+  ports[1] = port;
+  ports[2] = port + 1;
+  ports[3] = 1 + crypto_rand_int(65535);
+  for (i = 0; i < 4; ++i) {
+    if (ports[i] < 1 || ports[i] > 65535)
+      continue;
+    tt_int_op(compare_tor_addr_to_addr_policy(addr, ports[i], policy), OP_EQ,
+              compare_tor_addr_to_compiled_policy(addr, ports[i], policy,
+                                                  compiled));
+  }
+ done:
+  ;
+}
+
+/** Helper: parse <b>policy_str</b> as an exit policy with <b>options</b>,
+ * compile it, and check the compiled form against the linear matcher at
+ * random addresses inside and around the prefixes of every entry, and at
+ * ports on and next to the edges of every entry's port range. */
+static void
+test_policy_compiled_helper(const char *policy_str,
+                            exit_policy_parser_cfg_t options)
+{
+  config_line_t line;
+  smartlist_t *policy = NULL;
+  compiled_addr_policy_t *compiled = NULL;
+  tor_addr_t addr;
+  uint8_t buf[16];
+  int i;
+
+  line.key = (char*)"foo";
+  line.value = (char*)policy_str;
+  line.next = NULL;
+
+  tt_int_op(0, OP_EQ, policies_parse_exit_policy(&line, &policy, options,
+                                                 NULL));
+  compiled = addr_policy_compile(policy);
+  tt_assert(compiled);
+
+  SMARTLIST_FOREACH_BEGIN(policy, const addr_policy_t *, p) {
+    sa_family_t fam = tor_addr_family(&p->addr);
+    int maxbits = (fam == AF_INET6) ? 128 : 32;
+    int keep;
+    if (fam != AF_INET && fam != AF_INET6)
+      continue;
+    /* Try the entry's own address, then addresses that share a random
+     * number of leading bits with it, including some that fall just outside
+     * its prefix. */
+    for (i = 0; i < 16; ++i) {
+      keep = i ? crypto_rand_int(maxbits + 1) : maxbits;
+      crypto_rand((char*)buf, sizeof(buf));
+      if (fam == AF_INET) {
+        uint32_t a = tor_addr_to_ipv4h(&p->addr);
+        uint32_t mask = keep ? (0xffffffffu << (32 - keep)) : 0;
+        tor_addr_from_ipv4h(&addr, (a & mask) | (get_uint32(buf) & ~mask));
+      } else {
+        const uint8_t *a = tor_addr_to_in6_addr8(&p->addr);
+        int b;
+        for (b = 0; b < keep; ++b) {
+          uint8_t bit = 0x80 >> (b & 7);
+          buf[b >> 3] = (buf[b >> 3] & ~bit) | (a[b >> 3] & bit);
+        }
+        tor_addr_from_ipv6_bytes(&addr, (const char*)buf);
+      }
+      test_policy_compiled_check_addr(policy, compiled, &addr, p->prt_min);
+      test_policy_compiled_check_addr(policy, compiled, &addr, p->prt_max);
+    }
+  } SMARTLIST_FOREACH_END(p);
+
+  /* And some completely random addresses. */
+  for (i = 0; i < 64; ++i) {
+    crypto_rand((char*)buf, sizeof(buf));
+    if (i & 1)
+      tor_addr_from_ipv4h(&addr, get_uint32(buf));
+    else
+      tor_addr_from_ipv6_bytes(&addr, (const char*)buf);
+    test_policy_compiled_check_addr(policy, compiled, &addr,
+                                    1 + crypto_rand_int(65535));
+  }
+
+  /* Unknown addresses and ports still get the linear matcher's answer. */
+  tor_addr_make_unspec(&addr);
+  tt_int_op(compare_tor_addr_to_addr_policy(&addr, 80, policy), OP_EQ,
+            compare_tor_addr_to_compiled_policy(&addr, 80, policy,
+                                                compiled));
+  tor_addr_from_ipv4h(&addr, 0x01020304u);
+  tt_int_op(compare_tor_addr_to_addr_policy(&addr, 0, policy), OP_EQ,
+            compare_tor_addr_to_compiled_policy(&addr, 0, policy, compiled));
+
+ done:
+  compiled_addr_policy_free(compiled);
+  addr_policy_list_free(policy);
+}
+
+/** Check that compiled address policies match addresses and ports exactly as
+ * compare_tor_addr_to_addr_policy() does. */
+static void
+test_policies_compiled(void *arg)
+{
+  const exit_policy_parser_cfg_t opts =
+    EXIT_POLICY_IPV6_ENABLED | EXIT_POLICY_ADD_DEFAULT;
+  (void)arg;
+
+  tt_ptr_op(NULL, OP_EQ, addr_policy_compile(NULL));
+
+  /* The default exit policy, with and without private addresses. */
+  test_policy_compiled_helper("", opts);
+  test_policy_compiled_helper("", opts | EXIT_POLICY_REJECT_PRIVATE);
+  /* Overlapping prefixes whose ports overlap in different orders. */
+  test_policy_compiled_helper(
+      "reject 18.0.0.0/8:1-100,accept 18.244.0.0/16:50-60,"
+      "accept 18.244.7.0/24:*,reject 18.244.7.9:443,"
+      "accept 18.0.0.0/8:20-30,reject 0.0.0.0/1:25,accept *:25,"
+      "reject 128.0.0.0/1:1000-2000,accept 18.244.7.9:443-8080", opts);
+  /* IPv6 entries of various lengths, mixed with IPv4 ones. */
+  test_policy_compiled_helper(
+      "accept6 [2001:db8::]/32:80,reject6 [2001:db8:1::]/48:*,"
+      "accept6 [2001:db8:1::1]:22,reject [2001:db8::]/16:443,"
+      "accept *4:443,reject6 [::]/0:1-1024,accept 10.0.0.0/8:*,"
+      "reject *:*", opts);
+  /* Accept everything apart from a few holes. */
+  test_policy_compiled_helper(
+      "reject 1.2.3.4:25,reject6 [fe80::]/10:*,reject *:6667,accept *:*",
+      EXIT_POLICY_IPV6_ENABLED);
+
+ done:
+  ;
+}
+
 #undef DEFAULT_POLICY_STRING
 #undef TEST_IPV4_ADDR
 #undef TEST_IPV6_ADDR
@@ -1043,6 +1181,7 @@ test_policies_getinfo_helper_policies(void *arg)
 struct testcase_t policy_tests[] = {
   { "router_dump_exit_policy_to_string", test_dump_exit_policy_to_string, 0,
     NULL, NULL },
+  { "compiled", test_policies_compiled, 0, NULL, NULL },
   { "general", test_policies_general, 0, NULL, NULL },
   { "getinfo_helper_policies", test_policies_getinfo_helper_policies, 0, NULL,
     NULL },
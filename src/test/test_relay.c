@@ -1,9 +1,23 @@
 /* Copyright (c) 2014-2015, The Tor Project, Inc. */
 /* See LICENSE for licensing information */
 
+#include "orconfig.h"
+
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
 #include "or.h"
+#include "compat_libevent.h"
 #define CIRCUITBUILD_PRIVATE
 #include "circuitbuild.h"
+#define CIRCUITLIST_PRIVATE
+#include "circuitlist.h"
+#include "config.h"
+#include "cpuworker.h"
+#include "onion.h"
 #define RELAY_PRIVATE
 #include "relay.h"
 /* For init/free stuff */
@@ -118,9 +132,182 @@ test_relay_append_cell_to_circuit_queue(void *arg)
   return;
 }
 
+/** Cells passed to append_cell_to_circuit_queue_mock(), in order. */
+static smartlist_t *appended_cells = NULL;
+
+static void
+append_cell_to_circuit_queue_mock(circuit_t *circ, channel_t *chan,
+                                  cell_t *cell, cell_direction_t direction,
+                                  streamid_t fromstream)
+{
+  (void)circ;
+  (void)chan;
+  (void)fromstream;
+  tt_int_op(direction, OP_EQ, CELL_DIRECTION_IN);
+  smartlist_add(appended_cells, tor_memdup(cell, sizeof(cell_t)));
+ done:
+  ;
+}
+
+/** Onion handshake workers copy our onion keys when they start; we have
+ * none in the unit tests, so give them empty ones instead. */
+static server_onion_keys_t *
+server_onion_keys_new_mock(void)
+{
+  return tor_malloc_zero(sizeof(server_onion_keys_t));
+}
+
+/** Start a relay crypto thread, and return a new OR circuit whose inbound
+ * crypto state matches *<b>cipher_out</b> and *<b>digest_out</b>. */
+static or_circuit_t *
+setup_relay_crypt_threads(crypto_cipher_t **cipher_out,
+                          crypto_digest_t **digest_out)
+{
+  tor_libevent_cfg cfg;
+  or_circuit_t *or_circ;
+  char key[CIPHER_KEY_LEN];
+
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+  get_options_mutable()->RelayCryptoThreads = 1;
+  MOCK(server_onion_keys_new, server_onion_keys_new_mock);
+  cpu_init();
+  tor_assert(cpuworker_relay_crypto_enabled());
+
+  crypto_rand(key, sizeof(key));
+  or_circ = or_circuit_new(0, NULL);
+  or_circ->p_crypto = crypto_cipher_new(key);
+  or_circ->p_digest = crypto_digest_new();
+  crypto_digest_add_bytes(or_circ->p_digest, "xyzzy", 5);
+  *cipher_out = crypto_cipher_new(key);
+  *digest_out = crypto_digest_new();
+  crypto_digest_add_bytes(*digest_out, "xyzzy", 5);
+
+  appended_cells = smartlist_new();
+  MOCK(append_cell_to_circuit_queue, append_cell_to_circuit_queue_mock);
+  return or_circ;
+}
+
+#define N_RELAY_CRYPT_CELLS 40
+
+static void
+test_relay_crypt_threads_order(void *arg)
+{
+  or_circuit_t *or_circ;
+  crypto_cipher_t *cipher = NULL;
+  crypto_digest_t *digest = NULL;
+  channel_t *pchan = new_fake_channel();
+  cell_t *expected = tor_calloc(N_RELAY_CRYPT_CELLS, sizeof(cell_t));
+  int i;
+
+  (void)arg;
+  or_circ = setup_relay_crypt_threads(&cipher, &digest);
+  or_circ->p_chan = pchan;
+
+  /* Queue a mix of cells that we relay and cells that we originate.  The
+   * first one goes to a worker right away; the rest have to wait for it,
+   * and then go as a single batch. */
+  for (i = 0; i < N_RELAY_CRYPT_CELLS; ++i) {
+    const int originated = (i % 3 == 0);
+    cell_t cell;
+    memset(&cell, 0, sizeof(cell));
+    cell.command = CELL_RELAY;
+    crypto_rand((char*)cell.payload, sizeof(cell.payload));
+    memcpy(&expected[i], &cell, sizeof(cell));
+    relay_crypt_inbound_cell(digest, cipher, &expected[i], originated);
+    tt_int_op(0, OP_EQ,
+              cpuworker_queue_relay_cell(or_circ, &cell, 0, originated));
+  }
+  /* Until the replies come back, the cells count as queued. */
+  tt_int_op(or_circ->relaycrypt_n_cells, OP_EQ, N_RELAY_CRYPT_CELLS);
+  tt_int_op(n_cells_in_circ_queues(TO_CIRCUIT(or_circ)), OP_EQ,
+            N_RELAY_CRYPT_CELLS);
+  tt_assert(cpuworker_relay_crypto_get_total_allocation() > 0);
+
+  while (smartlist_len(appended_cells) < N_RELAY_CRYPT_CELLS)
+    event_base_loop(tor_libevent_get_base(), EVLOOP_ONCE);
+
+  /* Every cell came back crypted, in the order we queued it. */
+  tt_int_op(smartlist_len(appended_cells), OP_EQ, N_RELAY_CRYPT_CELLS);
+  for (i = 0; i < N_RELAY_CRYPT_CELLS; ++i) {
+    const cell_t *cell = smartlist_get(appended_cells, i);
+    tt_mem_op(cell->payload, OP_EQ, expected[i].payload, CELL_PAYLOAD_SIZE);
+  }
+  tt_int_op(or_circ->relaycrypt_n_cells, OP_EQ, 0);
+  tt_ptr_op(or_circ->relaycrypt_inflight, OP_EQ, NULL);
+  tt_ptr_op(or_circ->relaycrypt_waiting, OP_EQ, NULL);
+  tt_int_op(cpuworker_relay_crypto_get_total_allocation(), OP_EQ, 0);
+
+ done:
+  UNMOCK(append_cell_to_circuit_queue);
+  UNMOCK(server_onion_keys_new);
+  or_circ->p_chan = NULL;
+  circuit_free(TO_CIRCUIT(or_circ));
+  free_fake_channel(pchan);
+  crypto_cipher_free(cipher);
+  crypto_digest_free(digest);
+  tor_free(expected);
+  SMARTLIST_FOREACH(appended_cells, cell_t *, c, tor_free(c));
+  smartlist_free(appended_cells);
+}
+
+static void
+test_relay_crypt_threads_cancel(void *arg)
+{
+  or_circuit_t *or_circ;
+  crypto_cipher_t *cipher = NULL;
+  crypto_digest_t *digest = NULL;
+  channel_t *pchan = new_fake_channel();
+  cell_t cell;
+  int i;
+
+  (void)arg;
+  or_circ = setup_relay_crypt_threads(&cipher, &digest);
+  or_circ->p_chan = pchan;
+
+  memset(&cell, 0, sizeof(cell));
+  cell.command = CELL_RELAY;
+  for (i = 0; i < N_RELAY_CRYPT_CELLS; ++i) {
+    tt_int_op(0, OP_EQ, cpuworker_queue_relay_cell(or_circ, &cell, 0, 0));
+  }
+  tt_assert(or_circ->relaycrypt_inflight);
+  tt_assert(or_circ->relaycrypt_waiting);
+
+  /* Free the circuit while a worker may still be crypting its first cell.
+   * Either the work gets cancelled, or the worker takes over the crypto
+   * state and frees it when its reply comes back. */
+  or_circ->p_chan = NULL;
+  circuit_free(TO_CIRCUIT(or_circ));
+  or_circ = NULL;
+  while (cpuworker_relay_crypto_get_total_allocation() > 0)
+    event_base_loop(tor_libevent_get_base(), EVLOOP_ONCE);
+
+  /* None of the cells made it onto a queue. */
+  tt_int_op(smartlist_len(appended_cells), OP_EQ, 0);
+
+ done:
+  UNMOCK(append_cell_to_circuit_queue);
+  UNMOCK(server_onion_keys_new);
+  if (or_circ) {
+    or_circ->p_chan = NULL;
+    circuit_free(TO_CIRCUIT(or_circ));
+  }
+  free_fake_channel(pchan);
+  crypto_cipher_free(cipher);
+  crypto_digest_free(digest);
+  SMARTLIST_FOREACH(appended_cells, cell_t *, c, tor_free(c));
+  smartlist_free(appended_cells);
+}
+
+#undef N_RELAY_CRYPT_CELLS
+
 struct testcase_t relay_tests[] = {
   { "append_cell_to_circuit_queue", test_relay_append_cell_to_circuit_queue,
     TT_FORK, NULL, NULL },
+  { "crypt_threads_order", test_relay_crypt_threads_order,
+    TT_FORK, NULL, NULL },
+  { "crypt_threads_cancel", test_relay_crypt_threads_cancel,
+    TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
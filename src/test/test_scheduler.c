@@ -14,6 +14,7 @@
 
 #define TOR_CHANNEL_INTERNAL_
 #define CHANNEL_PRIVATE_
+#define COMPAT_PRIVATE
 #include "or.h"
 #include "compat_libevent.h"
 #include "channel.h"
@@ -44,6 +45,10 @@ static circuitmux_policy_t *mock_cgp_val_2 = NULL;
 static int scheduler_compare_channels_mock_ctr = 0;
 static int scheduler_run_mock_ctr = 0;
 
+static channel_t *mock_bucket_chan[3] = { NULL, NULL, NULL };
+static int mock_bucket_val[3] = { 0, 0, 0 };
+static int mock_kist_cells_writeable_val = 0;
+
 static void channel_flush_some_cells_mock_free_all(void);
 static void channel_flush_some_cells_mock_set(channel_t *chan,
                                               ssize_t num_cells);
@@ -61,14 +66,20 @@ static const circuitmux_policy_t * circuitmux_get_policy_mock(
     circuitmux_t *cmux);
 static int scheduler_compare_channels_mock(const void *c1_v,
                                            const void *c2_v);
+static int scheduler_get_channel_bucket_mock(channel_t *chan);
+static int scheduler_kist_cells_writeable_mock(channel_t *chan);
 static void scheduler_run_noop_mock(void);
 static struct event_base * tor_libevent_get_base_mock(void);
 
 /* Scheduler test cases */
 static void test_scheduler_channel_states(void *arg);
+static void test_scheduler_buckets(void *arg);
 static void test_scheduler_compare_channels(void *arg);
 static void test_scheduler_initfree(void *arg);
+static void test_scheduler_kist_loop(void *arg);
+static void test_scheduler_kist_socket_limit(void *arg);
 static void test_scheduler_loop(void *arg);
+static void test_scheduler_priority_to_bucket(void *arg);
 static void test_scheduler_queue_heuristic(void *arg);
 
 /* Mock event init/free */
@@ -304,6 +315,26 @@ scheduler_compare_channels_mock(const void *c1_v,
   else return -1;
 }
 
+static int
+scheduler_get_channel_bucket_mock(channel_t *chan)
+{
+  int i;
+
+  for (i = 0; i < 3; ++i) {
+    if (chan == mock_bucket_chan[i]) return mock_bucket_val[i];
+  }
+
+  return 0;
+}
+
+static int
+scheduler_kist_cells_writeable_mock(channel_t *chan)
+{
+  (void)chan;
+
+  return mock_kist_cells_writeable_val;
+}
+
 static void
 scheduler_run_noop_mock(void)
 {
@@ -324,13 +355,13 @@ test_scheduler_channel_states(void *arg)
   channel_t *ch1 = NULL, *ch2 = NULL;
   int old_count;
 
-  (void)arg;
-
   /* Set up libevent and scheduler */
 
   mock_event_init();
   MOCK(tor_libevent_get_base, tor_libevent_get_base_mock);
   scheduler_init();
+  /* Run with the bucketed queue if we were asked to */
+  if (arg) scheduler_set_queue_type(SCHEDULER_QUEUE_BUCKETS);
   /*
    * Install the compare channels mock so we can test
    * scheduler_touch_channel().
@@ -342,7 +373,7 @@ test_scheduler_channel_states(void *arg)
    */
   MOCK(scheduler_run, scheduler_run_noop_mock);
 
-  tt_int_op(smartlist_len(channels_pending), ==, 0);
+  tt_int_op(scheduler_n_pending(), ==, 0);
 
   /* Set up a fake channel */
   ch1 = new_fake_channel();
@@ -374,7 +405,7 @@ test_scheduler_channel_states(void *arg)
   /* This should send it to SCHED_CHAN_PENDING */
   scheduler_channel_wants_writes(ch1);
   tt_int_op(ch1->scheduler_state, ==, SCHED_CHAN_PENDING);
-  tt_int_op(smartlist_len(channels_pending), ==, 1);
+  tt_int_op(scheduler_n_pending(), ==, 1);
 
   /* Now send ch2 to SCHED_CHAN_WAITING_FOR_CELLS */
   scheduler_channel_wants_writes(ch2);
@@ -391,22 +422,29 @@ test_scheduler_channel_states(void *arg)
   /* ...and this should kick ch2 into SCHED_CHAN_PENDING */
   scheduler_channel_has_waiting_cells(ch2);
   tt_int_op(ch2->scheduler_state, ==, SCHED_CHAN_PENDING);
-  tt_int_op(smartlist_len(channels_pending), ==, 2);
+  tt_int_op(scheduler_n_pending(), ==, 2);
 
   /* This should send ch2 to SCHED_CHAN_WAITING_TO_WRITE */
   scheduler_channel_doesnt_want_writes(ch2);
   tt_int_op(ch2->scheduler_state, ==, SCHED_CHAN_WAITING_TO_WRITE);
-  tt_int_op(smartlist_len(channels_pending), ==, 1);
+  tt_int_op(scheduler_n_pending(), ==, 1);
 
   /* ...and back to SCHED_CHAN_PENDING */
   scheduler_channel_wants_writes(ch2);
   tt_int_op(ch2->scheduler_state, ==, SCHED_CHAN_PENDING);
-  tt_int_op(smartlist_len(channels_pending), ==, 2);
+  tt_int_op(scheduler_n_pending(), ==, 2);
 
   /* Now we exercise scheduler_touch_channel */
   old_count = scheduler_compare_channels_mock_ctr;
   scheduler_touch_channel(ch1);
-  tt_assert(scheduler_compare_channels_mock_ctr > old_count);
+  if (arg) {
+    /* The bucketed queue never compares channels */
+    tt_int_op(scheduler_compare_channels_mock_ctr, ==, old_count);
+  } else {
+    tt_assert(scheduler_compare_channels_mock_ctr > old_count);
+  }
+  tt_int_op(ch1->scheduler_state, ==, SCHED_CHAN_PENDING);
+  tt_int_op(scheduler_n_pending(), ==, 2);
 
   /* Close */
   channel_mark_for_close(ch1);
@@ -437,6 +475,101 @@ test_scheduler_channel_states(void *arg)
   return;
 }
 
+static void
+test_scheduler_buckets(void *arg)
+{
+  channel_t *ch1 = NULL, *ch2 = NULL, *ch3 = NULL;
+
+  (void)arg;
+
+  mock_event_init();
+  MOCK(tor_libevent_get_base, tor_libevent_get_base_mock);
+  scheduler_init();
+  scheduler_set_queue_type(SCHEDULER_QUEUE_BUCKETS);
+  MOCK(scheduler_get_channel_bucket, scheduler_get_channel_bucket_mock);
+  MOCK(scheduler_compare_channels, scheduler_compare_channels_mock);
+  MOCK(scheduler_run, scheduler_run_noop_mock);
+
+  ch1 = new_fake_channel();
+  ch2 = new_fake_channel();
+  ch3 = new_fake_channel();
+  tt_assert(ch1 && ch2 && ch3);
+  ch1->cmux = circuitmux_alloc();
+  ch2->cmux = circuitmux_alloc();
+  ch3->cmux = circuitmux_alloc();
+
+  mock_bucket_chan[0] = ch1;
+  mock_bucket_val[0] = 5;
+  mock_bucket_chan[1] = ch2;
+  mock_bucket_val[1] = 2;
+  mock_bucket_chan[2] = ch3;
+  mock_bucket_val[2] = 5;
+
+  /* Make all three pending */
+  scheduler_channel_wants_writes(ch1);
+  scheduler_channel_has_waiting_cells(ch1);
+  scheduler_channel_wants_writes(ch2);
+  scheduler_channel_has_waiting_cells(ch2);
+  scheduler_channel_wants_writes(ch3);
+  scheduler_channel_has_waiting_cells(ch3);
+  tt_int_op(ch1->scheduler_state, ==, SCHED_CHAN_PENDING);
+  tt_int_op(ch2->scheduler_state, ==, SCHED_CHAN_PENDING);
+  tt_int_op(ch3->scheduler_state, ==, SCHED_CHAN_PENDING);
+  tt_int_op(scheduler_n_pending(), ==, 3);
+  tt_int_op(smartlist_len(channels_pending), ==, 0);
+  tt_int_op(ch1->sched_bucket, ==, 5);
+  tt_int_op(ch2->sched_bucket, ==, 2);
+
+  /* Lowest bucket first, then FIFO within a bucket */
+  tt_ptr_op(scheduler_pending_pop(), ==, ch2);
+  tt_ptr_op(scheduler_pending_pop(), ==, ch1);
+  tt_ptr_op(scheduler_pending_pop(), ==, ch3);
+  tt_ptr_op(scheduler_pending_pop(), ==, NULL);
+  tt_int_op(scheduler_n_pending(), ==, 0);
+
+  /* Put them back; touching ch3 after its priority improves moves it up */
+  ch1->scheduler_state = ch2->scheduler_state = ch3->scheduler_state =
+    SCHED_CHAN_WAITING_TO_WRITE;
+  scheduler_channel_wants_writes(ch1);
+  scheduler_channel_wants_writes(ch2);
+  scheduler_channel_wants_writes(ch3);
+  tt_int_op(scheduler_n_pending(), ==, 3);
+  mock_bucket_val[2] = 0;
+  scheduler_touch_channel(ch3);
+  tt_int_op(ch3->sched_bucket, ==, 0);
+  /* Touching ch1 without a change keeps it where it was */
+  scheduler_touch_channel(ch1);
+  tt_int_op(ch1->sched_bucket, ==, 5);
+
+  /* Removing a channel takes it out of its bucket */
+  scheduler_channel_doesnt_want_writes(ch2);
+  tt_int_op(ch2->scheduler_state, ==, SCHED_CHAN_WAITING_TO_WRITE);
+  tt_int_op(scheduler_n_pending(), ==, 2);
+
+  /* Switching to the heap moves the pending channels over */
+  scheduler_set_queue_type(SCHEDULER_QUEUE_HEAP);
+  tt_int_op(scheduler_n_pending(), ==, 2);
+  tt_int_op(smartlist_len(channels_pending), ==, 2);
+  scheduler_set_queue_type(SCHEDULER_QUEUE_BUCKETS);
+  tt_int_op(smartlist_len(channels_pending), ==, 0);
+  tt_int_op(scheduler_n_pending(), ==, 2);
+  tt_ptr_op(scheduler_pending_pop(), ==, ch3);
+  tt_ptr_op(scheduler_pending_pop(), ==, ch1);
+
+ done:
+  free_fake_channel(ch1);
+  free_fake_channel(ch2);
+  free_fake_channel(ch3);
+  memset(mock_bucket_chan, 0, sizeof(mock_bucket_chan));
+  scheduler_free_all();
+  mock_event_free_all();
+
+  UNMOCK(scheduler_get_channel_bucket);
+  UNMOCK(scheduler_compare_channels);
+  UNMOCK(scheduler_run);
+  UNMOCK(tor_libevent_get_base);
+}
+
 static void
 test_scheduler_compare_channels(void *arg)
 {
@@ -547,17 +680,126 @@ test_scheduler_initfree(void *arg)
 }
 
 static void
-test_scheduler_loop(void *arg)
+test_scheduler_kist_loop(void *arg)
 {
-  channel_t *ch1 = NULL, *ch2 = NULL;
+  channel_t *ch1 = NULL;
 
   (void)arg;
 
+  mock_event_init();
+  MOCK(tor_libevent_get_base, tor_libevent_get_base_mock);
+  scheduler_init();
+  scheduler_set_kist(1, 10);
+  MOCK(scheduler_kist_cells_writeable, scheduler_kist_cells_writeable_mock);
+  MOCK(scheduler_run, scheduler_run_noop_mock);
+
+  ch1 = new_fake_channel();
+  tt_assert(ch1);
+  ch1->state = CHANNEL_STATE_OPENING;
+  ch1->cmux = circuitmux_alloc();
+  channel_register(ch1);
+  tt_assert(ch1->registered);
+  channel_change_state(ch1, CHANNEL_STATE_OPEN);
+
+  /*
+   * Make it pending; with KIST on, that should schedule a run for the next
+   * tick instead of activating the event right away.
+   */
+  scheduler_channel_wants_writes(ch1);
+  scheduler_channel_has_waiting_cells(ch1);
+  tt_int_op(ch1->scheduler_state, ==, SCHED_CHAN_PENDING);
+  tt_assert(event_pending(run_sched_ev, EV_TIMEOUT, NULL));
+
+  /* 48 cells to send and room for 32 on the channel... */
+  MOCK(channel_flush_some_cells, channel_flush_some_cells_mock);
+  channel_flush_some_cells_mock_set(ch1, 48);
+
+  /* ...but the kernel doesn't want any; it should stay pending */
+  mock_kist_cells_writeable_val = 0;
+  UNMOCK(scheduler_run);
+  scheduler_run();
+  MOCK(scheduler_run, scheduler_run_noop_mock);
+  tt_int_op(ch1->scheduler_state, ==, SCHED_CHAN_PENDING);
+  tt_int_op(scheduler_n_pending(), ==, 1);
+
+  /* Now the kernel wants 8, so we should write exactly 8 */
+  mock_kist_cells_writeable_val = 8;
+  UNMOCK(scheduler_run);
+  scheduler_run();
+  MOCK(scheduler_run, scheduler_run_noop_mock);
+  tt_assert(ch1->scheduler_state != SCHED_CHAN_PENDING);
+  tt_int_op(scheduler_n_pending(), ==, 0);
+  /* Drain the rest through the mock to see how many were left */
+  tt_int_op(channel_flush_some_cells_mock(ch1, -1), ==, 40);
+
+  channel_mark_for_close(ch1);
+  channel_closed(ch1);
+  tt_int_op(ch1->state, ==, CHANNEL_STATE_CLOSED);
+  ch1 = NULL;
+
+  channel_flush_some_cells_mock_free_all();
+  channel_free_all();
+  scheduler_free_all();
+  mock_event_free_all();
+
+ done:
+  tor_free(ch1);
+
+  UNMOCK(channel_flush_some_cells);
+  UNMOCK(scheduler_kist_cells_writeable);
+  UNMOCK(scheduler_run);
+  UNMOCK(tor_libevent_get_base);
+}
+
+static void
+test_scheduler_kist_socket_limit(void *arg)
+{
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  size_t limit = 0;
+  int r;
+
+  (void)arg;
+
+  if (!scheduler_kist_is_supported()) {
+    tt_int_op(scheduler_kist_socket_limit(TOR_INVALID_SOCKET, &limit), ==,
+              -1);
+    tt_skip();
+  }
+
+  /* The ersatz socketpair is a TCP connection over loopback */
+  r = tor_ersatz_socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  if (-r == SOCK_ERRNO(EPROTONOSUPPORT)) {
+    /* No 127.0.0.1 or ::1 here */
+    tt_skip();
+  }
+  tt_int_op(r, ==, 0);
+
+  /* An idle connection has its whole window free */
+  tt_int_op(scheduler_kist_socket_limit(fds[0], &limit), ==, 0);
+  tt_assert(limit > 0);
+
+  /* We can't ask about something that isn't a socket */
+  tt_int_op(scheduler_kist_socket_limit(TOR_INVALID_SOCKET, &limit), ==, -1);
+
+ done:
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+}
+
+static void
+test_scheduler_loop(void *arg)
+{
+  channel_t *ch1 = NULL, *ch2 = NULL;
+
   /* Set up libevent and scheduler */
 
   mock_event_init();
   MOCK(tor_libevent_get_base, tor_libevent_get_base_mock);
   scheduler_init();
+  /* Run with the bucketed queue if we were asked to */
+  if (arg) scheduler_set_queue_type(SCHEDULER_QUEUE_BUCKETS);
   /*
    * Install the compare channels mock so we can test
    * scheduler_touch_channel().
@@ -569,7 +811,7 @@ test_scheduler_loop(void *arg)
    */
   MOCK(scheduler_run, scheduler_run_noop_mock);
 
-  tt_int_op(smartlist_len(channels_pending), ==, 0);
+  tt_int_op(scheduler_n_pending(), ==, 0);
 
   /* Set up a fake channel */
   ch1 = new_fake_channel();
@@ -610,7 +852,7 @@ test_scheduler_loop(void *arg)
   /* This should send it to SCHED_CHAN_PENDING */
   scheduler_channel_wants_writes(ch1);
   tt_int_op(ch1->scheduler_state, ==, SCHED_CHAN_PENDING);
-  tt_int_op(smartlist_len(channels_pending), ==, 1);
+  tt_int_op(scheduler_n_pending(), ==, 1);
 
   /* Now send ch2 to SCHED_CHAN_WAITING_FOR_CELLS */
   scheduler_channel_wants_writes(ch2);
@@ -627,7 +869,7 @@ test_scheduler_loop(void *arg)
   /* ...and this should kick ch2 into SCHED_CHAN_PENDING */
   scheduler_channel_has_waiting_cells(ch2);
   tt_int_op(ch2->scheduler_state, ==, SCHED_CHAN_PENDING);
-  tt_int_op(smartlist_len(channels_pending), ==, 2);
+  tt_int_op(scheduler_n_pending(), ==, 2);
 
   /*
    * Now we've got two pending channels and need to fire off
@@ -649,7 +891,7 @@ test_scheduler_loop(void *arg)
   tt_int_op(ch2->state, ==, CHANNEL_STATE_OPENING);
   tt_assert(ch1->scheduler_state != SCHED_CHAN_PENDING);
   tt_assert(ch2->scheduler_state != SCHED_CHAN_PENDING);
-  tt_int_op(smartlist_len(channels_pending), ==, 0);
+  tt_int_op(scheduler_n_pending(), ==, 0);
 
   /* Now, finish opening ch2, and get both back to pending */
   channel_change_state(ch2, CHANNEL_STATE_OPEN);
@@ -661,7 +903,7 @@ test_scheduler_loop(void *arg)
   tt_int_op(ch2->state, ==, CHANNEL_STATE_OPEN);
   tt_int_op(ch1->scheduler_state, ==, SCHED_CHAN_PENDING);
   tt_int_op(ch2->scheduler_state, ==, SCHED_CHAN_PENDING);
-  tt_int_op(smartlist_len(channels_pending), ==, 2);
+  tt_int_op(scheduler_n_pending(), ==, 2);
 
   /* Now, set up the channel_flush_some_cells() mock */
   MOCK(channel_flush_some_cells, channel_flush_some_cells_mock);
@@ -727,6 +969,40 @@ test_scheduler_loop(void *arg)
   UNMOCK(tor_libevent_get_base);
 }
 
+static void
+test_scheduler_priority_to_bucket(void *arg)
+{
+  int b, prev;
+  double d;
+
+  (void)arg;
+
+  tt_int_op(scheduler_priority_to_bucket(0.0), ==, 0);
+  tt_int_op(scheduler_priority_to_bucket(0.5), ==, 0);
+  tt_int_op(scheduler_priority_to_bucket(-3.0), ==, 0);
+  tt_int_op(scheduler_priority_to_bucket(1.0), ==, 1);
+  tt_int_op(scheduler_priority_to_bucket(1.9), ==, 1);
+  tt_int_op(scheduler_priority_to_bucket(2.0), ==, 5);
+  tt_int_op(scheduler_priority_to_bucket(3.0), ==, 7);
+  tt_int_op(scheduler_priority_to_bucket(4.0), ==, 9);
+  tt_int_op(scheduler_priority_to_bucket(5.0), ==, 10);
+  tt_int_op(scheduler_priority_to_bucket(7.0), ==, 12);
+  tt_int_op(scheduler_priority_to_bucket(8.0), ==, 13);
+  tt_int_op(scheduler_priority_to_bucket(1e30), ==, SCHEDULER_N_BUCKETS - 1);
+
+  /* Buckets never decrease as priority grows */
+  prev = 0;
+  for (d = 0.25; d < 1e12; d *= 1.1) {
+    b = scheduler_priority_to_bucket(d);
+    tt_int_op(b, >=, prev);
+    tt_int_op(b, <, SCHEDULER_N_BUCKETS);
+    prev = b;
+  }
+
+ done:
+  ;
+}
+
 static void
 test_scheduler_queue_heuristic(void *arg)
 {
@@ -762,11 +1038,21 @@ test_scheduler_queue_heuristic(void *arg)
 }
 
 struct testcase_t scheduler_tests[] = {
+  { "buckets", test_scheduler_buckets, TT_FORK, NULL, NULL },
   { "channel_states", test_scheduler_channel_states, TT_FORK, NULL, NULL },
+  { "channel_states_buckets", test_scheduler_channel_states, TT_FORK,
+    &passthrough_setup, (void*)"buckets" },
   { "compare_channels", test_scheduler_compare_channels,
     TT_FORK, NULL, NULL },
   { "initfree", test_scheduler_initfree, TT_FORK, NULL, NULL },
+  { "kist_loop", test_scheduler_kist_loop, TT_FORK, NULL, NULL },
+  { "kist_socket_limit", test_scheduler_kist_socket_limit,
+    TT_FORK, NULL, NULL },
   { "loop", test_scheduler_loop, TT_FORK, NULL, NULL },
+  { "loop_buckets", test_scheduler_loop, TT_FORK,
+    &passthrough_setup, (void*)"buckets" },
+  { "priority_to_bucket", test_scheduler_priority_to_bucket,
+    TT_FORK, NULL, NULL },
   { "queue_heuristic", test_scheduler_queue_heuristic,
     TT_FORK, NULL, NULL },
   END_OF_TESTCASES
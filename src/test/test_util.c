@@ -7,10 +7,12 @@
 #define COMPAT_PRIVATE
 #define CONTROL_PRIVATE
 #define UTIL_PRIVATE
+#define HISTOGRAM_PRIVATE
 #include "or.h"
 #include "config.h"
 #include "control.h"
 #include "test.h"
+#include "histogram.h"
 #include "memarea.h"
 #include "util_process.h"
 
@@ -611,6 +613,12 @@ test_util_time(void *arg)
   /* We might've timewarped a little. */
   tt_int_op(tv_udiff(&start, &end), OP_GE, -5000);
 
+  /* Test tor_gettimeofday_monotonic */
+  tor_gettimeofday_monotonic(&start);
+  tor_gettimeofday_monotonic(&end);
+  tt_int_op(tv_udiff(&start, &end), OP_GE, 0);
+  tt_int_op(end.tv_usec, OP_LT, 1000000);
+
   /* Test format_iso_time */
 
   tv.tv_sec = (time_t)1326296338;
@@ -3769,6 +3777,60 @@ test_util_eat_whitespace(void *ptr)
   ;
 }
 
+/**
+ * Test RHS whitespace (and comment) finder, especially around the
+ * boundaries of the blocks that the vectorized version looks at.
+ */
+static void
+test_util_find_whitespace(void *ptr)
+{
+  const char stops[] = { ' ', '\t', '\r', '\n', '#' };
+  char str[80];
+  size_t i, pos;
+
+  (void)ptr;
+
+  /* Empty string */
+  strlcpy(str, "", sizeof(str));
+  tt_ptr_op(str,OP_EQ, find_whitespace(str));
+  tt_ptr_op(str,OP_EQ, find_whitespace_eos(str, str));
+
+  /* No whitespace at all, short and long */
+  strlcpy(str, "fuubaar", sizeof(str));
+  tt_ptr_op(str + 7,OP_EQ, find_whitespace(str));
+  tt_ptr_op(str + 7,OP_EQ, find_whitespace_eos(str, str + 7));
+  strlcpy(str, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJ", sizeof(str));
+  tt_ptr_op(str + strlen(str),OP_EQ, find_whitespace(str));
+  tt_ptr_op(str + strlen(str),OP_EQ,
+            find_whitespace_eos(str, str + strlen(str)));
+
+  /* Don't look past eos, even when there's whitespace there. */
+  strlcpy(str, "abcdefghijklmnopqrst uvwxyz", sizeof(str));
+  tt_ptr_op(str + 17,OP_EQ, find_whitespace_eos(str, str + 17));
+  tt_ptr_op(str + 20,OP_EQ, find_whitespace_eos(str, str + 21));
+
+  /* Every stop character, at every position. */
+  for (i = 0; i < sizeof(stops); ++i) {
+    for (pos = 0; pos < 40; ++pos) {
+      memset(str, 'x', 48);
+      str[48] = '\0';
+      str[pos] = stops[i];
+      tt_ptr_op(str + pos,OP_EQ, find_whitespace(str));
+      tt_ptr_op(str + pos,OP_EQ, find_whitespace_eos(str, str + 48));
+      tt_ptr_op(str + pos,OP_EQ, find_whitespace_eos(str, str + pos + 1));
+      tt_ptr_op(str + pos,OP_EQ, find_whitespace_eos(str, str + pos));
+    }
+  }
+
+  /* An embedded NUL stops the eos version too. */
+  memset(str, 'x', 48);
+  str[33] = '\0';
+  tt_ptr_op(str + 33,OP_EQ, find_whitespace_eos(str, str + 48));
+
+ done:
+  ;
+}
+
 /** Return a newly allocated smartlist containing the lines of text in
  * <b>lines</b>.  The returned strings are heap-allocated, and must be
  * freed by the caller.
@@ -4316,6 +4378,76 @@ test_util_clamp_double_to_int64(void *arg)
   ;
 }
 
+static void
+test_util_histogram(void *arg)
+{
+  histogram_t *h1 = histogram_new(), *h2 = histogram_new();
+  char *s = NULL;
+  uint32_t v;
+  int idx, last_idx = -1;
+  (void)arg;
+
+  /* Every value lands in the same bucket as its neighbours or in the next
+   * one, and each bucket ends just before the next one starts. */
+  for (v = 0; v <= HISTOGRAM_MAX_VALUE; v += (v < 4096) ? 1 : 97) {
+    idx = histogram_bucket_idx(v);
+    tt_int_op(idx, OP_GE, last_idx);
+    tt_int_op(idx, OP_LT, HISTOGRAM_N_BUCKETS);
+    tt_u64_op(v, OP_LE, histogram_bucket_max_value(idx));
+    if (idx > 0)
+      tt_u64_op(v, OP_GT, histogram_bucket_max_value(idx - 1));
+    last_idx = idx;
+  }
+  tt_int_op(histogram_bucket_idx(HISTOGRAM_MAX_VALUE), OP_EQ,
+            HISTOGRAM_N_BUCKETS - 1);
+  tt_u64_op(histogram_bucket_max_value(HISTOGRAM_N_BUCKETS - 1), OP_EQ,
+            HISTOGRAM_MAX_VALUE);
+  /* Small values are exact. */
+  tt_int_op(histogram_bucket_idx(7), OP_EQ, 7);
+  tt_int_op(histogram_bucket_idx(15), OP_EQ, 15);
+  tt_int_op(histogram_bucket_idx(16), OP_EQ, 16);
+  tt_int_op(histogram_bucket_idx(17), OP_EQ, 16);
+
+  /* An empty histogram. */
+  tt_u64_op(histogram_get_percentile(h1, 50.0), OP_EQ, 0);
+  tt_u64_op(histogram_get_mean(h1), OP_EQ, 0);
+
+  for (v = 1; v <= 1000; ++v)
+    histogram_add(h1, v);
+  tt_u64_op(h1->n_values, OP_EQ, 1000);
+  tt_u64_op(histogram_get_mean(h1), OP_EQ, 500);
+  tt_u64_op(h1->max, OP_EQ, 1000);
+  /* Percentiles are rounded up, but by no more than an eighth. */
+  tt_u64_op(histogram_get_percentile(h1, 50.0), OP_GE, 500);
+  tt_u64_op(histogram_get_percentile(h1, 50.0), OP_LE, 500 + 500/8);
+  tt_u64_op(histogram_get_percentile(h1, 99.0), OP_GE, 990);
+  tt_u64_op(histogram_get_percentile(h1, 99.0), OP_LE, 1000);
+  tt_u64_op(histogram_get_percentile(h1, 100.0), OP_EQ, 1000);
+  tt_u64_op(histogram_get_percentile(h1, 0.0), OP_EQ, 1);
+
+  /* Huge values are clamped. */
+  histogram_add(h2, UINT32_MAX);
+  tt_u64_op(h2->max, OP_EQ, HISTOGRAM_MAX_VALUE);
+  tt_u64_op(histogram_get_percentile(h2, 50.0), OP_EQ, HISTOGRAM_MAX_VALUE);
+
+  histogram_add_histogram(h2, h1);
+  tt_u64_op(h2->n_values, OP_EQ, 1001);
+  tt_u64_op(h2->max, OP_EQ, HISTOGRAM_MAX_VALUE);
+  tt_u64_op(histogram_get_percentile(h2, 50.0), OP_EQ,
+            histogram_get_percentile(h1, 50.0));
+
+  histogram_clear(h2);
+  histogram_add(h2, 3);
+  histogram_add(h2, 5);
+  s = histogram_format(h2);
+  tt_str_op(s, OP_EQ, "count:2,mean:4,p50:3,p90:5,p99:5,max:5");
+
+ done:
+  histogram_free(h1);
+  histogram_free(h2);
+  tor_free(s);
+}
+
 #define UTIL_LEGACY(name)                                               \
   { #name, test_util_ ## name , 0, NULL, NULL }
 
@@ -4627,6 +4759,7 @@ struct testcase_t util_tests[] = {
   UTIL_TEST(round_to_next_multiple_of, 0),
   UTIL_TEST(laplace, 0),
   UTIL_TEST(clamp_double_to_int64, 0),
+  UTIL_TEST(histogram, 0),
   UTIL_TEST(find_str_at_start_of_line, 0),
   UTIL_TEST(string_is_C_identifier, 0),
   UTIL_TEST(asprintf, 0),
@@ -4646,6 +4779,7 @@ struct testcase_t util_tests[] = {
   UTIL_TEST(split_lines, 0),
   UTIL_TEST(n_bits_set, 0),
   UTIL_TEST(eat_whitespace, 0),
+  UTIL_TEST(find_whitespace, 0),
   UTIL_TEST(sl_new_from_text_lines, 0),
   UTIL_TEST(envnames, 0),
   UTIL_TEST(make_environment, 0),
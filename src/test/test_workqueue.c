@@ -27,6 +27,8 @@ static int opt_n_inflight = 1000;
 static int opt_n_lowwater = 250;
 static int opt_n_cancel = 0;
 static int opt_ratio_rsa = 5;
+static int opt_n_batch = 1;
+static int opt_bench = 0;
 
 #ifdef TRACK_RESPONSES
 tor_mutex_t bitmap_mutex;
@@ -44,12 +46,14 @@ typedef struct state_s {
 
 typedef struct rsa_work_s {
   int serial;
+  struct timeval queued_at;
   uint8_t msg[128];
   uint8_t msglen;
 } rsa_work_t;
 
 typedef struct ecdh_work_s {
   int serial;
+  struct timeval queued_at;
   union {
     curve25519_public_key_t pk;
     uint8_t msg[32];
@@ -165,6 +169,12 @@ static int rsa_sent = 0;
 static int ecdh_sent = 0;
 static int n_received = 0;
 static int no_shutdown = 0;
+/** Total and greatest time between queueing an item and getting its reply,
+ * in microseconds. */
+static uint64_t latency_total_usec = 0;
+static int64_t latency_max_usec = 0;
+/** When did we get the last reply? */
+static struct timeval finished_at;
 
 #ifdef TRACK_RESPONSES
 bitarray_t *received;
@@ -173,12 +183,24 @@ bitarray_t *received;
 static void
 handle_reply(void *arg)
 {
+  /* Naughty cast, but only looking at serial and queued_at. */
+  rsa_work_t *rw = arg;
+  struct timeval now, diff;
+  int64_t usec;
 #ifdef TRACK_RESPONSES
-  rsa_work_t *rw = arg; /* Naughty cast, but only looking at serial. */
   tor_assert(! bitarray_is_set(received, rw->serial));
   bitarray_set(received,rw->serial);
 #endif
 
+  tor_gettimeofday(&now);
+  timersub(&now, &rw->queued_at, &diff);
+  usec = ((int64_t)diff.tv_sec)*1000000 + diff.tv_usec;
+  if (usec > 0) {
+    latency_total_usec += usec;
+    if (usec > latency_max_usec)
+      latency_max_usec = usec;
+  }
+
   tor_free(arg);
   ++n_received;
 }
@@ -191,8 +213,10 @@ handle_reply_shutdown(void *arg)
   no_shutdown = 1;
 }
 
-static workqueue_entry_t *
-add_work(threadpool_t *tp)
+/** Make a new item of work, and set *<b>fn_out</b> to the function that
+ * should do it. */
+static void *
+new_work(workqueue_reply_t (**fn_out)(void *, void *))
 {
   int add_rsa =
     opt_ratio_rsa == 0 ||
@@ -203,16 +227,63 @@ add_work(threadpool_t *tp)
     w->serial = n_sent++;
     crypto_rand((char*)w->msg, 20);
     w->msglen = 20;
+    tor_gettimeofday(&w->queued_at);
     ++rsa_sent;
-    return threadpool_queue_work(tp, workqueue_do_rsa, handle_reply, w);
+    *fn_out = workqueue_do_rsa;
+    return w;
   } else {
     ecdh_work_t *w = tor_malloc_zero(sizeof(*w));
     w->serial = n_sent++;
     /* Not strictly right, but this is just for benchmarks. */
     crypto_rand((char*)w->u.pk.public_key, 32);
+    tor_gettimeofday(&w->queued_at);
     ++ecdh_sent;
-    return threadpool_queue_work(tp, workqueue_do_ecdh, handle_reply, w);
+    *fn_out = workqueue_do_ecdh;
+    return w;
+  }
+}
+
+static workqueue_entry_t *
+add_work(threadpool_t *tp)
+{
+  workqueue_reply_t (*fn)(void *, void *);
+  void *w = new_work(&fn);
+  return threadpool_queue_work(tp, fn, handle_reply, w);
+}
+
+/** Queue up to <b>n</b> items of work with threadpool_queue_work_batch(),
+ * and store their entries in <b>ents</b>.  Since all the items in a batch
+ * share a work function, we stop early if we make one of a different kind.
+ * Return the number of items queued, or -1 on failure. */
+static int
+add_work_batch(threadpool_t *tp, int n, workqueue_entry_t **ents)
+{
+  void **args = tor_calloc(n, sizeof(void *));
+  workqueue_reply_t (*fn)(void *, void *) = NULL, (*fn1)(void *, void *);
+  int n_args = 0;
+
+  while (n_args < n) {
+    void *w = new_work(&fn1);
+    if (fn && fn1 != fn) {
+      /* Queue this one on its own. */
+      ents[n_args] = threadpool_queue_work(tp, fn1, handle_reply, w);
+      if (! ents[n_args]) {
+        tor_free(args);
+        return -1;
+      }
+      break;
+    }
+    fn = fn1;
+    args[n_args++] = w;
   }
+
+  if (threadpool_queue_work_batch(tp, fn, handle_reply, args, n_args,
+                                  ents) < 0) {
+    tor_free(args);
+    return -1;
+  }
+  tor_free(args);
+  return n_args < n ? n_args + 1 : n_args;
 }
 
 static int n_failed_cancel = 0;
@@ -228,6 +299,28 @@ add_n_work_items(threadpool_t *tp, int n)
 
   to_cancel = tor_malloc(sizeof(workqueue_entry_t*) * opt_n_cancel);
 
+  if (opt_n_batch > 1) {
+    workqueue_entry_t **ents = tor_calloc(opt_n_batch, sizeof(*ents));
+    while (n_queued < n) {
+      int r = add_work_batch(tp, MIN(opt_n_batch, n - n_queued), ents);
+      if (r < 0) {
+        puts("Z");
+        tor_free(ents);
+        tor_free(to_cancel);
+        tor_event_base_loopexit(tor_libevent_get_base(), NULL);
+        return -1;
+      }
+      for (i = 0; i < r; ++i) {
+        if (n_try_cancel < opt_n_cancel &&
+            tor_weak_random_range(&weak_rng, n) < opt_n_cancel) {
+          to_cancel[n_try_cancel++] = ents[i];
+        }
+      }
+      n_queued += r;
+    }
+    tor_free(ents);
+  }
+
   while (n_queued++ < n) {
     ent = add_work(tp);
     if (! ent) {
@@ -303,6 +396,7 @@ replysock_readable_cb(tor_socket_t sock, short what, void *arg)
       n_received+n_successful_cancel == n_sent &&
       n_sent >= opt_n_items) {
     shutting_down = 1;
+    tor_gettimeofday(&finished_at);
     threadpool_queue_update(tp, NULL,
                              workqueue_do_shutdown, NULL, NULL);
     // Anything we add after starting the shutdown must not be executed.
@@ -315,6 +409,82 @@ replysock_readable_cb(tor_socket_t sock, short what, void *arg)
   }
 }
 
+/** Run opt_n_items items of work through a new pool of <b>n_threads</b>
+ * threads that reply on <b>rq</b>.  Return 0 if every item was handled
+ * correctly, and -1 otherwise. */
+static int
+run_workqueue(replyqueue_t *rq, int n_threads)
+{
+  threadpool_t *tp;
+  struct event *ev;
+  struct timeval started_at, elapsed;
+  int i, r = 0;
+
+  n_sent = rsa_sent = ecdh_sent = n_received = 0;
+  n_failed_cancel = n_successful_cancel = 0;
+  shutting_down = no_shutdown = 0;
+  latency_total_usec = 0;
+  latency_max_usec = 0;
+
+  tp = threadpool_new(n_threads,
+                      rq, new_state, free_state, NULL);
+  tor_assert(tp);
+
+  ev = tor_event_new(tor_libevent_get_base(),
+                     replyqueue_get_socket(rq), EV_READ|EV_PERSIST,
+                     replysock_readable_cb, tp);
+
+  event_add(ev, NULL);
+
+#ifdef TRACK_RESPONSES
+  bitarray_free(handled);
+  bitarray_free(received);
+  handled = bitarray_init_zero(opt_n_items);
+  received = bitarray_init_zero(opt_n_items);
+  handled_len = opt_n_items;
+#endif
+
+  tor_gettimeofday(&started_at);
+
+  for (i = 0; i < opt_n_inflight; ++i) {
+    if (! add_work(tp)) {
+      puts("Couldn't add work.");
+      tor_event_free(ev);
+      return -1;
+    }
+  }
+
+  {
+    struct timeval limit = { 180, 0 };
+    tor_event_base_loopexit(tor_libevent_get_base(), &limit);
+  }
+
+  event_base_loop(tor_libevent_get_base(), 0);
+
+  tor_event_free(ev);
+
+  if (n_sent != opt_n_items || n_received+n_successful_cancel != n_sent) {
+    printf("%d vs %d\n", n_sent, opt_n_items);
+    printf("%d+%d vs %d\n", n_received, n_successful_cancel, n_sent);
+    r = -1;
+  } else if (no_shutdown) {
+    puts("Accepted work after shutdown\n");
+    r = -1;
+  } else if (opt_bench) {
+    double msec;
+    timersub(&finished_at, &started_at, &elapsed);
+    msec = elapsed.tv_sec * 1000.0 + elapsed.tv_usec / 1000.0;
+    printf("%2d threads: %d items in %.1f msec (%.0f items/sec); "
+           "latency %.0f usec avg, %ld usec max\n",
+           n_threads, n_received, msec,
+           msec > 0 ? n_received * 1000.0 / msec : 0.0,
+           n_received ? U64_TO_DBL(latency_total_usec) / n_received : 0.0,
+           (long)latency_max_usec);
+  }
+
+  return r;
+}
+
 static void
 help(void)
 {
@@ -328,6 +498,9 @@ help(void)
      "  -L <lowwater> Add items whenever fewer than this many are pending\n"
      "  -C <cancel>   Try to cancel N items of every batch that we add\n"
      "  -R <ratio>    Make one out of this many items be a slow (RSA) one\n"
+     "  -B <batch>    Queue work in batches of up to this many items\n"
+     "  --bench       Report throughput and latency with 1, 4, 16, and 64\n"
+     "                threads, instead of with -T threads\n"
      "  --no-{eventfd2,eventfd,pipe2,pipe,socketpair}\n"
      "                Disable one of the alert_socket backends.");
 }
@@ -336,10 +509,8 @@ int
 main(int argc, char **argv)
 {
   replyqueue_t *rq;
-  threadpool_t *tp;
   int i;
   tor_libevent_cfg evcfg;
-  struct event *ev;
   uint32_t as_flags = 0;
 
   for (i = 1; i < argc; ++i) {
@@ -357,6 +528,10 @@ main(int argc, char **argv)
       opt_ratio_rsa = atoi(argv[++i]);
     } else if (!strcmp(argv[i], "-C") && i+1<argc) {
       opt_n_cancel = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-B") && i+1<argc) {
+      opt_n_batch = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--bench")) {
+      opt_bench = 1;
     } else if (!strcmp(argv[i], "--no-eventfd2")) {
       as_flags |= ASOCKS_NOEVENTFD2;
     } else if (!strcmp(argv[i], "--no-eventfd")) {
@@ -379,7 +554,7 @@ main(int argc, char **argv)
   if (opt_n_threads < 1 ||
       opt_n_items < 1 || opt_n_inflight < 1 || opt_n_lowwater < 0 ||
       opt_n_cancel > opt_n_inflight || opt_n_inflight > MAX_INFLIGHT ||
-      opt_ratio_rsa < 0) {
+      opt_ratio_rsa < 0 || opt_n_batch < 1) {
     help();
     return 1;
   }
@@ -401,53 +576,29 @@ main(int argc, char **argv)
 
   rq = replyqueue_new(as_flags);
   tor_assert(rq);
-  tp = threadpool_new(opt_n_threads,
-                      rq, new_state, free_state, NULL);
-  tor_assert(tp);
 
   crypto_seed_weak_rng(&weak_rng);
 
   memset(&evcfg, 0, sizeof(evcfg));
   tor_libevent_initialize(&evcfg);
 
-  ev = tor_event_new(tor_libevent_get_base(),
-                     replyqueue_get_socket(rq), EV_READ|EV_PERSIST,
-                     replysock_readable_cb, tp);
-
-  event_add(ev, NULL);
-
 #ifdef TRACK_RESPONSES
-  handled = bitarray_init_zero(opt_n_items);
-  received = bitarray_init_zero(opt_n_items);
   tor_mutex_init(&bitmap_mutex);
-  handled_len = opt_n_items;
 #endif
 
-  for (i = 0; i < opt_n_inflight; ++i) {
-    if (! add_work(tp)) {
-      puts("Couldn't add work.");
-      return 1;
+  if (opt_bench) {
+    static const int bench_threads[] = { 1, 4, 16, 64 };
+    for (i = 0; i < (int)ARRAY_LENGTH(bench_threads); ++i) {
+      if (run_workqueue(rq, bench_threads[i]) < 0) {
+        puts("FAIL");
+        return 1;
+      }
     }
-  }
-
-  {
-    struct timeval limit = { 180, 0 };
-    tor_event_base_loopexit(tor_libevent_get_base(), &limit);
-  }
-
-  event_base_loop(tor_libevent_get_base(), 0);
-
-  if (n_sent != opt_n_items || n_received+n_successful_cancel != n_sent) {
-    printf("%d vs %d\n", n_sent, opt_n_items);
-    printf("%d+%d vs %d\n", n_received, n_successful_cancel, n_sent);
+  } else if (run_workqueue(rq, opt_n_threads) < 0) {
     puts("FAIL");
     return 1;
-  } else if (no_shutdown) {
-    puts("Accepted work after shutdown\n");
-    puts("FAIL");
-  } else {
-    puts("OK");
-    return 0;
   }
-}
 
+  puts("OK");
+  return 0;
+}
@@ -17,6 +17,7 @@ const char tor_git_revision[] = "";
 #include "control.h"
 #include "config.h"
 #include "rephist.h"
+#include "routerparse.h"
 #include "backtrace.h"
 #include "test.h"
 
@@ -278,6 +279,7 @@ main(int c, const char **v)
   }
   rep_hist_init();
   network_init();
+  routerparse_init();
   setup_directory();
   options_init(options);
   options->DataDirectory = tor_strdup(temp_dir);
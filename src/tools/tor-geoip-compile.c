@@ -0,0 +1,124 @@
+/* Copyright (c) 2007-2015, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file tor-geoip-compile.c
+ * \brief Turn a GeoIP text file into a compiled table that Tor can map into
+ * memory instead of parsing.
+ */
+
+#include "orconfig.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "compat.h"
+#include "util.h"
+#include "torlog.h"
+#include "crypto.h"
+#include "address.h"
+#include "container.h"
+#include "geoip_table.h"
+
+/** Write a usage message for tor-geoip-compile to stderr. */
+static void
+show_help(void)
+{
+  fprintf(stderr, "Syntax:\n"
+          "tor-geoip-compile [-h] [-6] input_file output_file\n"
+          "\n"
+          "Reads a GeoIP file in the format of Tor's geoip file (or, with\n"
+          "-6, of its geoip6 file), and writes a compiled table to\n"
+          "output_file.  Use output_file as your GeoIPFile (or\n"
+          "GeoIPv6File), and Tor will map it into memory instead of\n"
+          "parsing it.\n");
+}
+
+int
+main(int argc, char **argv)
+{
+  sa_family_t family = AF_INET;
+  const char *in_fname, *out_fname;
+  char *contents = NULL, *table = NULL;
+  char digest[DIGEST_LEN];
+  smartlist_t *lines = NULL;
+  geoip_table_builder_t *builder = NULL;
+  size_t table_len;
+  int n_entries = 0, n_bad = 0, argi = 1, r = 1;
+
+  init_logging(1);
+
+  while (argi < argc && argv[argi][0] == '-') {
+    if (!strcmp(argv[argi], "-6")) {
+      family = AF_INET6;
+    } else if (!strcmp(argv[argi], "-4")) {
+      family = AF_INET;
+    } else {
+      show_help();
+      return strcmp(argv[argi], "-h") ? 1 : 0;
+    }
+    ++argi;
+  }
+  if (argc - argi != 2) {
+    show_help();
+    return 1;
+  }
+  in_fname = argv[argi];
+  out_fname = argv[argi+1];
+
+  if (crypto_global_init(0, NULL, NULL)) {
+    fprintf(stderr, "Couldn't initialize crypto library.\n");
+    return 1;
+  }
+
+  contents = read_file_to_str(in_fname, 0, NULL);
+  if (!contents) {
+    fprintf(stderr, "Couldn't read %s.\n", in_fname);
+    goto done;
+  }
+  /* Tor reports the digest of the text file in its extra-info descriptors,
+   * so we record it in the table for Tor to report instead. */
+  crypto_digest(digest, contents, strlen(contents));
+
+  builder = geoip_table_builder_new(family);
+  lines = smartlist_new();
+  smartlist_split_string(lines, contents, "\n", 0, 0);
+  SMARTLIST_FOREACH_BEGIN(lines, const char *, line) {
+    tor_addr_t low, high;
+    char country[3];
+    int res;
+    if (!*line)
+      continue;
+    res = geoip_table_parse_line(line, family, &low, &high, country);
+    if (res > 0 && geoip_table_builder_add(builder, &low, &high, country) < 0)
+      res = -1;
+    if (res < 0) {
+      fprintf(stderr, "Skipping malformed line %d: %s\n",
+              line_sl_idx + 1, line);
+      ++n_bad;
+    } else if (res > 0) {
+      ++n_entries;
+    }
+  } SMARTLIST_FOREACH_END(line);
+
+  table = geoip_table_builder_encode(builder, digest, &table_len);
+  if (write_bytes_to_file(out_fname, table, table_len, 1) < 0) {
+    fprintf(stderr, "Couldn't write %s.\n", out_fname);
+    goto done;
+  }
+  printf("Wrote %d %s ranges to %s; skipped %d malformed lines.\n",
+         n_entries, family == AF_INET ? "IPv4" : "IPv6", out_fname, n_bad);
+
+  r = 0;
+ done:
+  if (lines) {
+    SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+    smartlist_free(lines);
+  }
+  geoip_table_builder_free(builder);
+  tor_free(contents);
+  tor_free(table);
+  crypto_global_cleanup();
+  return r;
+}
+